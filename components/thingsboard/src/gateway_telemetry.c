@@ -9,7 +9,7 @@ void thingsboard_gateway_send_telemetry(
 	thingsboard_handle_t *handle,
 	cJSON *json
 ) {
-	char *data = cJSON_Print(json);
+	char *data = cJSON_PrintUnformatted(json);
 	if(!data) {
 		ESP_LOGE(TAG, "Error printing JSON");
 		return;
@@ -21,6 +21,7 @@ void thingsboard_gateway_send_telemetry(
 		data, strlen(data),
 		0, 0
 	);
+	cJSON_free(data);
 
 	if(err == -1) {
 		ESP_LOGE(TAG, "Error sending telemetry");
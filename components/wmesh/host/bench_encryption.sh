@@ -0,0 +1,19 @@
+#!/bin/sh
+# Runs the encryption benchmark with every algorithm, on the Linux target.
+# Every algorithm is built in its own directory, as it is chosen at build
+# time.
+set -e
+cd "$(dirname "$0")"
+
+for algorithm in DISABLED AES128_GCM AES192_GCM AES256_GCM CHACHA20_POLY1305 CHACHA20; do
+	build="build_$algorithm"
+	mkdir -p "$build"
+	printf 'CONFIG_WMESH_ENCRYPTION_%s=y\n' "$algorithm" > "$build/sdkconfig.algorithm"
+
+	idf.py -B "$build" \
+		-D IDF_TARGET=linux \
+		-D SDKCONFIG="$build/sdkconfig" \
+		-D SDKCONFIG_DEFAULTS="sdkconfig.defaults;$build/sdkconfig.algorithm" \
+		build
+	"$build/wmesh_host.elf"
+done
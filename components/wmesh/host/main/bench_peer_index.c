@@ -0,0 +1,128 @@
+#include "host.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "wmesh/peer.h"
+
+static const char *TAG = "wmesh host";
+
+
+/// @brief Lookups timed per list size and kind of lookup.
+#define LOOKUPS 200000
+
+/// @brief Addresses looked up in turn. Known and unknown addresses are
+/// both drawn from a set of this size.
+#define ADDRESS_SET 256
+
+
+/// @brief Finds a peer by comparing every address, as the peer list did
+/// before it was indexed.
+static wmesh_peer_t *linear_get(wmesh_peer_list_t *list, const wmesh_address_t address) {
+	for(size_t i = 0; i < list->peer_count; i++) {
+		if(memcmp(list->peers[i].address, address, sizeof(wmesh_address_t)) == 0) {
+			return &list->peers[i];
+		}
+	}
+
+	return NULL;
+}
+
+
+/// @brief Times `LOOKUPS` lookups cycling through `addresses`.
+///
+/// @param indexed Whether to use the hash index, or the linear scan.
+/// @param[out] found Number of lookups which found a peer.
+///
+/// @return Average time per lookup, in nanoseconds.
+static double time_lookups(
+	wmesh_peer_list_t *list,
+	wmesh_address_t *addresses,
+	bool indexed,
+	uint32_t *found
+) {
+	uint32_t hits = 0;
+	int64_t start_us = esp_timer_get_time();
+
+	for(size_t i = 0; i < LOOKUPS; i++) {
+		const uint8_t *address = addresses[i % ADDRESS_SET];
+		wmesh_peer_t *peer = indexed ? wmesh_peer_list_get(list, address) : linear_get(list, address);
+		if(peer) {
+			hits++;
+		}
+	}
+
+	int64_t elapsed_us = esp_timer_get_time() - start_us;
+	*found = hits;
+	return elapsed_us * 1000.0 / LOOKUPS;
+}
+
+
+/// @brief Fills `address` with a random address missing from the list.
+static void random_address(wmesh_peer_list_t *list, wmesh_address_t address) {
+	do {
+		esp_fill_random(address, sizeof(wmesh_address_t));
+	} while(wmesh_peer_list_get(list, address));
+}
+
+
+void run_peer_index_benchmark(void) {
+	const size_t peer_counts[] = { 16, 128, 1024 };
+
+	wmesh_peer_list_t *list = malloc(sizeof(*list));
+	wmesh_address_t *known = malloc(ADDRESS_SET * sizeof(*known));
+	wmesh_address_t *unknown = malloc(ADDRESS_SET * sizeof(*unknown));
+	if(!list || !known || !unknown) {
+		ESP_LOGE(TAG, "Peer index benchmark: out of memory");
+		free(unknown);
+		free(known);
+		free(list);
+		return;
+	}
+
+	ESP_LOGI(TAG, "Peer lookup, ns per lookup:");
+	ESP_LOGI(TAG, "Peers\tIndex hit\tIndex miss\tLinear hit\tLinear miss");
+
+	for(size_t i = 0; i < sizeof(peer_counts) / sizeof(*peer_counts); i++) {
+		size_t count = peer_counts[i];
+		if(count > CONFIG_WMESH_PEER_LIST_SIZE) {
+			ESP_LOGI(TAG, "%zu\tskipped, above CONFIG_WMESH_PEER_LIST_SIZE", count);
+			continue;
+		}
+
+		memset(list, 0, sizeof(*list));
+		for(size_t j = 0; j < count; j++) {
+			wmesh_peer_t peer;
+			wmesh_address_t address;
+			random_address(list, address);
+			wmesh_peer_new(&peer, address);
+			wmesh_peer_list_add(list, peer);
+		}
+
+		for(size_t j = 0; j < ADDRESS_SET; j++) {
+			memcpy(known[j], list->peers[esp_random() % count].address, sizeof(wmesh_address_t));
+			random_address(list, unknown[j]);
+		}
+
+		uint32_t found[4];
+		double index_hit = time_lookups(list, known, true, &found[0]);
+		double index_miss = time_lookups(list, unknown, true, &found[1]);
+		double linear_hit = time_lookups(list, known, false, &found[2]);
+		double linear_miss = time_lookups(list, unknown, false, &found[3]);
+
+		if(found[0] != LOOKUPS || found[1] != 0 || found[2] != LOOKUPS || found[3] != 0) {
+			ESP_LOGE(TAG, "Peer index benchmark: wrong lookup result with %zu peers", count);
+		}
+
+		ESP_LOGI(TAG, "%zu\t%.1f\t\t%.1f\t\t%.1f\t\t%.1f",
+			count, index_hit, index_miss, linear_hit, linear_miss
+		);
+	}
+
+	free(unknown);
+	free(known);
+	free(list);
+}
@@ -0,0 +1,135 @@
+#include "host.h"
+
+#if CONFIG_WMESH_TRANSPORT_LOOPBACK && CONFIG_IDF_TARGET_LINUX
+
+#include <inttypes.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "nvs.h"
+#include "wmesh/peer.h"
+#include "wmesh/transport.h"
+
+static const char *TAG = "wmesh host";
+
+
+/// @brief Service used to run code in the receive task.
+#define SERVICE_ID 2
+
+/// @brief How long to wait for the message which fills the peer list.
+#define RECEIVE_TIMEOUT_MS 1000
+
+
+/// @brief Peer list fill request, handled by the receive task.
+typedef struct {
+
+	/// @brief Number of peers the list should hold.
+	size_t peer_count;
+
+	/// @brief Given once the list is filled.
+	SemaphoreHandle_t done;
+
+} store_bench_t;
+
+
+/// @brief Fills the peer list with changed peers. Runs in the receive task,
+/// which owns the list.
+static esp_err_t receive_cb(
+	wmesh_handle_t *handle, wmesh_address_t src,
+	uint8_t *data, size_t data_size, void *user_ctx
+) {
+	store_bench_t *bench = user_ctx;
+	wmesh_peer_list_t *list = handle->peers;
+
+	xSemaphoreTake(handle->tx_lock, portMAX_DELAY);
+	while(list->peer_count < bench->peer_count) {
+		wmesh_address_t address;
+		do {
+			esp_fill_random(address, sizeof(address));
+		} while(wmesh_peer_list_get(list, address));
+
+		wmesh_peer_t peer;
+		wmesh_peer_new(&peer, address);
+		peer.window.last = esp_random();
+		peer.dirty = true;
+
+		if(wmesh_peer_list_add(list, peer) != ESP_OK) {
+			break;
+		}
+	}
+	xSemaphoreGive(handle->tx_lock);
+
+	xSemaphoreGive(bench->done);
+	return ESP_OK;
+}
+
+
+/// @brief Removes every stored peer, so each run starts from an empty table.
+static void erase_peer_storage(void) {
+	nvs_handle_t nvs;
+	if(nvs_open("wmesh_peer", NVS_READWRITE, &nvs) != ESP_OK) {
+		return;
+	}
+
+	nvs_erase_all(nvs);
+	nvs_commit(nvs);
+	nvs_close(nvs);
+}
+
+
+void run_peer_store_benchmark(void) {
+	const size_t peer_counts[] = { 16, 128, 1024 };
+
+	store_bench_t bench = {
+		.done = xSemaphoreCreateBinary(),
+	};
+	if(!bench.done) {
+		ESP_LOGE(TAG, "Peer store benchmark: out of memory");
+		return;
+	}
+
+	wmesh_address_t self;
+	wmesh_transport_get_address(self);
+
+	for(size_t i = 0; i < sizeof(peer_counts) / sizeof(*peer_counts); i++) {
+		if(peer_counts[i] > CONFIG_WMESH_PEER_LIST_SIZE) {
+			continue;
+		}
+
+		erase_peer_storage();
+		bench.peer_count = peer_counts[i];
+
+		wmesh_handle_t *handle = host_start_mesh(SERVICE_ID, receive_cb, &bench);
+		if(!handle) {
+			break;
+		}
+
+		uint8_t message = 0;
+		bool filled =
+			wmesh_send(handle, self, SERVICE_ID, &message, sizeof(message)) == ESP_OK &&
+			xSemaphoreTake(bench.done, pdMS_TO_TICKS(RECEIVE_TIMEOUT_MS)) == pdTRUE;
+		size_t peer_count = handle->peers->peer_count;
+
+		int64_t start_us = esp_timer_get_time();
+		wmesh_stop(handle);
+		int64_t stop_us = esp_timer_get_time() - start_us;
+
+		if(!filled) {
+			ESP_LOGE(TAG, "Peer store benchmark: peer list not filled");
+			break;
+		}
+
+		ESP_LOGI(TAG,
+			"Peer store: %zu changed peers, wmesh_stop %"PRIi64" us",
+			peer_count, stop_us
+		);
+	}
+
+	erase_peer_storage();
+	vSemaphoreDelete(bench.done);
+}
+
+#endif
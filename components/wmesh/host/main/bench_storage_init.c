@@ -0,0 +1,60 @@
+#include "host.h"
+
+#if CONFIG_WMESH_TRANSPORT_LOOPBACK && CONFIG_IDF_TARGET_LINUX && CONFIG_WMESH_STORAGE_RTC_CACHE
+
+#include <inttypes.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "wmesh/storage_cache.h"
+
+static const char *TAG = "wmesh host";
+
+
+/// @brief Service registered by the mesh. Never receives anything.
+#define SERVICE_ID 2
+
+/// @brief Starts timed per kind of reset.
+#define INIT_RUNS 20
+
+
+/// @brief Starts and stops the mesh `INIT_RUNS` times after a simulated
+/// reset.
+///
+/// @return Average time taken by `wmesh_init`, in microseconds, or -1 on
+/// error.
+static int64_t time_init(esp_reset_reason_t reason) {
+	int64_t total_us = 0;
+
+	for(size_t i = 0; i < INIT_RUNS; i++) {
+		wmesh_storage_cache_simulate_reset(reason);
+
+		int64_t start_us = esp_timer_get_time();
+		wmesh_handle_t *handle = host_start_mesh(SERVICE_ID, NULL, NULL);
+		total_us += esp_timer_get_time() - start_us;
+
+		if(!handle) {
+			return -1;
+		}
+		wmesh_stop(handle);
+	}
+
+	return total_us / INIT_RUNS;
+}
+
+
+void run_storage_init_benchmark(void) {
+	int64_t power_on_us = time_init(ESP_RST_POWERON);
+	int64_t wake_us = time_init(ESP_RST_DEEPSLEEP);
+
+	if(power_on_us < 0 || wake_us < 0) {
+		ESP_LOGE(TAG, "Init benchmark: error starting mesh");
+		return;
+	}
+
+	ESP_LOGI(TAG,
+		"wmesh_init: %"PRIi64" us after power-on (storage from flash), %"PRIi64" us after deep sleep (storage from RTC memory), average of %d",
+		power_on_us, wake_us, INIT_RUNS
+	);
+}
+
+#endif
@@ -0,0 +1,236 @@
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "nvs_flash.h"
+#include "wmesh/benchmark.h"
+#include "wmesh/wmesh.h"
+#include "host.h"
+
+static const char *TAG = "wmesh host";
+
+
+/// @brief Service used for test messages.
+#define SERVICE_ID 1
+
+/// @brief Messages sent per run.
+#define MESSAGE_COUNT 1000
+
+/// @brief Size in bytes of every message. Starts with the send time.
+#define MESSAGE_SIZE 128
+
+/// @brief How long to wait for every message to arrive.
+#define RECEIVE_TIMEOUT_MS 10000
+
+/// @brief Frames encrypted per payload size by the encryption benchmark.
+#define BENCHMARK_FRAMES 1000
+
+
+#if CONFIG_WMESH_ENCRYPTION_BENCHMARK
+	/// @brief Measures the configured encryption algorithm over every payload
+	/// size up to a full frame.
+	static void run_encryption_benchmark(void) {
+		const size_t payload_lengths[] = {
+			16, 32, 64, 128, 200, 512, 1024,
+			CONFIG_WMESH_FRAME_SIZE - WMESH_CIPHERTEXT_BASE_LENGTH,
+		};
+		const size_t count = sizeof(payload_lengths) / sizeof(*payload_lengths);
+
+		wmesh_encryption_benchmark_point_t points[count];
+		wmesh_encryption_benchmark_t summary;
+		esp_err_t err = wmesh_encryption_benchmark(
+			payload_lengths, count, BENCHMARK_FRAMES,
+			points, &summary
+		);
+		if(err != ESP_OK) {
+			ESP_LOGE(TAG, "Encryption benchmark failed: %s", esp_err_to_name(err));
+			return;
+		}
+
+		wmesh_encryption_benchmark_log(points, count, &summary);
+	}
+#endif
+
+
+#if CONFIG_WMESH_TRANSPORT_SIMULATED
+	wmesh_handle_t *host_start_mesh(
+		wmesh_service_id_t service,
+		wmesh_service_recv_cb_t receive_callback,
+		void *ctx
+	) {
+		wmesh_service_config_t services[] = {
+			{ .receive_callback = receive_callback, .ctx = ctx, .id = service },
+			{ 0 },
+		};
+		wmesh_config_t config = {
+			.service_config = services,
+		};
+		memset(config.network_key, 0x5A, sizeof(config.network_key));
+
+		wmesh_handle_t *handle = wmesh_init(&config);
+		if(!handle) {
+			ESP_LOGE(TAG, "Error starting mesh");
+		}
+
+		return handle;
+	}
+
+
+	/// @brief Received message statistics.
+	typedef struct {
+		atomic_uint_least32_t received;
+		_Atomic int64_t latency_total_us;
+		_Atomic int64_t latency_max_us;
+		SemaphoreHandle_t done;
+	} run_t;
+
+
+	static esp_err_t receive_cb(
+		wmesh_handle_t *handle, wmesh_address_t src,
+		uint8_t *data, size_t data_size, void *user_ctx
+	) {
+		run_t *run = user_ctx;
+
+		int64_t sent_us;
+		if(data_size < sizeof(sent_us)) {
+			return ESP_ERR_INVALID_SIZE;
+		}
+		memcpy(&sent_us, data, sizeof(sent_us));
+
+		int64_t latency_us = esp_timer_get_time() - sent_us;
+		atomic_fetch_add(&run->latency_total_us, latency_us);
+
+		int64_t max_us = atomic_load(&run->latency_max_us);
+		while(latency_us > max_us && !atomic_compare_exchange_weak(&run->latency_max_us, &max_us, latency_us));
+
+		if(atomic_fetch_add(&run->received, 1) + 1 == MESSAGE_COUNT) {
+			xSemaphoreGive(run->done);
+		}
+
+		return ESP_OK;
+	}
+
+
+	/// @brief Broadcasts `MESSAGE_COUNT` messages and reports how many arrived,
+	/// and how long they took. With the loopback transport, every message is
+	/// received by this node. With UDP, by every other running instance.
+	static void run_mesh_benchmark(void) {
+		run_t run = {
+			.done = xSemaphoreCreateBinary(),
+		};
+		atomic_init(&run.received, 0);
+		atomic_init(&run.latency_total_us, 0);
+		atomic_init(&run.latency_max_us, 0);
+
+		wmesh_handle_t *handle = host_start_mesh(SERVICE_ID, receive_cb, &run);
+		if(!handle) {
+			vSemaphoreDelete(run.done);
+			return;
+		}
+
+		uint8_t message[MESSAGE_SIZE] = { 0 };
+		uint32_t failed = 0;
+		int64_t start_us = esp_timer_get_time();
+
+		for(size_t i = 0; i < MESSAGE_COUNT; i++) {
+			int64_t now_us = esp_timer_get_time();
+			memcpy(message, &now_us, sizeof(now_us));
+
+			if(wmesh_send(handle, wmesh_broadcast_address, SERVICE_ID, message, sizeof(message)) != ESP_OK) {
+				failed++;
+			}
+		}
+
+		int64_t send_us = esp_timer_get_time() - start_us;
+		xSemaphoreTake(run.done, pdMS_TO_TICKS(RECEIVE_TIMEOUT_MS));
+		int64_t total_us = esp_timer_get_time() - start_us;
+
+		uint32_t received = atomic_load(&run.received);
+		ESP_LOGI(TAG, "Sent %d messages of %d bytes in %"PRIi64" us, %"PRIu32" failed",
+			MESSAGE_COUNT, MESSAGE_SIZE, send_us, failed
+		);
+		ESP_LOGI(TAG, "Received %"PRIu32" messages, %.1f messages/s",
+			received, received * 1e6 / total_us
+		);
+		if(received > 0) {
+			ESP_LOGI(TAG, "Latency: %"PRIi64" us average, %"PRIi64" us max",
+				atomic_load(&run.latency_total_us) / received, atomic_load(&run.latency_max_us)
+			);
+		}
+
+		wmesh_stop(handle);
+		vSemaphoreDelete(run.done);
+	}
+#endif
+
+
+#if CONFIG_IDF_TARGET_LINUX
+	/// @brief Runs a test, and logs its result.
+	///
+	/// @return 1 if the test failed, 0 otherwise.
+	static int run_test(const char *name, bool (*test)(void)) {
+		bool passed = test();
+		if(passed) {
+			ESP_LOGI(TAG, "PASS %s", name);
+		} else {
+			ESP_LOGE(TAG, "FAIL %s", name);
+		}
+
+		return passed ? 0 : 1;
+	}
+#endif
+
+
+/// @brief Runs every enabled benchmark and test. On target, only the
+/// benchmarks which don't send frames run, as ESP-NOW needs Wi-Fi to be set
+/// up first.
+void app_main(void) {
+	ESP_ERROR_CHECK(nvs_flash_init());
+	int failures = 0;
+
+	#if CONFIG_WMESH_ENCRYPTION_BENCHMARK
+		run_encryption_benchmark();
+	#endif
+
+	run_peer_index_benchmark();
+
+	#if CONFIG_WMESH_TRANSPORT_SIMULATED
+		run_mesh_benchmark();
+	#endif
+
+	#if CONFIG_WMESH_TRANSPORT_LOOPBACK && CONFIG_IDF_TARGET_LINUX
+		run_peer_store_benchmark();
+		#if CONFIG_WMESH_STORAGE_RTC_CACHE
+			run_storage_init_benchmark();
+		#endif
+
+		failures += run_test("frame pool allocations", test_frame_pool_allocations);
+		failures += run_test("fragment reassembly", test_fragment_reassembly);
+		failures += run_test("reliable goodput", test_reliable_goodput);
+		failures += run_test("peer eviction", test_peer_eviction);
+		#if CONFIG_WMESH_RATE_CONTROL
+			failures += run_test("rate adaptation", test_rate_adaptation);
+		#endif
+		#if CONFIG_WMESH_ROUTING
+			failures += run_test("routing convergence", test_routing_convergence);
+		#endif
+		#if CONFIG_WMESH_STORAGE_RTC_CACHE
+			failures += run_test("storage power loss", test_storage_power_loss);
+		#endif
+	#endif
+
+	if(failures > 0) {
+		ESP_LOGE(TAG, "%d tests failed", failures);
+	}
+
+	#if CONFIG_IDF_TARGET_LINUX
+		// The simulator keeps running after `app_main` returns. The exit
+		// status tells scripts whether every test passed.
+		exit(failures > 0 ? 1 : 0);
+	#endif
+}
@@ -0,0 +1,97 @@
+#ifndef WMESH_HOST_H_
+#define WMESH_HOST_H_
+
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "wmesh/wmesh.h"
+
+
+/// @brief Times peer list lookups with 16, 128 and 1024 peers, through the
+/// hash index and with a linear scan. Sizes above
+/// `CONFIG_WMESH_PEER_LIST_SIZE` are skipped.
+void run_peer_index_benchmark(void);
+
+
+#if CONFIG_WMESH_TRANSPORT_SIMULATED
+	/// @brief Starts a mesh with a single service, and the key shared by
+	/// every test.
+	///
+	/// @param[in] service Service ID.
+	/// @param[in] receive_callback Service callback.
+	/// @param[in] ctx Passed to `receive_callback`.
+	///
+	/// @return Mesh handle, or `NULL` in case of an error.
+	wmesh_handle_t *host_start_mesh(
+		wmesh_service_id_t service,
+		wmesh_service_recv_cb_t receive_callback,
+		void *ctx
+	);
+#endif
+
+
+#if CONFIG_WMESH_TRANSPORT_LOOPBACK && CONFIG_IDF_TARGET_LINUX
+	/// @brief Checks that sending a message takes no heap allocation once the
+	/// destination is known.
+	///
+	/// @return `true` if passed.
+	bool test_frame_pool_allocations(void);
+
+	/// @brief Checks that fragmented messages survive reordering, and that
+	/// loss only costs the messages whose fragments were lost.
+	///
+	/// @return `true` if passed.
+	bool test_fragment_reassembly(void);
+
+	/// @brief Measures reliable delivery under 0 to 20% loss, and checks that
+	/// every message is delivered exactly once.
+	///
+	/// @return `true` if passed.
+	bool test_reliable_goodput(void);
+
+	/// @brief Checks that evicted peers are parked without touching storage,
+	/// get their whole state back when added again, and are only dropped once
+	/// written. Checks that frames from unknown peers only cause as many
+	/// storage lookups as the peer load rate allows.
+	///
+	/// @return `true` if passed.
+	bool test_peer_eviction(void);
+
+	#if CONFIG_WMESH_RATE_CONTROL
+		/// @brief Changes the signal strength of a simulated link, and checks
+		/// that rate control converges to a rate close to the best one.
+		///
+		/// @return `true` if passed.
+		bool test_rate_adaptation(void);
+	#endif
+
+	#if CONFIG_WMESH_STORAGE_RTC_CACHE
+		/// @brief Times `wmesh_init` after simulated power-on resets, which
+		/// load storage from flash, and after simulated deep sleep wakes,
+		/// which restore it from RTC memory.
+		void run_storage_init_benchmark(void);
+
+		/// @brief Checks that values survive a simulated deep sleep without
+		/// flash reads, and that write-through values also survive a simulated
+		/// power loss.
+		///
+		/// @return `true` if passed.
+		bool test_storage_power_loss(void);
+	#endif
+
+	#if CONFIG_WMESH_ROUTING
+		/// @brief Simulates a grid of nodes around a root, and measures how
+		/// long the routing tree takes to form and to recover from a failed
+		/// node, and how many routed messages arrive. Checks that parents
+		/// never form a loop.
+		///
+		/// @return `true` if passed.
+		bool test_routing_convergence(void);
+	#endif
+
+	/// @brief Times `wmesh_stop` with 16, 128 and 1024 changed peers, which
+	/// are all written to an empty peer table. Sizes above
+	/// `CONFIG_WMESH_PEER_LIST_SIZE` are skipped.
+	void run_peer_store_benchmark(void);
+#endif
+
+#endif
@@ -0,0 +1,180 @@
+#include "host.h"
+
+#if CONFIG_WMESH_TRANSPORT_LOOPBACK && CONFIG_IDF_TARGET_LINUX
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "wmesh/transport.h"
+
+static const char *TAG = "wmesh host";
+
+
+/// @brief Service used for test messages.
+#define SERVICE_ID 2
+
+/// @brief Messages sent per run.
+#define MESSAGE_COUNT 100
+
+/// @brief Size in bytes of every message. Takes several frames.
+#define MESSAGE_SIZE 1000
+
+/// @brief Delay between messages. Short enough for the fragments of
+/// consecutive messages to interleave once reordered, long enough for the
+/// messages in flight to fit in the reassembly buffers.
+#define SEND_INTERVAL_MS 10
+
+/// @brief Reordering applied in every run.
+#define REORDER_PERCENT 30
+#define REORDER_DELAY_MS 20
+
+/// @brief Loss applied in the lossy run. Most messages still arrive.
+#define LOSS_PERCENT 10
+
+
+/// @brief Messages received during a run.
+typedef struct {
+
+	/// @brief Number of times every message was received.
+	uint8_t received[MESSAGE_COUNT];
+
+	/// @brief Messages received whose content was wrong.
+	atomic_uint_fast32_t corrupted;
+
+} fragment_test_t;
+
+
+/// @brief Gets the expected content of a byte of a message.
+static uint8_t message_byte(uint16_t index, size_t offset) {
+	return (uint8_t) (index * 7 + offset * 13);
+}
+
+
+static esp_err_t receive_cb(
+	wmesh_handle_t *handle, wmesh_address_t src,
+	uint8_t *data, size_t data_size, void *user_ctx
+) {
+	fragment_test_t *test = user_ctx;
+
+	if(data_size != MESSAGE_SIZE) {
+		test->corrupted++;
+		return ESP_OK;
+	}
+
+	uint16_t index;
+	memcpy(&index, data, sizeof(index));
+	if(index >= MESSAGE_COUNT) {
+		test->corrupted++;
+		return ESP_OK;
+	}
+
+	for(size_t i = sizeof(index); i < data_size; i++) {
+		if(data[i] != message_byte(index, i)) {
+			test->corrupted++;
+			return ESP_OK;
+		}
+	}
+
+	test->received[index]++;
+	return ESP_OK;
+}
+
+
+/// @brief Sends `MESSAGE_COUNT` messages to self through an impaired link,
+/// then waits for reassembly to finish.
+///
+/// @param loss_percent Frame loss.
+/// @param[out] delivered Number of messages received exactly once.
+///
+/// @return `true` if no message was corrupted or duplicated.
+static bool run(wmesh_handle_t *handle, fragment_test_t *test, uint8_t loss_percent, uint32_t *delivered) {
+	memset(test->received, 0, sizeof(test->received));
+	test->corrupted = 0;
+
+	wmesh_transport_impairment_t impairment;
+	wmesh_transport_get_impairment(&impairment);
+	wmesh_transport_impairment_t saved = impairment;
+	impairment.loss_percent = loss_percent;
+	impairment.reorder_percent = REORDER_PERCENT;
+	impairment.reorder_delay_ms = REORDER_DELAY_MS;
+	wmesh_transport_set_impairment(&impairment);
+
+	wmesh_address_t self;
+	wmesh_transport_get_address(self);
+
+	uint32_t failed = 0;
+	static uint8_t message[MESSAGE_SIZE];
+	for(uint16_t index = 0; index < MESSAGE_COUNT; index++) {
+		memcpy(message, &index, sizeof(index));
+		for(size_t i = sizeof(index); i < MESSAGE_SIZE; i++) {
+			message[i] = message_byte(index, i);
+		}
+
+		if(wmesh_send(handle, self, SERVICE_ID, message, sizeof(message)) != ESP_OK) {
+			failed++;
+		}
+		vTaskDelay(pdMS_TO_TICKS(SEND_INTERVAL_MS));
+	}
+
+	// Held back frames arrive, and incomplete messages time out.
+	vTaskDelay(pdMS_TO_TICKS(REORDER_DELAY_MS + CONFIG_WMESH_REASSEMBLY_TIMEOUT_MS + 100));
+	wmesh_transport_set_impairment(&saved);
+
+	uint32_t duplicated = 0;
+	*delivered = 0;
+	for(size_t i = 0; i < MESSAGE_COUNT; i++) {
+		if(test->received[i] == 1) {
+			(*delivered)++;
+		} else if(test->received[i] > 1) {
+			duplicated++;
+		}
+	}
+
+	uint32_t corrupted = test->corrupted;
+	ESP_LOGI(TAG,
+		"Fragments: %d%% loss, %d%% reordered, %"PRIu32"/%d delivered, %"PRIu32" corrupted, %"PRIu32" duplicated, %"PRIu32" send failures",
+		loss_percent, REORDER_PERCENT, *delivered, MESSAGE_COUNT, corrupted, duplicated, failed
+	);
+
+	return corrupted == 0 && duplicated == 0 && failed == 0;
+}
+
+
+bool test_fragment_reassembly(void) {
+	static fragment_test_t test;
+
+	wmesh_handle_t *handle = host_start_mesh(SERVICE_ID, receive_cb, &test);
+	if(!handle) {
+		return false;
+	}
+
+	// Interleaved fragments of consecutive messages must not cost a message.
+	uint32_t delivered;
+	bool passed = run(handle, &test, 0, &delivered);
+	if(delivered != MESSAGE_COUNT) {
+		passed = false;
+	}
+
+	// Lost fragments lose their message, and only theirs.
+	passed = run(handle, &test, LOSS_PERCENT, &delivered) && passed;
+	if(delivered == 0 || delivered == MESSAGE_COUNT) {
+		passed = false;
+	}
+
+	wmesh_reassembly_t *reassembly = handle->reassembly;
+	ESP_LOGI(TAG,
+		"Fragments: reassembly %"PRIu32" completed, %"PRIu32" timeouts, %"PRIu32" evicted, %"PRIu32" dropped",
+		reassembly->completed, reassembly->timeouts, reassembly->evicted, reassembly->dropped
+	);
+	if(reassembly->dropped != 0) {
+		passed = false;
+	}
+
+	wmesh_stop(handle);
+	return passed;
+}
+
+#endif
@@ -0,0 +1,181 @@
+#include "host.h"
+
+#if CONFIG_WMESH_TRANSPORT_LOOPBACK && CONFIG_IDF_TARGET_LINUX
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "wmesh/transport.h"
+
+static const char *TAG = "wmesh host";
+
+
+/// @brief Service used for test messages.
+#define SERVICE_ID 2
+
+/// @brief Messages sent by every send function.
+#define MESSAGE_COUNT 200
+
+/// @brief Size in bytes of every message. Fits in a single frame.
+#define MESSAGE_SIZE 64
+
+/// @brief How long to wait for each message to arrive.
+#define RECEIVE_TIMEOUT_MS 1000
+
+
+/// @brief Heap allocations made by the current thread. The host is linked
+/// with `--wrap` for every allocation function, see `CMakeLists.txt`.
+static _Thread_local uint32_t allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+
+void *__wrap_malloc(size_t size) {
+	allocations++;
+	return __real_malloc(size);
+}
+
+
+void *__wrap_calloc(size_t count, size_t size) {
+	allocations++;
+	return __real_calloc(count, size);
+}
+
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+
+static esp_err_t receive_cb(
+	wmesh_handle_t *handle, wmesh_address_t src,
+	uint8_t *data, size_t data_size, void *user_ctx
+) {
+	xSemaphoreGive(user_ctx);
+	return ESP_OK;
+}
+
+
+/// @brief Gets the end of the current sequence number lease.
+static wmesh_encryption_ctr_t read_lease(wmesh_handle_t *handle) {
+	xSemaphoreTake(handle->tx_lock, portMAX_DELAY);
+	wmesh_encryption_ctr_t lease = handle->sequence_lease;
+	xSemaphoreGive(handle->tx_lock);
+
+	return lease;
+}
+
+
+/// @brief Sends a message with one of the send functions, and waits until it
+/// is received back.
+///
+/// @param method 0 for `wmesh_send`, 1 for `wmesh_send_frame`, 2 for
+/// `wmesh_send_coalesced`.
+///
+/// @return `true` if the message was sent and received.
+static bool send_one(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	int method, SemaphoreHandle_t received
+) {
+	uint8_t message[MESSAGE_SIZE] = { 0 };
+	esp_err_t err = ESP_FAIL;
+
+	switch(method) {
+		case 0:
+			err = wmesh_send(handle, dest, SERVICE_ID, message, sizeof(message));
+			break;
+
+		case 1: {
+			wmesh_frame_t *frame = wmesh_frame_alloc(handle);
+			if(frame) {
+				memcpy(wmesh_frame_payload(frame), message, sizeof(message));
+				err = wmesh_send_frame(handle, dest, SERVICE_ID, frame, sizeof(message));
+			}
+			break;
+		}
+
+		case 2:
+			err = wmesh_send_coalesced(handle, dest, SERVICE_ID, message, sizeof(message));
+			wmesh_flush(handle);
+			break;
+	}
+
+	return err == ESP_OK && xSemaphoreTake(received, pdMS_TO_TICKS(RECEIVE_TIMEOUT_MS)) == pdTRUE;
+}
+
+
+bool test_frame_pool_allocations(void) {
+	static const char *methods[] = { "wmesh_send", "wmesh_send_frame", "wmesh_send_coalesced" };
+
+	SemaphoreHandle_t received = xSemaphoreCreateBinary();
+	wmesh_handle_t *handle = host_start_mesh(SERVICE_ID, receive_cb, received);
+	if(!handle) {
+		vSemaphoreDelete(received);
+		return false;
+	}
+
+	wmesh_address_t self;
+	wmesh_transport_get_address(self);
+	const uint8_t *destinations[] = { self, wmesh_broadcast_address };
+
+	bool passed = true;
+	for(size_t i = 0; i < sizeof(destinations) / sizeof(*destinations); i++) {
+		// The first frame adds the destination to the peer list, and
+		// registers it in the transport.
+		if(!send_one(handle, destinations[i], 0, received)) {
+			ESP_LOGE(TAG, "Frame pool: warm-up message lost");
+			passed = false;
+			continue;
+		}
+
+		for(int method = 0; method < 3; method++) {
+			uint32_t count = 0;
+			uint32_t lost = 0;
+			uint32_t renewals = 0;
+			for(size_t j = 0; j < MESSAGE_COUNT; j++) {
+				wmesh_encryption_ctr_t lease = read_lease(handle);
+				uint32_t start = allocations;
+
+				if(!send_one(handle, destinations[i], method, received)) {
+					lost++;
+				}
+
+				// Renewing the sequence lease writes to storage, once every
+				// `CONFIG_WMESH_SEQUENCE_LEASE_SIZE` frames. That is not
+				// part of the send path.
+				if(read_lease(handle) != lease) {
+					renewals++;
+				} else {
+					count += allocations - start;
+				}
+			}
+
+			ESP_LOGI(TAG,
+				"Frame pool: %d messages to %s with %s, %"PRIu32" lost, %"PRIu32" allocations, %"PRIu32" lease renewals",
+				MESSAGE_COUNT, i == 0 ? "self" : "broadcast", methods[method], lost, count, renewals
+			);
+			if(count != 0 || lost != 0) {
+				passed = false;
+			}
+		}
+	}
+
+	uint32_t exhausted = handle->frame_pool.exhausted_count;
+	wmesh_stop(handle);
+	vSemaphoreDelete(received);
+
+	if(exhausted != 0) {
+		ESP_LOGE(TAG, "Frame pool: ran out of frames %"PRIu32" times", exhausted);
+		passed = false;
+	}
+
+	return passed;
+}
+
+#endif
@@ -0,0 +1,502 @@
+#include "host.h"
+
+#if CONFIG_WMESH_TRANSPORT_LOOPBACK && CONFIG_IDF_TARGET_LINUX
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include "wmesh/peer.h"
+#include "wmesh/ring.h"
+
+static const char *TAG = "wmesh host";
+
+
+/// @brief Service the test mesh is started with.
+#define SERVICE_ID 2
+
+/// @brief Namespace of the test peer table.
+#define TABLE_NAMESPACE "wmesh_test_p"
+
+/// @brief Frames with forged source addresses queued for the receive task.
+#define FORGED_FRAMES (4 * CONFIG_WMESH_PEER_LOAD_RATE)
+
+/// @brief Size of every forged frame.
+#define FORGED_FRAME_SIZE 64
+
+/// @brief First test peer of the failed flush check, after those of the
+/// parking check.
+#define FAILED_FLUSH_FIRST_PEER 0x1000
+
+/// @brief Test peer stored in a version 1 shard.
+#define UPGRADED_PEER 0x2000
+
+
+/// @brief Removes every value of a namespace from the backend.
+static void erase_namespace(const char *name) {
+	nvs_handle_t nvs;
+	if(nvs_open(name, NVS_READWRITE, &nvs) != ESP_OK) {
+		return;
+	}
+
+	nvs_erase_all(nvs);
+	nvs_commit(nvs);
+	nvs_close(nvs);
+}
+
+
+/// @brief Gets the address of the `n`th test peer.
+static void peer_address(wmesh_address_t address, size_t n) {
+	const wmesh_address_t base = { 0x02, 0xEE, 0x00, n >> 16, n >> 8, n };
+	memcpy(address, base, sizeof(wmesh_address_t));
+}
+
+
+/// @brief Inserts the `n`th test peer, changed, with a window, counters and
+/// reliable receive state of its own. Odd peers accept large frames. Nothing
+/// is written to storage.
+///
+/// @return Peer inside the list, or `NULL` if it could not be inserted.
+static wmesh_peer_t *insert_peer(wmesh_peer_list_t *list, size_t n) {
+	wmesh_address_t address;
+	peer_address(address, n);
+
+	wmesh_peer_t peer;
+	wmesh_peer_new(&peer, address);
+	peer.window.last = 1000 + n;
+	peer.reliable.session = n + 1;
+	peer.reliable.active = true;
+	wmesh_counter_add(&peer.counters.rx_ok, n + 1);
+	peer.large_frames = n % 2 == 1;
+	peer.dirty = true;
+
+	return wmesh_peer_list_insert(list, &peer, NULL);
+}
+
+
+/// @brief Checks that the `n`th test peer is in the list or parked with the
+/// state given by `insert_peer`.
+static bool check_peer_state(wmesh_peer_list_t *list, size_t n, const char *where) {
+	wmesh_address_t address;
+	peer_address(address, n);
+
+	const wmesh_peer_t *peer = wmesh_peer_list_get(list, address);
+	if(!peer) {
+		peer = wmesh_peer_list_get_parked(list, address);
+	}
+
+	wmesh_counters_snapshot_t counters;
+	if(peer) {
+		wmesh_counters_read(&peer->counters, &counters);
+	}
+
+	if(
+		!peer ||
+		peer->window.last != 1000 + n ||
+		peer->reliable.session != n + 1 ||
+		!peer->reliable.active ||
+		counters.rx_ok != n + 1 ||
+		peer->large_frames != (n % 2 == 1)
+	) {
+		ESP_LOGE(TAG, "Peer eviction: peer %zu lost its state %s", n, where);
+		return false;
+	}
+
+	return true;
+}
+
+
+/// @brief Checks whether the stored peer table holds the window of the `n`th
+/// test peer.
+static bool is_stored(wmesh_peer_table_t *table, size_t n) {
+	wmesh_address_t address;
+	peer_address(address, n);
+
+	const wmesh_peer_table_record_t *records;
+	size_t count;
+	if(wmesh_peer_table_read(table, wmesh_peer_table_shard(address), &records, &count) != WMESH_STORAGE_OK) {
+		return false;
+	}
+
+	const wmesh_peer_table_record_t *record = wmesh_peer_table_find(records, count, address);
+	return record && record->last == 1000 + n;
+}
+
+
+/// @brief Fills a list, and checks that evicted peers are parked without
+/// touching storage, come back with their whole state, and are only dropped
+/// once a flush wrote them.
+static bool check_parking(wmesh_peer_list_t *list, wmesh_peer_table_t *table) {
+	bool passed = true;
+
+	for(size_t n = 0; n < CONFIG_WMESH_PEER_LIST_SIZE; n++) {
+		if(!insert_peer(list, n)) {
+			ESP_LOGE(TAG, "Peer eviction: list not filled");
+			return false;
+		}
+	}
+
+	// Evicts peer 0, the least recently seen.
+	uint32_t misses = table->misses;
+	size_t next = CONFIG_WMESH_PEER_LIST_SIZE;
+	if(!insert_peer(list, next++) || list->evictions != 1 || list->parked_count != 1) {
+		ESP_LOGE(TAG, "Peer eviction: evicted peer not parked");
+		return false;
+	}
+	passed = check_peer_state(list, 0, "when parked") && passed;
+	if(table->misses != misses) {
+		ESP_LOGE(TAG, "Peer eviction: storage read on eviction");
+		passed = false;
+	}
+
+	// Peer 0 comes back, evicting peer 1.
+	wmesh_address_t address;
+	peer_address(address, 0);
+	wmesh_peer_t peer;
+	if(
+		wmesh_peer_list_fetch(list, address, table, &peer) != WMESH_STORAGE_OK ||
+		!wmesh_peer_list_insert(list, &peer, NULL) ||
+		list->unparked != 1 ||
+		wmesh_peer_list_get_parked(list, address)
+	) {
+		ESP_LOGE(TAG, "Peer eviction: parked peer not added back");
+		return false;
+	}
+	passed = check_peer_state(list, 0, "when added back") && passed;
+	peer_address(address, 1);
+	if(wmesh_peer_list_max_payload(list, address) != WMESH_FRAME_MAX_PAYLOAD) {
+		ESP_LOGE(TAG, "Peer eviction: parked peer lost its large frames");
+		passed = false;
+	}
+	if(table->misses != misses || is_stored(table, 0) || is_stored(table, 1)) {
+		ESP_LOGE(TAG, "Peer eviction: storage used before the flush");
+		passed = false;
+	}
+
+	// Once every parked peer waits for a flush, new peers are refused.
+	while(list->parked_count < CONFIG_WMESH_PEER_PARKED_COUNT) {
+		if(!insert_peer(list, next++)) {
+			ESP_LOGE(TAG, "Peer eviction: peer refused with room to park");
+			return false;
+		}
+	}
+	if(wmesh_peer_list_can_insert(list) || insert_peer(list, next)) {
+		ESP_LOGE(TAG, "Peer eviction: parked peer dropped before being stored");
+		return false;
+	}
+
+	// A flush writes every peer, parked or not. Parked peers may only be
+	// dropped once the next flush knows the write succeeded.
+	wmesh_peer_table_record_t *records = malloc(WMESH_PEER_RECORD_COUNT * sizeof(*records));
+	if(!records) {
+		return false;
+	}
+	size_t count = wmesh_peer_list_collect(list, records, 0);
+	size_t remaining = wmesh_peer_records_store(table, records, count);
+	bool droppable_early = wmesh_peer_list_can_insert(list);
+	count = wmesh_peer_list_collect(list, records, remaining);
+	free(records);
+
+	if(remaining > 0 || count > 0 || droppable_early || !wmesh_peer_list_can_insert(list)) {
+		ESP_LOGE(TAG, "Peer eviction: parked peers not flushed");
+		return false;
+	}
+	if(!is_stored(table, 1) || !is_stored(table, next - 1)) {
+		ESP_LOGE(TAG, "Peer eviction: flush did not write parked peers");
+		passed = false;
+	}
+
+	// Peer 1, the oldest parked peer, is dropped, and reloaded from storage.
+	if(!insert_peer(list, next++) || list->dropped != 1) {
+		ESP_LOGE(TAG, "Peer eviction: stored parked peer not dropped");
+		return false;
+	}
+	peer_address(address, 1);
+	uint32_t reloads = list->reloads;
+	if(
+		wmesh_peer_list_get_parked(list, address) ||
+		wmesh_peer_list_fetch(list, address, table, &peer) != WMESH_STORAGE_OK ||
+		peer.window.last != 1000 + 1 ||
+		!peer.large_frames ||
+		list->reloads != reloads + 1
+	) {
+		ESP_LOGE(TAG, "Peer eviction: dropped peer not reloaded from storage");
+		passed = false;
+	}
+
+	ESP_LOGI(TAG,
+		"Peer eviction: %"PRIu32" evictions, %"PRIu32" unparked, %"PRIu32" dropped, %"PRIu32" reloads",
+		list->evictions, list->unparked, list->dropped, list->reloads
+	);
+
+	return passed;
+}
+
+
+/// @brief Writes records as `wmesh_peer_records_store` does, except that
+/// writing the given shards fails.
+///
+/// @return Number of records left over, moved to the front.
+static size_t store_failing(
+	wmesh_peer_table_t *table,
+	wmesh_peer_table_record_t *records,
+	size_t count,
+	uint32_t failed_shards
+) {
+	size_t remaining = 0;
+	for(size_t i = 0; i < count; i++) {
+		if(failed_shards & (UINT32_C(1) << wmesh_peer_table_shard(records[i].address))) {
+			wmesh_peer_table_record_t record = records[i];
+			memmove(&records[remaining + 1], &records[remaining], (i - remaining) * sizeof(*records));
+			records[remaining++] = record;
+		}
+	}
+
+	return remaining + wmesh_peer_records_store(table, records + remaining, count - remaining);
+}
+
+
+/// @brief Checks whether a record of an address is in a list of records.
+static bool has_record(
+	const wmesh_peer_table_record_t *records,
+	size_t count,
+	const wmesh_address_t address
+) {
+	for(size_t i = 0; i < count; i++) {
+		if(memcmp(records[i].address, address, sizeof(wmesh_address_t)) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/// @brief Fails writing the shards of parked peers, and checks that their
+/// records, and those of peers evicted before the next flush, are written
+/// again before any of them may be dropped.
+static bool check_failed_flush(wmesh_peer_list_t *list, wmesh_peer_table_t *table) {
+	wmesh_peer_table_record_t *records = malloc(WMESH_PEER_RECORD_COUNT * sizeof(*records));
+	if(!records) {
+		return false;
+	}
+
+	bool passed = true;
+	size_t first = FAILED_FLUSH_FIRST_PEER;
+	size_t next = first;
+	while(list->parked_count < (CONFIG_WMESH_PEER_PARKED_COUNT + 1) / 2) {
+		if(!insert_peer(list, next++)) {
+			ESP_LOGE(TAG, "Peer eviction: peer refused with room to park");
+			free(records);
+			return false;
+		}
+	}
+
+	uint32_t failed_shards = 0;
+	for(size_t i = 0; i < list->parked_count; i++) {
+		failed_shards |= UINT32_C(1) << wmesh_peer_table_shard(list->parked[i].peer.address);
+	}
+
+	size_t count = wmesh_peer_list_collect(list, records, 0);
+	size_t remaining = store_failing(table, records, count, failed_shards);
+
+	// Peers evicted before the next flush may have a record left over.
+	while(list->parked_count < CONFIG_WMESH_PEER_PARKED_COUNT && insert_peer(list, next)) {
+		next++;
+	}
+
+	count = wmesh_peer_list_collect(list, records, remaining);
+	if(remaining == 0 || count > WMESH_PEER_RECORD_COUNT) {
+		ESP_LOGE(TAG, "Peer eviction: %zu records collected after a failed flush", count);
+		free(records);
+		return false;
+	}
+
+	for(size_t i = 0; i < list->parked_count; i++) {
+		const wmesh_parked_peer_t *parked = &list->parked[i];
+		bool failed = failed_shards & (UINT32_C(1) << wmesh_peer_table_shard(parked->peer.address));
+		if(failed && (!parked->flushing || !has_record(records, count, parked->peer.address))) {
+			ESP_LOGE(TAG, "Peer eviction: parked peer may be dropped before being stored");
+			passed = false;
+		}
+	}
+
+	// Once written, every peer may be dropped, and is found in storage.
+	remaining = wmesh_peer_records_store(table, records, count);
+	count = wmesh_peer_list_collect(list, records, remaining);
+	free(records);
+
+	if(remaining > 0 || count > 0 || !wmesh_peer_list_can_insert(list)) {
+		ESP_LOGE(TAG, "Peer eviction: parked peers not flushed after a failed flush");
+		return false;
+	}
+	for(size_t n = first; n < next; n++) {
+		if(!is_stored(table, n)) {
+			ESP_LOGE(TAG, "Peer eviction: peer %zu not stored after a failed flush", n);
+			passed = false;
+		}
+	}
+
+	return passed;
+}
+
+
+/// @brief Stores a peer in a version 1 shard, without flags, and checks that
+/// its window is still loaded, and that its large frames are stored once
+/// set.
+static bool check_upgrade(wmesh_peer_list_t *list, wmesh_peer_table_t *table) {
+	wmesh_address_t address;
+	peer_address(address, UPGRADED_PEER);
+
+	struct __attribute__((packed)) {
+		wmesh_peer_table_header_t header;
+		wmesh_address_t address;
+		wmesh_encryption_ctr_t last;
+		uint64_t bitmap;
+	} shard = {
+		.header = {
+			.version = 1,
+			.record_size = sizeof(wmesh_address_t) + sizeof(wmesh_encryption_ctr_t) + sizeof(uint64_t),
+			.count = 1,
+		},
+		.last = 1000 + UPGRADED_PEER,
+		.bitmap = 5,
+	};
+	memcpy(shard.address, address, sizeof(wmesh_address_t));
+
+	char key[8];
+	snprintf(key, sizeof(key), "pt%02u", (unsigned) wmesh_peer_table_shard(address));
+	if(wmesh_storage_write_blob(table->storage, key, &shard, sizeof(shard)) != WMESH_STORAGE_OK) {
+		return false;
+	}
+	wmesh_peer_table_free(table);
+
+	wmesh_peer_t peer;
+	if(
+		wmesh_peer_list_fetch(list, address, table, &peer) != WMESH_STORAGE_OK ||
+		peer.window.last != 1000 + UPGRADED_PEER ||
+		peer.window.bitmap != 5 ||
+		peer.large_frames
+	) {
+		ESP_LOGE(TAG, "Peer eviction: version 1 peer table shard not loaded");
+		return false;
+	}
+
+	wmesh_peer_t *inserted = wmesh_peer_list_insert(list, &peer, NULL);
+	if(
+		!inserted ||
+		wmesh_peer_list_set_large_frames(list, address, true) != ESP_OK ||
+		wmesh_peer_list_store(list, table) != WMESH_STORAGE_OK
+	) {
+		return false;
+	}
+	wmesh_peer_table_free(table);
+
+	if(
+		wmesh_peer_load(&peer, table, address) != WMESH_STORAGE_OK ||
+		peer.window.last != 1000 + UPGRADED_PEER ||
+		!peer.large_frames
+	) {
+		ESP_LOGE(TAG, "Peer eviction: large frames not stored with the peer");
+		return false;
+	}
+
+	return true;
+}
+
+
+/// @brief Queues frames from random addresses, as if received, and checks
+/// that the receive task only looks up as many unknown peers as the peer
+/// load rate allows.
+static bool check_load_limit(void) {
+	wmesh_handle_t *handle = host_start_mesh(SERVICE_ID, NULL, NULL);
+	if(!handle) {
+		return false;
+	}
+
+	wmesh_rx_ring_t *ring = handle->rx_ring;
+	uint32_t queued = 0;
+	int64_t start_us = esp_timer_get_time();
+
+	while(queued < FORGED_FRAMES) {
+		wmesh_rx_slot_t *slot = wmesh_rx_ring_reserve(ring);
+		if(!slot) {
+			xTaskNotifyGive(handle->rx_task);
+			vTaskDelay(1);
+			continue;
+		}
+
+		esp_fill_random(slot->src, sizeof(slot->src));
+		slot->src[0] &= 0xFE;
+		esp_fill_random(slot->data, FORGED_FRAME_SIZE);
+		slot->length = FORGED_FRAME_SIZE;
+		slot->rssi = -50;
+		wmesh_rx_ring_commit(ring);
+		queued++;
+	}
+
+	xTaskNotifyGive(handle->rx_task);
+	while(atomic_load(&ring->tail) != atomic_load(&ring->head)) {
+		vTaskDelay(1);
+	}
+	int64_t elapsed_us = esp_timer_get_time() - start_us;
+
+	uint32_t limited = handle->peer_loads_limited;
+	uint32_t loaded = queued - limited;
+	uint32_t allowed = CONFIG_WMESH_PEER_LOAD_RATE + 1 +
+		(uint32_t) (elapsed_us * CONFIG_WMESH_PEER_LOAD_RATE / 1000000);
+
+	ESP_LOGI(TAG,
+		"Peer eviction: %"PRIu32" frames from unknown peers in %"PRIi64" us, %"PRIu32" loaded, %"PRIu32" allowed",
+		queued, elapsed_us, loaded, allowed
+	);
+
+	wmesh_stop(handle);
+
+	if(loaded > allowed || loaded < CONFIG_WMESH_PEER_LOAD_RATE) {
+		ESP_LOGE(TAG, "Peer eviction: unknown peer loads not limited to the configured rate");
+		return false;
+	}
+
+	return true;
+}
+
+
+bool test_peer_eviction(void) {
+	erase_namespace(TABLE_NAMESPACE);
+
+	const wmesh_storage_config_t config = {
+		.name = TABLE_NAMESPACE,
+	};
+	wmesh_storage_handle_t storage;
+	if(wmesh_storage_open(&storage, &config) != ESP_OK) {
+		return false;
+	}
+	wmesh_peer_table_t table;
+	wmesh_peer_table_init(&table, &storage);
+
+	bool passed = false;
+	wmesh_peer_list_t *list = calloc(1, sizeof(*list));
+	if(list) {
+		passed = check_parking(list, &table);
+		memset(list, 0, sizeof(*list));
+		passed = check_failed_flush(list, &table) && passed;
+		memset(list, 0, sizeof(*list));
+		passed = check_upgrade(list, &table) && passed;
+		free(list);
+	}
+
+	wmesh_peer_table_free(&table);
+	wmesh_storage_close(&storage);
+	erase_namespace(TABLE_NAMESPACE);
+
+	return check_load_limit() && passed;
+}
+
+#endif
@@ -0,0 +1,178 @@
+#include "host.h"
+
+#if CONFIG_WMESH_TRANSPORT_LOOPBACK && CONFIG_IDF_TARGET_LINUX && CONFIG_WMESH_RATE_CONTROL
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "wmesh/transport.h"
+
+static const char *TAG = "wmesh host";
+
+
+/// @brief Service used for test messages.
+#define SERVICE_ID 2
+
+/// @brief Frames sent after every change of the link.
+#define FRAMES_PER_PHASE 500
+
+/// @brief Delay between frames, so every send result is fed back before the
+/// next frame.
+#define SEND_INTERVAL_MS 10
+
+/// @brief Share of the best expected throughput a rate must reach for rate
+/// control to count as converged, in percent.
+#define CONVERGED_PERCENT 90
+
+/// @brief Share of the best expected throughput rate control must reach on
+/// average over the last quarter of every phase, in percent.
+#define MIN_EFFICIENCY_PERCENT 70
+
+
+static esp_err_t receive_cb(
+	wmesh_handle_t *handle, wmesh_address_t src,
+	uint8_t *data, size_t data_size, void *user_ctx
+) {
+	atomic_uint_fast32_t *received = user_ctx;
+	(*received)++;
+	return ESP_OK;
+}
+
+
+/// @brief Gets the expected throughput of the link at a rate.
+///
+/// @return Delivered bit rate, in Kbps times percent.
+static uint32_t expected_throughput(wmesh_rate_t rate) {
+	return (uint32_t) wmesh_transport_link_delivery(rate) * wmesh_rate_kbps(rate);
+}
+
+
+/// @brief Changes the link's signal strength, and sends `FRAMES_PER_PHASE`
+/// frames to self. Checks that the rate in use converges to one close to the
+/// best for the new link.
+///
+/// @param rssi Signal strength of the link, in dBm.
+///
+/// @return `true` if rate control converged, and stayed close to the best
+/// rate.
+static bool run_phase(wmesh_handle_t *handle, atomic_uint_fast32_t *received, int8_t rssi) {
+	wmesh_transport_impairment_t impairment;
+	wmesh_transport_get_impairment(&impairment);
+	impairment.rssi = rssi;
+	wmesh_transport_set_impairment(&impairment);
+
+	wmesh_rate_t best = WMESH_RATE_LOWEST;
+	for(wmesh_rate_t rate = WMESH_RATE_LOWEST; rate < WMESH_RATE_COUNT; rate++) {
+		if(expected_throughput(rate) > expected_throughput(best)) {
+			best = rate;
+		}
+	}
+	uint64_t best_throughput = expected_throughput(best);
+
+	wmesh_address_t self;
+	wmesh_transport_get_address(self);
+
+	*received = 0;
+	int converged = -1;
+	uint64_t throughput = 0;
+	uint32_t failed = 0;
+	for(int i = 0; i < FRAMES_PER_PHASE; i++) {
+		uint8_t message = 0;
+		if(wmesh_send(handle, self, SERVICE_ID, &message, sizeof(message)) != ESP_OK) {
+			failed++;
+		}
+		vTaskDelay(pdMS_TO_TICKS(SEND_INTERVAL_MS));
+
+		wmesh_rate_t rate;
+		if(wmesh_transport_get_peer_rate(self, &rate) != ESP_OK) {
+			rate = WMESH_RATE_DEFAULT;
+		}
+
+		if(converged < 0 && 100 * expected_throughput(rate) >= CONVERGED_PERCENT * best_throughput) {
+			converged = i + 1;
+		}
+		if(i >= FRAMES_PER_PHASE * 3 / 4) {
+			throughput += expected_throughput(rate);
+		}
+	}
+
+	uint32_t efficiency = 100 * throughput / (best_throughput * (FRAMES_PER_PHASE - FRAMES_PER_PHASE * 3 / 4));
+	ESP_LOGI(TAG,
+		"Rate: %d dBm, best %"PRIu16" Kbps, converged after %d frames, %"PRIu32"%% of best throughput, %"PRIu32"/%d delivered",
+		rssi, wmesh_rate_kbps(best), converged, efficiency, (uint32_t) *received, FRAMES_PER_PHASE
+	);
+
+	return failed == 0 && converged >= 0 && efficiency >= MIN_EFFICIENCY_PERCENT;
+}
+
+
+/// @brief Checks that a peer removed from the driver gets its rate back
+/// when it is registered again.
+static bool check_registration(wmesh_handle_t *handle) {
+	wmesh_address_t self;
+	wmesh_transport_get_address(self);
+
+	// Fills the driver with other peers, removing this node.
+	xSemaphoreTake(handle->tx_lock, portMAX_DELAY);
+	for(size_t i = 0; i < CONFIG_WMESH_REGISTERED_PEER_COUNT; i++) {
+		const wmesh_address_t other = { 0x02, 0xFF, 0x00, 0x00, 0x00, i };
+		wmesh_peer_list_register(handle->peers, other);
+	}
+	xSemaphoreGive(handle->tx_lock);
+
+	wmesh_rate_t rate;
+	if(wmesh_transport_get_peer_rate(self, &rate) != ESP_ERR_NOT_FOUND) {
+		ESP_LOGE(TAG, "Rate: peer still registered");
+		return false;
+	}
+
+	uint8_t message = 0;
+	wmesh_send(handle, self, SERVICE_ID, &message, sizeof(message));
+
+	xSemaphoreTake(handle->tx_lock, portMAX_DELAY);
+	wmesh_peer_t *peer = wmesh_peer_list_get(handle->peers, self);
+	wmesh_rate_t expected = peer ? peer->rate.current : WMESH_RATE_DEFAULT;
+	xSemaphoreGive(handle->tx_lock);
+
+	if(
+		expected == WMESH_RATE_DEFAULT ||
+		wmesh_transport_get_peer_rate(self, &rate) != ESP_OK ||
+		rate != expected
+	) {
+		ESP_LOGE(TAG, "Rate: registered peer sent at the default rate");
+		return false;
+	}
+
+	return true;
+}
+
+
+bool test_rate_adaptation(void) {
+	// Strong link, then weaker and weaker, then strong again.
+	static const int8_t rssis[] = { -45, -78, -89, -45 };
+	static atomic_uint_fast32_t received;
+
+	wmesh_handle_t *handle = host_start_mesh(SERVICE_ID, receive_cb, &received);
+	if(!handle) {
+		return false;
+	}
+
+	wmesh_transport_impairment_t saved;
+	wmesh_transport_get_impairment(&saved);
+
+	bool passed = true;
+	for(size_t i = 0; i < sizeof(rssis) / sizeof(*rssis); i++) {
+		passed = run_phase(handle, &received, rssis[i]) && passed;
+		if(i == 0) {
+			passed = check_registration(handle) && passed;
+		}
+	}
+
+	wmesh_transport_set_impairment(&saved);
+	wmesh_stop(handle);
+	return passed;
+}
+
+#endif
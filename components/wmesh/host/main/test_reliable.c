@@ -0,0 +1,185 @@
+#include "host.h"
+
+#if CONFIG_WMESH_TRANSPORT_LOOPBACK && CONFIG_IDF_TARGET_LINUX
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "wmesh/transport.h"
+
+static const char *TAG = "wmesh host";
+
+
+/// @brief Service used for test messages.
+#define SERVICE_ID 2
+
+/// @brief Messages sent per loss rate.
+#define MESSAGE_COUNT 200
+
+/// @brief Size in bytes of every message.
+#define MESSAGE_SIZE 100
+
+/// @brief How long to wait for room in the send window, and for the last
+/// messages to be acknowledged.
+#define SEND_TIMEOUT_MS 5000
+
+
+/// @brief Messages received during a run.
+typedef struct {
+
+	/// @brief Number of times every message was received.
+	atomic_uint_fast8_t received[MESSAGE_COUNT];
+
+	/// @brief Messages received whose content was wrong.
+	atomic_uint_fast32_t corrupted;
+
+} reliable_test_t;
+
+
+static esp_err_t receive_cb(
+	wmesh_handle_t *handle, wmesh_address_t src,
+	uint8_t *data, size_t data_size, void *user_ctx
+) {
+	reliable_test_t *test = user_ctx;
+
+	if(data_size != MESSAGE_SIZE) {
+		test->corrupted++;
+		return ESP_OK;
+	}
+
+	uint16_t index;
+	memcpy(&index, data, sizeof(index));
+	if(index >= MESSAGE_COUNT) {
+		test->corrupted++;
+		return ESP_OK;
+	}
+
+	test->received[index]++;
+	return ESP_OK;
+}
+
+
+/// @brief Sends `MESSAGE_COUNT` reliable messages to self through a lossy
+/// link. Both frames and acknowledgements are lost.
+///
+/// @param loss_percent Frame loss.
+///
+/// @return `true` if every message was delivered exactly once, except those
+/// reported as dropped after too many retransmissions.
+static bool run(wmesh_handle_t *handle, reliable_test_t *test, uint8_t loss_percent) {
+	for(size_t i = 0; i < MESSAGE_COUNT; i++) {
+		test->received[i] = 0;
+	}
+	test->corrupted = 0;
+
+	wmesh_transport_impairment_t impairment;
+	wmesh_transport_get_impairment(&impairment);
+	wmesh_transport_impairment_t saved = impairment;
+	impairment.loss_percent = loss_percent;
+	wmesh_transport_set_impairment(&impairment);
+
+	wmesh_address_t self;
+	wmesh_transport_get_address(self);
+
+	wmesh_reliable_tx_t *reliable = handle->reliable;
+	uint32_t retransmissions = reliable->retransmissions;
+	uint32_t failed = reliable->failed;
+
+	uint32_t send_errors = 0;
+	int64_t start_us = esp_timer_get_time();
+	for(uint16_t index = 0; index < MESSAGE_COUNT; index++) {
+		uint8_t message[MESSAGE_SIZE] = { 0 };
+		memcpy(message, &index, sizeof(index));
+
+		if(wmesh_send_reliable(handle, self, SERVICE_ID, message, sizeof(message), pdMS_TO_TICKS(SEND_TIMEOUT_MS)) != ESP_OK) {
+			send_errors++;
+		}
+	}
+
+	esp_err_t err = wmesh_reliable_flush(handle, self, pdMS_TO_TICKS(SEND_TIMEOUT_MS));
+	int64_t elapsed_us = esp_timer_get_time() - start_us;
+	wmesh_transport_set_impairment(&saved);
+
+	// Counters are only updated with `reliable_lock` taken, and nothing is in
+	// flight anymore.
+	retransmissions = reliable->retransmissions - retransmissions;
+	failed = reliable->failed - failed;
+
+	uint32_t delivered = 0;
+	uint32_t duplicated = 0;
+	for(size_t i = 0; i < MESSAGE_COUNT; i++) {
+		if(test->received[i] == 1) {
+			delivered++;
+		} else if(test->received[i] > 1) {
+			duplicated++;
+		}
+	}
+
+	ESP_LOGI(TAG,
+		"Reliable: %d%% loss, %"PRIu32"/%d delivered, %"PRIu32" dropped, %.2f retransmissions per message, %.1f KB/s goodput",
+		loss_percent, delivered, MESSAGE_COUNT, failed,
+		(double) retransmissions / MESSAGE_COUNT,
+		delivered * MESSAGE_SIZE * 1000.0 / elapsed_us
+	);
+
+	// A dropped frame may still have been delivered, if only its
+	// acknowledgements were lost.
+	bool passed = send_errors == 0 &&
+		test->corrupted == 0 &&
+		duplicated == 0 &&
+		delivered + failed >= MESSAGE_COUNT &&
+		(err == ESP_OK || (err == ESP_FAIL && failed > 0));
+	if(!passed) {
+		ESP_LOGE(TAG,
+			"Reliable: %"PRIu32" send errors, %"PRIu32" corrupted, %"PRIu32" duplicated, flush %s",
+			send_errors, (uint32_t) test->corrupted, duplicated, esp_err_to_name(err)
+		);
+	}
+
+	return passed;
+}
+
+
+/// @brief Checks that the first frame of a session is delivered even if a
+/// later one arrives first.
+static bool check_session_start(void) {
+	wmesh_reliable_rx_t rx;
+	wmesh_reliable_rx_init(&rx);
+
+	wmesh_reliable_ack_t ack;
+	wmesh_reliable_header_t header = { .session = 1, .seq = 1 };
+	bool second = wmesh_reliable_rx_accept(&rx, &header, &ack);
+	header.seq = 0;
+	bool first = wmesh_reliable_rx_accept(&rx, &header, &ack);
+
+	if(!first || !second || ack.next != 2) {
+		ESP_LOGE(TAG, "Reliable: frame 0 lost when received after frame 1");
+		return false;
+	}
+
+	return true;
+}
+
+
+bool test_reliable_goodput(void) {
+	static const uint8_t loss_percents[] = { 0, 5, 10, 20 };
+	static reliable_test_t test;
+
+	wmesh_handle_t *handle = host_start_mesh(SERVICE_ID, receive_cb, &test);
+	if(!handle) {
+		return false;
+	}
+
+	bool passed = check_session_start();
+	for(size_t i = 0; i < sizeof(loss_percents) / sizeof(*loss_percents); i++) {
+		passed = run(handle, &test, loss_percents[i]) && passed;
+	}
+
+	wmesh_stop(handle);
+	return passed;
+}
+
+#endif
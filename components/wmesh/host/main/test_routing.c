@@ -0,0 +1,437 @@
+#include "host.h"
+
+#if CONFIG_WMESH_TRANSPORT_LOOPBACK && CONFIG_IDF_TARGET_LINUX && CONFIG_WMESH_ROUTING
+
+#include <inttypes.h>
+#include <string.h>
+#include "esp_log.h"
+#include "wmesh/routing.h"
+
+static const char *TAG = "wmesh host";
+
+
+/// @brief Nodes are placed on a square grid of this size. The root is in the
+/// middle.
+#define GRID_SIZE 5
+#define NODE_COUNT (GRID_SIZE * GRID_SIZE)
+#define ROOT (NODE_COUNT / 2)
+
+/// @brief Nodes failed one at a time once the tree has formed, and restarted
+/// before the next one fails. Next to the root, so part of the tree has to
+/// find another path.
+static const size_t failed_nodes[] = {
+	ROOT - GRID_SIZE - 1, ROOT - GRID_SIZE, ROOT - GRID_SIZE + 1,
+	ROOT - 1, ROOT + 1,
+	ROOT + GRID_SIZE - 1, ROOT + GRID_SIZE, ROOT + GRID_SIZE + 1,
+};
+
+/// @brief Frame loss between nodes next to each other, and between nodes
+/// diagonal to each other. Nodes further apart are out of range.
+#define NEAR_LOSS_PERCENT 10
+#define DIAGONAL_LOSS_PERCENT 50
+
+/// @brief Transmissions of a unicast frame before it is given up, like the
+/// driver's retries. Beacons are broadcast, and only sent once.
+#define SEND_ATTEMPTS 7
+
+/// @brief Simulated time step.
+#define STEP_US 10000LL
+
+#define BEACON_INTERVAL_US (CONFIG_WMESH_ROUTE_BEACON_INTERVAL_MS * 1000LL)
+
+/// @brief Longest time the tree may take to form, or to recover from the
+/// failed node. Recovery includes the neighbor timeout.
+#define CONVERGENCE_LIMIT_US (CONFIG_WMESH_ROUTE_NEIGHBOR_TIMEOUT_MS * 1000LL + 10 * BEACON_INTERVAL_US)
+
+/// @brief Messages sent by every node to the root, and by the root back.
+#define MESSAGES_PER_NODE 20
+
+/// @brief Share of messages which must arrive, in percent.
+#define MIN_DELIVERY_PERCENT 95
+
+
+/// @brief Simulated node.
+typedef struct {
+
+	/// @brief Routing state.
+	wmesh_router_t router;
+
+	/// @brief Time the next beacon is due.
+	int64_t beacon_us;
+
+	/// @brief Cleared when the node fails. Failed nodes neither send nor
+	/// receive.
+	bool alive;
+
+} sim_node_t;
+
+
+/// @brief Simulation state.
+typedef struct {
+
+	sim_node_t nodes[NODE_COUNT];
+
+	/// @brief Simulated time, in microseconds.
+	int64_t now_us;
+
+	/// @brief Random number generator state. Fixed seed, so every run is
+	/// the same.
+	uint32_t random;
+
+	/// @brief Time steps in which the parents formed a loop.
+	uint32_t loop_steps;
+
+} sim_t;
+
+
+/// @brief Gets a pseudorandom number.
+static uint32_t next_random(sim_t *sim) {
+	uint32_t x = sim->random;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	sim->random = x;
+	return x;
+}
+
+
+static void node_address(size_t node, wmesh_address_t address) {
+	const wmesh_address_t base = { 0x02, 0x00, 0x00, 0x00, 0x00, node };
+	memcpy(address, base, sizeof(wmesh_address_t));
+}
+
+
+/// @brief Gets the node with an address.
+///
+/// @return Node number, or `NODE_COUNT` if unknown.
+static size_t node_index(const wmesh_address_t address) {
+	wmesh_address_t expected;
+	node_address(address[5], expected);
+
+	if(address[5] >= NODE_COUNT || memcmp(address, expected, sizeof(wmesh_address_t)) != 0) {
+		return NODE_COUNT;
+	}
+	return address[5];
+}
+
+
+/// @brief Gets the frame loss between two nodes.
+///
+/// @return Loss in percent. 100 if the nodes can't hear each other.
+static uint32_t link_loss(const sim_t *sim, size_t a, size_t b) {
+	if(a == b || !sim->nodes[a].alive || !sim->nodes[b].alive) {
+		return 100;
+	}
+
+	int dx = abs((int) (a % GRID_SIZE) - (int) (b % GRID_SIZE));
+	int dy = abs((int) (a / GRID_SIZE) - (int) (b / GRID_SIZE));
+	if(dx > 1 || dy > 1) {
+		return 100;
+	}
+
+	return dx + dy == 1 ? NEAR_LOSS_PERCENT : DIAGONAL_LOSS_PERCENT;
+}
+
+
+/// @brief Sends a unicast frame, with retries.
+///
+/// @return Whether the frame arrived.
+static bool transmit(sim_t *sim, size_t from, size_t to) {
+	uint32_t loss = link_loss(sim, from, to);
+
+	for(size_t i = 0; i < SEND_ATTEMPTS; i++) {
+		if(next_random(sim) % 100 >= loss) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/// @brief Follows the parents from a node.
+///
+/// @param[out] hops Number of hops to the root.
+///
+/// @return `true` if the root is reached, through live nodes, within
+/// `CONFIG_WMESH_ROUTE_MAX_HOPS`.
+static bool reaches_root(const sim_t *sim, size_t node, size_t *hops) {
+	for(size_t hop = 0; hop <= CONFIG_WMESH_ROUTE_MAX_HOPS; hop++) {
+		if(node == ROOT) {
+			*hops = hop;
+			return true;
+		}
+
+		const wmesh_route_neighbor_t *parent = sim->nodes[node].router.parent;
+		if(!parent) {
+			return false;
+		}
+
+		node = node_index(parent->address);
+		if(node == NODE_COUNT || !sim->nodes[node].alive) {
+			return false;
+		}
+	}
+
+	return false;
+}
+
+
+/// @brief Checks whether following the parents from any node leads back to
+/// it.
+static bool has_loop(const sim_t *sim) {
+	for(size_t start = 0; start < NODE_COUNT; start++) {
+		size_t node = start;
+
+		for(size_t hop = 0; hop < NODE_COUNT; hop++) {
+			const wmesh_route_neighbor_t *parent = sim->nodes[node].router.parent;
+			if(!sim->nodes[node].alive || !parent) {
+				break;
+			}
+
+			node = node_index(parent->address);
+			if(node == NODE_COUNT) {
+				break;
+			}
+			if(node == start) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+
+/// @brief Checks whether every live node has a path to the root.
+///
+/// @param[out] max_hops Longest path.
+static bool converged(const sim_t *sim, size_t *max_hops) {
+	*max_hops = 0;
+
+	for(size_t node = 0; node < NODE_COUNT; node++) {
+		size_t hops;
+		if(!sim->nodes[node].alive) {
+			continue;
+		}
+		if(!reaches_root(sim, node, &hops)) {
+			return false;
+		}
+		if(hops > *max_hops) {
+			*max_hops = hops;
+		}
+	}
+
+	return true;
+}
+
+
+/// @brief Advances the simulation by one step. Sends every beacon due, as
+/// the receive task does.
+static void step(sim_t *sim) {
+	sim->now_us += STEP_US;
+
+	for(size_t node = 0; node < NODE_COUNT; node++) {
+		sim_node_t *sender = &sim->nodes[node];
+		if(!sender->alive || sender->beacon_us > sim->now_us) {
+			continue;
+		}
+
+		// Beacons drift a little, like independent timers.
+		sender->beacon_us += BEACON_INTERVAL_US - BEACON_INTERVAL_US / 10 + next_random(sim) % (BEACON_INTERVAL_US / 5);
+
+		wmesh_route_beacon_t beacon;
+		wmesh_router_expire(&sender->router, sim->now_us);
+		if(!wmesh_router_make_beacon(&sender->router, &beacon)) {
+			continue;
+		}
+
+		for(size_t receiver = 0; receiver < NODE_COUNT; receiver++) {
+			if(next_random(sim) % 100 >= link_loss(sim, node, receiver)) {
+				wmesh_router_beacon_received(&sim->nodes[receiver].router, sender->router.self, &beacon, sim->now_us);
+			}
+		}
+	}
+
+	if(has_loop(sim)) {
+		sim->loop_steps++;
+	}
+}
+
+
+/// @brief Runs the simulation until every node has a path to the root.
+///
+/// @param[out] max_hops Longest path.
+///
+/// @return Time taken, in microseconds, or -1 if the limit was reached.
+static int64_t run_until_converged(sim_t *sim, size_t *max_hops) {
+	int64_t start_us = sim->now_us;
+
+	while(sim->now_us - start_us < CONVERGENCE_LIMIT_US) {
+		step(sim);
+		if(converged(sim, max_hops)) {
+			return sim->now_us - start_us;
+		}
+	}
+
+	return -1;
+}
+
+
+/// @brief Relays a message hop by hop, as `routed_cb` does.
+///
+/// @return Whether the message arrived.
+static bool send_routed(sim_t *sim, size_t origin, size_t dest) {
+	wmesh_address_t origin_address, dest_address;
+	node_address(origin, origin_address);
+	node_address(dest, dest_address);
+
+	size_t node = origin;
+	for(size_t ttl = CONFIG_WMESH_ROUTE_MAX_HOPS; node != dest; ttl--) {
+		wmesh_address_t next_address;
+		if(ttl == 0 || !wmesh_router_next_hop(&sim->nodes[node].router, dest_address, next_address)) {
+			return false;
+		}
+
+		size_t next = node_index(next_address);
+		if(next == NODE_COUNT || !transmit(sim, node, next)) {
+			return false;
+		}
+
+		wmesh_router_learn(&sim->nodes[next].router, origin_address, sim->nodes[node].router.self, sim->now_us);
+		node = next;
+	}
+
+	return true;
+}
+
+
+/// @brief Sends `MESSAGES_PER_NODE` messages from every node to the root,
+/// and as many back.
+///
+/// @return `true` if enough messages arrived both ways.
+static bool run_traffic(sim_t *sim, const char *phase) {
+	uint32_t sent = 0, up = 0, down = 0;
+
+	for(size_t i = 0; i < MESSAGES_PER_NODE; i++) {
+		for(size_t node = 0; node < NODE_COUNT; node++) {
+			if(node == ROOT || !sim->nodes[node].alive) {
+				continue;
+			}
+
+			sent++;
+			up += send_routed(sim, node, ROOT);
+			down += send_routed(sim, ROOT, node);
+		}
+
+		step(sim);
+	}
+
+	ESP_LOGI(TAG,
+		"Routing: %s, %"PRIu32"/%"PRIu32" delivered to the root, %"PRIu32"/%"PRIu32" from the root",
+		phase, up, sent, down, sent
+	);
+
+	return 100 * up >= MIN_DELIVERY_PERCENT * sent && 100 * down >= MIN_DELIVERY_PERCENT * sent;
+}
+
+
+/// @brief Checks that a node which lost its parent doesn't pick a node
+/// further down its own subtree, still advertising the path through it.
+static bool check_stale_descendant(void) {
+	static const int64_t timeout_us = CONFIG_WMESH_ROUTE_NEIGHBOR_TIMEOUT_MS * 1000LL;
+	static wmesh_router_t root, node, child, grandchild;
+	wmesh_address_t address;
+	wmesh_route_beacon_t beacon;
+
+	node_address(0, address);
+	wmesh_router_init(&root, address);
+	wmesh_router_set_root(&root, true);
+	node_address(1, address);
+	wmesh_router_init(&node, address);
+	node_address(2, address);
+	wmesh_router_init(&child, address);
+	node_address(3, address);
+	wmesh_router_init(&grandchild, address);
+
+	// Root, node, child and grandchild form a chain, but the grandchild is
+	// also in range of the node.
+	wmesh_router_make_beacon(&root, &beacon);
+	wmesh_router_beacon_received(&node, root.self, &beacon, 0);
+	wmesh_router_make_beacon(&node, &beacon);
+	wmesh_router_beacon_received(&child, node.self, &beacon, 0);
+	wmesh_router_make_beacon(&child, &beacon);
+	wmesh_router_beacon_received(&node, child.self, &beacon, timeout_us);
+	wmesh_router_beacon_received(&grandchild, child.self, &beacon, timeout_us);
+	wmesh_router_make_beacon(&grandchild, &beacon);
+	wmesh_router_beacon_received(&node, grandchild.self, &beacon, timeout_us);
+
+	// The root goes silent.
+	wmesh_router_expire(&node, timeout_us + 1);
+
+	if(node.parent) {
+		ESP_LOGE(TAG, "Routing: parent lost, node %zu chosen instead", node_index(node.parent->address));
+		return false;
+	}
+	return true;
+}
+
+
+/// @brief Starts a node, with no neighbors or routes.
+static void start_node(sim_t *sim, size_t node) {
+	wmesh_address_t address;
+	node_address(node, address);
+
+	wmesh_router_init(&sim->nodes[node].router, address);
+	wmesh_router_set_root(&sim->nodes[node].router, node == ROOT);
+	sim->nodes[node].beacon_us = sim->now_us + next_random(sim) % BEACON_INTERVAL_US;
+	sim->nodes[node].alive = true;
+}
+
+
+bool test_routing_convergence(void) {
+	static sim_t sim;
+
+	bool passed = check_stale_descendant();
+
+	sim.now_us = 0;
+	sim.random = 0x2545F491;
+	sim.loop_steps = 0;
+	for(size_t node = 0; node < NODE_COUNT; node++) {
+		start_node(&sim, node);
+	}
+
+	size_t max_hops;
+	int64_t formed_us = run_until_converged(&sim, &max_hops);
+	ESP_LOGI(TAG,
+		"Routing: %d nodes, tree formed in %"PRIi64" ms, %zu hops max",
+		NODE_COUNT, formed_us / 1000, max_hops
+	);
+	passed = formed_us >= 0 && run_traffic(&sim, "formed") && passed;
+
+	int64_t worst_us = 0;
+	for(size_t i = 0; i < sizeof(failed_nodes) / sizeof(*failed_nodes); i++) {
+		sim.nodes[failed_nodes[i]].alive = false;
+		int64_t recovered_us = run_until_converged(&sim, &max_hops);
+		if(recovered_us < 0) {
+			ESP_LOGE(TAG, "Routing: no recovery from node %zu failing", failed_nodes[i]);
+			passed = false;
+		} else if(recovered_us > worst_us) {
+			worst_us = recovered_us;
+		}
+		passed = run_traffic(&sim, "node failed") && passed;
+
+		start_node(&sim, failed_nodes[i]);
+		passed = run_until_converged(&sim, &max_hops) >= 0 && passed;
+	}
+	ESP_LOGI(TAG, "Routing: recovered from a node next to the root failing in %"PRIi64" ms at most", worst_us / 1000);
+
+	if(sim.loop_steps > 0) {
+		ESP_LOGE(TAG, "Routing: parents formed a loop for %"PRIu32" ms", sim.loop_steps * (uint32_t) (STEP_US / 1000));
+		passed = false;
+	}
+
+	return passed;
+}
+
+#endif
@@ -0,0 +1,121 @@
+#include "host.h"
+
+#if CONFIG_WMESH_TRANSPORT_LOOPBACK && CONFIG_IDF_TARGET_LINUX && CONFIG_WMESH_STORAGE_RTC_CACHE
+
+#include <inttypes.h>
+#include <string.h>
+#include "esp_log.h"
+#include "nvs.h"
+#include "wmesh/storage.h"
+#include "wmesh/storage_cache.h"
+
+static const char *TAG = "wmesh host";
+
+
+/// @brief Removes every value of a namespace from the backend.
+static void erase_namespace(const char *name) {
+	nvs_handle_t nvs;
+	if(nvs_open(name, NVS_READWRITE, &nvs) != ESP_OK) {
+		return;
+	}
+
+	nvs_erase_all(nvs);
+	nvs_commit(nvs);
+	nvs_close(nvs);
+}
+
+
+/// @brief Opens a namespace, writes a window, and commits it.
+static bool write_window(const char *name, bool write_through, const wmesh_replay_window_t *window) {
+	const wmesh_storage_config_t config = {
+		.name = name,
+		.write_through = write_through,
+	};
+	wmesh_storage_handle_t storage;
+	if(wmesh_storage_open(&storage, &config) != ESP_OK) {
+		return false;
+	}
+
+	bool written =
+		wmesh_storage_write_window(&storage, "window", window) == WMESH_STORAGE_OK &&
+		wmesh_storage_commit(&storage) == ESP_OK;
+
+	wmesh_storage_close(&storage);
+	return written;
+}
+
+
+/// @brief Opens a namespace, and reads a window.
+///
+/// @param[out] window Window read. Zero if there is none.
+/// @param[out] from_flash Set if the backend had to be read.
+static void read_window(const char *name, bool write_through, wmesh_replay_window_t *window, bool *from_flash) {
+	const wmesh_storage_config_t config = {
+		.name = name,
+		.write_through = write_through,
+	};
+	wmesh_storage_handle_t storage;
+	memset(window, 0, sizeof(*window));
+	*from_flash = false;
+	if(wmesh_storage_open(&storage, &config) != ESP_OK) {
+		return;
+	}
+
+	if(wmesh_storage_read_window(&storage, "window", window) != WMESH_STORAGE_OK) {
+		memset(window, 0, sizeof(*window));
+	}
+	*from_flash = storage.backend_open;
+
+	wmesh_storage_close(&storage);
+}
+
+
+bool test_storage_power_loss(void) {
+	const wmesh_replay_window_t before_sleep = { .last = 1000, .bitmap = 1 };
+	const wmesh_replay_window_t before_power_loss = { .last = 2000, .bitmap = 3 };
+	wmesh_replay_window_t deferred, through;
+	bool deferred_from_flash, through_from_flash;
+	bool passed = true;
+
+	erase_namespace("wmesh_test_d");
+	erase_namespace("wmesh_test_t");
+	wmesh_storage_cache_simulate_reset(ESP_RST_POWERON);
+
+	// Both kinds of namespace are read from RTC memory after deep sleep.
+	passed = write_window("wmesh_test_d", false, &before_sleep) && passed;
+	passed = write_window("wmesh_test_t", true, &before_sleep) && passed;
+	wmesh_storage_cache_simulate_reset(ESP_RST_DEEPSLEEP);
+	read_window("wmesh_test_d", false, &deferred, &deferred_from_flash);
+	read_window("wmesh_test_t", true, &through, &through_from_flash);
+
+	if(deferred.last != before_sleep.last || through.last != before_sleep.last) {
+		ESP_LOGE(TAG, "Storage: window lost in deep sleep");
+		passed = false;
+	}
+	if(deferred_from_flash || through_from_flash) {
+		ESP_LOGE(TAG, "Storage: flash read after deep sleep");
+		passed = false;
+	}
+
+	// Only the write-through namespace keeps the newest window.
+	passed = write_window("wmesh_test_d", false, &before_power_loss) && passed;
+	passed = write_window("wmesh_test_t", true, &before_power_loss) && passed;
+	wmesh_storage_cache_simulate_reset(ESP_RST_POWERON);
+	read_window("wmesh_test_d", false, &deferred, &deferred_from_flash);
+	read_window("wmesh_test_t", true, &through, &through_from_flash);
+
+	ESP_LOGI(TAG,
+		"Storage: after power loss, deferred window at %"PRIu64", write-through window at %"PRIu64", %"PRIu64" written",
+		(uint64_t) deferred.last, (uint64_t) through.last, (uint64_t) before_power_loss.last
+	);
+	if(memcmp(&through, &before_power_loss, sizeof(through)) != 0) {
+		ESP_LOGE(TAG, "Storage: write-through window lost on power loss");
+		passed = false;
+	}
+
+	erase_namespace("wmesh_test_d");
+	erase_namespace("wmesh_test_t");
+	return passed;
+}
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef WMESH_BENCHMARK_H_
+#define WMESH_BENCHMARK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+
+#if CONFIG_WMESH_ENCRYPTION_BENCHMARK
+	/// @brief Unit of benchmark times. CPU cycles on target. On Linux, where
+	/// cycles can't be read portably, nanoseconds.
+	#if CONFIG_IDF_TARGET_LINUX
+		#define WMESH_BENCHMARK_TIME_UNIT "ns"
+	#else
+		#define WMESH_BENCHMARK_TIME_UNIT "cycles"
+	#endif
+
+
+	/// @brief Measurements of a single payload size.
+	typedef struct {
+
+		/// @brief Plaintext size in bytes.
+		size_t payload_length;
+
+		/// @brief Number of frames encrypted, and decrypted.
+		uint32_t frames;
+
+		/// @brief Total time spent in `wmesh_encrypt_aad`. See
+		/// `WMESH_BENCHMARK_TIME_UNIT`.
+		uint64_t encrypt_time;
+
+		#if CONFIG_WMESH_ENCRYPTION_PROFILE
+			/// @brief Part of `encrypt_time` spent building nonces.
+			uint64_t nonce_time;
+
+			/// @brief Part of `encrypt_time` spent in the cipher.
+			uint64_t aead_time;
+		#endif
+
+		/// @brief Total time spent copying payloads into frames, as
+		/// `wmesh_sendv` does before encrypting them.
+		uint64_t copy_time;
+
+		/// @brief Total time spent in `wmesh_decrypt_aad`. See
+		/// `WMESH_BENCHMARK_TIME_UNIT`.
+		uint64_t decrypt_time;
+
+		/// @brief Wall clock time of every copy and encryption, in
+		/// microseconds.
+		int64_t encrypt_us;
+
+		/// @brief Wall clock time of every decryption, in microseconds.
+		int64_t decrypt_us;
+
+	} wmesh_encryption_benchmark_point_t;
+
+
+	/// @brief Costs derived from every measured payload size. Times are in
+	/// `WMESH_BENCHMARK_TIME_UNIT`.
+	typedef struct {
+
+		/// @brief Creating and freeing an encryption context, which includes
+		/// the key schedule.
+		double context_time;
+
+		/// @brief Fixed cost of every `wmesh_encrypt_aad` call, regardless of
+		/// the payload size. Fitted over every payload size.
+		double encrypt_setup;
+
+		/// @brief Cost of every payload byte encrypted.
+		double encrypt_per_byte;
+
+		/// @brief Fixed cost of every `wmesh_decrypt_aad` call.
+		double decrypt_setup;
+
+		/// @brief Cost of every payload byte decrypted.
+		double decrypt_per_byte;
+
+	} wmesh_encryption_benchmark_t;
+
+
+	/// @brief Encrypts and decrypts frames of every payload size with the
+	/// configured algorithm. Payloads are copied into a frame and encrypted
+	/// in place, like frames sent by the mesh. With
+	/// `CONFIG_WMESH_ENCRYPTION_PROFILE`, encryption is further split into
+	/// nonce and cipher time.
+	///
+	/// @param[in] payload_lengths Payload sizes in bytes. At most
+	/// `CONFIG_WMESH_FRAME_SIZE - WMESH_CIPHERTEXT_BASE_LENGTH`.
+	/// @param[in] count Number of payload sizes.
+	/// @param[in] frames Frames encrypted and decrypted per payload size.
+	/// @param[out] points Measurements of every payload size. Must hold
+	/// `count` entries.
+	/// @param[out] summary Costs fitted over every payload size.
+	///
+	/// @return `ESP_OK`, `ESP_ERR_INVALID_SIZE` if a payload is too large, or
+	/// error if a frame fails to decrypt.
+	esp_err_t wmesh_encryption_benchmark(
+		const size_t *payload_lengths,
+		size_t count,
+		uint32_t frames,
+		wmesh_encryption_benchmark_point_t *points,
+		wmesh_encryption_benchmark_t *summary
+	);
+
+
+	/// @brief Logs benchmark results as a table.
+	///
+	/// @param[in] points Measurements of every payload size.
+	/// @param[in] count Number of payload sizes.
+	/// @param[in] summary Fitted costs.
+	void wmesh_encryption_benchmark_log(
+		const wmesh_encryption_benchmark_point_t *points,
+		size_t count,
+		const wmesh_encryption_benchmark_t *summary
+	);
+#endif
+
+#endif
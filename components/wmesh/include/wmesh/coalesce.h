@@ -0,0 +1,141 @@
+#ifndef WMESH_COALESCE_H_
+#define WMESH_COALESCE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "wmesh/common.h"
+#include "wmesh/frame.h"
+
+
+/// @brief Precedes every message inside a bundle.
+typedef struct __attribute__((packed)) {
+
+	/// @brief Destination service of the message.
+	wmesh_service_id_t service;
+
+	/// @brief Size in bytes of the message.
+	uint16_t length;
+
+} wmesh_bundle_record_t;
+
+
+/// @brief Frame collecting messages bound for the same destination.
+typedef struct {
+
+	/// @brief Destination address.
+	wmesh_address_t dest;
+
+	/// @brief Frame holding the records. `NULL` if the bundle is not in use.
+	wmesh_frame_t *frame;
+
+	/// @brief Number of payload bytes used.
+	uint16_t length;
+
+	/// @brief Maximum number of payload bytes. Depends on the destination.
+	uint16_t capacity;
+
+	/// @brief Number of records in the frame.
+	uint8_t count;
+
+	/// @brief Time at which the bundle is sent, in microseconds.
+	int64_t deadline_us;
+
+} wmesh_bundle_t;
+
+
+/// @brief Batches small messages into shared frames.
+typedef struct {
+
+	/// @brief Open bundles. At most one per destination.
+	wmesh_bundle_t bundles[CONFIG_WMESH_COALESCE_BUNDLES];
+
+	/// @brief Number of messages added to a bundle.
+	uint32_t messages;
+
+	/// @brief Number of frames sent for those messages.
+	uint32_t frames;
+
+} wmesh_coalescer_t;
+
+
+/// @brief Initializes a coalescer with no open bundles.
+///
+/// @param[out] coalescer Coalescer to initialize.
+void wmesh_coalescer_init(wmesh_coalescer_t *coalescer);
+
+
+/// @brief Finds the open bundle for a destination.
+///
+/// @param[in] coalescer Coalescer.
+/// @param[in] dest Destination address.
+///
+/// @return Bundle, or `NULL` if none is open.
+wmesh_bundle_t *wmesh_coalescer_find(
+	wmesh_coalescer_t *coalescer,
+	const wmesh_address_t dest
+);
+
+
+/// @brief Gets a bundle which is not in use, or, if every bundle is in use,
+/// the one with the earliest deadline.
+///
+/// @param[in] coalescer Coalescer.
+///
+/// @return Bundle. Must be sent first if its frame is not `NULL`.
+wmesh_bundle_t *wmesh_coalescer_victim(wmesh_coalescer_t *coalescer);
+
+
+/// @brief Gets the earliest deadline of every open bundle.
+///
+/// @param[in] coalescer Coalescer.
+///
+/// @return Deadline in microseconds, or `INT64_MAX` if no bundle is open.
+int64_t wmesh_coalescer_next_deadline(const wmesh_coalescer_t *coalescer);
+
+
+/// @brief Checks whether a message fits in a bundle.
+///
+/// @param[in] bundle Open bundle.
+/// @param[in] data_length Size in bytes of the message.
+///
+/// @return `true` if `wmesh_bundle_append` would succeed.
+bool wmesh_bundle_fits(const wmesh_bundle_t *bundle, size_t data_length);
+
+
+/// @brief Appends a message to an open bundle.
+///
+/// @param[inout] bundle Open bundle.
+/// @param[in] service Destination service.
+/// @param[in] iov Message segments.
+/// @param[in] iov_count Number of segments.
+///
+/// @return `true` if the message was added, `false` if it does not fit.
+bool wmesh_bundle_append(
+	wmesh_bundle_t *bundle,
+	wmesh_service_id_t service,
+	const wmesh_iovec_t *iov,
+	size_t iov_count
+);
+
+
+/// @brief Reads the next record of a received bundle.
+///
+/// @param[inout] cursor Start of the next record. Advanced past it.
+/// @param[in] end End of the bundle.
+/// @param[out] service Destination service of the record.
+/// @param[out] data Record data.
+/// @param[out] data_length Size in bytes of `data`.
+///
+/// @return `true` if a record was read, `false` at the end of the bundle or
+/// if the record is truncated.
+bool wmesh_bundle_next(
+	uint8_t **cursor,
+	const uint8_t *end,
+	wmesh_service_id_t *service,
+	uint8_t **data,
+	size_t *data_length
+);
+
+#endif
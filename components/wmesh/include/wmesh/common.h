@@ -1,14 +1,83 @@
 #ifndef WMESH_COMMON_H_
 #define WMESH_COMMON_H_
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 struct wmesh_handle_t;
 
 /// @brief Mesh node address.
 typedef uint8_t wmesh_address_t[6];
 
+/// @brief Service identifier. Must be unique to a single service.
+typedef uint8_t wmesh_service_id_t;
+
 /// @brief Any message sent to this address will be received by all nodes.
 static const wmesh_address_t wmesh_broadcast_address = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
+
+/// @brief Segment of a message. Messages built from a header and a body may be
+/// sent without joining them first.
+typedef struct {
+
+	/// @brief Segment data.
+	const void *data;
+
+	/// @brief Segment size in bytes.
+	size_t length;
+
+} wmesh_iovec_t;
+
+
+/// @brief Gets the total size of a list of segments.
+static inline size_t wmesh_iovec_length(const wmesh_iovec_t *iov, size_t iov_count) {
+	size_t length = 0;
+	for(size_t i = 0; i < iov_count; i++) {
+		length += iov[i].length;
+	}
+
+	return length;
+}
+
+
+/// @brief Copies part of a list of segments into a contiguous buffer.
+///
+/// @param[out] dst Output buffer, of at least `length` bytes.
+/// @param[in] iov Segments.
+/// @param[in] iov_count Number of segments.
+/// @param[in] offset First byte to copy, counted from the start of the first
+/// segment.
+/// @param[in] length Number of bytes to copy.
+static inline void wmesh_iovec_gather(
+	uint8_t *dst,
+	const wmesh_iovec_t *iov, size_t iov_count,
+	size_t offset, size_t length
+) {
+	for(size_t i = 0; i < iov_count && length > 0; i++) {
+		if(offset >= iov[i].length) {
+			offset -= iov[i].length;
+			continue;
+		}
+
+		size_t chunk = iov[i].length - offset < length ? iov[i].length - offset : length;
+		memcpy(dst, (const uint8_t *) iov[i].data + offset, chunk);
+		dst += chunk;
+		length -= chunk;
+		offset = 0;
+	}
+}
+
+
+/// @brief Hashes a node address (FNV-1a).
+static inline uint32_t wmesh_address_hash(const wmesh_address_t address) {
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < sizeof(wmesh_address_t); i++) {
+		hash ^= address[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
 #endif
@@ -4,6 +4,15 @@
 #include <stdint.h>
 #include "esp_err.h"
 #include "sdkconfig.h"
+#include "wmesh/common.h"
+
+#if CONFIG_WMESH_ENCRYPTION_PROFILE
+	#if CONFIG_IDF_TARGET_LINUX
+		#include <time.h>
+	#else
+		#include "esp_cpu.h"
+	#endif
+#endif
 
 
 #if CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH > 8
@@ -20,6 +29,26 @@
 	#error Nonce length too small.
 #endif
 
+#if CONFIG_WMESH_REPLAY_WINDOW_SIZE < 1 || CONFIG_WMESH_REPLAY_WINDOW_SIZE > 64
+	#error Replay window size must be between 1 and 64.
+#endif
+
+
+/// @brief Receive-side anti-replay state.
+///
+/// Counters greater than `last` are always accepted. Counters up to
+/// `CONFIG_WMESH_REPLAY_WINDOW_SIZE - 1` below `last` are accepted only once.
+typedef struct {
+
+	/// @brief Highest accepted counter.
+	wmesh_encryption_ctr_t last;
+
+	/// @brief Bit `n` is set if counter `last - n` has already been accepted.
+	uint64_t bitmap;
+
+} wmesh_replay_window_t;
+
+
 #if CONFIG_WMESH_ENCRYPTION_AES128_GCM || \
 	CONFIG_WMESH_ENCRYPTION_AES192_GCM || \
 	CONFIG_WMESH_ENCRYPTION_AES256_GCM
@@ -44,14 +73,98 @@
 #endif
 
 
-#define WMESH_CIPHERTEXT_BASE_LENGTH ( \
-	CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH + \
-	CONFIG_WMESH_ENCRYPTION_IV_LENGTH + \
-	CONFIG_WMESH_ENCRYPTION_TAG_LENGTH \
+#if CONFIG_WMESH_FRAME_COMPACT
+	#if CONFIG_WMESH_ENCRYPTION_IV_LENGTH < 6
+		#error Compact frames need an IV of at least 6 bytes, to hold the MAC address.
+	#endif
+
+	/// @brief Version stored in the top 3 bits of a compact frame's format
+	/// byte.
+	#define WMESH_COMPACT_FORMAT_VERSION 1
+
+	/// @brief Builds the format byte of a compact frame. Holds the version,
+	/// the tag length in 4-byte units minus 1, and the counter length minus
+	/// 1.
+	#define WMESH_COMPACT_FORMAT(counter_length) ( \
+		WMESH_COMPACT_FORMAT_VERSION << 5 | \
+		(CONFIG_WMESH_ENCRYPTION_TAG_LENGTH / 4 - 1) << 3 | \
+		((counter_length) - 1) \
 	)
+
+	/// @brief Bytes in front of the ciphertext: format and tag.
+	#define WMESH_CIPHERTEXT_HEADER_LENGTH (1 + CONFIG_WMESH_ENCRYPTION_TAG_LENGTH)
+
+	/// @brief Maximum bytes after the ciphertext: the counter, without its
+	/// leading zero bytes.
+	#define WMESH_CIPHERTEXT_TRAILER_LENGTH CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH
+
+	/// @brief Smallest possible overhead, with a 1-byte counter.
+	#define WMESH_CIPHERTEXT_MIN_OVERHEAD (WMESH_CIPHERTEXT_HEADER_LENGTH + 1)
+#else
+	/// @brief Bytes in front of the ciphertext: IV, nonce and tag.
+	#define WMESH_CIPHERTEXT_HEADER_LENGTH ( \
+		CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH + \
+		CONFIG_WMESH_ENCRYPTION_IV_LENGTH + \
+		CONFIG_WMESH_ENCRYPTION_TAG_LENGTH \
+		)
+	#define WMESH_CIPHERTEXT_TRAILER_LENGTH 0
+	#define WMESH_CIPHERTEXT_MIN_OVERHEAD WMESH_CIPHERTEXT_HEADER_LENGTH
+#endif
+
+/// @brief Maximum number of bytes encryption adds to a message.
+#define WMESH_CIPHERTEXT_BASE_LENGTH (WMESH_CIPHERTEXT_HEADER_LENGTH + WMESH_CIPHERTEXT_TRAILER_LENGTH)
 #define WMESH_CIPHERTEXT_LENGTH(x) (x + WMESH_CIPHERTEXT_BASE_LENGTH)
-#define WMESH_PLAINTEXT_LENGTH(x) (x - WMESH_CIPHERTEXT_BASE_LENGTH)
+#define WMESH_PLAINTEXT_LENGTH(x) (x - WMESH_CIPHERTEXT_MIN_OVERHEAD)
+
+
+
+#if CONFIG_WMESH_ENCRYPTION_PROFILE
+	/// @brief Unit of the times in `wmesh_encryption_profile_t`.
+	#if CONFIG_IDF_TARGET_LINUX
+		#define WMESH_PROFILE_TIME_UNIT "ns"
+	#else
+		#define WMESH_PROFILE_TIME_UNIT "cycles"
+	#endif
+
+
+	/// @brief Time spent preparing frames to send. See
+	/// `WMESH_PROFILE_TIME_UNIT`.
+	typedef struct {
+
+		/// @brief Number of frames encrypted.
+		uint32_t frames;
 
+		/// @brief Time spent building nonces, from the IV and counter.
+		uint64_t nonce_time;
+
+		/// @brief Time spent in the cipher.
+		uint64_t aead_time;
+
+		/// @brief Number of payloads copied into frames.
+		uint32_t copies;
+
+		/// @brief Number of payload bytes copied into frames.
+		uint64_t copied_bytes;
+
+		/// @brief Time spent copying payloads into frames.
+		uint64_t copy_time;
+
+	} wmesh_encryption_profile_t;
+
+
+	/// @brief Reads the profiling clock. See `WMESH_PROFILE_TIME_UNIT`.
+	///
+	/// Only differences between two readings are meaningful.
+	static inline uint32_t wmesh_profile_now(void) {
+		#if CONFIG_IDF_TARGET_LINUX
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return (uint32_t) (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+		#else
+			return esp_cpu_get_cycle_count();
+		#endif
+	}
+#endif
 
 
 /// @brief Stores encryption-related data.
@@ -60,6 +173,16 @@ typedef struct {
 	/// @brief MbedTLS context.
 	wmesh_encryption_mbedtls_ctx_t mbedtls_ctx;
 
+	/// @brief IV of every frame sent. Generated once, in
+	/// `wmesh_encryption_ctx_new`, so only the counter changes per frame.
+	uint8_t iv[CONFIG_WMESH_ENCRYPTION_IV_LENGTH];
+
+	#if CONFIG_WMESH_ENCRYPTION_PROFILE
+		/// @brief Send cost breakdown. Updated by `wmesh_encrypt_aad`, and
+		/// by the mesh as it copies payloads into frames.
+		wmesh_encryption_profile_t profile;
+	#endif
+
 } wmesh_encryption_ctx_t;
 
 
@@ -101,6 +224,7 @@ void wmesh_encryption_ctx_free(wmesh_encryption_ctx_t *ctx);
 /// @param[in] plaintext_length Size in bytes of input data.
 /// @param[out] ciphertext Encrypted data. Length of the buffer must be, at
 /// least, of `WMESH_CIPHERTEXT_LENGTH(plaintext_length)` bytes.
+/// @param[out] ciphertext_length Number of bytes written to `ciphertext`.
 ///
 /// @return `ESP_OK` if successful.
 esp_err_t wmesh_encrypt(
@@ -110,7 +234,8 @@ esp_err_t wmesh_encrypt(
 	const uint8_t *plaintext,
 	size_t plaintext_length,
 
-	uint8_t *ciphertext
+	uint8_t *ciphertext,
+	size_t *ciphertext_length
 );
 
 /// @brief Encrypts the given data and updates internal state.
@@ -126,6 +251,10 @@ esp_err_t wmesh_encrypt(
 /// @param[in] aad_size Size in bytes of `aad`.
 /// @param[out] ciphertext Encrypted data. Length of the buffer must be, at
 /// least, of `WMESH_CIPHERTEXT_LENGTH(plaintext_length)` bytes.
+/// @param[out] ciphertext_length Number of bytes written to `ciphertext`.
+///
+/// @note Encryption may be done in place by passing
+/// `ciphertext + WMESH_CIPHERTEXT_HEADER_LENGTH` as `plaintext`.
 ///
 /// @return `ESP_OK` if successful.
 esp_err_t wmesh_encrypt_aad(
@@ -138,7 +267,8 @@ esp_err_t wmesh_encrypt_aad(
 	const uint8_t *aad,
 	size_t aad_size,
 
-	uint8_t *ciphertext
+	uint8_t *ciphertext,
+	size_t *ciphertext_length
 );
 
 
@@ -158,11 +288,14 @@ typedef enum {
 /// @brief Decrypts the given data and updates internal state.
 ///
 /// @param[in] ctx Encryption context.
-/// @param[inout] ctr Encryption counter. Incremented when encryption succeeds.
+/// @param[inout] window Sender's replay window. Updated when decryption
+/// succeeds.
+/// @param[in] src Sender address. Used as IV by compact frames.
 /// @param[in] ciphertext Data to decrypt.
 /// @param[in] ciphertext_length Size in bytes of input data.
 /// @param[out] plaintext Decrypted data buffer. Length must be, at least,
 /// `WMESH_PLAINTEXT_LENGTH(ciphertext_length)` bytes long.
+/// @param[out] plaintext_length Number of bytes written to `plaintext`.
 ///
 /// @attention Decrypted data is only valid when `WMESH_DECRYPT_OK` is returned.
 /// Otherwise, its contents are left uninitialized.
@@ -170,32 +303,39 @@ typedef enum {
 /// @return
 /// 	- `WMESH_DECRYPT_OK` if successful.
 ///
-/// 	- `WMESH_DECRYPT_STALE` in case of nonce reuse.
+/// 	- `WMESH_DECRYPT_STALE` in case of nonce reuse, or if the nonce is too
+///			old to be checked.
 ///
 /// 	- `WMESH_DECRYPT_AUTH_ERROR` if the decryption succeeded, but the
 ///			authentication tag didn't match the ciphertext.
 ///
-/// 	- `WMESH_DECRYPT_ERROR` if the ciphertext failed to decrypt.
+/// 	- `WMESH_DECRYPT_ERROR` if the ciphertext failed to decrypt, or is
+///			malformed.
 wmesh_decrypt_status_t wmesh_decrypt(
 	wmesh_encryption_ctx_t *ctx,
-	wmesh_encryption_ctr_t *ctr,
+	wmesh_replay_window_t *window,
+	const wmesh_address_t src,
 
 	const uint8_t *ciphertext,
 	size_t ciphertext_length,
 
-	uint8_t *plaintext
+	uint8_t *plaintext,
+	size_t *plaintext_length
 );
 
 /// @brief Decrypts the given data and updates internal state.
 ///
 /// @param[in] ctx Encryption context.
-/// @param[inout] ctr Encryption counter. Incremented when encryption succeeds.
+/// @param[inout] window Sender's replay window. Updated when decryption
+/// succeeds.
+/// @param[in] src Sender address. Used as IV by compact frames.
 /// @param[in] ciphertext Data to decrypt.
 /// @param[in] ciphertext_length Size in bytes of input data.
 /// @param[in] aad Additional Authenticated Data.
 /// @param[in] aad_size Size in bytes of `aad`.
 /// @param[out] plaintext Decrypted data buffer. Length must be, at least,
 /// `WMESH_PLAINTEXT_LENGTH(ciphertext_length)` bytes long.
+/// @param[out] plaintext_length Number of bytes written to `plaintext`.
 ///
 /// @attention Decrypted data is only valid when `WMESH_DECRYPT_OK` is returned.
 /// Otherwise, its contents are left uninitialized.
@@ -203,15 +343,18 @@ wmesh_decrypt_status_t wmesh_decrypt(
 /// @return
 /// 	- `WMESH_DECRYPT_OK` if successful.
 ///
-/// 	- `WMESH_DECRYPT_STALE` in case of nonce reuse.
+/// 	- `WMESH_DECRYPT_STALE` in case of nonce reuse, or if the nonce is too
+///			old to be checked.
 ///
 /// 	- `WMESH_DECRYPT_AUTH_ERROR` if the decryption succeeded, but the
 ///			authentication tag didn't match the ciphertext.
 ///
-/// 	- `WMESH_DECRYPT_ERROR` if the ciphertext failed to decrypt.
+/// 	- `WMESH_DECRYPT_ERROR` if the ciphertext failed to decrypt, or is
+///			malformed.
 wmesh_decrypt_status_t wmesh_decrypt_aad(
 	wmesh_encryption_ctx_t *ctx,
-	wmesh_encryption_ctr_t *ctr,
+	wmesh_replay_window_t *window,
+	const wmesh_address_t src,
 
 	const uint8_t *ciphertext,
 	size_t ciphertext_length,
@@ -219,8 +362,63 @@ wmesh_decrypt_status_t wmesh_decrypt_aad(
 	const uint8_t *aad,
 	size_t aad_size,
 
-	uint8_t *plaintext
+	uint8_t *plaintext,
+	size_t *plaintext_length
 );
 
 
+/// @brief Encrypts a frame in place.
+///
+/// @param[in] ctx Encryption context.
+/// @param[inout] ctr Encryption counter. Incremented when encryption succeeds.
+/// @param[inout] frame Frame buffer. The plaintext starts at
+/// `frame + WMESH_CIPHERTEXT_HEADER_LENGTH`. Must be, at least,
+/// `WMESH_CIPHERTEXT_LENGTH(plaintext_length)` bytes long.
+/// @param[in] plaintext_length Size in bytes of the plaintext.
+/// @param[out] frame_length Number of bytes of `frame` to send.
+///
+/// @return `ESP_OK` if successful.
+esp_err_t wmesh_encrypt_inplace(
+	wmesh_encryption_ctx_t *ctx,
+	wmesh_encryption_ctr_t *ctr,
+
+	uint8_t *frame,
+	size_t plaintext_length,
+	size_t *frame_length
+);
+
+
+/// @brief Decrypts a frame in place.
+///
+/// @param[in] ctx Encryption context.
+/// @param[inout] window Sender's replay window. Updated when decryption
+/// succeeds.
+/// @param[in] src Sender address. Used as IV by compact frames.
+/// @param[inout] frame Received frame. Overwritten with the plaintext.
+/// @param[in] frame_length Size in bytes of the frame.
+/// @param[out] plaintext Start of the plaintext, inside `frame`.
+/// @param[out] plaintext_length Size in bytes of the plaintext.
+///
+/// @attention Decrypted data is only valid when `WMESH_DECRYPT_OK` is returned.
+///
+/// @return See `wmesh_decrypt_aad`.
+wmesh_decrypt_status_t wmesh_decrypt_inplace(
+	wmesh_encryption_ctx_t *ctx,
+	wmesh_replay_window_t *window,
+	const wmesh_address_t src,
+
+	uint8_t *frame,
+	size_t frame_length,
+
+	uint8_t **plaintext,
+	size_t *plaintext_length
+);
+
+
+/// @brief Initializes a replay window for a peer with no previous messages.
+///
+/// @param[out] window Window to initialize.
+void wmesh_replay_window_init(wmesh_replay_window_t *window);
+
+
 #endif
@@ -0,0 +1,135 @@
+#ifndef WMESH_FRAGMENT_H_
+#define WMESH_FRAGMENT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "wmesh/common.h"
+
+
+/// @brief Maximum number of fragments a message may be split into.
+#define WMESH_FRAGMENT_MAX_COUNT 64
+
+
+/// @brief Prepended to every fragment of a message.
+typedef struct __attribute__((packed)) {
+
+	/// @brief Identifies the message. Unique per sender.
+	uint16_t message_id;
+
+	/// @brief Size in bytes of the complete message.
+	uint16_t total_length;
+
+	/// @brief Position of this fragment's data in the complete message.
+	uint16_t offset;
+
+	/// @brief Fragment number, starting at 0.
+	uint8_t index;
+
+	/// @brief Number of fragments in the message.
+	uint8_t count;
+
+	/// @brief Service the complete message is sent to.
+	wmesh_service_id_t service;
+
+} wmesh_fragment_header_t;
+
+
+/// @brief Message being reassembled.
+typedef struct {
+
+	/// @brief Sender address.
+	wmesh_address_t src;
+
+	/// @brief Message ID, as sent by `src`.
+	uint16_t message_id;
+
+	/// @brief Destination service.
+	wmesh_service_id_t service;
+
+	/// @brief Size in bytes of the complete message.
+	uint16_t length;
+
+	/// @brief Number of fragments in the message.
+	uint8_t count;
+
+	/// @brief Bit `n` is set when fragment `n` has been received.
+	uint64_t received;
+
+	/// @brief Time the last fragment was received, in microseconds.
+	int64_t last_update_us;
+
+	/// @brief Set while the slot holds a message.
+	bool in_use;
+
+	/// @brief Message data.
+	uint8_t data[CONFIG_WMESH_MAX_MESSAGE_SIZE];
+
+} wmesh_reassembly_slot_t;
+
+
+/// @brief Reassembly buffers, one per message being received.
+typedef struct {
+
+	/// @brief Reassembly buffers.
+	wmesh_reassembly_slot_t slots[CONFIG_WMESH_REASSEMBLY_SLOTS];
+
+	/// @brief Number of messages reassembled successfully.
+	uint32_t completed;
+
+	/// @brief Number of incomplete messages dropped after
+	/// `CONFIG_WMESH_REASSEMBLY_TIMEOUT_MS`.
+	uint32_t timeouts;
+
+	/// @brief Number of incomplete messages discarded to make room for a new
+	/// one.
+	uint32_t evicted;
+
+	/// @brief Number of fragments dropped because they were malformed.
+	uint32_t dropped;
+
+} wmesh_reassembly_t;
+
+
+/// @brief Initializes the reassembly buffers.
+///
+/// @param[out] reassembly Buffers to initialize.
+void wmesh_reassembly_init(wmesh_reassembly_t *reassembly);
+
+
+/// @brief Adds a received fragment to its message. Messages are identified
+/// by sender and message ID, so fragments of several messages may arrive
+/// interleaved.
+///
+/// Messages which have not received a fragment in
+/// `CONFIG_WMESH_REASSEMBLY_TIMEOUT_MS` are discarded. If every slot is still
+/// in use, the message which went longest without a fragment is discarded to
+/// make room.
+///
+/// @param[inout] reassembly Reassembly buffers.
+/// @param[in] src Fragment sender.
+/// @param[in] header Fragment header.
+/// @param[in] data Fragment data.
+/// @param[in] data_length Size in bytes of `data`.
+/// @param[in] now_us Current time, in microseconds.
+///
+/// @return Slot holding the complete message, once every fragment has been
+/// received. `NULL` otherwise. The slot must be freed using
+/// `wmesh_reassembly_release`.
+wmesh_reassembly_slot_t *wmesh_reassembly_add(
+	wmesh_reassembly_t *reassembly,
+	const wmesh_address_t src,
+	const wmesh_fragment_header_t *header,
+	const uint8_t *data,
+	size_t data_length,
+	int64_t now_us
+);
+
+
+/// @brief Frees a reassembly slot.
+///
+/// @param[in] slot Slot returned by `wmesh_reassembly_add`.
+void wmesh_reassembly_release(wmesh_reassembly_slot_t *slot);
+
+#endif
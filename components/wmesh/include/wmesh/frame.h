@@ -0,0 +1,103 @@
+#ifndef WMESH_FRAME_H_
+#define WMESH_FRAME_H_
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+#include "wmesh/common.h"
+#include "wmesh/encryption.h"
+#include "wmesh/transport.h"
+
+
+/// @brief Bytes reserved in front of a frame's payload. Holds the encryption
+/// header and the service ID.
+#define WMESH_FRAME_HEADROOM (WMESH_CIPHERTEXT_HEADER_LENGTH + sizeof(wmesh_service_id_t))
+
+/// @brief Bytes reserved after a frame's payload, for the encryption
+/// trailer.
+#define WMESH_FRAME_TAILROOM WMESH_CIPHERTEXT_TRAILER_LENGTH
+
+/// @brief Maximum number of payload bytes a single frame can carry.
+#define WMESH_FRAME_MAX_PAYLOAD (CONFIG_WMESH_FRAME_SIZE - WMESH_FRAME_HEADROOM - WMESH_FRAME_TAILROOM)
+
+/// @brief Maximum number of payload bytes a frame can carry to a peer which
+/// has not negotiated large frames. Fits in an ESP-NOW v1 frame.
+#define WMESH_FRAME_SMALL_PAYLOAD ( \
+	(CONFIG_WMESH_FRAME_SIZE < WMESH_TRANSPORT_SMALL_FRAME_SIZE ? CONFIG_WMESH_FRAME_SIZE : WMESH_TRANSPORT_SMALL_FRAME_SIZE) - \
+	WMESH_FRAME_HEADROOM - WMESH_FRAME_TAILROOM \
+)
+
+
+/// @brief Number of frames in a frame pool. Every open bundle holds a frame
+/// for up to `CONFIG_WMESH_COALESCE_WINDOW_MS`, so those come on top of the
+/// frames available to every other send.
+#define WMESH_FRAME_POOL_FRAMES (CONFIG_WMESH_FRAME_POOL_SIZE + CONFIG_WMESH_COALESCE_BUNDLES)
+
+
+/// @brief Transmit buffer.
+///
+/// Layout is:
+/// |  Encryption header  |  Service  |   Payload   |  Encryption trailer  |
+///
+/// Encryption is done in place, so the payload only has to be written once.
+typedef struct wmesh_frame_t {
+
+	/// @brief Next free frame. Only used while the frame is in the pool.
+	struct wmesh_frame_t *next;
+
+	/// @brief Frame contents.
+	uint8_t data[CONFIG_WMESH_FRAME_SIZE];
+
+} wmesh_frame_t;
+
+
+/// @brief Fixed-size set of preallocated frames.
+typedef struct {
+
+	/// @brief Frame storage.
+	wmesh_frame_t frames[WMESH_FRAME_POOL_FRAMES];
+
+	/// @brief List of available frames.
+	wmesh_frame_t *free_list;
+
+	/// @brief Protects `free_list`.
+	portMUX_TYPE lock;
+
+	/// @brief Number of times a frame was requested while the pool was empty.
+	uint32_t exhausted_count;
+
+} wmesh_frame_pool_t;
+
+
+/// @brief Initializes a frame pool. Every frame is marked as available.
+///
+/// @param[out] pool Pool to initialize.
+void wmesh_frame_pool_init(wmesh_frame_pool_t *pool);
+
+
+/// @brief Takes a frame from the pool.
+///
+/// @param[in] pool Frame pool.
+///
+/// @return Frame, or `NULL` if every frame is in use.
+wmesh_frame_t *wmesh_frame_pool_get(wmesh_frame_pool_t *pool);
+
+
+/// @brief Returns a frame to the pool.
+///
+/// @param[in] pool Frame pool the frame was taken from.
+/// @param[in] frame Frame to return. May be `NULL`.
+void wmesh_frame_pool_put(wmesh_frame_pool_t *pool, wmesh_frame_t *frame);
+
+
+/// @brief Gets the service payload area of a frame.
+///
+/// @param[in] frame Frame.
+///
+/// @return Pointer to the first payload byte. Up to `WMESH_FRAME_MAX_PAYLOAD`
+/// bytes may be written.
+static inline uint8_t *wmesh_frame_payload(wmesh_frame_t *frame) {
+	return frame->data + WMESH_FRAME_HEADROOM;
+}
+
+#endif
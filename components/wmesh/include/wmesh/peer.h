@@ -1,10 +1,15 @@
 #ifndef WMESH_PEER_H_
 #define WMESH_PEER_H_
 
-#include "esp_now.h"
 #include "wmesh/common.h"
 #include "wmesh/encryption.h"
+#include "wmesh/frame.h"
+#include "wmesh/peer_table.h"
+#include "wmesh/rate.h"
+#include "wmesh/reliable.h"
+#include "wmesh/stats.h"
 #include "wmesh/storage.h"
+#include "wmesh/transport.h"
 
 /// @brief Stores a peer's data.
 typedef struct {
@@ -12,18 +17,40 @@ typedef struct {
 	/// @brief Peer's address.
 	wmesh_address_t address;
 
-	/// @brief Last known sequence number.
+	/// @brief Replay protection state. Holds the highest received sequence
+	/// number, plus which of the previous sequence numbers have been received.
 	///
-	/// Any received messages with a sequence number lower than this value are
-	/// discarded.
+	/// Any received messages with a sequence number already seen, or too old
+	/// to fit in the window, are discarded.
 	///
-	/// Automatically increased when a message is received.
-	wmesh_encryption_ctr_t sequence;
+	/// Automatically updated when a message is received.
+	wmesh_replay_window_t window;
+
+	/// @brief Reliable delivery state for frames received from this peer. Not
+	/// persisted.
+	wmesh_reliable_rx_t reliable;
+
+	#if CONFIG_WMESH_RATE_CONTROL
+		/// @brief PHY rate selection for frames sent to this peer. Not
+		/// persisted.
+		wmesh_rate_ctl_t rate;
+	#endif
+
+	/// @brief Traffic counters. Not persisted.
+	wmesh_counters_t counters;
+
+	/// @brief Value of `wmesh_peer_list_t.clock` when a frame from this peer
+	/// was last authenticated. Lowest value is evicted first.
+	uint32_t last_seen;
 
 	/// @brief Used to signal whether this peer's data has changed. Set when
-	/// the peer's sequence number is updated.
+	/// the peer's replay window is updated.
 	bool dirty:1;
 
+	/// @brief Set when the peer accepts frames larger than an ESP-NOW v1
+	/// frame. Persisted.
+	bool large_frames:1;
+
 } wmesh_peer_t;
 
 
@@ -34,33 +61,34 @@ typedef struct {
 void wmesh_peer_new(wmesh_peer_t *peer, const wmesh_address_t address);
 
 
-/// @brief Same as `wmesh_decrypt_aad`. Decrypts and verifies the given
-/// ciphertext.
+/// @brief Same as `wmesh_decrypt_inplace`. Decrypts and verifies a frame
+/// received from the peer, overwriting it with the plaintext.
 ///
-/// @param[inout] peer Peer info. Sequence number is automatically updated.
+/// @param[inout] peer Peer info. Replay window is automatically updated.
 /// @param[in] encryption_ctx Encryption context.
-/// @param[in] ciphertext Input ciphertext.
-/// @param[in] ciphertext_size Ciphertext size in bytes.
-/// @param[out] plaintext Decrypted data. Use `WMESH_PLAINTEXT_LENGTH` to get
-/// the minimum length for the buffer.
+/// @param[inout] frame Received frame.
+/// @param[in] frame_size Frame size in bytes.
+/// @param[out] plaintext Start of the plaintext, inside `frame`.
+/// @param[out] plaintext_length Size in bytes of the plaintext.
 ///
 /// @return See `wmesh_decrypt_aad`.
-wmesh_decrypt_status_t wmesh_peer_decrypt(
+wmesh_decrypt_status_t wmesh_peer_decrypt_inplace(
 	wmesh_peer_t *peer,
 	wmesh_encryption_ctx_t *encryption_ctx,
 
-	const uint8_t *ciphertext,
-	size_t ciphertext_size,
+	uint8_t *frame,
+	size_t frame_size,
 
-	uint8_t *plaintext
+	uint8_t **plaintext,
+	size_t *plaintext_length
 );
 
 
 /// @brief Saves peer info to persistent storage. Allows saving a peer's
-/// sequence number between reboots, preventing replay attacks.
+/// replay window between reboots, preventing replay attacks.
 ///
 /// @param[in] peer Peer data.
-/// @param[in] storage_handle Storage handle.
+/// @param[inout] table Peer table.
 ///
 /// @return See `wmesh_peer_store_result_t`.
 ///
@@ -69,15 +97,16 @@ wmesh_decrypt_status_t wmesh_peer_decrypt(
 /// - `WMESH_STORAGE_ERROR`: Error.
 wmesh_storage_result_t wmesh_peer_store(
 	wmesh_peer_t *peer,
-	wmesh_storage_handle_t *storage_handle
+	wmesh_peer_table_t *table
 );
 
 
-/// @brief Tries to restore a peer's data.
+/// @brief Tries to restore a peer's data. Peers stored in the old format,
+/// under their own key, are moved into the peer table.
 ///
 /// @param[out] peer Loaded peer data. Only valid when `WMESH_PEER_LOAD_OK` is
 /// returned.
-/// @param[in] storage_handle Storage handle.
+/// @param[inout] table Peer table.
 /// @param[in] address Peer address.
 ///
 /// @return See `wmesh_peer_load_result_t`.
@@ -89,12 +118,77 @@ wmesh_storage_result_t wmesh_peer_store(
 /// - `WMESH_STORAGE_ERROR`: Error.
 wmesh_storage_result_t wmesh_peer_load(
 	wmesh_peer_t *peer,
-	wmesh_storage_handle_t *storage_handle,
+	wmesh_peer_table_t *table,
 	const wmesh_address_t address
 );
 
 
+/// @brief Peer registered in the ESP-NOW driver.
+typedef struct {
+
+	/// @brief Registered address.
+	wmesh_address_t address;
+
+	/// @brief Value of `wmesh_peer_registry_t.clock` when this entry was last
+	/// used. Lowest value is evicted first.
+	uint32_t last_used;
+
+	/// @brief Set when the entry holds a registered peer.
+	bool in_use:1;
+
+} wmesh_peer_registration_t;
+
+
+/// @brief Keeps track of the peers registered in the ESP-NOW driver.
+///
+/// Peers stay registered between sends, and are only removed when the
+/// driver's peer table is full.
+typedef struct {
+
+	/// @brief Registered peers.
+	wmesh_peer_registration_t entries[CONFIG_WMESH_REGISTERED_PEER_COUNT];
+
+	/// @brief Increased every time a peer is used.
+	uint32_t clock;
+
+	/// @brief Number of sends to an already registered peer.
+	uint32_t hits;
+
+	/// @brief Number of sends which required registering a peer.
+	uint32_t misses;
+
+	/// @brief Number of peers removed from the driver to make room.
+	uint32_t evictions;
+
+} wmesh_peer_registry_t;
+
+
+/// @brief Number of buckets in the peer list's hash index. Kept at twice the
+/// list size so probe sequences stay short.
+#define WMESH_PEER_INDEX_SIZE (2 * CONFIG_WMESH_PEER_LIST_SIZE)
+
+
+/// @brief Peer removed from the list to make room.
+typedef struct {
+
+	/// @brief Peer, with its whole state. Its `dirty` flag is set until its
+	/// replay window is handed to a flush.
+	wmesh_peer_t peer;
+
+	/// @brief Set while the handed replay window may not be written yet,
+	/// including a window handed before the peer was parked. Only peers
+	/// neither dirty nor flushing may be dropped.
+	bool flushing:1;
+
+} wmesh_parked_peer_t;
+
+
 /// @brief Cotains a list of peers.
+///
+/// The list is a cache over the stored peer table. When full, the least
+/// recently seen peer is removed and parked, until its replay window is
+/// written back to storage by the next flush. Parked peers received from
+/// again get their whole state back, others are reloaded from storage.
 typedef struct {
 
 	/// @brief Number of stored peers.
@@ -102,16 +196,109 @@ typedef struct {
 
 	/// @brief
 	wmesh_peer_t peers[CONFIG_WMESH_PEER_LIST_SIZE];
+
+	/// @brief Open-addressing hash index over `peers`, keyed on the peer
+	/// address. Each bucket holds the position in `peers` plus one, or 0 if
+	/// empty.
+	uint16_t index[WMESH_PEER_INDEX_SIZE];
+
+	/// @brief Peers removed from `peers`, oldest first.
+	wmesh_parked_peer_t parked[CONFIG_WMESH_PEER_PARKED_COUNT];
+
+	/// @brief Number of peers in `parked`.
+	size_t parked_count;
+
+	/// @brief Peers registered in the ESP-NOW driver.
+	wmesh_peer_registry_t registry;
+
+	/// @brief Increased every time a peer is seen.
+	uint32_t clock;
+
+	/// @brief Number of peers removed to make room.
+	uint32_t evictions;
+
+	/// @brief Number of peers loaded back from storage after being evicted,
+	/// or not preloaded.
+	uint32_t reloads;
+
+	/// @brief Number of parked peers added back to the list.
+	uint32_t unparked;
+
+	/// @brief Number of parked peers dropped once stored, losing their
+	/// statistics and reliable delivery state.
+	uint32_t dropped;
+
+	/// @brief Set when every peer in the stored peer table has been loaded
+	/// into the list, so unknown peers need no table lookup. Cleared when a
+	/// peer is evicted.
+	bool preloaded;
+
+	/// @brief Set when every peer in range accepts large frames, so they
+	/// may be broadcast.
+	bool broadcast_large_frames;
 } wmesh_peer_list_t;
 
 
+/// @brief Loads every peer in the stored peer table into the list.
+///
+/// @param[inout] list Peer list.
+/// @param[inout] table Peer table.
+///
+/// @return `WMESH_STORAGE_OK` or error. Peers loaded before an error are kept.
+wmesh_storage_result_t wmesh_peer_list_preload(
+	wmesh_peer_list_t *list,
+	wmesh_peer_table_t *table
+);
+
+
 /// @brief Stores information of every peer.
 ///
 /// @param[in] list List of peers to save.
-/// @param[in] storage_handle Storage handle.
+/// @param[inout] table Peer table.
 wmesh_storage_result_t wmesh_peer_list_store(
 	wmesh_peer_list_t *list,
-	wmesh_storage_handle_t *storage_handle
+	wmesh_peer_table_t *table
+);
+
+
+/// @brief Number of records `wmesh_peer_list_collect` may return.
+#define WMESH_PEER_RECORD_COUNT (CONFIG_WMESH_PEER_LIST_SIZE + CONFIG_WMESH_PEER_PARKED_COUNT)
+
+
+/// @brief Copies every changed peer, parked or not, into a list of records,
+/// and marks them as stored. Lets the records be written later, without
+/// access to the list.
+///
+/// Must only be called once the records of the previous call were written,
+/// or handed back as left over. Parked peers whose records were written may
+/// then be dropped.
+///
+/// @param[inout] list Peer list.
+/// @param[inout] records Records. Must have room for
+/// `WMESH_PEER_RECORD_COUNT` records.
+/// @param[in] count Number of records already in `records`, left over from
+/// a failed `wmesh_peer_records_store`. They are kept, unless outdated.
+///
+/// @return Number of records.
+size_t wmesh_peer_list_collect(
+	wmesh_peer_list_t *list,
+	wmesh_peer_table_record_t *records,
+	size_t count
+);
+
+
+/// @brief Writes records to the peer table, one update per shard.
+///
+/// @param[inout] table Peer table.
+/// @param[inout] records Records to write. Records which could not be
+/// written are moved to the front.
+/// @param[in] count Number of records.
+///
+/// @return Number of records which could not be written.
+size_t wmesh_peer_records_store(
+	wmesh_peer_table_t *table,
+	wmesh_peer_table_record_t *records,
+	size_t count
 );
 
 
@@ -127,17 +314,80 @@ wmesh_peer_t* wmesh_peer_list_get(
 );
 
 
-/// @brief Searches for a peer in the list. If not found, creates one.
+/// @brief Searches for a parked peer.
+///
+/// @param[in] list Peer list.
+/// @param[in] address Address to search.
+///
+/// @return Pointer to the parked peer, valid until the list changes, or
+/// `NULL` if not found.
+const wmesh_peer_t* wmesh_peer_list_get_parked(
+	const wmesh_peer_list_t *list,
+	const wmesh_address_t address
+);
+
+
+/// @brief Checks whether a peer can be evicted without storing anything,
+/// that is whether the list has room, or a parked peer may be dropped.
+///
+/// @param[in] list Peer list.
+///
+/// @return `true` if `wmesh_peer_list_insert` succeeds without a table.
+bool wmesh_peer_list_can_insert(const wmesh_peer_list_t *list);
+
+
+/// @brief Searches for a peer in the list. If not found, loads or creates
+/// one, and inserts it with `wmesh_peer_list_insert`.
 ///
 /// @param[in] list Peer list.
 /// @param[in] address Address to search.
-/// @param[in] storage_handle Storage handle.
+/// @param[inout] table Peer table.
 ///
 /// @return Pointer to peer, or `NULL` in case of an error.
 wmesh_peer_t* wmesh_peer_list_get_or_create(
 	wmesh_peer_list_t *list,
 	const wmesh_address_t address,
-	wmesh_storage_handle_t *storage_handle
+	wmesh_peer_table_t *table
+);
+
+
+/// @brief Copies a parked peer, or loads a peer missing from the list from
+/// storage, or creates a new one if it is unknown. The peer is not added to
+/// the list.
+///
+/// @param[in] list Peer list.
+/// @param[in] address Peer address.
+/// @param[inout] table Peer table.
+/// @param[out] peer Peer data. Valid unless `WMESH_STORAGE_ERROR` is returned.
+///
+/// @return `WMESH_STORAGE_OK` if the peer was parked or found in storage,
+/// `WMESH_STORAGE_NOT_FOUND` if it is new, or `WMESH_STORAGE_ERROR`.
+wmesh_storage_result_t wmesh_peer_list_fetch(
+	wmesh_peer_list_t *list,
+	const wmesh_address_t address,
+	wmesh_peer_table_t *table,
+	wmesh_peer_t *peer
+);
+
+
+/// @brief Adds a peer missing from the list, replacing its parked copy if
+/// any. If the list is full, the least recently seen peer is removed and
+/// parked. Pointers to the removed peer become invalid.
+///
+/// To make room in `parked`, the oldest parked peer already stored is
+/// dropped. If every parked peer still waits for a flush, the oldest one is
+/// written to `table` instead.
+///
+/// @param[in] list Peer list.
+/// @param[in] peer Peer to add. Copied into the list.
+/// @param[inout] table Peer table, or `NULL` to never write to storage.
+///
+/// @return Pointer inside the list to the peer, or `NULL` if a parked peer
+/// had to be written and couldn't be.
+wmesh_peer_t* wmesh_peer_list_insert(
+	wmesh_peer_list_t *list,
+	const wmesh_peer_t *peer,
+	wmesh_peer_table_t *table
 );
 
 
@@ -152,4 +402,55 @@ esp_err_t wmesh_peer_list_add(
 	wmesh_peer_t peer
 );
 
+
+/// @brief Marks a peer as the most recently seen, so it is evicted last.
+///
+/// @param[in] list Peer list.
+/// @param[inout] peer Peer inside the list.
+void wmesh_peer_list_touch(wmesh_peer_list_t *list, wmesh_peer_t *peer);
+
+
+
+/// @brief Makes sure an address is registered in the ESP-NOW driver. If the
+/// driver's peer table is full, the least recently used peer is removed. A
+/// newly registered peer in the list is set to its current rate.
+///
+/// @param[in] list Peer list.
+/// @param[in] address Address to register.
+///
+/// @return `ESP_OK` or error.
+esp_err_t wmesh_peer_list_register(
+	wmesh_peer_list_t *list,
+	const wmesh_address_t address
+);
+
+
+/// @brief Sets whether a peer accepts large frames. Stored with the peer, so
+/// it is kept once the peer is evicted or the device restarts.
+///
+/// @param[in] list Peer list.
+/// @param[in] address Peer address, or `wmesh_broadcast_address`.
+/// @param[in] enabled Whether large frames may be sent to the peer.
+///
+/// @return `ESP_OK`, or `ESP_ERR_NOT_FOUND` if the peer is neither in the
+/// list nor parked.
+esp_err_t wmesh_peer_list_set_large_frames(
+	wmesh_peer_list_t *list,
+	const wmesh_address_t address,
+	bool enabled
+);
+
+
+/// @brief Gets the maximum payload of a frame sent to a peer.
+///
+/// @param[in] list Peer list.
+/// @param[in] address Peer address.
+///
+/// @return `WMESH_FRAME_MAX_PAYLOAD` if the peer accepts large frames,
+/// `WMESH_FRAME_SMALL_PAYLOAD` otherwise.
+size_t wmesh_peer_list_max_payload(
+	const wmesh_peer_list_t *list,
+	const wmesh_address_t address
+);
+
 #endif
@@ -0,0 +1,154 @@
+#ifndef WMESH_PEER_TABLE_H_
+#define WMESH_PEER_TABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "wmesh/common.h"
+#include "wmesh/encryption.h"
+#include "wmesh/storage.h"
+
+
+/// @brief Current peer table format. Shards of version 1, without record
+/// flags, are still read.
+#define WMESH_PEER_TABLE_VERSION 2
+
+
+/// @brief Set in `wmesh_peer_table_record_t.flags` when the peer accepts
+/// large frames.
+#define WMESH_PEER_TABLE_LARGE_FRAMES 0x01
+
+
+/// @brief Stored at the start of every peer table shard.
+typedef struct __attribute__((packed)) {
+
+	/// @brief Format version. Shards with a different version are ignored.
+	uint8_t version;
+
+	/// @brief Size in bytes of each record. Changes with
+	/// `CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH`.
+	uint8_t record_size;
+
+	/// @brief Number of records following the header.
+	uint16_t count;
+
+} wmesh_peer_table_header_t;
+
+
+/// @brief Stored replay window of a single peer.
+typedef struct __attribute__((packed)) {
+
+	/// @brief Peer address. Records are sorted by address.
+	wmesh_address_t address;
+
+	/// @brief See `wmesh_replay_window_t.last`.
+	wmesh_encryption_ctr_t last;
+
+	/// @brief See `wmesh_replay_window_t.bitmap`.
+	uint64_t bitmap;
+
+	/// @brief `WMESH_PEER_TABLE_*` flags.
+	uint8_t flags;
+
+} wmesh_peer_table_record_t;
+
+
+/// @brief Gets the shard a peer is stored in.
+///
+/// @param[in] address Peer address.
+///
+/// @return Shard number, below `CONFIG_WMESH_PEER_TABLE_SHARDS`.
+static inline size_t wmesh_peer_table_shard(const wmesh_address_t address) {
+	return wmesh_address_hash(address) % CONFIG_WMESH_PEER_TABLE_SHARDS;
+}
+
+
+/// @brief Access to the stored peer table. Keeps the last used shard in
+/// memory, so consecutive lookups and updates in a shard only read it once.
+typedef struct {
+
+	/// @brief Storage holding the table.
+	wmesh_storage_handle_t *storage;
+
+	/// @brief Cached shard, as stored: a header followed by the records.
+	/// `NULL` if the shard does not exist.
+	uint8_t *blob;
+
+	/// @brief Number of the cached shard, or `SIZE_MAX` if none.
+	size_t shard;
+
+	/// @brief Number of reads served from the cached shard.
+	uint32_t hits;
+
+	/// @brief Number of reads which had to load a shard from storage.
+	uint32_t misses;
+
+} wmesh_peer_table_t;
+
+
+/// @brief Sets up access to the peer table.
+///
+/// @param[out] table Peer table.
+/// @param[in] storage Storage handle. Must stay open while the table is used.
+void wmesh_peer_table_init(wmesh_peer_table_t *table, wmesh_storage_handle_t *storage);
+
+
+/// @brief Frees the cached shard.
+///
+/// @param[inout] table Peer table.
+void wmesh_peer_table_free(wmesh_peer_table_t *table);
+
+
+/// @brief Loads every record of a shard.
+///
+/// @param[inout] table Peer table.
+/// @param[in] shard Shard number.
+/// @param[out] records Sorted records. Owned by the table, and only valid
+/// until the next call on it. Only valid when `WMESH_STORAGE_OK` is returned.
+/// @param[out] count Number of records.
+///
+/// @return
+/// - `WMESH_STORAGE_OK`: Shard loaded.
+///
+/// - `WMESH_STORAGE_NOT_FOUND`: The shard does not exist, or was written in
+/// an incompatible format.
+///
+/// - `WMESH_STORAGE_ERROR`: Error.
+wmesh_storage_result_t wmesh_peer_table_read(
+	wmesh_peer_table_t *table,
+	size_t shard,
+	const wmesh_peer_table_record_t **records,
+	size_t *count
+);
+
+
+/// @brief Merges updated records into a shard, and writes it back.
+///
+/// @param[inout] table Peer table.
+/// @param[in] shard Shard number.
+/// @param[inout] updates Records to add or replace. Sorted in place.
+/// @param[in] update_count Number of records in `updates`.
+///
+/// @return `WMESH_STORAGE_OK` or error.
+wmesh_storage_result_t wmesh_peer_table_update(
+	wmesh_peer_table_t *table,
+	size_t shard,
+	wmesh_peer_table_record_t *updates,
+	size_t update_count
+);
+
+
+/// @brief Searches a sorted list of records.
+///
+/// @param[in] records Sorted records.
+/// @param[in] count Number of records.
+/// @param[in] address Address to search.
+///
+/// @return Matching record, or `NULL` if not found.
+const wmesh_peer_table_record_t *wmesh_peer_table_find(
+	const wmesh_peer_table_record_t *records,
+	size_t count,
+	const wmesh_address_t address
+);
+
+#endif
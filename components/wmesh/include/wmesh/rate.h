@@ -0,0 +1,135 @@
+#ifndef WMESH_RATE_H_
+#define WMESH_RATE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+
+/// @brief PHY rates a peer may be sent frames at, from slowest to fastest.
+typedef enum {
+	WMESH_RATE_LORA_250K,
+	WMESH_RATE_LORA_500K,
+	WMESH_RATE_1M,
+	WMESH_RATE_2M,
+	WMESH_RATE_5M5,
+	WMESH_RATE_6M,
+	WMESH_RATE_9M,
+	WMESH_RATE_11M,
+	WMESH_RATE_12M,
+	WMESH_RATE_18M,
+	WMESH_RATE_24M,
+	WMESH_RATE_36M,
+	WMESH_RATE_48M,
+	WMESH_RATE_54M,
+
+	WMESH_RATE_COUNT,
+} wmesh_rate_t;
+
+
+/// @brief Slowest rate rate control may choose.
+#if CONFIG_WMESH_RATE_LONG_RANGE
+	#define WMESH_RATE_LOWEST WMESH_RATE_LORA_250K
+#else
+	#define WMESH_RATE_LOWEST WMESH_RATE_1M
+#endif
+
+
+/// @brief Rate used until a peer has been measured. Matches the driver's
+/// default.
+#define WMESH_RATE_DEFAULT WMESH_RATE_1M
+
+
+/// @brief Measured delivery of a single rate.
+typedef struct {
+
+	/// @brief Moving average of the share of frames delivered, in 1/1000.
+	/// Only valid when `measured` is set.
+	uint16_t probability;
+
+	/// @brief Set once a whole evaluation window has been sent at this rate.
+	bool measured:1;
+
+} wmesh_rate_stats_t;
+
+
+/// @brief Rate control state of a single peer.
+///
+/// Frames are sent at `current` for `CONFIG_WMESH_RATE_WINDOW` frames. Then,
+/// the rate with the highest expected throughput (delivery probability times
+/// bit rate) is chosen. Every `CONFIG_WMESH_RATE_SAMPLE_INTERVAL`
+/// evaluations, the next faster rate is sampled instead.
+typedef struct {
+
+	/// @brief Delivery statistics of every rate.
+	wmesh_rate_stats_t stats[WMESH_RATE_COUNT];
+
+	/// @brief Rate frames are being sent at.
+	wmesh_rate_t current;
+
+	/// @brief Frames sent at `current` in this evaluation window.
+	uint8_t attempts;
+
+	/// @brief Frames delivered at `current` in this evaluation window.
+	uint8_t successes;
+
+	/// @brief Evaluations since a faster rate was last sampled.
+	uint8_t evaluations;
+
+	/// @brief Moving average of the received signal strength, in dBm. Only
+	/// valid when `has_rssi` is set.
+	int8_t rssi;
+
+	/// @brief Set once a frame has been received from the peer.
+	bool has_rssi:1;
+
+	/// @brief Set once a frame has been sent to the peer. From then on, the
+	/// rate is only chosen from send results.
+	bool started:1;
+
+} wmesh_rate_ctl_t;
+
+
+/// @brief Initializes a peer's rate control state.
+///
+/// @param[out] ctl Rate control state.
+void wmesh_rate_init(wmesh_rate_ctl_t *ctl);
+
+
+/// @brief Records the signal strength of a frame received from the peer.
+/// Until a frame has been sent to the peer, the rate is chosen from it.
+///
+/// @param[inout] ctl Rate control state.
+/// @param[in] rssi Received signal strength, in dBm.
+///
+/// @return `true` if `ctl->current` changed.
+bool wmesh_rate_rssi(wmesh_rate_ctl_t *ctl, int8_t rssi);
+
+
+/// @brief Records the result of a frame sent to the peer.
+///
+/// @param[inout] ctl Rate control state.
+/// @param[in] success Whether the peer acknowledged the frame.
+///
+/// @return `true` if an evaluation window ended, and `ctl->current` should
+/// be applied again.
+bool wmesh_rate_feedback(wmesh_rate_ctl_t *ctl, bool success);
+
+
+/// @brief Gets the bit rate of a rate.
+///
+/// @param[in] rate Rate.
+///
+/// @return Bit rate in Kbps.
+uint16_t wmesh_rate_kbps(wmesh_rate_t rate);
+
+
+/// @brief Gets the typical receiver sensitivity of a rate.
+///
+/// @param[in] rate Rate.
+///
+/// @return Weakest signal a frame sent at the rate is usually received at,
+/// in dBm.
+int8_t wmesh_rate_sensitivity(wmesh_rate_t rate);
+
+#endif
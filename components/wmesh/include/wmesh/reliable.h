@@ -0,0 +1,295 @@
+#ifndef WMESH_RELIABLE_H_
+#define WMESH_RELIABLE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "wmesh/common.h"
+#include "wmesh/frame.h"
+
+
+/// @brief Number of frames after the cumulative acknowledgement which can be
+/// acknowledged selectively.
+#define WMESH_RELIABLE_SACK_BITS 32
+
+#if CONFIG_WMESH_RELIABLE_WINDOW > WMESH_RELIABLE_SACK_BITS
+	#error Reliable send window must not exceed the selective acknowledgement size.
+#endif
+
+
+/// @brief Prepended to every reliable frame.
+typedef struct __attribute__((packed)) {
+
+	/// @brief Chosen randomly by the sender every time it starts sending to a
+	/// destination. Lets the receiver detect that sequence numbers were reset.
+	uint32_t session;
+
+	/// @brief Frame sequence number, starting at 0 for every session.
+	uint16_t seq;
+
+	/// @brief Service the payload is sent to.
+	wmesh_service_id_t service;
+
+} wmesh_reliable_header_t;
+
+
+/// @brief Acknowledgement, sent back for every reliable frame received.
+typedef struct __attribute__((packed)) {
+
+	/// @brief Session being acknowledged.
+	uint32_t session;
+
+	/// @brief Every frame before this sequence number has been received.
+	uint16_t next;
+
+	/// @brief Bit `n` is set when frame `next + 1 + n` has been received.
+	uint32_t sack;
+
+} wmesh_reliable_ack_t;
+
+
+/// @brief Maximum payload of a reliable frame.
+#define WMESH_RELIABLE_MAX_PAYLOAD (WMESH_FRAME_MAX_PAYLOAD - sizeof(wmesh_reliable_header_t))
+
+
+/// @brief Frame waiting to be acknowledged.
+typedef struct {
+
+	/// @brief Time at which the frame is retransmitted, in microseconds.
+	int64_t deadline_us;
+
+	/// @brief Time the frame was first sent, in microseconds.
+	int64_t sent_us;
+
+	/// @brief Number of bytes in `data`.
+	uint16_t length;
+
+	/// @brief Number of times the frame has been retransmitted.
+	uint8_t retries;
+
+	/// @brief Set while the frame is in flight.
+	bool in_use;
+
+	/// @brief Reliable header, followed by the payload.
+	uint8_t data[WMESH_FRAME_MAX_PAYLOAD];
+
+} wmesh_reliable_entry_t;
+
+
+/// @brief Reliable send state towards a single destination.
+typedef struct {
+
+	/// @brief Destination address.
+	wmesh_address_t dest;
+
+	/// @brief Current session.
+	uint32_t session;
+
+	/// @brief Sequence number of the next frame.
+	uint16_t next_seq;
+
+	/// @brief Set while the channel is assigned to `dest`.
+	bool in_use;
+
+	/// @brief Set when a frame is dropped after too many retransmissions.
+	/// Cleared by the owner once reported.
+	bool lost;
+
+	/// @brief Smoothed round-trip time, in microseconds. 0 until the first
+	/// sample is taken.
+	uint32_t srtt_us;
+
+	/// @brief Round-trip time variation, in microseconds.
+	uint32_t rttvar_us;
+
+	/// @brief Current retransmission timeout, in microseconds.
+	uint32_t rto_us;
+
+	/// @brief Frames in flight, indexed by sequence number modulo the window
+	/// size.
+	wmesh_reliable_entry_t entries[CONFIG_WMESH_RELIABLE_WINDOW];
+
+} wmesh_reliable_channel_t;
+
+
+/// @brief Reliable send state.
+typedef struct {
+
+	/// @brief Send channels, one per destination.
+	wmesh_reliable_channel_t channels[CONFIG_WMESH_RELIABLE_CHANNELS];
+
+	/// @brief Number of frames sent for the first time.
+	uint32_t sent;
+
+	/// @brief Number of retransmissions.
+	uint32_t retransmissions;
+
+	/// @brief Number of frames acknowledged.
+	uint32_t acked;
+
+	/// @brief Number of frames dropped after
+	/// `CONFIG_WMESH_RELIABLE_MAX_RETRIES` retransmissions.
+	uint32_t failed;
+
+} wmesh_reliable_tx_t;
+
+
+/// @brief Reliable receive state for a single sender.
+typedef struct {
+
+	/// @brief Session being received.
+	uint32_t session;
+
+	/// @brief Lowest sequence number not received yet.
+	uint16_t next;
+
+	/// @brief Bit `n` is set when frame `next + 1 + n` has been received.
+	uint32_t received;
+
+	/// @brief Set once the first frame of `session` has been received.
+	bool active;
+
+} wmesh_reliable_rx_t;
+
+
+/// @brief Initializes the reliable send state.
+///
+/// @param[out] tx State to initialize.
+void wmesh_reliable_tx_init(wmesh_reliable_tx_t *tx);
+
+
+/// @brief Finds the channel to a destination.
+///
+/// @param[in] tx Reliable send state.
+/// @param[in] dest Destination address.
+/// @param[in] create If set, and no channel exists, a new session is started
+/// on a free channel. Channels with no frames in flight are reused if
+/// necessary.
+///
+/// @return Channel, or `NULL` if not found or every channel is busy.
+wmesh_reliable_channel_t *wmesh_reliable_tx_channel(
+	wmesh_reliable_tx_t *tx,
+	const wmesh_address_t dest,
+	bool create
+);
+
+
+/// @brief Queues a frame on a channel.
+///
+/// @param[inout] tx Reliable send state.
+/// @param[inout] channel Channel.
+/// @param[in] service Destination service.
+/// @param[in] iov Payload segments. Their total size must not exceed
+/// `WMESH_RELIABLE_MAX_PAYLOAD`.
+/// @param[in] iov_count Number of segments.
+/// @param[in] now_us Current time, in microseconds.
+///
+/// @return Entry to send, or `NULL` if the window is full.
+wmesh_reliable_entry_t *wmesh_reliable_channel_push(
+	wmesh_reliable_tx_t *tx,
+	wmesh_reliable_channel_t *channel,
+	wmesh_service_id_t service,
+	const wmesh_iovec_t *iov,
+	size_t iov_count,
+	int64_t now_us
+);
+
+
+/// @brief Processes an acknowledgement. Acknowledged frames are removed from
+/// the window, and the retransmission timeout is updated from frames which
+/// were not retransmitted.
+///
+/// @param[inout] tx Reliable send state.
+/// @param[inout] channel Channel the acknowledgement was received on.
+/// @param[in] ack Acknowledgement.
+/// @param[in] now_us Current time, in microseconds.
+///
+/// @return Number of frames removed from the window.
+size_t wmesh_reliable_channel_ack(
+	wmesh_reliable_tx_t *tx,
+	wmesh_reliable_channel_t *channel,
+	const wmesh_reliable_ack_t *ack,
+	int64_t now_us
+);
+
+
+/// @brief Gets the next frame whose retransmission timer has expired. Frames
+/// which exceed `CONFIG_WMESH_RELIABLE_MAX_RETRIES` are dropped.
+///
+/// The frame must then be passed to `wmesh_reliable_entry_rearm`.
+///
+/// @param[inout] tx Reliable send state.
+/// @param[inout] channel Channel.
+/// @param[in] now_us Current time, in microseconds.
+///
+/// @return Entry to retransmit, or `NULL` if none.
+wmesh_reliable_entry_t *wmesh_reliable_channel_expired(
+	wmesh_reliable_tx_t *tx,
+	wmesh_reliable_channel_t *channel,
+	int64_t now_us
+);
+
+
+/// @brief Restarts the timer of a frame returned by
+/// `wmesh_reliable_channel_expired`.
+///
+/// @param[inout] tx Reliable send state.
+/// @param[in] channel Channel.
+/// @param[inout] entry Expired frame.
+/// @param[in] sent Whether the frame was retransmitted. If so, the retry is
+/// counted, and the timer backs off exponentially. Otherwise the frame is
+/// tried again shortly, without counting a retry.
+/// @param[in] now_us Current time, in microseconds.
+void wmesh_reliable_entry_rearm(
+	wmesh_reliable_tx_t *tx,
+	const wmesh_reliable_channel_t *channel,
+	wmesh_reliable_entry_t *entry,
+	bool sent,
+	int64_t now_us
+);
+
+
+/// @brief Checks whether a channel has frames in flight.
+///
+/// @param[in] channel Channel.
+///
+/// @return `true` if every frame has been acknowledged or dropped.
+bool wmesh_reliable_channel_idle(const wmesh_reliable_channel_t *channel);
+
+
+/// @brief Gets the earliest retransmission deadline.
+///
+/// @param[in] tx Reliable send state.
+///
+/// @return Deadline in microseconds, or `INT64_MAX` if nothing is in flight.
+int64_t wmesh_reliable_tx_next_deadline(const wmesh_reliable_tx_t *tx);
+
+
+/// @brief Initializes the reliable receive state of a peer.
+///
+/// @param[out] rx State to initialize.
+void wmesh_reliable_rx_init(wmesh_reliable_rx_t *rx);
+
+
+/// @brief Records a received reliable frame.
+///
+/// The first frame received from a session may not be its first frame, for
+/// instance if that one was lost, or if the receive state was discarded
+/// mid-session. Reception then starts from the oldest frame the sender may
+/// still have in flight.
+///
+/// @param[inout] rx Receive state of the sender.
+/// @param[in] header Frame header.
+/// @param[out] ack Acknowledgement to send back. Always filled, even for
+/// duplicates, since the previous acknowledgement may have been lost.
+///
+/// @return `true` if the frame has not been received before, and must be
+/// delivered. Frames may be delivered out of order.
+bool wmesh_reliable_rx_accept(
+	wmesh_reliable_rx_t *rx,
+	const wmesh_reliable_header_t *header,
+	wmesh_reliable_ack_t *ack
+);
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef WMESH_RING_H_
+#define WMESH_RING_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "wmesh/common.h"
+
+
+#if (CONFIG_WMESH_RX_QUEUE_LENGTH & (CONFIG_WMESH_RX_QUEUE_LENGTH - 1)) != 0
+	#error Receive queue length must be a power of two.
+#endif
+
+
+/// @brief Received frame, waiting to be processed.
+typedef struct {
+
+	/// @brief Sender address.
+	wmesh_address_t src;
+
+	/// @brief Number of valid bytes in `data`.
+	uint16_t length;
+
+	/// @brief Received signal strength, in dBm.
+	int8_t rssi;
+
+	/// @brief Raw frame, as received from ESP-NOW. Decrypted in place by the
+	/// consumer.
+	uint8_t data[CONFIG_WMESH_FRAME_SIZE];
+
+} wmesh_rx_slot_t;
+
+
+/// @brief Receive path statistics.
+typedef struct {
+
+	/// @brief Frames queued for processing.
+	uint32_t queued;
+
+	/// @brief Frames dropped because the queue was full.
+	uint32_t overflows;
+
+	/// @brief Frames dropped because they were larger than a slot.
+	uint32_t oversized;
+
+	/// @brief Longest time spent in the ESP-NOW receive callback, in
+	/// microseconds.
+	uint32_t callback_max_us;
+
+	/// @brief Total time spent in the ESP-NOW receive callback, in
+	/// microseconds.
+	uint64_t callback_total_us;
+
+} wmesh_rx_stats_t;
+
+
+/// @brief Single-producer, single-consumer queue of received frames.
+///
+/// The producer (ESP-NOW receive callback) only writes `head`, and the
+/// consumer (mesh receive task) only writes `tail`, so no locking is needed.
+typedef struct {
+
+	/// @brief Frame storage.
+	wmesh_rx_slot_t slots[CONFIG_WMESH_RX_QUEUE_LENGTH];
+
+	/// @brief Number of frames ever queued. Written by the producer.
+	atomic_uint_least32_t head;
+
+	/// @brief Number of frames ever processed. Written by the consumer.
+	atomic_uint_least32_t tail;
+
+	/// @brief Statistics. Written by the producer.
+	wmesh_rx_stats_t stats;
+
+} wmesh_rx_ring_t;
+
+
+/// @brief Initializes an empty ring.
+///
+/// @param[out] ring Ring to initialize.
+void wmesh_rx_ring_init(wmesh_rx_ring_t *ring);
+
+
+/// @brief Gets the next free slot. Producer only.
+///
+/// @param[in] ring Ring.
+///
+/// @return Slot to fill, or `NULL` if the ring is full. The slot is not
+/// visible to the consumer until `wmesh_rx_ring_commit` is called.
+wmesh_rx_slot_t *wmesh_rx_ring_reserve(wmesh_rx_ring_t *ring);
+
+
+/// @brief Publishes the slot returned by `wmesh_rx_ring_reserve`. Producer
+/// only.
+///
+/// @param[in] ring Ring.
+void wmesh_rx_ring_commit(wmesh_rx_ring_t *ring);
+
+
+/// @brief Gets the oldest queued slot. Consumer only.
+///
+/// @param[in] ring Ring.
+///
+/// @return Slot, or `NULL` if the ring is empty. The slot stays valid until
+/// `wmesh_rx_ring_release` is called.
+wmesh_rx_slot_t *wmesh_rx_ring_peek(wmesh_rx_ring_t *ring);
+
+
+/// @brief Frees the slot returned by `wmesh_rx_ring_peek`. Consumer only.
+///
+/// @param[in] ring Ring.
+void wmesh_rx_ring_release(wmesh_rx_ring_t *ring);
+
+#endif
@@ -0,0 +1,267 @@
+#ifndef WMESH_ROUTING_H_
+#define WMESH_ROUTING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "wmesh/common.h"
+
+
+#if CONFIG_WMESH_ROUTING
+	/// @brief Path cost of a perfect link, in `etx` units. ETX is the expected
+	/// number of transmissions needed to deliver a frame.
+	#define WMESH_ROUTE_ETX_ONE 16
+
+
+	/// @brief Periodically broadcast by roots, and by every node with a route to
+	/// one.
+	typedef struct __attribute__((packed)) {
+
+		/// @brief Root at the end of the advertised path.
+		wmesh_address_t root;
+
+		/// @brief Next hop of the sender towards `root`. Zero for roots.
+		wmesh_address_t parent;
+
+		/// @brief Increased by the root with every beacon, and repeated by
+		/// every node forwarding it. Tells current paths from stale ones.
+		uint16_t seq;
+
+		/// @brief Increased by the sender with every beacon it sends. Used to
+		/// estimate the link quality.
+		uint16_t link_seq;
+
+		/// @brief Cost of the sender's path to `root`, in 1/16 ETX.
+		uint16_t etx;
+
+		/// @brief Number of hops from the sender to `root`.
+		uint8_t hops;
+
+	} wmesh_route_beacon_t;
+
+
+	/// @brief Prepended to every routed frame.
+	typedef struct __attribute__((packed)) {
+
+		/// @brief Node which sent the message.
+		wmesh_address_t origin;
+
+		/// @brief Node the message is for.
+		wmesh_address_t dest;
+
+		/// @brief Remaining hops. The frame is dropped when it reaches 0.
+		uint8_t ttl;
+
+		/// @brief Service the payload is sent to.
+		wmesh_service_id_t service;
+
+	} wmesh_route_header_t;
+
+
+	/// @brief Node in radio range which sends beacons.
+	typedef struct {
+
+		/// @brief Neighbor address.
+		wmesh_address_t address;
+
+		/// @brief Root the neighbor has a path to.
+		wmesh_address_t root;
+
+		/// @brief Root sequence number last advertised by the neighbor.
+		uint16_t seq;
+
+		/// @brief Link sequence number of the last beacon heard from the
+		/// neighbor.
+		uint16_t link_seq;
+
+		/// @brief Neighbor's path cost, as advertised.
+		uint16_t etx;
+
+		/// @brief Moving average of the share of beacons received from the
+		/// neighbor, in 1/256.
+		uint16_t reception;
+
+		/// @brief Neighbor's hop count, as advertised.
+		uint8_t hops;
+
+		/// @brief Time the last beacon was heard, in microseconds.
+		int64_t heard_us;
+
+		/// @brief Set when the entry holds a neighbor.
+		bool in_use:1;
+
+		/// @brief Set when the neighbor's parent is this node. Such neighbors
+		/// are never chosen as parent.
+		bool is_child:1;
+
+	} wmesh_route_neighbor_t;
+
+
+	/// @brief Next hop towards a node further down the tree. Learned from the
+	/// frames it sends towards the root.
+	typedef struct {
+
+		/// @brief Final destination.
+		wmesh_address_t dest;
+
+		/// @brief Neighbor to send frames for `dest` to.
+		wmesh_address_t next_hop;
+
+		/// @brief Time the route was last learned, in microseconds. Oldest
+		/// route is replaced first.
+		int64_t learned_us;
+
+		/// @brief Set when the entry holds a route.
+		bool in_use:1;
+
+	} wmesh_route_entry_t;
+
+
+	/// @brief Routing state of a node.
+	///
+	/// Every node picks as parent the neighbor with the cheapest path to a root.
+	/// Frames towards the root follow the parents, and teach every hop the way
+	/// back to their origin.
+	///
+	/// A neighbor only becomes parent if it advertises a newer sequence number
+	/// than this node has, or the same one at a lower cost. Nodes further down
+	/// this node's subtree never do, so parents can't form a loop of any length.
+	typedef struct {
+
+		/// @brief This node's address.
+		wmesh_address_t self;
+
+		/// @brief Set when this node is a root, and originates beacons.
+		bool is_root;
+
+		/// @brief Parent towards the root, or `NULL` if there is no route.
+		wmesh_route_neighbor_t *parent;
+
+		/// @brief Newest root sequence number heard from the parent, or sent,
+		/// if this node is a root.
+		uint16_t seq;
+
+		/// @brief Link sequence number of the next beacon sent.
+		uint16_t link_seq;
+
+		/// @brief Root of the newest path this node has advertised. Only valid
+		/// when `advertised` is set.
+		wmesh_address_t feasible_root;
+
+		/// @brief Root sequence number of the newest path this node has
+		/// advertised.
+		uint16_t feasible_seq;
+
+		/// @brief Lowest cost this node has advertised with `feasible_seq`, in
+		/// 1/16 ETX.
+		uint16_t feasible_etx;
+
+		/// @brief Set once this node has advertised a path.
+		bool advertised;
+
+		/// @brief Nodes in radio range.
+		wmesh_route_neighbor_t neighbors[CONFIG_WMESH_ROUTE_NEIGHBORS];
+
+		/// @brief Routes towards nodes further down the tree.
+		wmesh_route_entry_t routes[CONFIG_WMESH_ROUTE_TABLE_SIZE];
+
+		/// @brief Frames forwarded for other nodes.
+		uint32_t forwarded;
+
+		/// @brief Frames dropped for lack of a route, or an expired TTL.
+		uint32_t dropped;
+
+		/// @brief Number of times the parent changed.
+		uint32_t parent_changes;
+
+	} wmesh_router_t;
+
+
+	/// @brief Initializes a node's routing state, with no neighbors or routes.
+	///
+	/// @param[out] router Routing state.
+	/// @param[in] self This node's address.
+	void wmesh_router_init(wmesh_router_t *router, const wmesh_address_t self);
+
+
+	/// @brief Makes this node a root, or stops being one.
+	///
+	/// @param[inout] router Routing state.
+	/// @param[in] is_root Whether this node is a root.
+	void wmesh_router_set_root(wmesh_router_t *router, bool is_root);
+
+
+	/// @brief Processes a beacon received from a neighbor, and reselects the
+	/// parent.
+	///
+	/// @param[inout] router Routing state.
+	/// @param[in] src Neighbor address.
+	/// @param[in] beacon Received beacon.
+	/// @param[in] now_us Current time, in microseconds.
+	void wmesh_router_beacon_received(
+		wmesh_router_t *router,
+		const wmesh_address_t src,
+		const wmesh_route_beacon_t *beacon,
+		int64_t now_us
+	);
+
+
+	/// @brief Forgets neighbors which have not been heard for
+	/// `CONFIG_WMESH_ROUTE_NEIGHBOR_TIMEOUT_MS`, and reselects the parent.
+	///
+	/// @param[inout] router Routing state.
+	/// @param[in] now_us Current time, in microseconds.
+	void wmesh_router_expire(wmesh_router_t *router, int64_t now_us);
+
+
+	/// @brief Builds the beacon this node should send.
+	///
+	/// @param[inout] router Routing state. Roots advance their sequence number.
+	/// @param[out] beacon Beacon.
+	///
+	/// @return `true` if a beacon should be sent, `false` if this node has no
+	/// route to a root.
+	bool wmesh_router_make_beacon(wmesh_router_t *router, wmesh_route_beacon_t *beacon);
+
+
+	/// @brief Records that frames for `dest` arrive through `prev_hop`.
+	///
+	/// @param[inout] router Routing state.
+	/// @param[in] dest Origin of a received routed frame.
+	/// @param[in] prev_hop Neighbor which relayed it.
+	/// @param[in] now_us Current time, in microseconds.
+	void wmesh_router_learn(
+		wmesh_router_t *router,
+		const wmesh_address_t dest,
+		const wmesh_address_t prev_hop,
+		int64_t now_us
+	);
+
+
+	/// @brief Finds the neighbor to send a frame for `dest` to.
+	///
+	/// Frames for the root go to the parent. Frames for other nodes follow a
+	/// learned route or, failing that, are sent directly to a neighbor.
+	///
+	/// @param[in] router Routing state.
+	/// @param[in] dest Final destination.
+	/// @param[out] next_hop Neighbor to send the frame to.
+	///
+	/// @return `true` if a next hop was found.
+	bool wmesh_router_next_hop(
+		const wmesh_router_t *router,
+		const wmesh_address_t dest,
+		wmesh_address_t next_hop
+	);
+
+
+	/// @brief Checks whether any neighbor uses this node as parent.
+	///
+	/// @param[in] router Routing state.
+	///
+	/// @return `true` if frames may have to be forwarded for other nodes.
+	bool wmesh_router_has_children(const wmesh_router_t *router);
+#endif
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef WMESH_STATS_H_
+#define WMESH_STATS_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "wmesh/common.h"
+
+
+/// @brief Link counters, kept per peer, per service and for the whole mesh.
+///
+/// Counters are only ever increased, and wrap around. They are updated
+/// without locking, so they may be read at any time with
+/// `wmesh_counters_read`.
+typedef struct {
+
+	/// @brief Frames received and decrypted. For services, messages passed to
+	/// the service's handler.
+	atomic_uint_least32_t rx_ok;
+
+	/// @brief Frames rejected by replay protection.
+	atomic_uint_least32_t rx_stale;
+
+	/// @brief Frames whose authentication tag didn't match.
+	atomic_uint_least32_t rx_auth_errors;
+
+	/// @brief Frames which couldn't be decrypted, or were malformed.
+	atomic_uint_least32_t rx_decrypt_errors;
+
+	/// @brief Messages received for a service without a handler.
+	atomic_uint_least32_t rx_no_handler;
+
+	/// @brief Frames delivered. Unicast frames count once acknowledged by the
+	/// peer, broadcasts once sent. For services, messages accepted for
+	/// sending.
+	atomic_uint_least32_t tx_ok;
+
+	/// @brief Frames which couldn't be sent, or weren't acknowledged. For
+	/// services, failed send calls.
+	atomic_uint_least32_t tx_failed;
+
+	/// @brief Bytes received. Whole frames for peers, message payloads for
+	/// services.
+	atomic_uint_least32_t bytes_in;
+
+	/// @brief Bytes sent. Whole frames for peers, message payloads for
+	/// services.
+	atomic_uint_least32_t bytes_out;
+
+	/// @brief Signal strength of the last received frame, in dBm. 0 until a
+	/// frame is received. Not set for services.
+	atomic_int_least8_t last_rssi;
+
+} wmesh_counters_t;
+
+
+/// @brief Copy of `wmesh_counters_t`. See it for every field.
+typedef struct {
+	uint32_t rx_ok;
+	uint32_t rx_stale;
+	uint32_t rx_auth_errors;
+	uint32_t rx_decrypt_errors;
+	uint32_t rx_no_handler;
+	uint32_t tx_ok;
+	uint32_t tx_failed;
+	uint32_t bytes_in;
+	uint32_t bytes_out;
+	int8_t last_rssi;
+} wmesh_counters_snapshot_t;
+
+
+/// @brief Counters of a single peer.
+typedef struct {
+
+	/// @brief Peer address.
+	wmesh_address_t address;
+
+	/// @brief Counters.
+	wmesh_counters_snapshot_t counters;
+
+} wmesh_peer_stats_t;
+
+
+/// @brief Counters of a single service.
+typedef struct {
+
+	/// @brief Service ID.
+	wmesh_service_id_t id;
+
+	/// @brief Set if the service had a handler when the snapshot was taken.
+	bool registered;
+
+	/// @brief Counters.
+	wmesh_counters_snapshot_t counters;
+
+} wmesh_service_stats_t;
+
+
+/// @brief Resets every counter.
+///
+/// @param[out] counters Counters to initialize.
+void wmesh_counters_init(wmesh_counters_t *counters);
+
+
+/// @brief Reads every counter. Counters are read one by one, so a snapshot
+/// taken while traffic flows may be off by a few frames between fields.
+///
+/// @param[in] counters Counters.
+/// @param[out] snapshot Copy of every counter.
+void wmesh_counters_read(
+	const wmesh_counters_t *counters,
+	wmesh_counters_snapshot_t *snapshot
+);
+
+
+/// @brief Checks whether any traffic was counted.
+///
+/// @param[in] snapshot Counters.
+///
+/// @return `true` if any counter is not zero.
+bool wmesh_counters_any(const wmesh_counters_snapshot_t *snapshot);
+
+
+/// @brief Increases a counter. Ordering is relaxed, as counters are only
+/// statistics.
+///
+/// @param[inout] counter Counter.
+/// @param[in] value Amount to add.
+static inline void wmesh_counter_add(atomic_uint_least32_t *counter, uint32_t value) {
+	atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+#endif
@@ -1,25 +1,55 @@
 #ifndef WMESH_STORAGE_H_
 #define WMESH_STORAGE_H_
 
-#include "nvs_flash.h"
+#include <stdbool.h>
 #include "sdkconfig.h"
 #include "wmesh/encryption.h"
+#include "wmesh/storage_backend.h"
 
 
 /// @brief Storage handle.
 typedef struct {
-	#ifdef CONFIG_WMESH_PERSISTENCE_NVS
-		nvs_handle_t nvs_handle;
+
+	/// @brief Backend namespace.
+	wmesh_storage_backend_t backend;
+
+	#if CONFIG_WMESH_STORAGE_RTC_CACHE
+		/// @brief Namespace name. The backend is only opened when a value
+		/// is missing from the cache, or on flush.
+		char name[WMESH_STORAGE_NAME_MAX_LENGTH];
+
+		/// @brief Index of the namespace in the RTC memory cache.
+		uint8_t cache_namespace;
+
+		/// @brief Set once `backend` is open.
+		bool backend_open;
+
+		/// @brief Set if values were written to the backend directly, and
+		/// not yet committed.
+		bool backend_dirty;
+
+		/// @brief Set if the cache survived since the last boot.
+		bool restored;
+
+		/// @brief Copy of `wmesh_storage_config_t.write_through`.
+		bool write_through;
 	#endif
+
 } wmesh_storage_handle_t;
 
 
 /// @brief Storage configuration. Used when opening a handle.
 typedef struct {
-	#ifdef CONFIG_WMESH_PERSISTENCE_NVS
-		/// @brief NVS namespace.
-		const char *name;
-	#endif
+
+	/// @brief Namespace. At most `WMESH_STORAGE_NAME_MAX_LENGTH - 1`
+	/// characters.
+	const char *name;
+
+	/// @brief Set to write values to the backend right away, for values
+	/// which must survive power loss. With `CONFIG_WMESH_STORAGE_RTC_CACHE`,
+	/// reads are still served from RTC memory.
+	bool write_through;
+
 } wmesh_storage_config_t;
 
 /// @brief Opens a storage device.
@@ -40,19 +70,38 @@ esp_err_t wmesh_storage_open(
 void wmesh_storage_close(wmesh_storage_handle_t *handle);
 
 
-/// @brief Error values used for storage functions.
-typedef enum {
+/// @brief Makes every previous write durable. With
+/// `CONFIG_WMESH_STORAGE_RTC_CACHE`, writes held in RTC memory are only
+/// written to the backend once `CONFIG_WMESH_STORAGE_FLUSH_INTERVAL_S` passed
+/// since the last flush, or after a reset which was not a deep sleep wake.
+/// Until then they survive deep sleep and software resets, but not power
+/// loss. Write-through namespaces never hold such writes.
+///
+/// @param[in] handle Storage handle.
+///
+/// @return `ESP_OK` or error.
+esp_err_t wmesh_storage_commit(wmesh_storage_handle_t *handle);
 
-	/// @brief Success.
-	WMESH_STORAGE_OK,
 
-	/// @brief Key was not found.
-	WMESH_STORAGE_NOT_FOUND,
+/// @brief Makes every previous write durable, including writes held in RTC
+/// memory. Same as `wmesh_storage_commit` without
+/// `CONFIG_WMESH_STORAGE_RTC_CACHE`.
+///
+/// @param[in] handle Storage handle.
+///
+/// @return `ESP_OK` or error.
+esp_err_t wmesh_storage_flush(wmesh_storage_handle_t *handle);
 
-	/// @brief Error during operation.
-	WMESH_STORAGE_ERROR,
 
-} wmesh_storage_result_t;
+/// @brief Checks whether writes committed but not flushed before the last
+/// reset may have been lost, in which case values read may be older than
+/// the last ones written.
+///
+/// @param[in] handle Storage handle.
+///
+/// @return `true` if the RTC memory cache didn't survive since the last
+/// boot. Always `false` without `CONFIG_WMESH_STORAGE_RTC_CACHE`.
+bool wmesh_storage_writes_lost(const wmesh_storage_handle_t *handle);
 
 
 /// @brief Load an encryption counter.
@@ -80,4 +129,79 @@ wmesh_storage_result_t wmesh_storage_write_ctr(
 	const char *key,
 	const wmesh_encryption_ctr_t *ctr
 );
+
+
+/// @brief Load a replay window.
+///
+/// @param[in] handle Storage handle.
+/// @param[in] key Name for this value.
+/// @param[out] window Replay window. Only valid when `WMESH_STORAGE_OK` is
+/// returned.
+///
+/// @return `WMESH_STORAGE_OK` or error.
+wmesh_storage_result_t wmesh_storage_read_window(
+	wmesh_storage_handle_t *handle,
+	const char *key,
+	wmesh_replay_window_t *window
+);
+
+/// @brief Stores a replay window.
+///
+/// @param[in] handle Storage handle.
+/// @param[in] key Name for this value.
+/// @param[in] window Replay window.
+///
+/// @return `WMESH_STORAGE_OK` or error.
+wmesh_storage_result_t wmesh_storage_write_window(
+	wmesh_storage_handle_t *handle,
+	const char *key,
+	const wmesh_replay_window_t *window
+);
+
+
+/// @brief Loads a binary blob.
+///
+/// @param[in] handle Storage handle.
+/// @param[in] key Name for this value.
+/// @param[out] data Buffer. If `NULL`, only the blob size is returned.
+/// @param[inout] length Size in bytes of `data`. Set to the size of the blob.
+///
+/// @return `WMESH_STORAGE_OK` or error. Buffers too small for the blob are an
+/// error.
+wmesh_storage_result_t wmesh_storage_read_blob(
+	wmesh_storage_handle_t *handle,
+	const char *key,
+	void *data,
+	size_t *length
+);
+
+
+/// @brief Stores a binary blob.
+///
+/// @param[in] handle Storage handle.
+/// @param[in] key Name for this value.
+/// @param[in] data Blob data.
+/// @param[in] length Size in bytes of `data`.
+///
+/// @return `WMESH_STORAGE_OK` or error.
+wmesh_storage_result_t wmesh_storage_write_blob(
+	wmesh_storage_handle_t *handle,
+	const char *key,
+	const void *data,
+	size_t length
+);
+
+
+/// @brief Removes a value. Not durable until committed.
+///
+/// @param[in] handle Storage handle.
+/// @param[in] key Name of the value.
+///
+/// @return `WMESH_STORAGE_OK`, `WMESH_STORAGE_NOT_FOUND` if there was no
+/// such value, or error.
+wmesh_storage_result_t wmesh_storage_erase(
+	wmesh_storage_handle_t *handle,
+	const char *key
+);
+
 #endif
@@ -0,0 +1,130 @@
+#ifndef WMESH_STORAGE_BACKEND_H_
+#define WMESH_STORAGE_BACKEND_H_
+
+#include <stddef.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#ifdef CONFIG_WMESH_PERSISTENCE_NVS
+	#include "nvs_flash.h"
+#endif
+
+
+/// @brief Maximum length of a storage namespace or key, including the null
+/// terminator.
+#define WMESH_STORAGE_NAME_MAX_LENGTH 16
+
+
+/// @brief Error values used for storage functions.
+typedef enum {
+
+	/// @brief Success.
+	WMESH_STORAGE_OK,
+
+	/// @brief Key was not found.
+	WMESH_STORAGE_NOT_FOUND,
+
+	/// @brief Error during operation.
+	WMESH_STORAGE_ERROR,
+
+} wmesh_storage_result_t;
+
+
+/// @brief Kind of stored value. Backends may store each kind differently.
+typedef enum {
+
+	/// @brief A `wmesh_encryption_ctr_t`.
+	WMESH_STORAGE_TYPE_CTR,
+
+	/// @brief Binary data of any size.
+	WMESH_STORAGE_TYPE_BLOB,
+
+} wmesh_storage_type_t;
+
+
+/// @brief Backend state of an open storage namespace.
+typedef struct {
+	#ifdef CONFIG_WMESH_PERSISTENCE_NVS
+		nvs_handle_t nvs_handle;
+	#endif
+} wmesh_storage_backend_t;
+
+
+/// @brief Opens a namespace of the selected backend.
+///
+/// @param[out] backend Backend state. Only valid if `ESP_OK` is returned.
+/// @param[in] name Namespace. At most `WMESH_STORAGE_NAME_MAX_LENGTH - 1`
+/// characters.
+///
+/// @return `ESP_OK` or error.
+esp_err_t wmesh_storage_backend_open(
+	wmesh_storage_backend_t *backend,
+	const char *name
+);
+
+
+/// @brief Commits every write, and closes a namespace.
+///
+/// @param[in] backend Backend state.
+void wmesh_storage_backend_close(wmesh_storage_backend_t *backend);
+
+
+/// @brief Makes every previous write durable.
+///
+/// @param[in] backend Backend state.
+///
+/// @return `ESP_OK` or error.
+esp_err_t wmesh_storage_backend_commit(wmesh_storage_backend_t *backend);
+
+
+/// @brief Reads a value.
+///
+/// @param[in] backend Backend state.
+/// @param[in] key Name of the value.
+/// @param[in] type Kind of value.
+/// @param[out] data Buffer. If `NULL`, only the value size is returned.
+/// @param[inout] length Size in bytes of `data`. Set to the size of the value.
+///
+/// @return `WMESH_STORAGE_OK` or error. Buffers too small for the value are
+/// an error.
+wmesh_storage_result_t wmesh_storage_backend_read(
+	wmesh_storage_backend_t *backend,
+	const char *key,
+	wmesh_storage_type_t type,
+	void *data,
+	size_t *length
+);
+
+
+/// @brief Writes a value. Not durable until committed.
+///
+/// @param[in] backend Backend state.
+/// @param[in] key Name of the value.
+/// @param[in] type Kind of value.
+/// @param[in] data Value.
+/// @param[in] length Size in bytes of `data`. Must be
+/// `sizeof(wmesh_encryption_ctr_t)` for counters.
+///
+/// @return `WMESH_STORAGE_OK` or error.
+wmesh_storage_result_t wmesh_storage_backend_write(
+	wmesh_storage_backend_t *backend,
+	const char *key,
+	wmesh_storage_type_t type,
+	const void *data,
+	size_t length
+);
+
+
+/// @brief Removes a value. Not durable until committed.
+///
+/// @param[in] backend Backend state.
+/// @param[in] key Name of the value.
+///
+/// @return `WMESH_STORAGE_OK`, `WMESH_STORAGE_NOT_FOUND` if there was no
+/// such value, or error.
+wmesh_storage_result_t wmesh_storage_backend_erase(
+	wmesh_storage_backend_t *backend,
+	const char *key
+);
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef WMESH_STORAGE_CACHE_H_
+#define WMESH_STORAGE_CACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_system.h"
+#include "wmesh/storage_backend.h"
+
+
+#if CONFIG_WMESH_STORAGE_RTC_CACHE
+	/// @brief Maximum number of namespaces held in the cache.
+	#define WMESH_STORAGE_CACHE_NAMESPACES 4
+
+
+	/// @brief Finds or adds a namespace in the RTC memory cache. The first
+	/// call after boot checks the cache, and empties it if its checksum
+	/// doesn't match.
+	///
+	/// @param[in] name Namespace.
+	/// @param[out] index Position of the namespace in the cache.
+	/// @param[out] restored Set if the cache survived since the last boot.
+	/// Cleared after a power-on reset, or if the cache was corrupted, in
+	/// which case writes not yet flushed were lost.
+	///
+	/// @return `ESP_OK`, `ESP_ERR_NO_MEM` if every namespace is in use, or
+	/// error.
+	esp_err_t wmesh_storage_cache_attach(
+		const char *name,
+		uint8_t *index,
+		bool *restored
+	);
+
+
+	/// @brief Looks a value up in the cache.
+	///
+	/// @param[in] index Namespace.
+	/// @param[in] key Name of the value.
+	/// @param[out] data Buffer. If `NULL`, only the value size is returned.
+	/// @param[inout] length Size in bytes of `data`. Set to the size of the
+	/// value.
+	/// @param[out] result Same as `wmesh_storage_backend_read`. Only set on a
+	/// hit.
+	///
+	/// @return `true` if the cache knows the value, or knows it doesn't exist.
+	bool wmesh_storage_cache_read(
+		uint8_t index,
+		const char *key,
+		void *data,
+		size_t *length,
+		wmesh_storage_result_t *result
+	);
+
+
+	/// @brief Adds a value read from the backend. Nothing is added if the
+	/// cache is full.
+	///
+	/// @param[in] index Namespace.
+	/// @param[in] key Name of the value.
+	/// @param[in] type Kind of value.
+	/// @param[in] data Value, or `NULL` if the backend doesn't have it.
+	/// @param[in] length Size in bytes of `data`.
+	void wmesh_storage_cache_fill(
+		uint8_t index,
+		const char *key,
+		wmesh_storage_type_t type,
+		const void *data,
+		size_t length
+	);
+
+
+	/// @brief Writes a value to the cache. Dirty values reach the backend on
+	/// the next flush.
+	///
+	/// @param[in] index Namespace.
+	/// @param[in] key Name of the value.
+	/// @param[in] type Kind of value.
+	/// @param[in] data Value.
+	/// @param[in] length Size in bytes of `data`.
+	/// @param[in] dirty Set if the backend doesn't have the value yet. Cleared
+	/// if it was just written to the backend.
+	///
+	/// @return `true` on success. `false` if the value doesn't fit, in which
+	/// case any cached copy is dropped, and the value must be written to the
+	/// backend directly.
+	bool wmesh_storage_cache_write(
+		uint8_t index,
+		const char *key,
+		wmesh_storage_type_t type,
+		const void *data,
+		size_t length,
+		bool dirty
+	);
+
+
+	/// @brief Drops a value from the cache, including a write not yet
+	/// flushed. The value must then be erased from the backend directly.
+	///
+	/// @param[in] index Namespace.
+	/// @param[in] key Name of the value.
+	void wmesh_storage_cache_erase(uint8_t index, const char *key);
+
+
+	/// @brief Checks whether a namespace should be flushed: it holds values
+	/// not yet written to the backend, and either
+	/// `CONFIG_WMESH_STORAGE_FLUSH_INTERVAL_S` passed since its last flush,
+	/// or the last reset was not a deep sleep wake.
+	///
+	/// @param[in] index Namespace.
+	///
+	/// @return `true` if a flush is due.
+	bool wmesh_storage_cache_flush_due(uint8_t index);
+
+
+	/// @brief Writes every value of a namespace not yet in the backend. The
+	/// backend must be committed afterwards.
+	///
+	/// @param[in] index Namespace.
+	/// @param[in] backend Open backend namespace.
+	///
+	/// @return `WMESH_STORAGE_OK` or error. Values which failed to be written
+	/// are retried on the next flush.
+	wmesh_storage_result_t wmesh_storage_cache_flush(
+		uint8_t index,
+		wmesh_storage_backend_t *backend
+	);
+
+
+	#if CONFIG_IDF_TARGET_LINUX
+		/// @brief Simulates a reset, for tests. RTC memory is ordinary memory
+		/// on Linux, so the cache survives unless `reason` is a power-on
+		/// reset. It is checked again by the next `wmesh_storage_cache_attach`.
+		///
+		/// @param[in] reason Kind of reset.
+		void wmesh_storage_cache_simulate_reset(esp_reset_reason_t reason);
+	#endif
+#endif
+
+#endif
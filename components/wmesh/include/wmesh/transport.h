@@ -0,0 +1,209 @@
+#ifndef WMESH_TRANSPORT_H_
+#define WMESH_TRANSPORT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+#include "wmesh/common.h"
+#include "wmesh/rate.h"
+
+#if CONFIG_WMESH_TRANSPORT_ESP_NOW
+	#include "esp_now.h"
+#endif
+
+
+/// @brief Largest frame every peer is guaranteed to accept. Larger frames
+/// must be negotiated first.
+#if CONFIG_WMESH_TRANSPORT_ESP_NOW
+	#define WMESH_TRANSPORT_SMALL_FRAME_SIZE ESP_NOW_MAX_DATA_LEN
+#else
+	#define WMESH_TRANSPORT_SMALL_FRAME_SIZE 250
+#endif
+
+
+/// @brief Called for every received frame. May run in a driver task, so it
+/// must return quickly.
+///
+/// @param[in] src Sender address.
+/// @param[in] data Frame. Only valid during the call.
+/// @param[in] length Size in bytes of `data`.
+/// @param[in] rssi Received signal strength, in dBm.
+typedef void (*wmesh_transport_recv_cb_t)(
+	const wmesh_address_t src,
+	const uint8_t *data,
+	size_t length,
+	int8_t rssi
+);
+
+
+/// @brief Called with the result of every sent frame. May run in a driver
+/// task, so it must return quickly.
+///
+/// @param[in] dest Destination address.
+/// @param[in] success Whether the frame was delivered. Always set for
+/// broadcasts.
+typedef void (*wmesh_transport_send_cb_t)(
+	const wmesh_address_t dest,
+	bool success
+);
+
+
+/// @brief Transport configuration.
+typedef struct {
+
+	/// @brief Network key. Used by links with their own encryption.
+	const uint8_t *network_key;
+
+	/// @brief Receive callback.
+	wmesh_transport_recv_cb_t recv_cb;
+
+	/// @brief Send result callback. May be `NULL`.
+	wmesh_transport_send_cb_t send_cb;
+
+} wmesh_transport_config_t;
+
+
+/// @brief Starts the transport. Only one transport may run at a time.
+///
+/// @param[in] config Transport configuration.
+///
+/// @return `ESP_OK` or error.
+esp_err_t wmesh_transport_init(const wmesh_transport_config_t *config);
+
+
+/// @brief Stops calling the receive and send callbacks. Frames may still be
+/// sent until `wmesh_transport_deinit` is called.
+void wmesh_transport_detach(void);
+
+
+/// @brief Stops the transport.
+void wmesh_transport_deinit(void);
+
+
+/// @brief Gets this node's address. May be called before the transport is
+/// started.
+///
+/// @param[out] address Address.
+void wmesh_transport_get_address(wmesh_address_t address);
+
+
+/// @brief Sends a frame. The destination must be registered with
+/// `wmesh_transport_add_peer`.
+///
+/// @param[in] dest Destination address.
+/// @param[in] data Frame.
+/// @param[in] length Size in bytes of `data`.
+///
+/// @return `ESP_OK` or error.
+esp_err_t wmesh_transport_send(
+	const wmesh_address_t dest,
+	const uint8_t *data,
+	size_t length
+);
+
+
+/// @brief Registers a destination. Registering a known destination is not
+/// an error.
+///
+/// @param[in] address Peer address.
+///
+/// @return `ESP_OK` or error.
+esp_err_t wmesh_transport_add_peer(const wmesh_address_t address);
+
+
+/// @brief Removes a registered destination.
+///
+/// @param[in] address Peer address.
+void wmesh_transport_del_peer(const wmesh_address_t address);
+
+
+#if CONFIG_WMESH_RATE_CONTROL
+	/// @brief Sets the PHY rate frames are sent to a peer at.
+	///
+	/// @param[in] address Peer address.
+	/// @param[in] rate Rate.
+	///
+	/// @return `ESP_OK`, `ESP_ERR_NOT_FOUND` if the peer is not registered, or
+	/// error.
+	esp_err_t wmesh_transport_set_peer_rate(
+		const wmesh_address_t address,
+		wmesh_rate_t rate
+	);
+#endif
+
+
+#if CONFIG_WMESH_TRANSPORT_SIMULATED
+	/// @brief Link impairments applied by a simulated transport to every
+	/// sent frame.
+	typedef struct {
+
+		/// @brief Chance of a frame being dropped, in percent.
+		uint8_t loss_percent;
+
+		/// @brief Delay added to every frame.
+		uint32_t latency_ms;
+
+		/// @brief Maximum random delay added on top of `latency_ms`.
+		uint32_t jitter_ms;
+
+		/// @brief Chance of a frame being held back by `reorder_delay_ms`, in
+		/// percent.
+		uint8_t reorder_percent;
+
+		/// @brief Extra delay of held back frames.
+		uint32_t reorder_delay_ms;
+
+		/// @brief Signal strength of the link, in dBm. Reported for every
+		/// received frame. With rate control, frames sent at a rate whose
+		/// sensitivity is close to it are also lost, and all of them once it
+		/// is well below.
+		int8_t rssi;
+
+	} wmesh_transport_impairment_t;
+
+
+	/// @brief Changes the impairments of a simulated link. Defaults to the
+	/// values in the `CONFIG_WMESH_TRANSPORT_SIM_*` options. Only valid while
+	/// the transport runs.
+	///
+	/// Frames already sent keep their delay.
+	///
+	/// @param[in] impairment New impairments.
+	void wmesh_transport_set_impairment(const wmesh_transport_impairment_t *impairment);
+
+
+	/// @brief Gets the impairments of a simulated link. Only valid while the
+	/// transport runs.
+	///
+	/// @param[out] impairment Current impairments.
+	void wmesh_transport_get_impairment(wmesh_transport_impairment_t *impairment);
+
+
+	#if CONFIG_WMESH_RATE_CONTROL
+		/// @brief Gets the rate frames are sent to a peer at.
+		///
+		/// @param[in] address Peer address.
+		/// @param[out] rate Rate set with `wmesh_transport_set_peer_rate`, or
+		/// `WMESH_RATE_DEFAULT` if none was set since the peer was registered.
+		///
+		/// @return `ESP_OK`, or `ESP_ERR_NOT_FOUND` if the peer is not
+		/// registered.
+		esp_err_t wmesh_transport_get_peer_rate(
+			const wmesh_address_t address,
+			wmesh_rate_t *rate
+		);
+
+
+		/// @brief Gets the share of frames the simulated link delivers at a
+		/// rate, given its current `rssi`. `loss_percent` comes on top.
+		///
+		/// @param[in] rate Rate.
+		///
+		/// @return Delivered frames, in percent.
+		uint8_t wmesh_transport_link_delivery(wmesh_rate_t rate);
+	#endif
+#endif
+
+#endif
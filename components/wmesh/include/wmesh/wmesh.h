@@ -4,15 +4,46 @@
 #include "sdkconfig.h"
 #include <stdint.h>
 #include <esp_err.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 
+#include "wmesh/coalesce.h"
 #include "wmesh/common.h"
 #include "wmesh/encryption.h"
+#include "wmesh/fragment.h"
+#include "wmesh/frame.h"
 #include "wmesh/peer.h"
+#include "wmesh/reliable.h"
+#include "wmesh/ring.h"
+#include "wmesh/routing.h"
+#include "wmesh/stats.h"
 #include "wmesh/storage.h"
 
 
-/// @brief Service identifier. Must be unique to a single service.
-typedef uint8_t wmesh_service_id_t;
+/// @brief Service IDs from this value onwards are reserved for internal use,
+/// and may not be registered.
+#define WMESH_SERVICE_RESERVED_FIRST 0xF0
+
+/// @brief Carries fragments of messages larger than a single frame.
+#define WMESH_SERVICE_FRAGMENT 0xFF
+
+/// @brief Carries frames sent using `wmesh_send_reliable`.
+#define WMESH_SERVICE_RELIABLE_DATA 0xFE
+
+/// @brief Carries acknowledgements of reliable frames.
+#define WMESH_SERVICE_RELIABLE_ACK 0xFD
+
+/// @brief Carries several messages sent using `wmesh_send_coalesced`.
+#define WMESH_SERVICE_BUNDLE 0xFC
+
+/// @brief Carries routing beacons.
+#define WMESH_SERVICE_ROUTE_BEACON 0xFB
+
+/// @brief Carries messages sent using `wmesh_send_routed`.
+#define WMESH_SERVICE_ROUTED 0xFA
 
 
 /// @brief Service callback.
@@ -71,20 +102,27 @@ typedef struct {
 } wmesh_config_t;
 
 
-/// @brief Mesh service handle.
-typedef struct wmesh_service_handle_t {
+/// @brief Number of possible service IDs.
+#define WMESH_SERVICE_COUNT (1 << (8 * sizeof(wmesh_service_id_t)))
 
-	/// @brief Called when a message is received.
+
+/// @brief Mesh service handle. Entry of the service dispatch table.
+typedef struct {
+
+	/// @brief Called when a message is received. `NULL` if the service is not
+	/// registered.
 	wmesh_service_recv_cb_t receive_callback;
 
 	/// @brief User context.
 	void *ctx;
 
-	/// @brief Pointer to next handle.
-	struct wmesh_service_handle_t *next;
+	/// @brief Traffic counters. Kept when the service is unregistered.
+	wmesh_counters_t counters;
 
-	/// @brief Service ID.
-	wmesh_service_id_t id;
+	/// @brief Incremented before and after the entry is modified. Allows the
+	/// receive task to read the entry without locking: an odd value, or a
+	/// value that changed during the read, means the read must be retried.
+	atomic_uint_least32_t version;
 
 } wmesh_service_handle_t;
 
@@ -98,19 +136,135 @@ typedef struct wmesh_handle_t {
 	/// @brief Known peer list.
 	wmesh_peer_list_t *peers;
 
-	/// @brief Pointer to service handlers.
-	wmesh_service_handle_t *service_handlers;
+	/// @brief Service dispatch table, indexed by service ID.
+	wmesh_service_handle_t services[WMESH_SERVICE_COUNT];
+
+	/// @brief Serializes changes to `services`.
+	portMUX_TYPE services_lock;
 
 	/// @brief Stores peer counters.
 	wmesh_storage_handle_t peer_storage;
 
+	/// @brief Peer table inside `peer_storage`.
+	wmesh_peer_table_t peer_table;
+
+	/// @brief Protects `peer_storage` and `peer_table`. Peers are loaded by
+	/// `rx_task`, and written by `flush_task`.
+	SemaphoreHandle_t peer_storage_lock;
+
 	/// @brief Stores self data.
 	wmesh_storage_handle_t self_storage;
 
+	/// @brief Preallocated transmit buffers.
+	wmesh_frame_pool_t frame_pool;
+
+	/// @brief Serializes transmissions. Protects `sequence_number` and the
+	/// transport peer registry.
+	///
+	/// Also taken by `rx_task` to add and evict peers in `peers`, so other
+	/// tasks may look peers up while holding it. Only `rx_task` changes the
+	/// list, so it may read it without locking.
+	SemaphoreHandle_t tx_lock;
+
+	/// @brief Frames received from the transport, waiting to be processed.
+	wmesh_rx_ring_t *rx_ring;
+
+	/// @brief Decrypts received frames and dispatches them to services.
+	TaskHandle_t rx_task;
+
+	/// @brief Given by `rx_task` right before exiting.
+	SemaphoreHandle_t rx_task_done;
+
+	/// @brief Cleared to stop `rx_task`.
+	atomic_bool rx_running;
+
+	/// @brief Buffers for fragmented messages. Only used by `rx_task`.
+	wmesh_reassembly_t *reassembly;
+
+	/// @brief Time at which `rx_task` gets its whole budget of peer loads
+	/// back, see `CONFIG_WMESH_PEER_LOAD_RATE`.
+	int64_t peer_load_full_us;
+
+	/// @brief Number of frames from unknown peers dropped because the peer
+	/// load budget was spent.
+	uint32_t peer_loads_limited;
+
+	/// @brief Results of unicast sends, queued by the transport send callback
+	/// for `rx_task`.
+	QueueHandle_t send_results;
+
+	#if CONFIG_WMESH_PEER_FLUSH_INTERVAL_MS > 0
+		/// @brief Writes changed peers to storage, so that `rx_task` never
+		/// waits for flash.
+		TaskHandle_t flush_task;
+
+		/// @brief Given by `flush_task` right before exiting.
+		SemaphoreHandle_t flush_task_done;
+
+		/// @brief Cleared to stop `flush_task`.
+		atomic_bool flush_running;
+
+		/// @brief Changed peers copied by `rx_task`, for `flush_task` to
+		/// write. Holds up to `WMESH_PEER_RECORD_COUNT` records. Records
+		/// which could not be written are kept for the next flush.
+		wmesh_peer_table_record_t *flush_records;
+
+		/// @brief Number of records in `flush_records`.
+		size_t flush_count;
+
+		/// @brief Set by `rx_task` once `flush_records` is filled, and
+		/// cleared by `flush_task` once written. Only the task the flag
+		/// hands the records to may access them.
+		atomic_bool flush_pending;
+	#endif
+
+	/// @brief Traffic counters of every peer and service, including frames
+	/// sent to or received from no known peer.
+	wmesh_counters_t counters;
+
+	/// @brief ID of the next fragmented message sent.
+	atomic_uint_least16_t next_message_id;
+
+	/// @brief Reliable frames waiting to be acknowledged.
+	wmesh_reliable_tx_t *reliable;
+
+	/// @brief Protects `reliable`.
+	SemaphoreHandle_t reliable_lock;
+
+	/// @brief Given by `rx_task` whenever reliable frames are acknowledged or
+	/// dropped, freeing space in a send window.
+	SemaphoreHandle_t reliable_progress;
+
+	/// @brief Messages waiting to be sent in a shared frame.
+	wmesh_coalescer_t coalescer;
+
+	/// @brief Protects `coalescer`.
+	SemaphoreHandle_t coalesce_lock;
+
+	#if CONFIG_WMESH_ROUTING
+		/// @brief Neighbors and routes.
+		wmesh_router_t *router;
+
+		/// @brief Protects `router`.
+		SemaphoreHandle_t route_lock;
+
+		/// @brief Time the next beacon is due, in microseconds. Only used
+		/// by `rx_task`.
+		int64_t beacon_us;
+
+		/// @brief This node is reported as relaying until this time, in
+		/// microseconds. Extended whenever a frame is forwarded.
+		_Atomic int64_t relay_until_us;
+	#endif
+
 	/// @brief Sequence number, identifies a packet. Automatically increases
 	/// when a message is sent.
 	wmesh_encryption_ctr_t sequence_number;
 
+	/// @brief Sequence numbers below this value are reserved in storage. A
+	/// new block is reserved when `sequence_number` reaches it.
+	wmesh_encryption_ctr_t sequence_lease;
+
 	/// @brief Shared network key.
 	uint8_t network_key[CONFIG_WMESH_NETKEY_LENGTH];
 
@@ -124,11 +278,12 @@ extern wmesh_handle_t *wmesh_global_handle;
 /// @brief Initializes and connects to a mesh network.
 ///
 /// Configures ESP-NOW in Soft-AP mode. Application code may
-/// use Station mode freely.
+/// use Station mode freely. On the Linux target, a simulated transport is
+/// used instead. See `CONFIG_WMESH_TRANSPORT`.
 ///
-/// @note Wi-Fi modem must be configured and set to either SoftAP mode
-/// (`WIFI_MODE_AP`) or SoftAP + STA (`WIFI_MODE_APSTA`) before calling this
-/// function.
+/// @note With ESP-NOW, the Wi-Fi modem must be configured and set to either
+/// SoftAP mode (`WIFI_MODE_AP`) or SoftAP + STA (`WIFI_MODE_APSTA`) before
+/// calling this function.
 ///
 /// @attention Currently, only one mesh instance may be running at a time. Calling
 /// this function multiple times without calling `wmesh_stop` in-between, *WILL*
@@ -149,7 +304,7 @@ esp_err_t wmesh_stop(wmesh_handle_t *handle);
 
 /// @brief Sends a message at the mesh level.
 /// @attention Messages sent using this function are not ACK'd, and, as such,
-/// are not guaranteed to be received.
+/// are not guaranteed to be received. See `wmesh_send_reliable`.
 ///
 /// @param handle Mesh handle.
 /// @param dest Node to send this message to.
@@ -163,13 +318,50 @@ esp_err_t wmesh_ll_send(
 );
 
 
+/// @brief Sets whether a node accepts large frames, which are only
+/// supported by ESP-NOW v2. Until set, frames sent to a node carry at most
+/// `WMESH_FRAME_SMALL_PAYLOAD` bytes.
+///
+/// Services are expected to negotiate this with the node, from a service
+/// callback. It is stored with the node's replay window, so it survives
+/// the node being evicted from the peer list, and restarts. Set it on the
+/// broadcast address only if every node in range supports large frames.
+///
+/// @param handle Mesh handle.
+/// @param address Node address. The node must have been received from.
+/// @param enabled Whether large frames may be sent to the node.
+///
+/// @return `ESP_OK`, or `ESP_ERR_NOT_FOUND` if the node is unknown.
+esp_err_t wmesh_set_large_frames(
+	wmesh_handle_t *handle, const wmesh_address_t address,
+	bool enabled
+);
+
+
+/// @brief Gets the maximum payload of a single frame sent to a node.
+///
+/// @param handle Mesh handle.
+/// @param address Node address.
+///
+/// @return `WMESH_FRAME_MAX_PAYLOAD` if large frames were enabled for the
+/// node, `WMESH_FRAME_SMALL_PAYLOAD` otherwise.
+size_t wmesh_get_max_payload(
+	wmesh_handle_t *handle, const wmesh_address_t address
+);
+
+
 /// @brief Send a message at the service level.
 ///
+/// Messages larger than `wmesh_get_max_payload` are split into several
+/// frames, and delivered to the destination service once all of them have
+/// been received. Losing any fragment loses the whole message.
+///
 /// @param handle Mesh handle.
 /// @param dest Destination node address.
 /// @param service Destination service ID.
 /// @param data Data to send.
-/// @param data_length Size of data in bytes.
+/// @param data_length Size of data in bytes. Must not exceed
+/// `CONFIG_WMESH_MAX_MESSAGE_SIZE`.
 ///
 /// @return `ESP_OK` or error.
 esp_err_t wmesh_send(
@@ -179,7 +371,272 @@ esp_err_t wmesh_send(
 );
 
 
-/// @brief Adds a service handler to the mesh.
+/// @brief Same as `wmesh_send`, but the message is split in segments, which
+/// are copied straight into the frame.
+///
+/// @param handle Mesh handle.
+/// @param dest Destination node address.
+/// @param service Destination service ID.
+/// @param iov Message segments.
+/// @param iov_count Number of segments.
+///
+/// @return `ESP_OK` or error.
+esp_err_t wmesh_sendv(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	const wmesh_iovec_t *iov, size_t iov_count
+);
+
+
+/// @brief Send a message at the service level, and retransmit it until the
+/// destination acknowledges it.
+///
+/// Up to `CONFIG_WMESH_RELIABLE_WINDOW` messages per destination may be in
+/// flight at the same time. Retransmissions are timed from the measured
+/// round-trip time, and stop after `CONFIG_WMESH_RELIABLE_MAX_RETRIES`
+/// attempts.
+///
+/// Every message is delivered at most once, but may be delivered out of order.
+///
+/// @param handle Mesh handle.
+/// @param dest Destination node address. Must not be the broadcast address.
+/// @param service Destination service ID.
+/// @param data Data to send.
+/// @param data_length Size of data in bytes. Must not exceed
+/// `wmesh_get_max_payload` minus `sizeof(wmesh_reliable_header_t)`.
+/// @param timeout Maximum time to wait for space in the send window.
+///
+/// @return
+/// - `ESP_OK`: Message queued. It has been sent at least once, or will be
+/// when its retransmission timer expires.
+///
+/// - `ESP_ERR_TIMEOUT`: The send window stayed full for `timeout`.
+///
+/// - Other errors: Invalid arguments.
+esp_err_t wmesh_send_reliable(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	const uint8_t *data, size_t data_length,
+	TickType_t timeout
+);
+
+
+/// @brief Same as `wmesh_send_reliable`, but the message is split in
+/// segments, which are copied straight into the send window.
+///
+/// @param handle Mesh handle.
+/// @param dest Destination node address. Must not be the broadcast address.
+/// @param service Destination service ID.
+/// @param iov Message segments.
+/// @param iov_count Number of segments.
+/// @param timeout Maximum time to wait for space in the send window.
+///
+/// @return See `wmesh_send_reliable`.
+esp_err_t wmesh_send_reliablev(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	const wmesh_iovec_t *iov, size_t iov_count,
+	TickType_t timeout
+);
+
+
+/// @brief Waits until every reliable message sent to a destination has been
+/// acknowledged or dropped.
+///
+/// @param handle Mesh handle.
+/// @param dest Destination node address.
+/// @param timeout Maximum time to wait.
+///
+/// @return
+/// - `ESP_OK`: Every message was acknowledged.
+///
+/// - `ESP_FAIL`: At least one message was dropped since the previous call.
+///
+/// - `ESP_ERR_TIMEOUT`: Messages are still in flight.
+esp_err_t wmesh_reliable_flush(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	TickType_t timeout
+);
+
+
+/// @brief Send a small message at the service level, batched with other
+/// messages to the same destination.
+///
+/// The message is held for up to `CONFIG_WMESH_COALESCE_WINDOW_MS`, or until
+/// the shared frame is full, and every message collected in that time is
+/// encrypted and sent as a single frame. The receiver splits the frame and
+/// dispatches each message to its service.
+///
+/// Messages too large to share a frame are sent right away using
+/// `wmesh_send`.
+///
+/// @param handle Mesh handle.
+/// @param dest Destination node address.
+/// @param service Destination service ID.
+/// @param data Data to send. Copied before returning.
+/// @param data_length Size of data in bytes.
+///
+/// @return `ESP_OK` or error.
+esp_err_t wmesh_send_coalesced(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	const uint8_t *data, size_t data_length
+);
+
+
+/// @brief Same as `wmesh_send_coalesced`, but the message is split in
+/// segments, which are copied straight into the shared frame.
+///
+/// @param handle Mesh handle.
+/// @param dest Destination node address.
+/// @param service Destination service ID.
+/// @param iov Message segments. Copied before returning.
+/// @param iov_count Number of segments.
+///
+/// @return `ESP_OK` or error.
+esp_err_t wmesh_send_coalescedv(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	const wmesh_iovec_t *iov, size_t iov_count
+);
+
+
+/// @brief Sends every message waiting in `wmesh_send_coalesced` right away.
+///
+/// @param handle Mesh handle.
+void wmesh_flush(wmesh_handle_t *handle);
+
+
+#if CONFIG_WMESH_ROUTING
+	/// @brief Makes this node a root of the routing tree, or stops being
+	/// one. Roots originate beacons, and are usually gateways.
+	///
+	/// @param handle Mesh handle.
+	/// @param is_root Whether this node is a root.
+	void wmesh_route_set_root(wmesh_handle_t *handle, bool is_root);
+
+
+	/// @brief Gets the root this node has a path to.
+	///
+	/// @param handle Mesh handle.
+	/// @param[out] root Root address. Only valid when `true` is returned.
+	/// @param[out] hops Number of hops to the root. May be `NULL`.
+	///
+	/// @return `true` if this node has a path to a root.
+	bool wmesh_route_get_root(
+		wmesh_handle_t *handle,
+		wmesh_address_t root, uint8_t *hops
+	);
+
+
+	/// @brief Checks whether this node may have to forward frames for other
+	/// nodes, and should stay awake.
+	///
+	/// @param handle Mesh handle.
+	///
+	/// @return `true` if any neighbor uses this node as parent, or a frame
+	/// was forwarded in the last `CONFIG_WMESH_ROUTE_FORWARD_WINDOW_MS`.
+	bool wmesh_route_is_relaying(wmesh_handle_t *handle);
+
+
+	/// @brief Sends a message to a node which may be out of radio range.
+	///
+	/// The message is relayed along the routing tree. Every hop decrypts it
+	/// and encrypts it again for the next one. Messages are not
+	/// acknowledged, nor fragmented.
+	///
+	/// @param handle Mesh handle.
+	/// @param dest Destination node address. Either the root, a node which
+	/// sent routed messages through this one, or a neighbor.
+	/// @param service Destination service ID.
+	/// @param data Data to send.
+	/// @param data_length Size of data in bytes. Must fit in a single frame
+	/// along with a `wmesh_route_header_t`.
+	///
+	/// @return `ESP_OK`, `ESP_ERR_NOT_FOUND` if there is no route to `dest`,
+	/// or error.
+	esp_err_t wmesh_send_routed(
+		wmesh_handle_t *handle, const wmesh_address_t dest,
+		wmesh_service_id_t service,
+		const uint8_t *data, size_t data_length
+	);
+#endif
+
+
+/// @brief Takes a transmit frame from the mesh's frame pool.
+///
+/// The service payload can be written directly to `wmesh_frame_payload(frame)`
+/// and then sent using `wmesh_send_frame`, which avoids any intermediate
+/// copies.
+///
+/// @param handle Mesh handle.
+///
+/// @return Frame, or `NULL` if every frame is in use.
+wmesh_frame_t *wmesh_frame_alloc(wmesh_handle_t *handle);
+
+
+/// @brief Returns an unsent frame to the mesh's frame pool.
+///
+/// @param handle Mesh handle.
+/// @param frame Frame obtained from `wmesh_frame_alloc`.
+void wmesh_frame_free(wmesh_handle_t *handle, wmesh_frame_t *frame);
+
+
+/// @brief Send a frame at the service level. The payload is encrypted in
+/// place.
+///
+/// @attention The frame is returned to the pool, even if an error occurs.
+///
+/// @param handle Mesh handle.
+/// @param dest Destination node address.
+/// @param service Destination service ID.
+/// @param frame Frame obtained from `wmesh_frame_alloc`.
+/// @param payload_length Number of bytes written to the frame's payload. Must
+/// not exceed `WMESH_FRAME_MAX_PAYLOAD`, and should not exceed
+/// `wmesh_get_max_payload` for `dest`.
+///
+/// @return `ESP_OK` or error.
+esp_err_t wmesh_send_frame(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	wmesh_frame_t *frame, size_t payload_length
+);
+
+
+/// @brief Gets a copy of the receive path statistics.
+///
+/// @param handle Mesh handle.
+/// @param[out] stats Statistics.
+void wmesh_get_rx_stats(wmesh_handle_t *handle, wmesh_rx_stats_t *stats);
+
+
+/// @brief Gets a copy of the traffic counters of the mesh, its peers and its
+/// services.
+///
+/// Peers added while the snapshot is taken may be missing from it.
+///
+/// @param handle Mesh handle.
+/// @param[out] total Counters of the whole mesh. May be `NULL`.
+/// @param[out] peers Counters of every known peer which has seen traffic.
+/// May be `NULL`.
+/// @param[inout] peer_count Size of `peers` on input, number of entries
+/// written on output. Ignored if `peers` is `NULL`.
+/// @param[out] services Counters of every registered service, or one which
+/// has seen traffic. Internal services are included. May be `NULL`.
+/// @param[inout] service_count Size of `services` on input, number of
+/// entries written on output. Ignored if `services` is `NULL`.
+void wmesh_get_stats(
+	wmesh_handle_t *handle,
+	wmesh_counters_snapshot_t *total,
+	wmesh_peer_stats_t *peers, size_t *peer_count,
+	wmesh_service_stats_t *services, size_t *service_count
+);
+
+
+/// @brief Adds a service handler to the mesh. If the service is already
+/// registered, its handler is replaced.
+///
+/// @note May be called at any time, including from a service callback.
 ///
 /// @param handle Mesh handle.
 /// @param config Service configuration.
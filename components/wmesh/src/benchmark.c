@@ -0,0 +1,318 @@
+#include "wmesh/benchmark.h"
+
+#if CONFIG_WMESH_ENCRYPTION_BENCHMARK
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "wmesh/encryption.h"
+#include "wmesh/transport.h"
+
+#if CONFIG_IDF_TARGET_LINUX
+	#include <time.h>
+#else
+	#include "esp_cpu.h"
+#endif
+
+static const char *TAG = "Mesh benchmark";
+
+
+/// @brief Context creations timed for `context_time`.
+#define CONTEXT_ITERATIONS 100
+
+
+#if CONFIG_WMESH_ENCRYPTION_DISABLED
+	#define ALGORITHM_NAME "None"
+#elif CONFIG_WMESH_ENCRYPTION_AES128_GCM
+	#define ALGORITHM_NAME "AES-128-GCM"
+#elif CONFIG_WMESH_ENCRYPTION_AES192_GCM
+	#define ALGORITHM_NAME "AES-192-GCM"
+#elif CONFIG_WMESH_ENCRYPTION_AES256_GCM
+	#define ALGORITHM_NAME "AES-256-GCM"
+#elif CONFIG_WMESH_ENCRYPTION_CHACHA20_POLY1305
+	#define ALGORITHM_NAME "ChaCha20-Poly1305"
+#elif CONFIG_WMESH_ENCRYPTION_CHACHA20
+	#define ALGORITHM_NAME "ChaCha20"
+#endif
+
+
+/// @brief Reads the benchmark clock. See `WMESH_BENCHMARK_TIME_UNIT`.
+///
+/// Only differences between two readings are meaningful. On target, the
+/// cycle counter wraps every few seconds, which unsigned subtraction
+/// handles as long as a single call is shorter.
+static inline uint32_t now(void) {
+	#if CONFIG_IDF_TARGET_LINUX
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint32_t) (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+	#else
+		return esp_cpu_get_cycle_count();
+	#endif
+}
+
+
+/// @brief Fits `y = setup + per_byte * x` by least squares.
+static void fit(
+	const double *x, const double *y, size_t count,
+	double *setup, double *per_byte
+) {
+	double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+	for(size_t i = 0; i < count; i++) {
+		sum_x += x[i];
+		sum_y += y[i];
+		sum_xx += x[i] * x[i];
+		sum_xy += x[i] * y[i];
+	}
+
+	double denominator = count * sum_xx - sum_x * sum_x;
+	if(count < 2 || denominator == 0) {
+		// A single size can't separate fixed and per byte costs.
+		*setup = 0;
+		*per_byte = sum_x > 0 ? sum_y / sum_x : 0;
+		return;
+	}
+
+	*per_byte = (count * sum_xy - sum_x * sum_y) / denominator;
+	*setup = (sum_y - *per_byte * sum_x) / count;
+}
+
+
+/// @brief Measures a single payload size.
+static esp_err_t measure(
+	wmesh_encryption_ctx_t *ctx,
+	const wmesh_address_t self,
+	uint8_t *plaintext,
+	uint8_t *ciphertext,
+	uint8_t *decrypted,
+	wmesh_encryption_benchmark_point_t *point
+) {
+	wmesh_encryption_ctr_t ctr = 0;
+	size_t ciphertext_length = 0;
+	esp_fill_random(plaintext, point->payload_length);
+	const wmesh_iovec_t iov = { plaintext, point->payload_length };
+
+	#if CONFIG_WMESH_ENCRYPTION_PROFILE
+		memset(&ctx->profile, 0, sizeof(ctx->profile));
+	#endif
+
+	point->encrypt_time = 0;
+	point->copy_time = 0;
+	int64_t start_us = esp_timer_get_time();
+	for(uint32_t i = 0; i < point->frames; i++) {
+		uint32_t start = now();
+		wmesh_iovec_gather(ciphertext + WMESH_CIPHERTEXT_HEADER_LENGTH, &iov, 1, 0, point->payload_length);
+		uint32_t copied = now();
+		esp_err_t err = wmesh_encrypt_inplace(
+			ctx, &ctr,
+			ciphertext, point->payload_length,
+			&ciphertext_length
+		);
+		point->encrypt_time += (uint32_t) (now() - copied);
+		point->copy_time += (uint32_t) (copied - start);
+
+		if(err != ESP_OK) {
+			return err;
+		}
+	}
+	point->encrypt_us = esp_timer_get_time() - start_us;
+
+	#if CONFIG_WMESH_ENCRYPTION_PROFILE
+		point->nonce_time = ctx->profile.nonce_time;
+		point->aead_time = ctx->profile.aead_time;
+	#endif
+
+	// The last frame is decrypted every time. The replay window is reset
+	// between calls, so it is never rejected as stale.
+	wmesh_replay_window_t window;
+	point->decrypt_time = 0;
+	start_us = esp_timer_get_time();
+	for(uint32_t i = 0; i < point->frames; i++) {
+		wmesh_replay_window_init(&window);
+
+		size_t decrypted_length;
+		uint32_t start = now();
+		wmesh_decrypt_status_t status = wmesh_decrypt_aad(
+			ctx, &window, self,
+			ciphertext, ciphertext_length,
+			NULL, 0,
+			decrypted, &decrypted_length
+		);
+		point->decrypt_time += (uint32_t) (now() - start);
+
+		if(status != WMESH_DECRYPT_OK || decrypted_length != point->payload_length) {
+			ESP_LOGE(TAG, "Error decrypting %zu byte frame: %d", point->payload_length, status);
+			return ESP_FAIL;
+		}
+	}
+	point->decrypt_us = esp_timer_get_time() - start_us;
+
+	if(memcmp(plaintext, decrypted, point->payload_length) != 0) {
+		ESP_LOGE(TAG, "Decrypted %zu byte frame doesn't match", point->payload_length);
+		return ESP_FAIL;
+	}
+
+	return ESP_OK;
+}
+
+
+esp_err_t wmesh_encryption_benchmark(
+	const size_t *payload_lengths,
+	size_t count,
+	uint32_t frames,
+	wmesh_encryption_benchmark_point_t *points,
+	wmesh_encryption_benchmark_t *summary
+) {
+	const size_t max_payload = CONFIG_WMESH_FRAME_SIZE - WMESH_CIPHERTEXT_BASE_LENGTH;
+	for(size_t i = 0; i < count; i++) {
+		if(payload_lengths[i] > max_payload) {
+			ESP_LOGE(TAG, "Payload too long: %zu bytes", payload_lengths[i]);
+			return ESP_ERR_INVALID_SIZE;
+		}
+	}
+
+	uint8_t key[CONFIG_WMESH_NETKEY_LENGTH];
+	esp_fill_random(key, sizeof(key));
+	const wmesh_encryption_config_t config = {
+		.key = key,
+	};
+
+	wmesh_address_t self;
+	wmesh_transport_get_address(self);
+
+	wmesh_encryption_ctx_t *ctx = malloc(sizeof(*ctx));
+	uint8_t *plaintext = malloc(max_payload);
+	uint8_t *ciphertext = malloc(CONFIG_WMESH_FRAME_SIZE);
+	uint8_t *decrypted = malloc(max_payload);
+	double *sizes = malloc(count * sizeof(*sizes));
+	double *encrypt_times = malloc(count * sizeof(*encrypt_times));
+	double *decrypt_times = malloc(count * sizeof(*decrypt_times));
+	if(!ctx || !plaintext || !ciphertext || !decrypted || !sizes || !encrypt_times || !decrypt_times) {
+		free(decrypt_times);
+		free(encrypt_times);
+		free(sizes);
+		free(decrypted);
+		free(ciphertext);
+		free(plaintext);
+		free(ctx);
+		return ESP_ERR_NO_MEM;
+	}
+
+	esp_err_t err = ESP_OK;
+	uint64_t context_time = 0;
+	for(size_t i = 0; i < CONTEXT_ITERATIONS && err == ESP_OK; i++) {
+		uint32_t start = now();
+		err = wmesh_encryption_ctx_new(ctx, &config);
+		if(err == ESP_OK) {
+			wmesh_encryption_ctx_free(ctx);
+		}
+		context_time += (uint32_t) (now() - start);
+	}
+	summary->context_time = (double) context_time / CONTEXT_ITERATIONS;
+
+	if(err == ESP_OK) {
+		err = wmesh_encryption_ctx_new(ctx, &config);
+	}
+
+	if(err == ESP_OK) {
+		for(size_t i = 0; i < count && err == ESP_OK; i++) {
+			points[i] = (wmesh_encryption_benchmark_point_t) {
+				.payload_length = payload_lengths[i],
+				.frames = frames,
+			};
+			err = measure(ctx, self, plaintext, ciphertext, decrypted, &points[i]);
+
+			sizes[i] = payload_lengths[i];
+			encrypt_times[i] = (double) points[i].encrypt_time / frames;
+			decrypt_times[i] = (double) points[i].decrypt_time / frames;
+		}
+
+		wmesh_encryption_ctx_free(ctx);
+	}
+
+	if(err == ESP_OK) {
+		fit(sizes, encrypt_times, count, &summary->encrypt_setup, &summary->encrypt_per_byte);
+		fit(sizes, decrypt_times, count, &summary->decrypt_setup, &summary->decrypt_per_byte);
+	}
+
+	free(decrypt_times);
+	free(encrypt_times);
+	free(sizes);
+	free(decrypted);
+	free(ciphertext);
+	free(plaintext);
+	free(ctx);
+	return err;
+}
+
+
+void wmesh_encryption_benchmark_log(
+	const wmesh_encryption_benchmark_point_t *points,
+	size_t count,
+	const wmesh_encryption_benchmark_t *summary
+) {
+	ESP_LOGI(TAG,
+		"%s, %d byte tag, times in %s",
+		ALGORITHM_NAME, CONFIG_WMESH_ENCRYPTION_TAG_LENGTH, WMESH_BENCHMARK_TIME_UNIT
+	);
+	ESP_LOGI(TAG, "Bytes	Encrypt/B	Decrypt/B	Encrypt frames/s	Decrypt frames/s");
+
+	for(size_t i = 0; i < count; i++) {
+		const wmesh_encryption_benchmark_point_t *point = &points[i];
+		double bytes = (double) point->payload_length * point->frames;
+
+		ESP_LOGI(TAG,
+			"%zu	%.2f		%.2f		%.0f			%.0f",
+			point->payload_length,
+			bytes > 0 ? point->encrypt_time / bytes : 0,
+			bytes > 0 ? point->decrypt_time / bytes : 0,
+			point->encrypt_us > 0 ? point->frames * 1e6 / point->encrypt_us : 0,
+			point->decrypt_us > 0 ? point->frames * 1e6 / point->decrypt_us : 0
+		);
+	}
+
+	// Per frame cost of every step of sending a frame. Without profiling,
+	// nonce and cipher are only measured together.
+	#if CONFIG_WMESH_ENCRYPTION_PROFILE
+		ESP_LOGI(TAG, "Bytes	Nonce/frame	Cipher/frame	Copy/frame");
+	#else
+		ESP_LOGI(TAG, "Bytes	Encrypt/frame	Copy/frame");
+	#endif
+
+	for(size_t i = 0; i < count; i++) {
+		const wmesh_encryption_benchmark_point_t *point = &points[i];
+		double frames = point->frames > 0 ? point->frames : 1;
+
+		#if CONFIG_WMESH_ENCRYPTION_PROFILE
+			ESP_LOGI(TAG,
+				"%zu	%.0f		%.0f		%.0f",
+				point->payload_length,
+				point->nonce_time / frames,
+				point->aead_time / frames,
+				point->copy_time / frames
+			);
+		#else
+			ESP_LOGI(TAG,
+				"%zu	%.0f		%.0f",
+				point->payload_length,
+				point->encrypt_time / frames,
+				point->copy_time / frames
+			);
+		#endif
+	}
+
+	ESP_LOGI(TAG, "Context setup: %.0f", summary->context_time);
+	ESP_LOGI(TAG,
+		"Encrypt: %.0f per call + %.2f per byte",
+		summary->encrypt_setup, summary->encrypt_per_byte
+	);
+	ESP_LOGI(TAG,
+		"Decrypt: %.0f per call + %.2f per byte",
+		summary->decrypt_setup, summary->decrypt_per_byte
+	);
+}
+
+#endif
@@ -0,0 +1,117 @@
+#include "wmesh/coalesce.h"
+
+#include <string.h>
+
+
+void wmesh_coalescer_init(wmesh_coalescer_t *coalescer) {
+	for(size_t i = 0; i < CONFIG_WMESH_COALESCE_BUNDLES; i++) {
+		coalescer->bundles[i].frame = NULL;
+	}
+
+	coalescer->messages = 0;
+	coalescer->frames = 0;
+}
+
+
+wmesh_bundle_t *wmesh_coalescer_find(
+	wmesh_coalescer_t *coalescer,
+	const wmesh_address_t dest
+) {
+	for(size_t i = 0; i < CONFIG_WMESH_COALESCE_BUNDLES; i++) {
+		wmesh_bundle_t *bundle = &coalescer->bundles[i];
+		if(bundle->frame && memcmp(bundle->dest, dest, sizeof(wmesh_address_t)) == 0) {
+			return bundle;
+		}
+	}
+
+	return NULL;
+}
+
+
+wmesh_bundle_t *wmesh_coalescer_victim(wmesh_coalescer_t *coalescer) {
+	wmesh_bundle_t *victim = &coalescer->bundles[0];
+
+	for(size_t i = 0; i < CONFIG_WMESH_COALESCE_BUNDLES; i++) {
+		wmesh_bundle_t *bundle = &coalescer->bundles[i];
+		if(!bundle->frame) {
+			return bundle;
+		}
+
+		if(bundle->deadline_us < victim->deadline_us) {
+			victim = bundle;
+		}
+	}
+
+	return victim;
+}
+
+
+int64_t wmesh_coalescer_next_deadline(const wmesh_coalescer_t *coalescer) {
+	int64_t deadline_us = INT64_MAX;
+
+	for(size_t i = 0; i < CONFIG_WMESH_COALESCE_BUNDLES; i++) {
+		const wmesh_bundle_t *bundle = &coalescer->bundles[i];
+		if(bundle->frame && bundle->deadline_us < deadline_us) {
+			deadline_us = bundle->deadline_us;
+		}
+	}
+
+	return deadline_us;
+}
+
+
+bool wmesh_bundle_fits(const wmesh_bundle_t *bundle, size_t data_length) {
+	return bundle->length + sizeof(wmesh_bundle_record_t) + data_length <= bundle->capacity;
+}
+
+
+bool wmesh_bundle_append(
+	wmesh_bundle_t *bundle,
+	wmesh_service_id_t service,
+	const wmesh_iovec_t *iov,
+	size_t iov_count
+) {
+	size_t data_length = wmesh_iovec_length(iov, iov_count);
+	if(!wmesh_bundle_fits(bundle, data_length)) {
+		return false;
+	}
+
+	wmesh_bundle_record_t record = {
+		.service = service,
+		.length = data_length,
+	};
+
+	uint8_t *payload = wmesh_frame_payload(bundle->frame) + bundle->length;
+	memcpy(payload, &record, sizeof(record));
+	wmesh_iovec_gather(payload + sizeof(record), iov, iov_count, 0, data_length);
+
+	bundle->length += sizeof(record) + data_length;
+	bundle->count++;
+	return true;
+}
+
+
+bool wmesh_bundle_next(
+	uint8_t **cursor,
+	const uint8_t *end,
+	wmesh_service_id_t *service,
+	uint8_t **data,
+	size_t *data_length
+) {
+	wmesh_bundle_record_t record;
+	if((size_t) (end - *cursor) < sizeof(record)) {
+		return false;
+	}
+	memcpy(&record, *cursor, sizeof(record));
+
+	uint8_t *record_data = *cursor + sizeof(record);
+	if((size_t) (end - record_data) < record.length) {
+		return false;
+	}
+
+	*service = record.service;
+	*data = record_data;
+	*data_length = record.length;
+	*cursor = record_data + record.length;
+	return true;
+}
@@ -2,8 +2,8 @@
 
 #include <string.h>
 #include "esp_log.h"
-#include "esp_mac.h"
 #include "esp_random.h"
+#include "wmesh/transport.h"
 
 
 #ifdef CONFIG_WMESH_ENCRYPTION_AES128_GCM
@@ -23,6 +23,11 @@
 #endif
 
 
+/// @brief Size of the full nonce passed to the cipher: IV followed by the
+/// counter.
+#define NONCE_SIZE (CONFIG_WMESH_ENCRYPTION_IV_LENGTH + CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH)
+
+
 static void init_mbedtls_context(wmesh_encryption_mbedtls_ctx_t *ctx);
 static void free_mbedtls_context(wmesh_encryption_mbedtls_ctx_t *ctx);
 static esp_err_t setkey_mbedtls_context(
@@ -30,6 +35,28 @@ static esp_err_t setkey_mbedtls_context(
 	const uint8_t key[CONFIG_WMESH_ENCRYPTION_KEYLENGTH]
 );
 static void generate_iv(uint8_t iv[CONFIG_WMESH_ENCRYPTION_IV_LENGTH]);
+#if CONFIG_WMESH_FRAME_COMPACT
+	static size_t compact_counter_length(wmesh_encryption_ctr_t ctr);
+#endif
+#if CONFIG_WMESH_ENCRYPTION_CHACHA20_POLY1305 && CONFIG_WMESH_ENCRYPTION_TAG_LENGTH < 16
+	static int chachapoly_auth_decrypt_truncated(
+		mbedtls_chachapoly_context *ctx,
+		size_t length,
+		const uint8_t nonce[12],
+		const uint8_t *aad, size_t aad_size,
+		const uint8_t *tag,
+		const uint8_t *input,
+		uint8_t *output
+	);
+#endif
+static bool replay_window_check(
+	const wmesh_replay_window_t *window,
+	wmesh_encryption_ctr_t ctr
+);
+static void replay_window_update(
+	wmesh_replay_window_t *window,
+	wmesh_encryption_ctr_t ctr
+);
 
 
 esp_err_t wmesh_encryption_ctx_new(
@@ -45,6 +72,12 @@ esp_err_t wmesh_encryption_ctx_new(
 		return err;
 	}
 
+	generate_iv(ctx->iv);
+
+	#if CONFIG_WMESH_ENCRYPTION_PROFILE
+		memset(&ctx->profile, 0, sizeof(ctx->profile));
+	#endif
+
 	return ESP_OK;
 }
 
@@ -61,18 +94,18 @@ esp_err_t wmesh_encrypt(
 	const uint8_t *plaintext,
 	size_t plaintext_length,
 
-	uint8_t *ciphertext
+	uint8_t *ciphertext,
+	size_t *ciphertext_length
 ) {
-	return wmesh_encrypt_aad(ctx, ctr, plaintext, plaintext_length, NULL, 0, ciphertext);
+	return wmesh_encrypt_aad(
+		ctx, ctr,
+		plaintext, plaintext_length,
+		NULL, 0,
+		ciphertext, ciphertext_length
+	);
 }
 
 
-struct encrypted_message {
-	uint8_t iv[CONFIG_WMESH_ENCRYPTION_IV_LENGTH + CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH];
-	uint8_t tag[CONFIG_WMESH_ENCRYPTION_TAG_LENGTH];
-	uint8_t ciphertext[];
-} __attribute__((packed));
-
 esp_err_t wmesh_encrypt_aad(
 	wmesh_encryption_ctx_t *ctx,
 	wmesh_encryption_ctr_t *ctr,
@@ -83,16 +116,35 @@ esp_err_t wmesh_encrypt_aad(
 	const uint8_t *aad,
 	size_t aad_size,
 
-	uint8_t *ciphertext
+	uint8_t *ciphertext,
+	size_t *ciphertext_length
 ) {
-	// Output structure is:
-	// |  IV  |  Nonce  |  Tag  |   Ciphertext   |
-	struct encrypted_message *encrypted = (struct encrypted_message *) ciphertext;
+	#if CONFIG_WMESH_FRAME_COMPACT
+		// Output structure is:
+		// |  Format  |  Tag  |   Ciphertext   |  Counter  |
+		// The IV is this node's MAC address, which the receiver gets from
+		// ESP-NOW, so it is not sent.
+		uint8_t nonce[NONCE_SIZE];
+		uint8_t *tag = ciphertext + 1;
+	#else
+		// Output structure is:
+		// |  IV  |  Nonce  |  Tag  |   Ciphertext   |
+		uint8_t *nonce = ciphertext;
+		uint8_t *tag = ciphertext + NONCE_SIZE;
+	#endif
+	uint8_t *body = ciphertext + WMESH_CIPHERTEXT_HEADER_LENGTH;
 
-	memset(encrypted->iv, 0, CONFIG_WMESH_ENCRYPTION_IV_LENGTH + CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH);
-	generate_iv(encrypted->iv);
+	#if CONFIG_WMESH_ENCRYPTION_PROFILE
+		uint32_t start_time = wmesh_profile_now();
+	#endif
+
+	memcpy(nonce, ctx->iv, CONFIG_WMESH_ENCRYPTION_IV_LENGTH);
 	wmesh_encryption_ctr_t send_counter = *ctr + 1;
-	memcpy(encrypted->iv + CONFIG_WMESH_ENCRYPTION_IV_LENGTH, &send_counter, CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH);
+	memcpy(nonce + CONFIG_WMESH_ENCRYPTION_IV_LENGTH, &send_counter, CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH);
+
+	#if CONFIG_WMESH_ENCRYPTION_PROFILE
+		uint32_t nonce_time = wmesh_profile_now();
+	#endif
 
 	int err;
 	#ifdef ENC_TYPE_GCM
@@ -100,39 +152,66 @@ esp_err_t wmesh_encrypt_aad(
 			&ctx->mbedtls_ctx,
 			MBEDTLS_GCM_ENCRYPT,
 			plaintext_length,
-			encrypted->iv, CONFIG_WMESH_ENCRYPTION_IV_LENGTH + CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH,
+			nonce, NONCE_SIZE,
 			aad, aad_size,
 			plaintext,
-			encrypted->ciphertext,
-			CONFIG_WMESH_ENCRYPTION_TAG_LENGTH, encrypted->tag
+			body,
+			CONFIG_WMESH_ENCRYPTION_TAG_LENGTH, tag
 		);
 	#elifdef CONFIG_WMESH_ENCRYPTION_CHACHA20_POLY1305
+		#if CONFIG_WMESH_ENCRYPTION_TAG_LENGTH < 16
+			// Poly1305 always produces a 16-byte tag, only the start is sent.
+			uint8_t full_tag[16];
+		#else
+			uint8_t *full_tag = tag;
+		#endif
+
 		err = mbedtls_chachapoly_encrypt_and_tag(
 			&ctx->mbedtls_ctx,
 			plaintext_length,
-			encrypted->iv,
+			nonce,
 			aad, aad_size,
 			plaintext,
-			encrypted->ciphertext,
-			encrypted->tag
+			body,
+			full_tag
 		);
+
+		#if CONFIG_WMESH_ENCRYPTION_TAG_LENGTH < 16
+			memcpy(tag, full_tag, CONFIG_WMESH_ENCRYPTION_TAG_LENGTH);
+		#endif
 	#elifdef CONFIG_WMESH_ENCRYPTION_CHACHA20
 		err = mbedtls_chacha20_crypt(
 			ctx->mbedtls_ctx,
-			encrypted->iv,
+			nonce,
 			0,
 			plaintext_length, plaintext,
-			encrypted->ciphertext
+			body
 		);
 	#elifdef CONFIG_WMESH_ENCRYPTION_DISABLED
 		err = 0;
-		memcpy(encrypted->ciphertext, plaintext, plaintext_length);
+		memmove(body, plaintext, plaintext_length);
 	#endif
 
 	if(err != 0) {
 		return ESP_FAIL;
 	}
 
+	#if CONFIG_WMESH_ENCRYPTION_PROFILE
+		uint32_t end_time = wmesh_profile_now();
+		ctx->profile.frames++;
+		ctx->profile.nonce_time += (uint32_t) (nonce_time - start_time);
+		ctx->profile.aead_time += (uint32_t) (end_time - nonce_time);
+	#endif
+
+	*ciphertext_length = WMESH_CIPHERTEXT_HEADER_LENGTH + plaintext_length;
+
+	#if CONFIG_WMESH_FRAME_COMPACT
+		size_t counter_length = compact_counter_length(send_counter);
+		memcpy(body + plaintext_length, &send_counter, counter_length);
+		ciphertext[0] = WMESH_COMPACT_FORMAT(counter_length);
+		*ciphertext_length += counter_length;
+	#endif
+
 	*ctr += 1;
 	return ESP_OK;
 }
@@ -140,20 +219,28 @@ esp_err_t wmesh_encrypt_aad(
 
 wmesh_decrypt_status_t wmesh_decrypt(
 	wmesh_encryption_ctx_t *ctx,
-	wmesh_encryption_ctr_t *ctr,
+	wmesh_replay_window_t *window,
+	const wmesh_address_t src,
 
 	const uint8_t *ciphertext,
 	size_t ciphertext_length,
 
-	uint8_t *plaintext
+	uint8_t *plaintext,
+	size_t *plaintext_length
 ) {
-	return wmesh_decrypt_aad(ctx, ctr, ciphertext, ciphertext_length, NULL, 0, plaintext);
+	return wmesh_decrypt_aad(
+		ctx, window, src,
+		ciphertext, ciphertext_length,
+		NULL, 0,
+		plaintext, plaintext_length
+	);
 }
 
 
 wmesh_decrypt_status_t wmesh_decrypt_aad(
 	wmesh_encryption_ctx_t *ctx,
-	wmesh_encryption_ctr_t *ctr,
+	wmesh_replay_window_t *window,
+	const wmesh_address_t src,
 
 	const uint8_t *ciphertext,
 	size_t ciphertext_length,
@@ -161,106 +248,294 @@ wmesh_decrypt_status_t wmesh_decrypt_aad(
 	const uint8_t *aad,
 	size_t aad_size,
 
-	uint8_t *plaintext
+	uint8_t *plaintext,
+	size_t *plaintext_length
 ) {
-
-	// Input structure is:
-	// |  IV  |  Nonce  |  Tag  |   Ciphertext   |
-	struct encrypted_message *encrypted = (struct encrypted_message *) ciphertext;
-
-	if(ciphertext_length < WMESH_CIPHERTEXT_BASE_LENGTH) {
+	if(ciphertext_length < WMESH_CIPHERTEXT_MIN_OVERHEAD) {
 		return WMESH_DECRYPT_ERROR;
 	}
-	size_t data_length = WMESH_PLAINTEXT_LENGTH(ciphertext_length);
 
 	wmesh_encryption_ctr_t received_ctr = 0;
-	memcpy(&received_ctr, encrypted->iv + CONFIG_WMESH_ENCRYPTION_IV_LENGTH, CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH);
-	if(*ctr >= received_ctr) {
+
+	#if CONFIG_WMESH_FRAME_COMPACT
+		// Input structure is:
+		// |  Format  |  Tag  |   Ciphertext   |  Counter  |
+		// Frames sent with a different tag length are rejected, so the tag
+		// cannot be shortened by an attacker.
+		uint8_t format = ciphertext[0];
+		size_t counter_length = (format & 0x07) + 1;
+		if(
+			(format & ~0x07) != (WMESH_COMPACT_FORMAT(1) & ~0x07) ||
+			counter_length > CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH ||
+			ciphertext_length < WMESH_CIPHERTEXT_HEADER_LENGTH + counter_length
+		) {
+			return WMESH_DECRYPT_ERROR;
+		}
+		size_t data_length = ciphertext_length - WMESH_CIPHERTEXT_HEADER_LENGTH - counter_length;
+		memcpy(&received_ctr, ciphertext + ciphertext_length - counter_length, counter_length);
+
+		uint8_t nonce[NONCE_SIZE] = { 0 };
+		memcpy(nonce, src, sizeof(wmesh_address_t));
+		memcpy(nonce + CONFIG_WMESH_ENCRYPTION_IV_LENGTH, &received_ctr, CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH);
+		const uint8_t *tag = ciphertext + 1;
+	#else
+		// Input structure is:
+		// |  IV  |  Nonce  |  Tag  |   Ciphertext   |
+		size_t data_length = ciphertext_length - WMESH_CIPHERTEXT_HEADER_LENGTH;
+		memcpy(&received_ctr, ciphertext + CONFIG_WMESH_ENCRYPTION_IV_LENGTH, CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH);
+
+		const uint8_t *nonce = ciphertext;
+		const uint8_t *tag = ciphertext + NONCE_SIZE;
+	#endif
+	const uint8_t *body = ciphertext + WMESH_CIPHERTEXT_HEADER_LENGTH;
+
+	if(!replay_window_check(window, received_ctr)) {
 		return WMESH_DECRYPT_STALE;
 	}
 
 	int err;
+	wmesh_decrypt_status_t status;
 	#ifdef ENC_TYPE_GCM
 		err = mbedtls_gcm_auth_decrypt(
 			&ctx->mbedtls_ctx,
 			data_length,
-			encrypted->iv, CONFIG_WMESH_ENCRYPTION_IV_LENGTH + CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH,
+			nonce, NONCE_SIZE,
 			aad, aad_size,
-			encrypted->tag, CONFIG_WMESH_ENCRYPTION_TAG_LENGTH,
-			encrypted->ciphertext, plaintext
+			tag, CONFIG_WMESH_ENCRYPTION_TAG_LENGTH,
+			body, plaintext
 		);
 
 		switch(err) {
 			case 0:
-				*ctr = received_ctr;
-				return WMESH_DECRYPT_OK;
+				status = WMESH_DECRYPT_OK;
+				break;
 
 			case MBEDTLS_ERR_GCM_AUTH_FAILED:
-				return WMESH_DECRYPT_AUTH_ERROR;
+				status = WMESH_DECRYPT_AUTH_ERROR;
+				break;
 
 			default:
-				return WMESH_DECRYPT_ERROR;
+				status = WMESH_DECRYPT_ERROR;
+				break;
 		}
 
 	#elifdef CONFIG_WMESH_ENCRYPTION_CHACHA20_POLY1305
-		err = mbedtls_chachapoly_auth_decrypt(
-			&ctx->mbedtls_ctx,
-			data_length,
-			encrypted->iv,
-			aad, aad_size,
-			encrypted->tag,
-			encrypted->ciphertext,
-			plaintext
-		);
+		#if CONFIG_WMESH_ENCRYPTION_TAG_LENGTH < 16
+			err = chachapoly_auth_decrypt_truncated(
+				&ctx->mbedtls_ctx,
+				data_length,
+				nonce,
+				aad, aad_size,
+				tag,
+				body,
+				plaintext
+			);
+		#else
+			err = mbedtls_chachapoly_auth_decrypt(
+				&ctx->mbedtls_ctx,
+				data_length,
+				nonce,
+				aad, aad_size,
+				tag,
+				body,
+				plaintext
+			);
+		#endif
 
 		switch(err) {
 			case 0:
-				*ctr = received_ctr;
-				return WMESH_DECRYPT_OK;
+				status = WMESH_DECRYPT_OK;
+				break;
 
 			case MBEDTLS_ERR_CHACHAPOLY_AUTH_FAILED:
-				return WMESH_DECRYPT_AUTH_ERROR;
+				status = WMESH_DECRYPT_AUTH_ERROR;
+				break;
 
 			default:
-				return WMESH_DECRYPT_ERROR;
+				status = WMESH_DECRYPT_ERROR;
+				break;
 		}
 
 	#elifdef CONFIG_WMESH_ENCRYPTION_CHACHA20
 		err = mbedtls_chacha20_crypt(
 			ctx->mbedtls_ctx,
-			encrypted->iv,
+			nonce,
 			0,
-			data_length, encrypted->ciphertext,
+			data_length, body,
 			plaintext
 		);
 
-		switch(err) {
-			case 0:
-				*ctr = received_ctr;
-				return WMESH_DECRYPT_OK;
-
-			default:
-				return WMESH_DECRYPT_ERROR;
-		}
+		status = err == 0 ? WMESH_DECRYPT_OK : WMESH_DECRYPT_ERROR;
 
 	#elifdef CONFIG_WMESH_ENCRYPTION_DISABLED
-		memcpy(plaintext, encrypted->ciphertext, data_length);
-		err = WMESH_DECRYPT_OK;
-		return err;
+		memmove(plaintext, body, data_length);
+		status = WMESH_DECRYPT_OK;
 	#endif
 
+	// Only authenticated counters may move the window.
+	if(status == WMESH_DECRYPT_OK) {
+		replay_window_update(window, received_ctr);
+		*plaintext_length = data_length;
+	}
+
+	return status;
+}
+
+
+esp_err_t wmesh_encrypt_inplace(
+	wmesh_encryption_ctx_t *ctx,
+	wmesh_encryption_ctr_t *ctr,
+
+	uint8_t *frame,
+	size_t plaintext_length,
+	size_t *frame_length
+) {
+	// The header is written in front of the plaintext, and the ciphertext
+	// over it.
+	return wmesh_encrypt_aad(
+		ctx, ctr,
+		frame + WMESH_CIPHERTEXT_HEADER_LENGTH, plaintext_length,
+		NULL, 0,
+		frame, frame_length
+	);
+}
+
+
+wmesh_decrypt_status_t wmesh_decrypt_inplace(
+	wmesh_encryption_ctx_t *ctx,
+	wmesh_replay_window_t *window,
+	const wmesh_address_t src,
+
+	uint8_t *frame,
+	size_t frame_length,
+
+	uint8_t **plaintext,
+	size_t *plaintext_length
+) {
+	// Both ciphers read each block before overwriting it, and the nonce,
+	// tag and counter lie outside the ciphertext, so the output may overlap
+	// the input.
+	*plaintext = frame + WMESH_CIPHERTEXT_HEADER_LENGTH;
+	return wmesh_decrypt_aad(
+		ctx, window, src,
+		frame, frame_length,
+		NULL, 0,
+		*plaintext, plaintext_length
+	);
+}
+
+
+void wmesh_replay_window_init(wmesh_replay_window_t *window) {
+	// Counter 0 is never sent, mark it as seen.
+	window->last = 0;
+	window->bitmap = 1;
+}
+
+
+/// @brief Checks whether a counter is acceptable for the given window.
+///
+/// @return `true` if the counter is new, `false` if it was already accepted
+/// or is too old to tell.
+static bool replay_window_check(
+	const wmesh_replay_window_t *window,
+	wmesh_encryption_ctr_t ctr
+) {
+	if(ctr > window->last) {
+		return true;
+	}
+
+	wmesh_encryption_ctr_t offset = window->last - ctr;
+	if(offset >= CONFIG_WMESH_REPLAY_WINDOW_SIZE) {
+		return false;
+	}
+
+	return (window->bitmap & (UINT64_C(1) << offset)) == 0;
+}
+
+
+/// @brief Marks a counter as accepted, sliding the window if needed.
+static void replay_window_update(
+	wmesh_replay_window_t *window,
+	wmesh_encryption_ctr_t ctr
+) {
+	if(ctr > window->last) {
+		wmesh_encryption_ctr_t shift = ctr - window->last;
+		window->bitmap = shift >= 64 ? 0 : window->bitmap << shift;
+		window->bitmap |= 1;
+		window->last = ctr;
+	} else {
+		window->bitmap |= UINT64_C(1) << (window->last - ctr);
+	}
 }
 
 
 static void generate_iv(uint8_t iv[CONFIG_WMESH_ENCRYPTION_IV_LENGTH]) {
+	memset(iv, 0, CONFIG_WMESH_ENCRYPTION_IV_LENGTH);
+
 	#ifdef CONFIG_WMESH_ENCRYPTION_IV_SOURCE_MAC
-		esp_read_mac(iv, ESP_MAC_WIFI_SOFTAP);
+		wmesh_address_t mac;
+		wmesh_transport_get_address(mac);
+		memcpy(iv, mac, CONFIG_WMESH_ENCRYPTION_IV_LENGTH < sizeof(mac) ? CONFIG_WMESH_ENCRYPTION_IV_LENGTH : sizeof(mac));
 	#elifdef CONFIG_WMESH_ENCRYPTION_IV_SOURCE_RANDOM
 		esp_fill_random(iv, CONFIG_WMESH_ENCRYPTION_IV_LENGTH);
 	#endif
 }
 
 
+#if CONFIG_WMESH_FRAME_COMPACT
+	/// @brief Gets the number of bytes needed to send a counter, without its
+	/// leading zero bytes.
+	static size_t compact_counter_length(wmesh_encryption_ctr_t ctr) {
+		size_t length = 1;
+		while(length < CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH && (ctr >> (8 * length)) != 0) {
+			length++;
+		}
+
+		return length;
+	}
+#endif
+
+
+#if CONFIG_WMESH_ENCRYPTION_CHACHA20_POLY1305 && CONFIG_WMESH_ENCRYPTION_TAG_LENGTH < 16
+	/// @brief Same as `mbedtls_chachapoly_auth_decrypt`, but only checks the
+	/// first `CONFIG_WMESH_ENCRYPTION_TAG_LENGTH` bytes of the tag.
+	static int chachapoly_auth_decrypt_truncated(
+		mbedtls_chachapoly_context *ctx,
+		size_t length,
+		const uint8_t nonce[12],
+		const uint8_t *aad, size_t aad_size,
+		const uint8_t *tag,
+		const uint8_t *input,
+		uint8_t *output
+	) {
+		uint8_t expected[16];
+		int err;
+
+		if(
+			(err = mbedtls_chachapoly_starts(ctx, nonce, MBEDTLS_CHACHAPOLY_DECRYPT)) != 0 ||
+			(err = mbedtls_chachapoly_update_aad(ctx, aad, aad_size)) != 0 ||
+			(err = mbedtls_chachapoly_update(ctx, length, input, output)) != 0 ||
+			(err = mbedtls_chachapoly_finish(ctx, expected)) != 0
+		) {
+			return err;
+		}
+
+		// Constant time, so the tag cannot be guessed byte by byte.
+		uint8_t diff = 0;
+		for(size_t i = 0; i < CONFIG_WMESH_ENCRYPTION_TAG_LENGTH; i++) {
+			diff |= expected[i] ^ tag[i];
+		}
+
+		if(diff != 0) {
+			memset(output, 0, length);
+			return MBEDTLS_ERR_CHACHAPOLY_AUTH_FAILED;
+		}
+
+		return 0;
+	}
+#endif
+
+
 static void init_mbedtls_context(wmesh_encryption_mbedtls_ctx_t *ctx) {
 	#ifdef ENC_TYPE_GCM
 		mbedtls_gcm_init(ctx);
@@ -0,0 +1,113 @@
+#include "wmesh/fragment.h"
+
+#include <string.h>
+
+
+void wmesh_reassembly_init(wmesh_reassembly_t *reassembly) {
+	for(size_t i = 0; i < CONFIG_WMESH_REASSEMBLY_SLOTS; i++) {
+		reassembly->slots[i].in_use = false;
+	}
+
+	reassembly->completed = 0;
+	reassembly->timeouts = 0;
+	reassembly->evicted = 0;
+	reassembly->dropped = 0;
+}
+
+
+wmesh_reassembly_slot_t *wmesh_reassembly_add(
+	wmesh_reassembly_t *reassembly,
+	const wmesh_address_t src,
+	const wmesh_fragment_header_t *header,
+	const uint8_t *data,
+	size_t data_length,
+	int64_t now_us
+) {
+	if(
+		header->count == 0 || header->count > WMESH_FRAGMENT_MAX_COUNT ||
+		header->index >= header->count ||
+		header->total_length > CONFIG_WMESH_MAX_MESSAGE_SIZE ||
+		header->offset + data_length > header->total_length
+	) {
+		reassembly->dropped++;
+		return NULL;
+	}
+
+	// Fragments of several messages from the same sender may be interleaved,
+	// for instance when frames are reordered, so messages are told apart by
+	// sender and message ID.
+	wmesh_reassembly_slot_t *slot = NULL;
+	wmesh_reassembly_slot_t *free_slot = NULL;
+	wmesh_reassembly_slot_t *oldest = NULL;
+	for(size_t i = 0; i < CONFIG_WMESH_REASSEMBLY_SLOTS; i++) {
+		wmesh_reassembly_slot_t *current = &reassembly->slots[i];
+
+		if(current->in_use && now_us - current->last_update_us >= CONFIG_WMESH_REASSEMBLY_TIMEOUT_MS * 1000LL) {
+			current->in_use = false;
+			reassembly->timeouts++;
+		}
+
+		if(!current->in_use) {
+			if(!free_slot) {
+				free_slot = current;
+			}
+			continue;
+		}
+
+		if(
+			current->message_id == header->message_id &&
+			memcmp(current->src, src, sizeof(wmesh_address_t)) == 0
+		) {
+			slot = current;
+		}
+
+		if(!oldest || current->last_update_us < oldest->last_update_us) {
+			oldest = current;
+		}
+	}
+
+	if(!slot) {
+		// The message which went longest without a fragment is the least
+		// likely to be completed.
+		if(!free_slot) {
+			oldest->in_use = false;
+			reassembly->evicted++;
+			free_slot = oldest;
+		}
+
+		slot = free_slot;
+		memcpy(slot->src, src, sizeof(wmesh_address_t));
+		slot->message_id = header->message_id;
+		slot->service = header->service;
+		slot->length = header->total_length;
+		slot->count = header->count;
+		slot->received = 0;
+		slot->in_use = true;
+
+	} else if(
+		slot->count != header->count ||
+		slot->length != header->total_length ||
+		slot->service != header->service
+	) {
+		reassembly->dropped++;
+		return NULL;
+	}
+
+	memcpy(slot->data + header->offset, data, data_length);
+	slot->received |= UINT64_C(1) << header->index;
+	slot->last_update_us = now_us;
+
+	uint64_t complete = slot->count == WMESH_FRAGMENT_MAX_COUNT ?
+		UINT64_MAX : (UINT64_C(1) << slot->count) - 1;
+	if(slot->received != complete) {
+		return NULL;
+	}
+
+	reassembly->completed++;
+	return slot;
+}
+
+
+void wmesh_reassembly_release(wmesh_reassembly_slot_t *slot) {
+	slot->in_use = false;
+}
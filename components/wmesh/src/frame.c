@@ -0,0 +1,40 @@
+#include "wmesh/frame.h"
+
+
+void wmesh_frame_pool_init(wmesh_frame_pool_t *pool) {
+	pool->free_list = NULL;
+	for(size_t i = 0; i < WMESH_FRAME_POOL_FRAMES; i++) {
+		pool->frames[i].next = pool->free_list;
+		pool->free_list = &pool->frames[i];
+	}
+
+	pool->exhausted_count = 0;
+	portMUX_INITIALIZE(&pool->lock);
+}
+
+
+wmesh_frame_t *wmesh_frame_pool_get(wmesh_frame_pool_t *pool) {
+	portENTER_CRITICAL(&pool->lock);
+
+	wmesh_frame_t *frame = pool->free_list;
+	if(frame) {
+		pool->free_list = frame->next;
+	} else {
+		pool->exhausted_count++;
+	}
+
+	portEXIT_CRITICAL(&pool->lock);
+	return frame;
+}
+
+
+void wmesh_frame_pool_put(wmesh_frame_pool_t *pool, wmesh_frame_t *frame) {
+	if(!frame) {
+		return;
+	}
+
+	portENTER_CRITICAL(&pool->lock);
+	frame->next = pool->free_list;
+	pool->free_list = frame;
+	portEXIT_CRITICAL(&pool->lock);
+}
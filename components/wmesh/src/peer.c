@@ -1,29 +1,72 @@
 #include "wmesh/peer.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include "esp_log.h"
+#include "wmesh/peer_table.h"
 
 static const char *TAG = "Mesh";
 
 
+static size_t find_bucket(
+	const wmesh_peer_list_t *list,
+	const wmesh_address_t address
+);
+static void remove_bucket(wmesh_peer_list_t *list, size_t bucket);
+static wmesh_parked_peer_t *find_parked(
+	const wmesh_peer_list_t *list,
+	const wmesh_address_t address
+);
+static wmesh_peer_t *find_known(
+	wmesh_peer_list_t *list,
+	const wmesh_address_t address
+);
+static void unpark(wmesh_peer_list_t *list, wmesh_parked_peer_t *parked);
+static bool park(
+	wmesh_peer_list_t *list,
+	const wmesh_peer_t *peer,
+	wmesh_peer_table_t *table
+);
+static void peer_to_record(
+	const wmesh_peer_t *peer,
+	wmesh_peer_table_record_t *record
+);
+static wmesh_storage_result_t load_legacy(
+	wmesh_peer_t *peer,
+	wmesh_peer_table_t *table,
+	const wmesh_address_t address
+);
+
+
 void wmesh_peer_new(wmesh_peer_t *peer, const wmesh_address_t address) {
 	memcpy(peer->address, address, sizeof(wmesh_address_t));
-	peer->sequence = 0;
+	wmesh_replay_window_init(&peer->window);
+	wmesh_reliable_rx_init(&peer->reliable);
+	#if CONFIG_WMESH_RATE_CONTROL
+		wmesh_rate_init(&peer->rate);
+	#endif
+	wmesh_counters_init(&peer->counters);
+	peer->last_seen = 0;
 	peer->dirty = false;
+	peer->large_frames = false;
 }
 
 
-wmesh_decrypt_status_t wmesh_peer_decrypt(
+wmesh_decrypt_status_t wmesh_peer_decrypt_inplace(
 	wmesh_peer_t *peer,
 	wmesh_encryption_ctx_t *encryption_ctx,
 
-	const uint8_t *ciphertext,
-	size_t ciphertext_size,
+	uint8_t *frame,
+	size_t frame_size,
 
-	uint8_t *plaintext
+	uint8_t **plaintext,
+	size_t *plaintext_length
 ) {
-	wmesh_decrypt_status_t err;
-	err = wmesh_decrypt(encryption_ctx, &peer->sequence, ciphertext, ciphertext_size, plaintext);
+	wmesh_decrypt_status_t err = wmesh_decrypt_inplace(
+		encryption_ctx, &peer->window, peer->address,
+		frame, frame_size,
+		plaintext, plaintext_length
+	);
 
 	if(err == WMESH_DECRYPT_OK) {
 		peer->dirty = true;
@@ -35,19 +78,20 @@ wmesh_decrypt_status_t wmesh_peer_decrypt(
 
 wmesh_storage_result_t wmesh_peer_store(
 	wmesh_peer_t *peer,
-	wmesh_storage_handle_t *storage_handle
+	wmesh_peer_table_t *table
 ) {
 	if(!peer->dirty) {
 		return WMESH_STORAGE_OK;
 	}
 
-	char address_str[sizeof(wmesh_address_t) * 2 + 1] = "";
-	sprintf(
-		address_str, "%02X%02X%02X%02X%02X%02X",
-		peer->address[0], peer->address[1], peer->address[2],
-		peer->address[3], peer->address[4], peer->address[5]
+	wmesh_peer_table_record_t record;
+	peer_to_record(peer, &record);
+
+	wmesh_storage_result_t err = wmesh_peer_table_update(
+		table,
+		wmesh_peer_table_shard(peer->address),
+		&record, 1
 	);
-	wmesh_storage_result_t err = wmesh_storage_write_ctr(storage_handle, address_str, &peer->sequence);
 
 	if(err == WMESH_STORAGE_OK) {
 		peer->dirty = false;
@@ -59,9 +103,55 @@ wmesh_storage_result_t wmesh_peer_store(
 
 wmesh_storage_result_t wmesh_peer_load(
 	wmesh_peer_t *peer,
-	wmesh_storage_handle_t *storage_handle,
+	wmesh_peer_table_t *table,
+	const wmesh_address_t address
+) {
+	memcpy(peer->address, address, sizeof(wmesh_address_t));
+	wmesh_reliable_rx_init(&peer->reliable);
+	#if CONFIG_WMESH_RATE_CONTROL
+		wmesh_rate_init(&peer->rate);
+	#endif
+	wmesh_counters_init(&peer->counters);
+	peer->last_seen = 0;
+	peer->dirty = false;
+	peer->large_frames = false;
+
+	const wmesh_peer_table_record_t *records;
+	size_t count;
+	wmesh_storage_result_t err = wmesh_peer_table_read(
+		table,
+		wmesh_peer_table_shard(address),
+		&records, &count
+	);
+	if(err == WMESH_STORAGE_ERROR) {
+		return err;
+	}
+
+	if(err == WMESH_STORAGE_OK) {
+		const wmesh_peer_table_record_t *record = wmesh_peer_table_find(records, count, address);
+		if(record) {
+			peer->window.last = record->last;
+			peer->window.bitmap = record->bitmap;
+			peer->large_frames = record->flags & WMESH_PEER_TABLE_LARGE_FRAMES;
+			return WMESH_STORAGE_OK;
+		}
+	}
+
+	return load_legacy(peer, table, address);
+}
+
+
+/// @brief Loads a peer stored before the peer table was introduced, under its
+/// own key. The peer is moved into the peer table, and its key erased, so
+/// later lookups don't need to search for it again.
+///
+/// @return See `wmesh_peer_load`.
+static wmesh_storage_result_t load_legacy(
+	wmesh_peer_t *peer,
+	wmesh_peer_table_t *table,
 	const wmesh_address_t address
 ) {
+	wmesh_storage_result_t err;
 
 	char address_str[sizeof(wmesh_address_t) * 2 + 1] = "";
 	sprintf(
@@ -71,50 +161,277 @@ wmesh_storage_result_t wmesh_peer_load(
 	);
 
 	memcpy(peer->address, address, sizeof(wmesh_address_t));
+	wmesh_reliable_rx_init(&peer->reliable);
+	#if CONFIG_WMESH_RATE_CONTROL
+		wmesh_rate_init(&peer->rate);
+	#endif
+	wmesh_counters_init(&peer->counters);
+	peer->last_seen = 0;
 	peer->dirty = false;
-	return wmesh_storage_read_ctr(storage_handle, address_str, &peer->sequence);
+	peer->large_frames = false;
+
+	err = wmesh_storage_read_window(table->storage, address_str, &peer->window);
+	if(err == WMESH_STORAGE_NOT_FOUND) {
+		// Peers stored before replay windows were introduced only have a
+		// counter. Treat every older sequence number as already received.
+		err = wmesh_storage_read_ctr(table->storage, address_str, &peer->window.last);
+		peer->window.bitmap = UINT64_MAX;
+	}
+	if(err != WMESH_STORAGE_OK) {
+		return err;
+	}
+
+	// The legacy key is only erased once the peer is safely in the table.
+	wmesh_peer_table_record_t record;
+	peer_to_record(peer, &record);
+	if(wmesh_peer_table_update(table, wmesh_peer_table_shard(address), &record, 1) == WMESH_STORAGE_OK) {
+		if(wmesh_storage_erase(table->storage, address_str) == WMESH_STORAGE_ERROR) {
+			ESP_LOGW(TAG, "Error erasing migrated peer %s", address_str);
+		}
+	}
+
+	return WMESH_STORAGE_OK;
 }
 
 
-wmesh_storage_result_t wmesh_peer_list_store(
+wmesh_storage_result_t wmesh_peer_list_preload(
 	wmesh_peer_list_t *list,
-	wmesh_storage_handle_t *storage_handle
+	wmesh_peer_table_t *table
 ) {
 	wmesh_storage_result_t err = WMESH_STORAGE_OK;
+	bool complete = true;
 
-	for(size_t i = 0; i < list->peer_count; i++) {
-		wmesh_storage_result_t current_err =
-			wmesh_peer_store(&list->peers[i], storage_handle);
+	for(size_t shard = 0; shard < CONFIG_WMESH_PEER_TABLE_SHARDS; shard++) {
+		const wmesh_peer_table_record_t *records;
+		size_t count;
+		wmesh_storage_result_t shard_err = wmesh_peer_table_read(table, shard, &records, &count);
+
+		if(shard_err == WMESH_STORAGE_NOT_FOUND) {
+			continue;
+		}
+
+		if(shard_err == WMESH_STORAGE_ERROR) {
+			err = shard_err;
+			complete = false;
+			continue;
+		}
 
-		if(current_err != WMESH_STORAGE_OK) {
-			err = current_err;
+		for(size_t i = 0; i < count; i++) {
+			if(wmesh_peer_list_get(list, records[i].address)) {
+				continue;
+			}
+
+			wmesh_peer_t peer;
+			wmesh_peer_new(&peer, records[i].address);
+			peer.window.last = records[i].last;
+			peer.window.bitmap = records[i].bitmap;
+			peer.large_frames = records[i].flags & WMESH_PEER_TABLE_LARGE_FRAMES;
+
+			if(wmesh_peer_list_add(list, peer) != ESP_OK) {
+				complete = false;
+				break;
+			}
 		}
 	}
 
+	list->preloaded = complete;
 	return err;
 }
 
 
-wmesh_peer_t* wmesh_peer_list_get(
+wmesh_storage_result_t wmesh_peer_list_store(
 	wmesh_peer_list_t *list,
-	const wmesh_address_t address
+	wmesh_peer_table_t *table
 ) {
+	size_t dirty_count = 0;
+	for(size_t i = 0; i < list->peer_count; i++) {
+		if(list->peers[i].dirty) {
+			dirty_count++;
+		}
+	}
+	for(size_t i = 0; i < list->parked_count; i++) {
+		if(list->parked[i].peer.dirty) {
+			dirty_count++;
+		}
+	}
+
+	if(dirty_count == 0) {
+		return WMESH_STORAGE_OK;
+	}
+
+	wmesh_peer_table_record_t *records = malloc(dirty_count * sizeof(*records));
+	if(!records) {
+		return WMESH_STORAGE_ERROR;
+	}
+
+	size_t count = wmesh_peer_list_collect(list, records, 0);
+	size_t remaining = wmesh_peer_records_store(table, records, count);
+
+	// Peers which could not be stored are written again next time.
+	for(size_t i = 0; i < list->parked_count; i++) {
+		list->parked[i].flushing = false;
+	}
+	for(size_t i = 0; i < remaining; i++) {
+		wmesh_peer_t *peer = find_known(list, records[i].address);
+		if(peer) {
+			peer->dirty = true;
+		}
+	}
+
+	free(records);
+	return remaining == 0 ? WMESH_STORAGE_OK : WMESH_STORAGE_ERROR;
+}
+
+
+size_t wmesh_peer_list_collect(
+	wmesh_peer_list_t *list,
+	wmesh_peer_table_record_t *records,
+	size_t count
+) {
+	// The previous records are written, except those left over, so parked
+	// peers without a left over record may now be dropped. Left over records
+	// are not sorted, so they are searched one by one.
+	for(size_t i = 0; i < list->parked_count; i++) {
+		wmesh_parked_peer_t *parked = &list->parked[i];
+		if(!parked->flushing) {
+			continue;
+		}
+
+		bool left_over = false;
+		for(size_t j = 0; j < count && !left_over; j++) {
+			left_over = memcmp(records[j].address, parked->peer.address, sizeof(wmesh_address_t)) == 0;
+		}
+		parked->flushing = left_over;
+	}
+
+	// Records left over from a failed write are outdated if their peer
+	// changed again since. Peers with a left over record are never dropped,
+	// so each known peer has at most one record, and every record is kept
+	// until written.
+	size_t kept = 0;
+	for(size_t i = 0; i < count; i++) {
+		wmesh_peer_t *peer = find_known(list, records[i].address);
+		if(!peer || !peer->dirty) {
+			records[kept++] = records[i];
+		}
+	}
+
 	for(size_t i = 0; i < list->peer_count; i++) {
 		wmesh_peer_t *peer = &list->peers[i];
+		if(peer->dirty) {
+			peer_to_record(peer, &records[kept++]);
+			peer->dirty = false;
+		}
+	}
 
-		if(memcmp(peer->address, address, sizeof(wmesh_address_t)) == 0) {
-			return peer;
+	for(size_t i = 0; i < list->parked_count; i++) {
+		wmesh_parked_peer_t *parked = &list->parked[i];
+		if(parked->peer.dirty) {
+			peer_to_record(&parked->peer, &records[kept++]);
+			parked->peer.dirty = false;
+			parked->flushing = true;
 		}
 	}
 
-	return NULL;
+	return kept;
+}
+
+
+size_t wmesh_peer_records_store(
+	wmesh_peer_table_t *table,
+	wmesh_peer_table_record_t *records,
+	size_t count
+) {
+	// Only shards holding a changed peer are rewritten.
+	uint32_t shards = 0;
+	for(size_t i = 0; i < count; i++) {
+		shards |= UINT32_C(1) << wmesh_peer_table_shard(records[i].address);
+	}
+
+	if(shards == 0) {
+		return 0;
+	}
+
+	wmesh_peer_table_record_t *updates = malloc(count * sizeof(*updates));
+	if(!updates) {
+		return count;
+	}
+
+	uint32_t failed_shards = 0;
+	for(size_t shard = 0; shard < CONFIG_WMESH_PEER_TABLE_SHARDS; shard++) {
+		if(!(shards & (UINT32_C(1) << shard))) {
+			continue;
+		}
+
+		size_t update_count = 0;
+		for(size_t i = 0; i < count; i++) {
+			if(wmesh_peer_table_shard(records[i].address) == shard) {
+				updates[update_count++] = records[i];
+			}
+		}
+
+		if(wmesh_peer_table_update(table, shard, updates, update_count) != WMESH_STORAGE_OK) {
+			failed_shards |= UINT32_C(1) << shard;
+		}
+	}
+
+	free(updates);
+
+	size_t remaining = 0;
+	for(size_t i = 0; i < count; i++) {
+		if(failed_shards & (UINT32_C(1) << wmesh_peer_table_shard(records[i].address))) {
+			records[remaining++] = records[i];
+		}
+	}
+
+	return remaining;
+}
+
+
+wmesh_peer_t* wmesh_peer_list_get(
+	wmesh_peer_list_t *list,
+	const wmesh_address_t address
+) {
+	uint16_t entry = list->index[find_bucket(list, address)];
+	if(entry == 0) {
+		return NULL;
+	}
+
+	return &list->peers[entry - 1];
+}
+
+
+const wmesh_peer_t* wmesh_peer_list_get_parked(
+	const wmesh_peer_list_t *list,
+	const wmesh_address_t address
+) {
+	wmesh_parked_peer_t *parked = find_parked(list, address);
+	return parked ? &parked->peer : NULL;
+}
+
+
+bool wmesh_peer_list_can_insert(const wmesh_peer_list_t *list) {
+	if(
+		list->peer_count < CONFIG_WMESH_PEER_LIST_SIZE ||
+		list->parked_count < CONFIG_WMESH_PEER_PARKED_COUNT
+	) {
+		return true;
+	}
+
+	for(size_t i = 0; i < list->parked_count; i++) {
+		if(!list->parked[i].peer.dirty && !list->parked[i].flushing) {
+			return true;
+		}
+	}
+
+	return false;
 }
 
 
 wmesh_peer_t* wmesh_peer_list_get_or_create(
 	wmesh_peer_list_t *list,
 	const wmesh_address_t address,
-	wmesh_storage_handle_t *storage_handle
+	wmesh_peer_table_t *table
 ) {
 	wmesh_peer_t *peer_ptr = wmesh_peer_list_get(list, address);
 	if(peer_ptr != NULL) {
@@ -122,27 +439,88 @@ wmesh_peer_t* wmesh_peer_list_get_or_create(
 	}
 
 	wmesh_peer_t peer;
-	wmesh_storage_result_t load_err =
-		wmesh_peer_load(
-			&peer,
-			storage_handle,
-			address
-		);
+	if(wmesh_peer_list_fetch(list, address, table, &peer) == WMESH_STORAGE_ERROR) {
+		return NULL;
+	}
+
+	return wmesh_peer_list_insert(list, &peer, table);
+}
+
+
+wmesh_storage_result_t wmesh_peer_list_fetch(
+	wmesh_peer_list_t *list,
+	const wmesh_address_t address,
+	wmesh_peer_table_t *table,
+	wmesh_peer_t *peer
+) {
+	const wmesh_peer_t *parked = wmesh_peer_list_get_parked(list, address);
+	if(parked) {
+		memcpy(peer, parked, sizeof(*peer));
+		return WMESH_STORAGE_OK;
+	}
+
+	// Once the whole table is in memory, only peers stored in the old format
+	// may still be found in storage.
+	wmesh_storage_result_t load_err = list->preloaded ?
+		load_legacy(peer, table, address) :
+		wmesh_peer_load(peer, table, address);
 
 	if(load_err == WMESH_STORAGE_ERROR) {
 		ESP_LOGE(TAG, "Error loading peer.");
-		return NULL;
+		return load_err;
 	}
 
 	if(load_err == WMESH_STORAGE_NOT_FOUND) {
-		wmesh_peer_new(&peer, address);
+		wmesh_peer_new(peer, address);
+	} else {
+		list->reloads++;
 	}
 
-	if(wmesh_peer_list_add(list, peer) != ESP_OK) {
-		return NULL;
+	return load_err;
+}
+
+
+wmesh_peer_t* wmesh_peer_list_insert(
+	wmesh_peer_list_t *list,
+	const wmesh_peer_t *peer,
+	wmesh_peer_table_t *table
+) {
+	// The parked copy is outdated, and its slot leaves room to park the
+	// evicted peer.
+	wmesh_parked_peer_t *parked = find_parked(list, peer->address);
+	if(parked) {
+		unpark(list, parked);
+		list->unparked++;
+	}
+
+	size_t position = list->peer_count;
+
+	if(position == CONFIG_WMESH_PEER_LIST_SIZE) {
+		position = 0;
+		for(size_t i = 1; i < list->peer_count; i++) {
+			if(list->peers[i].last_seen < list->peers[position].last_seen) {
+				position = i;
+			}
+		}
+
+		wmesh_peer_t *evicted = &list->peers[position];
+		if(!park(list, evicted, table)) {
+			return NULL;
+		}
+
+		remove_bucket(list, find_bucket(list, evicted->address));
+		list->evictions++;
+		list->preloaded = false;
+	} else {
+		list->peer_count++;
 	}
 
-	return &list->peers[list->peer_count - 1];
+	wmesh_peer_t *peer_ptr = &list->peers[position];
+	memcpy(peer_ptr, peer, sizeof(*peer));
+	peer_ptr->last_seen = ++list->clock;
+	list->index[find_bucket(list, peer->address)] = position + 1;
+
+	return peer_ptr;
 }
 
 
@@ -154,8 +532,285 @@ esp_err_t wmesh_peer_list_add(
 		return ESP_ERR_NO_MEM;
 	}
 
+	peer.last_seen = ++list->clock;
 	memcpy(&list->peers[list->peer_count], &peer, sizeof(peer));
 	list->peer_count++;
+	list->index[find_bucket(list, peer.address)] = list->peer_count;
 
 	return ESP_OK;
 }
+
+
+void wmesh_peer_list_touch(wmesh_peer_list_t *list, wmesh_peer_t *peer) {
+	peer->last_seen = ++list->clock;
+}
+
+
+esp_err_t wmesh_peer_list_register(
+	wmesh_peer_list_t *list,
+	const wmesh_address_t address
+) {
+	wmesh_peer_registry_t *registry = &list->registry;
+	wmesh_peer_registration_t *free_entry = NULL;
+	wmesh_peer_registration_t *lru_entry = NULL;
+
+	registry->clock++;
+	for(size_t i = 0; i < CONFIG_WMESH_REGISTERED_PEER_COUNT; i++) {
+		wmesh_peer_registration_t *entry = &registry->entries[i];
+
+		if(!entry->in_use) {
+			if(!free_entry) {
+				free_entry = entry;
+			}
+			continue;
+		}
+
+		if(memcmp(entry->address, address, sizeof(wmesh_address_t)) == 0) {
+			entry->last_used = registry->clock;
+			registry->hits++;
+			return ESP_OK;
+		}
+
+		if(!lru_entry || entry->last_used < lru_entry->last_used) {
+			lru_entry = entry;
+		}
+	}
+
+	registry->misses++;
+
+	wmesh_peer_registration_t *entry = free_entry;
+	if(!entry) {
+		entry = lru_entry;
+		wmesh_transport_del_peer(entry->address);
+		entry->in_use = false;
+		registry->evictions++;
+	}
+
+	esp_err_t err = wmesh_transport_add_peer(address);
+	if(err != ESP_OK) {
+		return err;
+	}
+
+	memcpy(entry->address, address, sizeof(wmesh_address_t));
+	entry->last_used = registry->clock;
+	entry->in_use = true;
+
+	#if CONFIG_WMESH_RATE_CONTROL
+		// The driver starts every newly registered peer at its default rate.
+		wmesh_peer_t *peer = wmesh_peer_list_get(list, address);
+		if(peer && peer->rate.current != WMESH_RATE_DEFAULT) {
+			err = wmesh_transport_set_peer_rate(address, peer->rate.current);
+			if(err != ESP_OK) {
+				ESP_LOGW(TAG, "Error setting peer rate: %s", esp_err_to_name(err));
+			}
+		}
+	#endif
+
+	return ESP_OK;
+}
+
+
+esp_err_t wmesh_peer_list_set_large_frames(
+	wmesh_peer_list_t *list,
+	const wmesh_address_t address,
+	bool enabled
+) {
+	if(memcmp(address, wmesh_broadcast_address, sizeof(wmesh_address_t)) == 0) {
+		list->broadcast_large_frames = enabled;
+		return ESP_OK;
+	}
+
+	wmesh_peer_t *peer = find_known(list, address);
+	if(!peer) {
+		return ESP_ERR_NOT_FOUND;
+	}
+
+	if(peer->large_frames != enabled) {
+		peer->large_frames = enabled;
+		peer->dirty = true;
+	}
+	return ESP_OK;
+}
+
+
+size_t wmesh_peer_list_max_payload(
+	const wmesh_peer_list_t *list,
+	const wmesh_address_t address
+) {
+	bool large_frames = list->broadcast_large_frames;
+	if(memcmp(address, wmesh_broadcast_address, sizeof(wmesh_address_t)) != 0) {
+		const wmesh_peer_t *peer = find_known((wmesh_peer_list_t *) list, address);
+		large_frames = peer && peer->large_frames;
+	}
+
+	if(large_frames) {
+		return WMESH_FRAME_MAX_PAYLOAD;
+	}
+
+	return WMESH_FRAME_SMALL_PAYLOAD;
+}
+
+
+/// @brief Finds the index bucket for an address, using linear probing.
+///
+/// @return Position in `list->index` of the bucket holding `address`, or of
+/// the empty bucket where it would be inserted.
+static size_t find_bucket(
+	const wmesh_peer_list_t *list,
+	const wmesh_address_t address
+) {
+	size_t bucket = wmesh_address_hash(address) % WMESH_PEER_INDEX_SIZE;
+
+	// The index is never more than half full, so an empty bucket is always
+	// found.
+	while(list->index[bucket] != 0) {
+		const wmesh_peer_t *peer = &list->peers[list->index[bucket] - 1];
+		if(memcmp(peer->address, address, sizeof(wmesh_address_t)) == 0) {
+			break;
+		}
+
+		bucket = (bucket + 1) % WMESH_PEER_INDEX_SIZE;
+	}
+
+	return bucket;
+}
+
+
+/// @brief Empties an index bucket. Following buckets of the probe sequence
+/// are shifted back, so lookups never stop early at the emptied bucket.
+///
+/// @param list Peer list.
+/// @param bucket Position in `list->index` of the bucket to empty.
+static void remove_bucket(wmesh_peer_list_t *list, size_t bucket) {
+	size_t next = bucket;
+
+	while(true) {
+		next = (next + 1) % WMESH_PEER_INDEX_SIZE;
+		uint16_t entry = list->index[next];
+		if(entry == 0) {
+			break;
+		}
+
+		// An entry may only move back if the emptied bucket is not before
+		// its home bucket in the probe sequence.
+		size_t home = wmesh_address_hash(list->peers[entry - 1].address) % WMESH_PEER_INDEX_SIZE;
+		bool stays = bucket <= next ?
+			bucket < home && home <= next :
+			bucket < home || home <= next;
+		if(!stays) {
+			list->index[bucket] = entry;
+			bucket = next;
+		}
+	}
+
+	list->index[bucket] = 0;
+}
+
+
+/// @brief Finds a parked peer.
+///
+/// @return Parked peer, or `NULL` if not found.
+static wmesh_parked_peer_t *find_parked(
+	const wmesh_peer_list_t *list,
+	const wmesh_address_t address
+) {
+	for(size_t i = 0; i < list->parked_count; i++) {
+		const wmesh_parked_peer_t *parked = &list->parked[i];
+		if(memcmp(parked->peer.address, address, sizeof(wmesh_address_t)) == 0) {
+			return (wmesh_parked_peer_t *) parked;
+		}
+	}
+
+	return NULL;
+}
+
+
+/// @brief Finds a peer in the list, or parked.
+///
+/// @return Peer, or `NULL` if not found.
+static wmesh_peer_t *find_known(
+	wmesh_peer_list_t *list,
+	const wmesh_address_t address
+) {
+	wmesh_peer_t *peer = wmesh_peer_list_get(list, address);
+	if(peer) {
+		return peer;
+	}
+
+	wmesh_parked_peer_t *parked = find_parked(list, address);
+	return parked ? &parked->peer : NULL;
+}
+
+
+/// @brief Removes a parked peer. Later parked peers move down, so the oldest
+/// stays first.
+static void unpark(wmesh_peer_list_t *list, wmesh_parked_peer_t *parked) {
+	size_t position = parked - list->parked;
+	memmove(
+		parked, parked + 1,
+		(list->parked_count - position - 1) * sizeof(*parked)
+	);
+	list->parked_count--;
+}
+
+
+/// @brief Parks a peer removed from the list. When `parked` is full, the
+/// oldest parked peer already stored is dropped. If there is none, the
+/// oldest parked peer is written to `table`, and dropped.
+///
+/// @param list Peer list.
+/// @param peer Peer to park. Copied.
+/// @param table Peer table, or `NULL` to fail rather than write.
+///
+/// @return `false` if no parked peer could be dropped.
+static bool park(
+	wmesh_peer_list_t *list,
+	const wmesh_peer_t *peer,
+	wmesh_peer_table_t *table
+) {
+	if(list->parked_count == CONFIG_WMESH_PEER_PARKED_COUNT) {
+		size_t position = 0;
+		while(
+			position < list->parked_count &&
+			(list->parked[position].peer.dirty || list->parked[position].flushing)
+		) {
+			position++;
+		}
+
+		// Dropping a peer without storing its replay window would let its
+		// frames be replayed once it is reloaded.
+		if(position == list->parked_count) {
+			if(!table) {
+				return false;
+			}
+
+			position = 0;
+			if(wmesh_peer_store(&list->parked[position].peer, table) != WMESH_STORAGE_OK) {
+				ESP_LOGE(TAG, "Error storing evicted peer.");
+				return false;
+			}
+		}
+
+		unpark(list, &list->parked[position]);
+		list->dropped++;
+	}
+
+	// A record of the peer may be being written, so it is kept until the
+	// next `wmesh_peer_list_collect` knows the write succeeded.
+	wmesh_parked_peer_t *parked = &list->parked[list->parked_count++];
+	memcpy(&parked->peer, peer, sizeof(*peer));
+	parked->flushing = true;
+	return true;
+}
+
+
+/// @brief Converts a peer into its peer table record.
+static void peer_to_record(
+	const wmesh_peer_t *peer,
+	wmesh_peer_table_record_t *record
+) {
+	memcpy(record->address, peer->address, sizeof(wmesh_address_t));
+	record->last = peer->window.last;
+	record->bitmap = peer->window.bitmap;
+	record->flags = peer->large_frames ? WMESH_PEER_TABLE_LARGE_FRAMES : 0;
+}
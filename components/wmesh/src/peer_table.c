@@ -0,0 +1,299 @@
+#include "wmesh/peer_table.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+
+static const char *TAG = "Mesh";
+
+
+/// @brief Record of a version 1 shard.
+typedef struct __attribute__((packed)) {
+	wmesh_address_t address;
+	wmesh_encryption_ctr_t last;
+	uint64_t bitmap;
+} record_v1_t;
+
+
+/// @brief Builds the storage key of a shard.
+static void shard_key(size_t shard, char key[8]) {
+	snprintf(key, 8, "pt%02u", (unsigned) shard);
+}
+
+
+/// @brief Orders records by address.
+static int compare_records(const void *a, const void *b) {
+	const wmesh_peer_table_record_t *record_a = a;
+	const wmesh_peer_table_record_t *record_b = b;
+
+	return memcmp(record_a->address, record_b->address, sizeof(wmesh_address_t));
+}
+
+
+void wmesh_peer_table_init(wmesh_peer_table_t *table, wmesh_storage_handle_t *storage) {
+	table->storage = storage;
+	table->blob = NULL;
+	table->shard = SIZE_MAX;
+	table->hits = 0;
+	table->misses = 0;
+}
+
+
+void wmesh_peer_table_free(wmesh_peer_table_t *table) {
+	free(table->blob);
+	table->blob = NULL;
+	table->shard = SIZE_MAX;
+}
+
+
+/// @brief Gets the records of the cached shard.
+///
+/// @return Number of records.
+static size_t cached_records(
+	const wmesh_peer_table_t *table,
+	const wmesh_peer_table_record_t **records
+) {
+	if(!table->blob) {
+		*records = NULL;
+		return 0;
+	}
+
+	wmesh_peer_table_header_t header;
+	memcpy(&header, table->blob, sizeof(header));
+
+	// Records are packed, so they may be used in place.
+	*records = (const wmesh_peer_table_record_t *) (table->blob + sizeof(header));
+	return header.count;
+}
+
+
+/// @brief Converts a version 1 shard to the current format, in memory. It is
+/// only rewritten in the new format once a peer in it changes.
+///
+/// @param[inout] blob Shard, as stored. Replaced by the converted shard.
+/// @param[in] header Header of the shard.
+///
+/// @return `WMESH_STORAGE_OK` or `WMESH_STORAGE_ERROR`.
+static wmesh_storage_result_t upgrade_v1(uint8_t **blob, wmesh_peer_table_header_t header) {
+	uint8_t *upgraded = malloc(sizeof(header) + header.count * sizeof(wmesh_peer_table_record_t));
+	if(!upgraded) {
+		return WMESH_STORAGE_ERROR;
+	}
+
+	for(size_t i = 0; i < header.count; i++) {
+		record_v1_t old;
+		memcpy(&old, *blob + sizeof(header) + i * sizeof(old), sizeof(old));
+
+		wmesh_peer_table_record_t record;
+		memcpy(record.address, old.address, sizeof(wmesh_address_t));
+		record.last = old.last;
+		record.bitmap = old.bitmap;
+		record.flags = 0;
+		memcpy(upgraded + sizeof(header) + i * sizeof(record), &record, sizeof(record));
+	}
+
+	header.version = WMESH_PEER_TABLE_VERSION;
+	header.record_size = sizeof(wmesh_peer_table_record_t);
+	memcpy(upgraded, &header, sizeof(header));
+
+	free(*blob);
+	*blob = upgraded;
+	return WMESH_STORAGE_OK;
+}
+
+
+/// @brief Makes a shard the cached one, reading it from storage unless it
+/// already is. A missing or incompatible shard is cached as empty.
+///
+/// @return `WMESH_STORAGE_OK` or `WMESH_STORAGE_ERROR`.
+static wmesh_storage_result_t load_shard(wmesh_peer_table_t *table, size_t shard) {
+	if(table->shard == shard) {
+		table->hits++;
+		return WMESH_STORAGE_OK;
+	}
+
+	table->misses++;
+	wmesh_peer_table_free(table);
+
+	char key[8];
+	shard_key(shard, key);
+
+	size_t length = 0;
+	wmesh_storage_result_t err = wmesh_storage_read_blob(table->storage, key, NULL, &length);
+	if(err == WMESH_STORAGE_NOT_FOUND) {
+		table->shard = shard;
+		return WMESH_STORAGE_OK;
+	}
+	if(err != WMESH_STORAGE_OK) {
+		return err;
+	}
+
+	uint8_t *blob = malloc(length > 0 ? length : 1);
+	if(!blob) {
+		return WMESH_STORAGE_ERROR;
+	}
+
+	err = wmesh_storage_read_blob(table->storage, key, blob, &length);
+	if(err == WMESH_STORAGE_NOT_FOUND) {
+		free(blob);
+		table->shard = shard;
+		return WMESH_STORAGE_OK;
+	}
+	if(err != WMESH_STORAGE_OK) {
+		free(blob);
+		return err;
+	}
+
+	wmesh_peer_table_header_t header;
+	if(length >= sizeof(header)) {
+		memcpy(&header, blob, sizeof(header));
+	}
+
+	if(
+		length >= sizeof(header) &&
+		header.version == 1 &&
+		header.record_size == sizeof(record_v1_t) &&
+		length == sizeof(header) + header.count * sizeof(record_v1_t)
+	) {
+		err = upgrade_v1(&blob, header);
+		if(err != WMESH_STORAGE_OK) {
+			free(blob);
+			return err;
+		}
+	} else if(
+		length < sizeof(header) ||
+		header.version != WMESH_PEER_TABLE_VERSION ||
+		header.record_size != sizeof(wmesh_peer_table_record_t) ||
+		length != sizeof(header) + header.count * sizeof(wmesh_peer_table_record_t)
+	) {
+		ESP_LOGW(TAG, "Ignoring incompatible peer table shard %zu", shard);
+		free(blob);
+		table->shard = shard;
+		return WMESH_STORAGE_OK;
+	}
+
+	table->blob = blob;
+	table->shard = shard;
+	return WMESH_STORAGE_OK;
+}
+
+
+wmesh_storage_result_t wmesh_peer_table_read(
+	wmesh_peer_table_t *table,
+	size_t shard,
+	const wmesh_peer_table_record_t **records,
+	size_t *count
+) {
+	wmesh_storage_result_t err = load_shard(table, shard);
+	if(err != WMESH_STORAGE_OK) {
+		return err;
+	}
+
+	if(!table->blob) {
+		return WMESH_STORAGE_NOT_FOUND;
+	}
+
+	*count = cached_records(table, records);
+	return WMESH_STORAGE_OK;
+}
+
+
+wmesh_storage_result_t wmesh_peer_table_update(
+	wmesh_peer_table_t *table,
+	size_t shard,
+	wmesh_peer_table_record_t *updates,
+	size_t update_count
+) {
+	qsort(updates, update_count, sizeof(*updates), compare_records);
+
+	wmesh_storage_result_t err = load_shard(table, shard);
+	if(err != WMESH_STORAGE_OK) {
+		return err;
+	}
+
+	const wmesh_peer_table_record_t *stored;
+	size_t stored_count = cached_records(table, &stored);
+
+	size_t capacity = stored_count + update_count;
+	uint8_t *blob = malloc(sizeof(wmesh_peer_table_header_t) + capacity * sizeof(wmesh_peer_table_record_t));
+	if(!blob) {
+		return WMESH_STORAGE_ERROR;
+	}
+
+	// Both lists are sorted, so they are merged in a single pass. Updated
+	// records replace stored ones with the same address, unless the stored
+	// window is ahead: records may be written late by the flush task, after
+	// a newer copy was stored.
+	wmesh_peer_table_record_t *merged = (wmesh_peer_table_record_t *) (blob + sizeof(wmesh_peer_table_header_t));
+	size_t i = 0, j = 0, count = 0;
+	while(i < stored_count || j < update_count) {
+		int cmp =
+			i == stored_count ? 1 :
+			j == update_count ? -1 :
+			compare_records(&stored[i], &updates[j]);
+
+		if(cmp < 0) {
+			merged[count++] = stored[i++];
+		} else if(cmp == 0 && stored[i].last > updates[j].last) {
+			merged[count++] = stored[i++];
+			j++;
+		} else {
+			merged[count++] = updates[j++];
+			if(cmp == 0) {
+				i++;
+			}
+		}
+	}
+
+	wmesh_peer_table_header_t header = {
+		.version = WMESH_PEER_TABLE_VERSION,
+		.record_size = sizeof(wmesh_peer_table_record_t),
+		.count = count,
+	};
+	memcpy(blob, &header, sizeof(header));
+
+	char key[8];
+	shard_key(shard, key);
+	err = wmesh_storage_write_blob(
+		table->storage, key,
+		blob, sizeof(header) + count * sizeof(wmesh_peer_table_record_t)
+	);
+
+	// The written shard becomes the cached one. After an error, what is
+	// stored is unknown, so it is read again next time.
+	wmesh_peer_table_free(table);
+	if(err == WMESH_STORAGE_OK) {
+		table->blob = blob;
+		table->shard = shard;
+	} else {
+		free(blob);
+	}
+
+	return err;
+}
+
+
+const wmesh_peer_table_record_t *wmesh_peer_table_find(
+	const wmesh_peer_table_record_t *records,
+	size_t count,
+	const wmesh_address_t address
+) {
+	size_t low = 0;
+	size_t high = count;
+
+	while(low < high) {
+		size_t middle = low + (high - low) / 2;
+		int cmp = memcmp(records[middle].address, address, sizeof(wmesh_address_t));
+
+		if(cmp == 0) {
+			return &records[middle];
+		} else if(cmp < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,174 @@
+#include "wmesh/rate.h"
+
+#include <stddef.h>
+
+#if CONFIG_WMESH_RATE_CONTROL
+
+/// @brief Delivery probability below which a faster rate is abandoned for
+/// the next slower one, in 1/1000.
+#define FALLBACK_PROBABILITY 500
+
+
+/// @brief Bit rate and typical receiver sensitivity of every rate.
+static const struct {
+	uint16_t kbps;
+	int8_t sensitivity;
+} rates[WMESH_RATE_COUNT] = {
+	[WMESH_RATE_LORA_250K] = {250, -105},
+	[WMESH_RATE_LORA_500K] = {500, -102},
+	[WMESH_RATE_1M] = {1000, -97},
+	[WMESH_RATE_2M] = {2000, -94},
+	[WMESH_RATE_5M5] = {5500, -92},
+	[WMESH_RATE_6M] = {6000, -92},
+	[WMESH_RATE_9M] = {9000, -91},
+	[WMESH_RATE_11M] = {11000, -88},
+	[WMESH_RATE_12M] = {12000, -88},
+	[WMESH_RATE_18M] = {18000, -86},
+	[WMESH_RATE_24M] = {24000, -83},
+	[WMESH_RATE_36M] = {36000, -80},
+	[WMESH_RATE_48M] = {48000, -76},
+	[WMESH_RATE_54M] = {54000, -74},
+};
+
+
+static void evaluate(wmesh_rate_ctl_t *ctl);
+static wmesh_rate_t best_rate(const wmesh_rate_ctl_t *ctl);
+
+
+void wmesh_rate_init(wmesh_rate_ctl_t *ctl) {
+	for(size_t i = 0; i < WMESH_RATE_COUNT; i++) {
+		ctl->stats[i].probability = 0;
+		ctl->stats[i].measured = false;
+	}
+
+	ctl->current = WMESH_RATE_DEFAULT;
+	ctl->attempts = 0;
+	ctl->successes = 0;
+	ctl->evaluations = 0;
+	ctl->rssi = 0;
+	ctl->has_rssi = false;
+	ctl->started = false;
+}
+
+
+bool wmesh_rate_rssi(wmesh_rate_ctl_t *ctl, int8_t rssi) {
+	ctl->rssi = ctl->has_rssi ? (7 * ctl->rssi + rssi) / 8 : rssi;
+	ctl->has_rssi = true;
+
+	if(ctl->started) {
+		return false;
+	}
+
+	// Fastest rate which leaves enough margin over the receiver's
+	// sensitivity.
+	wmesh_rate_t rate = WMESH_RATE_LOWEST;
+	for(size_t i = WMESH_RATE_LOWEST; i < WMESH_RATE_COUNT; i++) {
+		if(rates[i].sensitivity + CONFIG_WMESH_RATE_RSSI_MARGIN <= ctl->rssi) {
+			rate = i;
+		}
+	}
+
+	bool changed = rate != ctl->current;
+	ctl->current = rate;
+	return changed;
+}
+
+
+bool wmesh_rate_feedback(wmesh_rate_ctl_t *ctl, bool success) {
+	ctl->started = true;
+	ctl->attempts++;
+	if(success) {
+		ctl->successes++;
+	}
+
+	if(ctl->attempts < CONFIG_WMESH_RATE_WINDOW) {
+		return false;
+	}
+
+	evaluate(ctl);
+	return true;
+}
+
+
+uint16_t wmesh_rate_kbps(wmesh_rate_t rate) {
+	return rates[rate].kbps;
+}
+
+
+int8_t wmesh_rate_sensitivity(wmesh_rate_t rate) {
+	return rates[rate].sensitivity;
+}
+
+
+/// @brief Ends an evaluation window, and chooses the rate for the next one.
+static void evaluate(wmesh_rate_ctl_t *ctl) {
+	wmesh_rate_stats_t *stats = &ctl->stats[ctl->current];
+	uint16_t sample = 1000 * ctl->successes / ctl->attempts;
+
+	stats->probability = stats->measured ? (3 * stats->probability + sample) / 4 : sample;
+	stats->measured = true;
+	ctl->attempts = 0;
+	ctl->successes = 0;
+
+	// A rate losing most frames means the link got worse, and faster rates
+	// would do no better than it. Their older measurements no longer hold.
+	if(sample < FALLBACK_PROBABILITY) {
+		for(size_t i = ctl->current + 1; i < WMESH_RATE_COUNT; i++) {
+			ctl->stats[i].measured = false;
+		}
+	}
+
+	wmesh_rate_t best = best_rate(ctl);
+
+	// A rate losing most frames may be doing worse than a slower one which
+	// has not been measured lately.
+	if(ctl->stats[best].probability < FALLBACK_PROBABILITY && best > WMESH_RATE_LOWEST) {
+		ctl->current = best - 1;
+		ctl->evaluations = 0;
+		return;
+	}
+
+	// Periodically try the next faster rate, unless the signal is known to
+	// be too weak for it.
+	ctl->evaluations++;
+	wmesh_rate_t faster = best + 1;
+	if(
+		ctl->evaluations >= CONFIG_WMESH_RATE_SAMPLE_INTERVAL &&
+		faster < WMESH_RATE_COUNT &&
+		(!ctl->has_rssi || ctl->rssi >= rates[faster].sensitivity)
+	) {
+		ctl->current = faster;
+		ctl->evaluations = 0;
+		return;
+	}
+
+	ctl->current = best;
+}
+
+
+/// @brief Finds the measured rate with the highest expected throughput.
+///
+/// @return Best rate. If no measured rate delivers any frame, the slowest
+/// measured rate.
+static wmesh_rate_t best_rate(const wmesh_rate_ctl_t *ctl) {
+	wmesh_rate_t best = WMESH_RATE_COUNT;
+	uint32_t best_throughput = 0;
+
+	for(size_t i = WMESH_RATE_LOWEST; i < WMESH_RATE_COUNT; i++) {
+		const wmesh_rate_stats_t *stats = &ctl->stats[i];
+		if(!stats->measured) {
+			continue;
+		}
+
+		uint32_t throughput = (uint32_t) stats->probability * rates[i].kbps;
+		if(best == WMESH_RATE_COUNT || throughput > best_throughput) {
+			best = i;
+			best_throughput = throughput;
+		}
+	}
+
+	// At least the current rate has been measured.
+	return best == WMESH_RATE_COUNT ? ctl->current : best;
+}
+
+#endif
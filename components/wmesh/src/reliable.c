@@ -0,0 +1,310 @@
+#include "wmesh/reliable.h"
+
+#include <string.h>
+#include "esp_random.h"
+
+/// @brief Retransmission timeout bounds, in microseconds.
+#define RTO_MIN_US (10 * 1000)
+#define RTO_MAX_US (2000 * 1000)
+
+
+static void channel_start(wmesh_reliable_channel_t *channel, const wmesh_address_t dest);
+static void update_rto(wmesh_reliable_channel_t *channel, uint32_t sample_us);
+
+
+void wmesh_reliable_tx_init(wmesh_reliable_tx_t *tx) {
+	for(size_t i = 0; i < CONFIG_WMESH_RELIABLE_CHANNELS; i++) {
+		tx->channels[i].in_use = false;
+	}
+
+	tx->sent = 0;
+	tx->retransmissions = 0;
+	tx->acked = 0;
+	tx->failed = 0;
+}
+
+
+wmesh_reliable_channel_t *wmesh_reliable_tx_channel(
+	wmesh_reliable_tx_t *tx,
+	const wmesh_address_t dest,
+	bool create
+) {
+	wmesh_reliable_channel_t *free_channel = NULL;
+	wmesh_reliable_channel_t *idle_channel = NULL;
+
+	for(size_t i = 0; i < CONFIG_WMESH_RELIABLE_CHANNELS; i++) {
+		wmesh_reliable_channel_t *channel = &tx->channels[i];
+
+		if(!channel->in_use) {
+			if(!free_channel) {
+				free_channel = channel;
+			}
+			continue;
+		}
+
+		if(memcmp(channel->dest, dest, sizeof(wmesh_address_t)) == 0) {
+			return channel;
+		}
+
+		if(!idle_channel && wmesh_reliable_channel_idle(channel)) {
+			idle_channel = channel;
+		}
+	}
+
+	if(!create) {
+		return NULL;
+	}
+
+	wmesh_reliable_channel_t *channel = free_channel ? free_channel : idle_channel;
+	if(channel) {
+		channel_start(channel, dest);
+	}
+
+	return channel;
+}
+
+
+wmesh_reliable_entry_t *wmesh_reliable_channel_push(
+	wmesh_reliable_tx_t *tx,
+	wmesh_reliable_channel_t *channel,
+	wmesh_service_id_t service,
+	const wmesh_iovec_t *iov,
+	size_t iov_count,
+	int64_t now_us
+) {
+	size_t data_length = wmesh_iovec_length(iov, iov_count);
+
+	// The slot is still taken by the frame sent one window ago.
+	wmesh_reliable_entry_t *entry = &channel->entries[channel->next_seq % CONFIG_WMESH_RELIABLE_WINDOW];
+	if(entry->in_use || data_length > WMESH_RELIABLE_MAX_PAYLOAD) {
+		return NULL;
+	}
+
+	wmesh_reliable_header_t header = {
+		.session = channel->session,
+		.seq = channel->next_seq++,
+		.service = service,
+	};
+
+	memcpy(entry->data, &header, sizeof(header));
+	wmesh_iovec_gather(entry->data + sizeof(header), iov, iov_count, 0, data_length);
+	entry->length = sizeof(header) + data_length;
+	entry->retries = 0;
+	entry->sent_us = now_us;
+	entry->deadline_us = now_us + channel->rto_us;
+	entry->in_use = true;
+
+	tx->sent++;
+	return entry;
+}
+
+
+size_t wmesh_reliable_channel_ack(
+	wmesh_reliable_tx_t *tx,
+	wmesh_reliable_channel_t *channel,
+	const wmesh_reliable_ack_t *ack,
+	int64_t now_us
+) {
+	if(ack->session != channel->session) {
+		return 0;
+	}
+
+	size_t acked = 0;
+	for(size_t i = 0; i < CONFIG_WMESH_RELIABLE_WINDOW; i++) {
+		wmesh_reliable_entry_t *entry = &channel->entries[i];
+		if(!entry->in_use) {
+			continue;
+		}
+
+		wmesh_reliable_header_t header;
+		memcpy(&header, entry->data, sizeof(header));
+
+		int16_t distance = (int16_t) (uint16_t) (header.seq - ack->next);
+		bool received = distance < 0 || (
+			distance > 0 && distance <= WMESH_RELIABLE_SACK_BITS &&
+			(ack->sack >> (distance - 1)) & 1
+		);
+		if(!received) {
+			continue;
+		}
+
+		// Karn's algorithm: acknowledgements of retransmitted frames are
+		// ambiguous, so they are not used as RTT samples.
+		if(entry->retries == 0) {
+			update_rto(channel, now_us - entry->sent_us);
+		}
+
+		entry->in_use = false;
+		acked++;
+	}
+
+	tx->acked += acked;
+	return acked;
+}
+
+
+wmesh_reliable_entry_t *wmesh_reliable_channel_expired(
+	wmesh_reliable_tx_t *tx,
+	wmesh_reliable_channel_t *channel,
+	int64_t now_us
+) {
+	for(size_t i = 0; i < CONFIG_WMESH_RELIABLE_WINDOW; i++) {
+		wmesh_reliable_entry_t *entry = &channel->entries[i];
+		if(!entry->in_use || entry->deadline_us > now_us) {
+			continue;
+		}
+
+		if(entry->retries >= CONFIG_WMESH_RELIABLE_MAX_RETRIES) {
+			entry->in_use = false;
+			channel->lost = true;
+			tx->failed++;
+			continue;
+		}
+
+		return entry;
+	}
+
+	return NULL;
+}
+
+
+void wmesh_reliable_entry_rearm(
+	wmesh_reliable_tx_t *tx,
+	const wmesh_reliable_channel_t *channel,
+	wmesh_reliable_entry_t *entry,
+	bool sent,
+	int64_t now_us
+) {
+	if(!sent) {
+		entry->deadline_us = now_us + RTO_MIN_US;
+		return;
+	}
+
+	entry->retries++;
+	uint64_t backoff_us = (uint64_t) channel->rto_us << entry->retries;
+	entry->deadline_us = now_us + (backoff_us < RTO_MAX_US ? backoff_us : RTO_MAX_US);
+
+	tx->retransmissions++;
+}
+
+
+bool wmesh_reliable_channel_idle(const wmesh_reliable_channel_t *channel) {
+	for(size_t i = 0; i < CONFIG_WMESH_RELIABLE_WINDOW; i++) {
+		if(channel->entries[i].in_use) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+int64_t wmesh_reliable_tx_next_deadline(const wmesh_reliable_tx_t *tx) {
+	int64_t deadline_us = INT64_MAX;
+
+	for(size_t i = 0; i < CONFIG_WMESH_RELIABLE_CHANNELS; i++) {
+		const wmesh_reliable_channel_t *channel = &tx->channels[i];
+		if(!channel->in_use) {
+			continue;
+		}
+
+		for(size_t j = 0; j < CONFIG_WMESH_RELIABLE_WINDOW; j++) {
+			const wmesh_reliable_entry_t *entry = &channel->entries[j];
+			if(entry->in_use && entry->deadline_us < deadline_us) {
+				deadline_us = entry->deadline_us;
+			}
+		}
+	}
+
+	return deadline_us;
+}
+
+
+void wmesh_reliable_rx_init(wmesh_reliable_rx_t *rx) {
+	rx->session = 0;
+	rx->next = 0;
+	rx->received = 0;
+	rx->active = false;
+}
+
+
+bool wmesh_reliable_rx_accept(
+	wmesh_reliable_rx_t *rx,
+	const wmesh_reliable_header_t *header,
+	wmesh_reliable_ack_t *ack
+) {
+	// A new session means the sender restarted. Sessions start at 0, but
+	// the sender only sends frame `n` once every frame up to
+	// `n - CONFIG_WMESH_RELIABLE_WINDOW` was acknowledged or dropped. Those
+	// are treated as already received.
+	if(!rx->active || rx->session != header->session) {
+		rx->session = header->session;
+		rx->next = header->seq < CONFIG_WMESH_RELIABLE_WINDOW ?
+			0 : header->seq - CONFIG_WMESH_RELIABLE_WINDOW + 1;
+		rx->received = 0;
+		rx->active = true;
+	}
+
+	int16_t distance = (int16_t) (uint16_t) (header->seq - rx->next);
+	bool fresh = false;
+
+	if(distance == 0) {
+		fresh = true;
+
+		// Bit `n` now refers to frame `next + n`. Skip every frame already
+		// received out of order.
+		rx->next++;
+		while(rx->received & 1) {
+			rx->received >>= 1;
+			rx->next++;
+		}
+		rx->received >>= 1;
+
+	} else if(distance > 0 && distance <= WMESH_RELIABLE_SACK_BITS) {
+		uint32_t bit = UINT32_C(1) << (distance - 1);
+		fresh = !(rx->received & bit);
+		rx->received |= bit;
+	}
+
+	ack->session = rx->session;
+	ack->next = rx->next;
+	ack->sack = rx->received;
+
+	return fresh;
+}
+
+
+/// @brief Assigns a channel to a destination, and starts a new session.
+static void channel_start(wmesh_reliable_channel_t *channel, const wmesh_address_t dest) {
+	memcpy(channel->dest, dest, sizeof(wmesh_address_t));
+	channel->session = esp_random();
+	channel->next_seq = 0;
+	channel->srtt_us = 0;
+	channel->rttvar_us = 0;
+	channel->rto_us = CONFIG_WMESH_RELIABLE_INITIAL_RTO_MS * 1000;
+	channel->in_use = true;
+	channel->lost = false;
+
+	for(size_t i = 0; i < CONFIG_WMESH_RELIABLE_WINDOW; i++) {
+		channel->entries[i].in_use = false;
+	}
+}
+
+
+/// @brief Updates the retransmission timeout with a new round-trip time
+/// sample, as described in RFC 6298.
+static void update_rto(wmesh_reliable_channel_t *channel, uint32_t sample_us) {
+	if(channel->srtt_us == 0) {
+		channel->srtt_us = sample_us;
+		channel->rttvar_us = sample_us / 2;
+	} else {
+		uint32_t error_us = channel->srtt_us > sample_us ?
+			channel->srtt_us - sample_us : sample_us - channel->srtt_us;
+		channel->rttvar_us = (3 * channel->rttvar_us + error_us) / 4;
+		channel->srtt_us = (7 * channel->srtt_us + sample_us) / 8;
+	}
+
+	uint32_t rto_us = channel->srtt_us + 4 * channel->rttvar_us;
+	channel->rto_us = rto_us < RTO_MIN_US ? RTO_MIN_US :
+		rto_us > RTO_MAX_US ? RTO_MAX_US : rto_us;
+}
@@ -0,0 +1,48 @@
+#include "wmesh/ring.h"
+
+#include <string.h>
+
+#define SLOT_MASK (CONFIG_WMESH_RX_QUEUE_LENGTH - 1)
+
+
+void wmesh_rx_ring_init(wmesh_rx_ring_t *ring) {
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	memset(&ring->stats, 0, sizeof(ring->stats));
+}
+
+
+wmesh_rx_slot_t *wmesh_rx_ring_reserve(wmesh_rx_ring_t *ring) {
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if(head - tail >= CONFIG_WMESH_RX_QUEUE_LENGTH) {
+		return NULL;
+	}
+
+	return &ring->slots[head & SLOT_MASK];
+}
+
+
+void wmesh_rx_ring_commit(wmesh_rx_ring_t *ring) {
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+
+wmesh_rx_slot_t *wmesh_rx_ring_peek(wmesh_rx_ring_t *ring) {
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if(head == tail) {
+		return NULL;
+	}
+
+	return &ring->slots[tail & SLOT_MASK];
+}
+
+
+void wmesh_rx_ring_release(wmesh_rx_ring_t *ring) {
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
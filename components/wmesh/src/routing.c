@@ -0,0 +1,337 @@
+#include "wmesh/routing.h"
+
+#include <string.h>
+
+#if CONFIG_WMESH_ROUTING
+
+/// @brief Link reception ratio assumed for a newly heard neighbor, in 1/256.
+#define INITIAL_RECEPTION 192
+
+/// @brief A new parent must be cheaper than the current one by at least this
+/// much, in 1/16 ETX. Prevents switching back and forth between paths of
+/// similar cost.
+#define PARENT_HYSTERESIS (WMESH_ROUTE_ETX_ONE / 2)
+
+
+static wmesh_route_neighbor_t *find_neighbor(
+	wmesh_router_t *router,
+	const wmesh_address_t address
+);
+static wmesh_route_neighbor_t *alloc_neighbor(wmesh_router_t *router);
+static uint32_t path_cost(const wmesh_route_neighbor_t *neighbor);
+static bool is_feasible(const wmesh_router_t *router, const wmesh_route_neighbor_t *neighbor);
+static void select_parent(wmesh_router_t *router);
+
+
+void wmesh_router_init(wmesh_router_t *router, const wmesh_address_t self) {
+	memcpy(router->self, self, sizeof(wmesh_address_t));
+	router->is_root = false;
+	router->parent = NULL;
+	router->seq = 0;
+	router->link_seq = 0;
+	router->advertised = false;
+
+	for(size_t i = 0; i < CONFIG_WMESH_ROUTE_NEIGHBORS; i++) {
+		router->neighbors[i].in_use = false;
+	}
+
+	for(size_t i = 0; i < CONFIG_WMESH_ROUTE_TABLE_SIZE; i++) {
+		router->routes[i].in_use = false;
+	}
+
+	router->forwarded = 0;
+	router->dropped = 0;
+	router->parent_changes = 0;
+}
+
+
+void wmesh_router_set_root(wmesh_router_t *router, bool is_root) {
+	router->is_root = is_root;
+	select_parent(router);
+}
+
+
+void wmesh_router_beacon_received(
+	wmesh_router_t *router,
+	const wmesh_address_t src,
+	const wmesh_route_beacon_t *beacon,
+	int64_t now_us
+) {
+	wmesh_route_neighbor_t *neighbor = find_neighbor(router, src);
+
+	if(!neighbor) {
+		neighbor = alloc_neighbor(router);
+		if(!neighbor) {
+			return;
+		}
+
+		memcpy(neighbor->address, src, sizeof(wmesh_address_t));
+		neighbor->reception = INITIAL_RECEPTION;
+		neighbor->in_use = true;
+	} else {
+		// Every beacon missed since the previous one counts as a loss.
+		uint16_t gap = beacon->link_seq - neighbor->link_seq;
+		if(gap == 0) {
+			return;
+		}
+
+		uint16_t sample = gap > 256 ? 1 : 256 / gap;
+		neighbor->reception = (7 * neighbor->reception + sample) / 8;
+	}
+
+	memcpy(neighbor->root, beacon->root, sizeof(wmesh_address_t));
+	neighbor->seq = beacon->seq;
+	neighbor->link_seq = beacon->link_seq;
+	neighbor->etx = beacon->etx;
+	neighbor->hops = beacon->hops;
+	neighbor->heard_us = now_us;
+	neighbor->is_child = memcmp(beacon->parent, router->self, sizeof(wmesh_address_t)) == 0;
+
+	if(neighbor == router->parent) {
+		router->seq = beacon->seq;
+	}
+
+	select_parent(router);
+}
+
+
+void wmesh_router_expire(wmesh_router_t *router, int64_t now_us) {
+	const int64_t timeout_us = CONFIG_WMESH_ROUTE_NEIGHBOR_TIMEOUT_MS * 1000LL;
+
+	for(size_t i = 0; i < CONFIG_WMESH_ROUTE_NEIGHBORS; i++) {
+		wmesh_route_neighbor_t *neighbor = &router->neighbors[i];
+		if(!neighbor->in_use || now_us - neighbor->heard_us < timeout_us) {
+			continue;
+		}
+
+		neighbor->in_use = false;
+		if(neighbor == router->parent) {
+			router->parent = NULL;
+		}
+
+		// Routes through a lost neighbor lead nowhere.
+		for(size_t j = 0; j < CONFIG_WMESH_ROUTE_TABLE_SIZE; j++) {
+			wmesh_route_entry_t *route = &router->routes[j];
+			if(route->in_use && memcmp(route->next_hop, neighbor->address, sizeof(wmesh_address_t)) == 0) {
+				route->in_use = false;
+			}
+		}
+	}
+
+	select_parent(router);
+}
+
+
+bool wmesh_router_make_beacon(wmesh_router_t *router, wmesh_route_beacon_t *beacon) {
+	if(router->is_root) {
+		router->seq++;
+		memcpy(beacon->root, router->self, sizeof(wmesh_address_t));
+		memset(beacon->parent, 0, sizeof(wmesh_address_t));
+		beacon->etx = 0;
+		beacon->hops = 0;
+	} else if(router->parent) {
+		uint32_t cost = path_cost(router->parent);
+		memcpy(beacon->root, router->parent->root, sizeof(wmesh_address_t));
+		memcpy(beacon->parent, router->parent->address, sizeof(wmesh_address_t));
+		beacon->etx = cost > UINT16_MAX ? UINT16_MAX : cost;
+		beacon->hops = router->parent->hops + 1;
+
+		// Neighbors are compared against the best path ever advertised for
+		// the newest sequence number, as nodes further down may still use it.
+		if(
+			!router->advertised ||
+			memcmp(router->feasible_root, beacon->root, sizeof(wmesh_address_t)) != 0 ||
+			router->feasible_seq != router->seq ||
+			beacon->etx < router->feasible_etx
+		) {
+			memcpy(router->feasible_root, beacon->root, sizeof(wmesh_address_t));
+			router->feasible_seq = router->seq;
+			router->feasible_etx = beacon->etx;
+			router->advertised = true;
+		}
+	} else {
+		return false;
+	}
+
+	beacon->seq = router->seq;
+	beacon->link_seq = router->link_seq++;
+	return true;
+}
+
+
+void wmesh_router_learn(
+	wmesh_router_t *router,
+	const wmesh_address_t dest,
+	const wmesh_address_t prev_hop,
+	int64_t now_us
+) {
+	wmesh_route_entry_t *entry = NULL;
+
+	for(size_t i = 0; i < CONFIG_WMESH_ROUTE_TABLE_SIZE; i++) {
+		wmesh_route_entry_t *route = &router->routes[i];
+
+		if(route->in_use && memcmp(route->dest, dest, sizeof(wmesh_address_t)) == 0) {
+			entry = route;
+			break;
+		}
+
+		if(!entry || (entry->in_use && (!route->in_use || route->learned_us < entry->learned_us))) {
+			entry = route;
+		}
+	}
+
+	memcpy(entry->dest, dest, sizeof(wmesh_address_t));
+	memcpy(entry->next_hop, prev_hop, sizeof(wmesh_address_t));
+	entry->learned_us = now_us;
+	entry->in_use = true;
+}
+
+
+bool wmesh_router_next_hop(
+	const wmesh_router_t *router,
+	const wmesh_address_t dest,
+	wmesh_address_t next_hop
+) {
+	const wmesh_route_neighbor_t *parent = router->parent;
+	if(parent && memcmp(parent->root, dest, sizeof(wmesh_address_t)) == 0) {
+		memcpy(next_hop, parent->address, sizeof(wmesh_address_t));
+		return true;
+	}
+
+	for(size_t i = 0; i < CONFIG_WMESH_ROUTE_TABLE_SIZE; i++) {
+		const wmesh_route_entry_t *route = &router->routes[i];
+		if(route->in_use && memcmp(route->dest, dest, sizeof(wmesh_address_t)) == 0) {
+			memcpy(next_hop, route->next_hop, sizeof(wmesh_address_t));
+			return true;
+		}
+	}
+
+	for(size_t i = 0; i < CONFIG_WMESH_ROUTE_NEIGHBORS; i++) {
+		const wmesh_route_neighbor_t *neighbor = &router->neighbors[i];
+		if(neighbor->in_use && memcmp(neighbor->address, dest, sizeof(wmesh_address_t)) == 0) {
+			memcpy(next_hop, dest, sizeof(wmesh_address_t));
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+bool wmesh_router_has_children(const wmesh_router_t *router) {
+	for(size_t i = 0; i < CONFIG_WMESH_ROUTE_NEIGHBORS; i++) {
+		if(router->neighbors[i].in_use && router->neighbors[i].is_child) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/// @brief Finds a neighbor by address.
+///
+/// @return Neighbor, or `NULL` if not found.
+static wmesh_route_neighbor_t *find_neighbor(
+	wmesh_router_t *router,
+	const wmesh_address_t address
+) {
+	for(size_t i = 0; i < CONFIG_WMESH_ROUTE_NEIGHBORS; i++) {
+		wmesh_route_neighbor_t *neighbor = &router->neighbors[i];
+		if(neighbor->in_use && memcmp(neighbor->address, address, sizeof(wmesh_address_t)) == 0) {
+			return neighbor;
+		}
+	}
+
+	return NULL;
+}
+
+
+/// @brief Gets a free neighbor entry. If the table is full, the most
+/// expensive neighbor other than the parent is replaced.
+///
+/// @return Neighbor entry, or `NULL` if the table only holds the parent.
+static wmesh_route_neighbor_t *alloc_neighbor(wmesh_router_t *router) {
+	wmesh_route_neighbor_t *victim = NULL;
+
+	for(size_t i = 0; i < CONFIG_WMESH_ROUTE_NEIGHBORS; i++) {
+		wmesh_route_neighbor_t *neighbor = &router->neighbors[i];
+		if(!neighbor->in_use) {
+			return neighbor;
+		}
+
+		if(neighbor != router->parent && (!victim || path_cost(neighbor) > path_cost(victim))) {
+			victim = neighbor;
+		}
+	}
+
+	return victim;
+}
+
+
+/// @brief Gets the cost of the path to the root through a neighbor.
+///
+/// @return Advertised cost plus the link's ETX, in 1/16 ETX.
+static uint32_t path_cost(const wmesh_route_neighbor_t *neighbor) {
+	uint16_t reception = neighbor->reception > 0 ? neighbor->reception : 1;
+	return neighbor->etx + WMESH_ROUTE_ETX_ONE * 256 / reception;
+}
+
+
+/// @brief Checks whether a neighbor's path can't lead through this node.
+///
+/// @return `true` if the neighbor advertises a newer sequence number than
+/// this node has, or the same one at a lower cost.
+static bool is_feasible(const wmesh_router_t *router, const wmesh_route_neighbor_t *neighbor) {
+	if(!router->advertised || memcmp(neighbor->root, router->feasible_root, sizeof(wmesh_address_t)) != 0) {
+		return true;
+	}
+
+	int16_t newer = neighbor->seq - router->feasible_seq;
+	return newer > 0 || (newer == 0 && neighbor->etx < router->feasible_etx);
+}
+
+
+/// @brief Picks the neighbor with the cheapest path to a root as parent.
+static void select_parent(wmesh_router_t *router) {
+	if(router->is_root) {
+		router->parent = NULL;
+		return;
+	}
+
+	wmesh_route_neighbor_t *current = router->parent;
+	wmesh_route_neighbor_t *best = NULL;
+
+	for(size_t i = 0; i < CONFIG_WMESH_ROUTE_NEIGHBORS; i++) {
+		wmesh_route_neighbor_t *neighbor = &router->neighbors[i];
+		if(!neighbor->in_use || neighbor->is_child || neighbor->hops + 1 > CONFIG_WMESH_ROUTE_MAX_HOPS) {
+			continue;
+		}
+
+		// A neighbor which may have a path through this node is only used
+		// once the root's next beacon reaches it through another path.
+		if(neighbor != current && !is_feasible(router, neighbor)) {
+			continue;
+		}
+
+		if(!best || path_cost(neighbor) < path_cost(best)) {
+			best = neighbor;
+		}
+	}
+
+	bool current_valid = current && !current->is_child && current->in_use;
+	if(current_valid && best && path_cost(best) + PARENT_HYSTERESIS > path_cost(current)) {
+		best = current;
+	}
+
+	if(best != current) {
+		router->parent_changes++;
+		if(best) {
+			router->seq = best->seq;
+		}
+	}
+
+	router->parent = best;
+}
+
+#endif
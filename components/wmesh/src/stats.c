@@ -0,0 +1,41 @@
+#include "wmesh/stats.h"
+
+
+void wmesh_counters_init(wmesh_counters_t *counters) {
+	atomic_init(&counters->rx_ok, 0);
+	atomic_init(&counters->rx_stale, 0);
+	atomic_init(&counters->rx_auth_errors, 0);
+	atomic_init(&counters->rx_decrypt_errors, 0);
+	atomic_init(&counters->rx_no_handler, 0);
+	atomic_init(&counters->tx_ok, 0);
+	atomic_init(&counters->tx_failed, 0);
+	atomic_init(&counters->bytes_in, 0);
+	atomic_init(&counters->bytes_out, 0);
+	atomic_init(&counters->last_rssi, 0);
+}
+
+
+void wmesh_counters_read(
+	const wmesh_counters_t *counters,
+	wmesh_counters_snapshot_t *snapshot
+) {
+	snapshot->rx_ok = atomic_load_explicit(&counters->rx_ok, memory_order_relaxed);
+	snapshot->rx_stale = atomic_load_explicit(&counters->rx_stale, memory_order_relaxed);
+	snapshot->rx_auth_errors = atomic_load_explicit(&counters->rx_auth_errors, memory_order_relaxed);
+	snapshot->rx_decrypt_errors = atomic_load_explicit(&counters->rx_decrypt_errors, memory_order_relaxed);
+	snapshot->rx_no_handler = atomic_load_explicit(&counters->rx_no_handler, memory_order_relaxed);
+	snapshot->tx_ok = atomic_load_explicit(&counters->tx_ok, memory_order_relaxed);
+	snapshot->tx_failed = atomic_load_explicit(&counters->tx_failed, memory_order_relaxed);
+	snapshot->bytes_in = atomic_load_explicit(&counters->bytes_in, memory_order_relaxed);
+	snapshot->bytes_out = atomic_load_explicit(&counters->bytes_out, memory_order_relaxed);
+	snapshot->last_rssi = atomic_load_explicit(&counters->last_rssi, memory_order_relaxed);
+}
+
+
+bool wmesh_counters_any(const wmesh_counters_snapshot_t *snapshot) {
+	return
+		snapshot->rx_ok || snapshot->rx_stale ||
+		snapshot->rx_auth_errors || snapshot->rx_decrypt_errors ||
+		snapshot->rx_no_handler ||
+		snapshot->tx_ok || snapshot->tx_failed;
+}
@@ -1,76 +1,263 @@
 #include "wmesh/storage.h"
 
+#include <string.h>
+#include "wmesh/storage_cache.h"
+
+
+#if CONFIG_WMESH_STORAGE_RTC_CACHE
+	/// @brief Opens the backend namespace, if not already open.
+	static esp_err_t open_backend(wmesh_storage_handle_t *handle) {
+		if(handle->backend_open) {
+			return ESP_OK;
+		}
+
+		esp_err_t err = wmesh_storage_backend_open(&handle->backend, handle->name);
+		handle->backend_open = err == ESP_OK;
+		return err;
+	}
+#endif
+
+
 esp_err_t wmesh_storage_open(
 	wmesh_storage_handle_t *handle,
 	const wmesh_storage_config_t *config
 ) {
-	#ifdef CONFIG_WMESH_PERSISTENCE_NVS
-		return nvs_open(config->name, NVS_READWRITE, &handle->nvs_handle);
+	#if CONFIG_WMESH_STORAGE_RTC_CACHE
+		if(strlen(config->name) >= sizeof(handle->name)) {
+			return ESP_ERR_INVALID_ARG;
+		}
+		strcpy(handle->name, config->name);
+		handle->backend_open = false;
+		handle->backend_dirty = false;
+		handle->write_through = config->write_through;
+
+		esp_err_t err = wmesh_storage_cache_attach(
+			config->name, &handle->cache_namespace, &handle->restored
+		);
+		if(err != ESP_OK) {
+			return err;
+		}
+
+		if(wmesh_storage_cache_flush_due(handle->cache_namespace)) {
+			return wmesh_storage_flush(handle);
+		}
+		return ESP_OK;
+	#else
+		return wmesh_storage_backend_open(&handle->backend, config->name);
 	#endif
 }
 
 
 void wmesh_storage_close(wmesh_storage_handle_t *handle) {
-	#ifdef CONFIG_WMESH_PERSISTENCE_NVS
-		nvs_commit(handle->nvs_handle);
-		nvs_close(handle->nvs_handle);
+	#if CONFIG_WMESH_STORAGE_RTC_CACHE
+		if(handle->backend_open) {
+			wmesh_storage_backend_close(&handle->backend);
+			handle->backend_open = false;
+		}
+	#else
+		wmesh_storage_backend_close(&handle->backend);
 	#endif
 }
 
-wmesh_storage_result_t wmesh_storage_read_ctr(
+
+esp_err_t wmesh_storage_commit(wmesh_storage_handle_t *handle) {
+	#if CONFIG_WMESH_STORAGE_RTC_CACHE
+		if(wmesh_storage_cache_flush_due(handle->cache_namespace)) {
+			return wmesh_storage_flush(handle);
+		}
+
+		if(!handle->backend_dirty) {
+			return ESP_OK;
+		}
+		handle->backend_dirty = false;
+	#endif
+
+	return wmesh_storage_backend_commit(&handle->backend);
+}
+
+
+esp_err_t wmesh_storage_flush(wmesh_storage_handle_t *handle) {
+	#if CONFIG_WMESH_STORAGE_RTC_CACHE
+		esp_err_t err = open_backend(handle);
+		if(err != ESP_OK) {
+			return err;
+		}
+
+		wmesh_storage_result_t result = wmesh_storage_cache_flush(
+			handle->cache_namespace, &handle->backend
+		);
+		handle->backend_dirty = false;
+
+		err = wmesh_storage_backend_commit(&handle->backend);
+		if(err == ESP_OK && result != WMESH_STORAGE_OK) {
+			err = ESP_FAIL;
+		}
+		return err;
+	#else
+		return wmesh_storage_backend_commit(&handle->backend);
+	#endif
+}
+
+
+bool wmesh_storage_writes_lost(const wmesh_storage_handle_t *handle) {
+	#if CONFIG_WMESH_STORAGE_RTC_CACHE
+		return !handle->restored;
+	#else
+		return false;
+	#endif
+}
+
+
+/// @brief Reads a value, from the cache if possible.
+static wmesh_storage_result_t read_value(
 	wmesh_storage_handle_t *handle,
 	const char *key,
-	wmesh_encryption_ctr_t *ctr
+	wmesh_storage_type_t type,
+	void *data,
+	size_t *length
 ) {
-	#ifdef CONFIG_WMESH_PERSISTENCE_NVS
-		esp_err_t err;
-		#if CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH > 4
-			err = nvs_get_u64(handle->nvs_handle, key, ctr);
-		#elif CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH > 2
-			err = nvs_get_u32(handle->nvs_handle, key, ctr);
-		#elif CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH > 1
-			err = nvs_get_u16(handle->nvs_handle, key, ctr);
-		#else
-			err = nvs_get_u8(handle->nvs_handle, key, ctr);
-		#endif
-
-		switch(err) {
-			case ESP_OK:
-				return WMESH_STORAGE_OK;
-
-			case ESP_ERR_NVS_NOT_FOUND:
-				return WMESH_STORAGE_NOT_FOUND;
-
-			default:
-				return WMESH_STORAGE_ERROR;
+	#if CONFIG_WMESH_STORAGE_RTC_CACHE
+		wmesh_storage_result_t result;
+		if(wmesh_storage_cache_read(handle->cache_namespace, key, data, length, &result)) {
+			return result;
 		}
+
+		if(open_backend(handle) != ESP_OK) {
+			return WMESH_STORAGE_ERROR;
+		}
+
+		result = wmesh_storage_backend_read(&handle->backend, key, type, data, length);
+		if(result == WMESH_STORAGE_OK && data) {
+			wmesh_storage_cache_fill(handle->cache_namespace, key, type, data, *length);
+		} else if(result == WMESH_STORAGE_NOT_FOUND) {
+			wmesh_storage_cache_fill(handle->cache_namespace, key, type, NULL, 0);
+		}
+		return result;
+	#else
+		return wmesh_storage_backend_read(&handle->backend, key, type, data, length);
 	#endif
 }
 
 
+/// @brief Writes a value, to the cache if it fits. Write-through namespaces
+/// write to the backend, and keep a copy in the cache.
+static wmesh_storage_result_t write_value(
+	wmesh_storage_handle_t *handle,
+	const char *key,
+	wmesh_storage_type_t type,
+	const void *data,
+	size_t length
+) {
+	#if CONFIG_WMESH_STORAGE_RTC_CACHE
+		if(!handle->write_through && wmesh_storage_cache_write(handle->cache_namespace, key, type, data, length, true)) {
+			return WMESH_STORAGE_OK;
+		}
+
+		if(open_backend(handle) != ESP_OK) {
+			return WMESH_STORAGE_ERROR;
+		}
+
+		wmesh_storage_result_t result = wmesh_storage_backend_write(
+			&handle->backend, key, type, data, length
+		);
+		if(result == WMESH_STORAGE_OK) {
+			handle->backend_dirty = true;
+			if(handle->write_through) {
+				wmesh_storage_cache_write(handle->cache_namespace, key, type, data, length, false);
+			}
+		}
+		return result;
+	#else
+		return wmesh_storage_backend_write(&handle->backend, key, type, data, length);
+	#endif
+}
+
+
+wmesh_storage_result_t wmesh_storage_read_ctr(
+	wmesh_storage_handle_t *handle,
+	const char *key,
+	wmesh_encryption_ctr_t *ctr
+) {
+	size_t length = sizeof(*ctr);
+	wmesh_storage_result_t err = read_value(handle, key, WMESH_STORAGE_TYPE_CTR, ctr, &length);
+
+	if(err == WMESH_STORAGE_OK && length != sizeof(*ctr)) {
+		return WMESH_STORAGE_ERROR;
+	}
+	return err;
+}
+
+
 wmesh_storage_result_t wmesh_storage_write_ctr(
 	wmesh_storage_handle_t *handle,
 	const char *key,
 	const wmesh_encryption_ctr_t *ctr
 ) {
-	#ifdef CONFIG_WMESH_PERSISTENCE_NVS
-		esp_err_t err;
-		#if CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH > 4
-			err = nvs_set_u64(handle->nvs_handle, key, *ctr);
-		#elif CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH > 2
-			err = nvs_set_u32(handle->nvs_handle, key, *ctr);
-		#elif CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH > 1
-			err = nvs_set_u16(handle->nvs_handle, key, *ctr);
-		#else
-			err = nvs_set_u8(handle->nvs_handle, key, *ctr);
-		#endif
-
-		switch(err) {
-			case ESP_OK:
-				return WMESH_STORAGE_OK;
-
-			default:
-				return WMESH_STORAGE_ERROR;
+	return write_value(handle, key, WMESH_STORAGE_TYPE_CTR, ctr, sizeof(*ctr));
+}
+
+
+wmesh_storage_result_t wmesh_storage_read_window(
+	wmesh_storage_handle_t *handle,
+	const char *key,
+	wmesh_replay_window_t *window
+) {
+	size_t length = sizeof(*window);
+	wmesh_storage_result_t err = read_value(handle, key, WMESH_STORAGE_TYPE_BLOB, window, &length);
+
+	if(err == WMESH_STORAGE_OK && length != sizeof(*window)) {
+		return WMESH_STORAGE_ERROR;
+	}
+	return err;
+}
+
+
+wmesh_storage_result_t wmesh_storage_write_window(
+	wmesh_storage_handle_t *handle,
+	const char *key,
+	const wmesh_replay_window_t *window
+) {
+	return write_value(handle, key, WMESH_STORAGE_TYPE_BLOB, window, sizeof(*window));
+}
+
+
+wmesh_storage_result_t wmesh_storage_read_blob(
+	wmesh_storage_handle_t *handle,
+	const char *key,
+	void *data,
+	size_t *length
+) {
+	return read_value(handle, key, WMESH_STORAGE_TYPE_BLOB, data, length);
+}
+
+
+wmesh_storage_result_t wmesh_storage_write_blob(
+	wmesh_storage_handle_t *handle,
+	const char *key,
+	const void *data,
+	size_t length
+) {
+	return write_value(handle, key, WMESH_STORAGE_TYPE_BLOB, data, length);
+}
+
+
+wmesh_storage_result_t wmesh_storage_erase(
+	wmesh_storage_handle_t *handle,
+	const char *key
+) {
+	#if CONFIG_WMESH_STORAGE_RTC_CACHE
+		wmesh_storage_cache_erase(handle->cache_namespace, key);
+
+		if(open_backend(handle) != ESP_OK) {
+			return WMESH_STORAGE_ERROR;
+		}
+
+		wmesh_storage_result_t result = wmesh_storage_backend_erase(&handle->backend, key);
+		if(result == WMESH_STORAGE_OK) {
+			handle->backend_dirty = true;
 		}
+		return result;
+	#else
+		return wmesh_storage_backend_erase(&handle->backend, key);
 	#endif
 }
@@ -0,0 +1,497 @@
+#include "wmesh/storage_cache.h"
+
+#if CONFIG_WMESH_STORAGE_RTC_CACHE
+
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "wmesh/encryption.h"
+
+static const char *TAG = "Mesh storage";
+
+
+/// @brief Identifies a cache written by this layout and size.
+#define CACHE_MAGIC (0x574d5331 ^ CONFIG_WMESH_STORAGE_RTC_CACHE_SIZE)
+
+/// @brief Entry holds a value not yet written to the backend.
+#define ENTRY_DIRTY 0x01
+
+/// @brief Entry records that the backend doesn't have the value.
+#define ENTRY_ABSENT 0x02
+
+/// @brief Rounds a size up to the next multiple of 4, so entries stay aligned.
+#define ALIGN4(size) (((size) + 3) & ~(size_t) 3)
+
+
+/// @brief Cached namespace.
+typedef struct {
+
+	/// @brief Time of the last flush, in seconds.
+	int64_t last_flush;
+
+	/// @brief Namespace name. Empty if the slot is free.
+	char name[WMESH_STORAGE_NAME_MAX_LENGTH];
+
+} cache_namespace_t;
+
+
+/// @brief Header of a cached value. Followed by the value, padded to 4 bytes.
+typedef struct {
+
+	/// @brief Name of the value.
+	char key[WMESH_STORAGE_NAME_MAX_LENGTH];
+
+	/// @brief Size in bytes of the value.
+	uint16_t length;
+
+	/// @brief Index of the namespace.
+	uint8_t ns;
+
+	/// @brief `wmesh_storage_type_t` of the value.
+	uint8_t type;
+
+	/// @brief `ENTRY_DIRTY` and `ENTRY_ABSENT`.
+	uint8_t flags;
+
+	uint8_t reserved[3];
+
+} cache_entry_t;
+
+
+/// @brief Cache layout in RTC memory. Fields are ordered so there is no
+/// padding, as everything from `namespaces` to the end of the used arena is
+/// checksummed.
+typedef struct {
+	uint32_t magic;
+	uint32_t checksum;
+	cache_namespace_t namespaces[WMESH_STORAGE_CACHE_NAMESPACES];
+
+	/// @brief Bytes of `arena` holding entries.
+	uint32_t used;
+
+	/// @brief Entries, packed one after the other.
+	uint8_t arena[CONFIG_WMESH_STORAGE_RTC_CACHE_SIZE];
+} cache_t;
+
+static_assert(offsetof(cache_t, arena) % 4 == 0, "Cache entries must be aligned");
+
+
+/// @brief Kept across deep sleep and software resets. Lost on power loss, in
+/// which case the checksum no longer matches.
+static RTC_NOINIT_ATTR cache_t cache;
+
+/// @brief Protects `cache`. Created by the first `wmesh_storage_cache_attach`.
+static SemaphoreHandle_t cache_lock;
+
+/// @brief Set once the cache was checked since boot.
+static bool cache_checked;
+
+/// @brief Set if the cache survived since the last boot.
+static bool cache_restored;
+
+/// @brief Namespaces to flush on the next commit, as the cache survived a
+/// reset which was not a deep sleep wake.
+static bool flush_pending[WMESH_STORAGE_CACHE_NAMESPACES];
+
+#if CONFIG_IDF_TARGET_LINUX
+	/// @brief Reason of the last simulated reset.
+	static esp_reset_reason_t simulated_reset_reason = ESP_RST_POWERON;
+#endif
+
+
+/// @brief Gets the reason of the last reset.
+static esp_reset_reason_t reset_reason(void) {
+	#if CONFIG_IDF_TARGET_LINUX
+		return simulated_reset_reason;
+	#else
+		return esp_reset_reason();
+	#endif
+}
+
+
+/// @brief Computes the checksum of the cache.
+static uint32_t cache_checksum(void) {
+	const uint8_t *start = (const uint8_t *) cache.namespaces;
+	size_t length = offsetof(cache_t, arena) - offsetof(cache_t, namespaces) + cache.used;
+	return esp_rom_crc32_le(0, start, length);
+}
+
+
+/// @brief Updates the checksum after a change.
+static void cache_seal(void) {
+	cache.checksum = cache_checksum();
+}
+
+
+/// @brief Returns the entry at an arena offset.
+static cache_entry_t *entry_at(size_t offset) {
+	return (cache_entry_t *) &cache.arena[offset];
+}
+
+
+/// @brief Returns the arena space taken by an entry.
+static size_t entry_size(const cache_entry_t *entry) {
+	return sizeof(*entry) + ALIGN4(entry->length);
+}
+
+
+/// @brief Checks that every entry lies within the used arena, and belongs to
+/// a namespace.
+static bool cache_valid(void) {
+	if(cache.magic != CACHE_MAGIC || cache.used > sizeof(cache.arena)) {
+		return false;
+	}
+	if(cache.checksum != cache_checksum()) {
+		return false;
+	}
+
+	size_t offset = 0;
+	while(offset < cache.used) {
+		if(cache.used - offset < sizeof(cache_entry_t)) {
+			return false;
+		}
+
+		const cache_entry_t *entry = entry_at(offset);
+		if(
+			entry->ns >= WMESH_STORAGE_CACHE_NAMESPACES ||
+			cache.namespaces[entry->ns].name[0] == '\0' ||
+			cache.used - offset < entry_size(entry)
+		) {
+			return false;
+		}
+		offset += entry_size(entry);
+	}
+
+	return true;
+}
+
+
+/// @brief Empties the cache.
+static void cache_reset(void) {
+	memset(&cache, 0, offsetof(cache_t, arena));
+	cache.magic = CACHE_MAGIC;
+	cache_seal();
+}
+
+
+/// @brief Finds an entry.
+///
+/// @return Arena offset of the entry, or -1 if not found.
+static ptrdiff_t cache_find(uint8_t index, const char *key) {
+	size_t offset = 0;
+	while(offset < cache.used) {
+		const cache_entry_t *entry = entry_at(offset);
+		if(entry->ns == index && strncmp(entry->key, key, sizeof(entry->key)) == 0) {
+			return offset;
+		}
+		offset += entry_size(entry);
+	}
+
+	return -1;
+}
+
+
+/// @brief Removes an entry. Following entries are moved down. The checksum
+/// must be updated afterwards.
+static void cache_remove(size_t offset) {
+	size_t size = entry_size(entry_at(offset));
+	memmove(&cache.arena[offset], &cache.arena[offset + size], cache.used - offset - size);
+	cache.used -= size;
+}
+
+
+/// @brief Removes entries already in the backend, of any namespace, until
+/// `size` bytes are free. The checksum must be updated afterwards.
+static void cache_evict(size_t size) {
+	size_t offset = 0;
+	while(offset < cache.used && sizeof(cache.arena) - cache.used < size) {
+		if(entry_at(offset)->flags & ENTRY_DIRTY) {
+			offset += entry_size(entry_at(offset));
+		} else {
+			cache_remove(offset);
+		}
+	}
+}
+
+
+/// @brief Adds an entry at the end of the arena. The checksum must be updated
+/// afterwards.
+///
+/// @return `true` on success, `false` if there is not enough space.
+static bool cache_append(
+	uint8_t index, const char *key, wmesh_storage_type_t type,
+	uint8_t flags, const void *data, size_t length
+) {
+	size_t size = sizeof(cache_entry_t) + ALIGN4(length);
+	if(length > UINT16_MAX || sizeof(cache.arena) - cache.used < size) {
+		return false;
+	}
+
+	cache_entry_t *entry = entry_at(cache.used);
+	memset(entry, 0, size);
+	strncpy(entry->key, key, sizeof(entry->key) - 1);
+	entry->length = length;
+	entry->ns = index;
+	entry->type = type;
+	entry->flags = flags;
+	if(data) {
+		memcpy(entry + 1, data, length);
+	}
+
+	cache.used += size;
+	return true;
+}
+
+
+esp_err_t wmesh_storage_cache_attach(
+	const char *name,
+	uint8_t *index,
+	bool *restored
+) {
+	if(strlen(name) >= WMESH_STORAGE_NAME_MAX_LENGTH) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	if(!cache_lock && !(cache_lock = xSemaphoreCreateMutex())) {
+		return ESP_ERR_NO_MEM;
+	}
+
+	xSemaphoreTake(cache_lock, portMAX_DELAY);
+
+	if(!cache_checked) {
+		cache_checked = true;
+		cache_restored = cache_valid();
+
+		if(!cache_restored) {
+			if(reset_reason() != ESP_RST_POWERON) {
+				ESP_LOGW(TAG, "RTC cache corrupted, unflushed writes were lost");
+			}
+			cache_reset();
+		} else if(reset_reason() != ESP_RST_DEEPSLEEP) {
+			// The cache survived, but whatever caused this reset may not let
+			// it survive the next one.
+			for(size_t i = 0; i < WMESH_STORAGE_CACHE_NAMESPACES; i++) {
+				flush_pending[i] = true;
+			}
+		}
+	}
+
+	esp_err_t err = ESP_ERR_NO_MEM;
+	ptrdiff_t free_slot = -1;
+	for(size_t i = 0; i < WMESH_STORAGE_CACHE_NAMESPACES; i++) {
+		if(strncmp(cache.namespaces[i].name, name, WMESH_STORAGE_NAME_MAX_LENGTH) == 0) {
+			*index = i;
+			err = ESP_OK;
+			break;
+		}
+		if(free_slot < 0 && cache.namespaces[i].name[0] == '\0') {
+			free_slot = i;
+		}
+	}
+
+	if(err != ESP_OK && free_slot >= 0) {
+		cache_namespace_t *ns = &cache.namespaces[free_slot];
+		strncpy(ns->name, name, sizeof(ns->name) - 1);
+		ns->last_flush = time(NULL);
+		cache_seal();
+
+		*index = free_slot;
+		err = ESP_OK;
+	}
+
+	*restored = cache_restored;
+	xSemaphoreGive(cache_lock);
+	return err;
+}
+
+
+bool wmesh_storage_cache_read(
+	uint8_t index,
+	const char *key,
+	void *data,
+	size_t *length,
+	wmesh_storage_result_t *result
+) {
+	xSemaphoreTake(cache_lock, portMAX_DELAY);
+
+	ptrdiff_t offset = cache_find(index, key);
+	if(offset < 0) {
+		xSemaphoreGive(cache_lock);
+		return false;
+	}
+
+	const cache_entry_t *entry = entry_at(offset);
+	if(entry->flags & ENTRY_ABSENT) {
+		*result = WMESH_STORAGE_NOT_FOUND;
+	} else if(data && *length < entry->length) {
+		*result = WMESH_STORAGE_ERROR;
+	} else {
+		if(data) {
+			memcpy(data, entry + 1, entry->length);
+		}
+		*length = entry->length;
+		*result = WMESH_STORAGE_OK;
+	}
+
+	xSemaphoreGive(cache_lock);
+	return true;
+}
+
+
+void wmesh_storage_cache_fill(
+	uint8_t index,
+	const char *key,
+	wmesh_storage_type_t type,
+	const void *data,
+	size_t length
+) {
+	xSemaphoreTake(cache_lock, portMAX_DELAY);
+
+	if(cache_find(index, key) < 0) {
+		uint8_t flags = data ? 0 : ENTRY_ABSENT;
+		if(cache_append(index, key, type, flags, data, data ? length : 0)) {
+			cache_seal();
+		}
+	}
+
+	xSemaphoreGive(cache_lock);
+}
+
+
+bool wmesh_storage_cache_write(
+	uint8_t index,
+	const char *key,
+	wmesh_storage_type_t type,
+	const void *data,
+	size_t length,
+	bool dirty
+) {
+	uint8_t flags = dirty ? ENTRY_DIRTY : 0;
+
+	xSemaphoreTake(cache_lock, portMAX_DELAY);
+
+	ptrdiff_t offset = cache_find(index, key);
+	if(offset >= 0) {
+		cache_entry_t *entry = entry_at(offset);
+
+		// Same size, overwrite in place.
+		if(!(entry->flags & ENTRY_ABSENT) && entry->length == length) {
+			memcpy(entry + 1, data, length);
+			entry->type = type;
+			entry->flags = flags;
+			cache_seal();
+
+			xSemaphoreGive(cache_lock);
+			return true;
+		}
+
+		cache_remove(offset);
+	}
+
+	cache_evict(sizeof(cache_entry_t) + ALIGN4(length));
+	bool stored = cache_append(index, key, type, flags, data, length);
+	cache_seal();
+
+	xSemaphoreGive(cache_lock);
+	return stored;
+}
+
+
+void wmesh_storage_cache_erase(uint8_t index, const char *key) {
+	xSemaphoreTake(cache_lock, portMAX_DELAY);
+
+	ptrdiff_t offset = cache_find(index, key);
+	if(offset >= 0) {
+		cache_remove(offset);
+		cache_seal();
+	}
+
+	xSemaphoreGive(cache_lock);
+}
+
+
+bool wmesh_storage_cache_flush_due(uint8_t index) {
+	xSemaphoreTake(cache_lock, portMAX_DELAY);
+
+	bool dirty = false;
+	for(size_t offset = 0; offset < cache.used; offset += entry_size(entry_at(offset))) {
+		const cache_entry_t *entry = entry_at(offset);
+		if(entry->ns == index && (entry->flags & ENTRY_DIRTY)) {
+			dirty = true;
+			break;
+		}
+	}
+
+	int64_t now = time(NULL);
+	int64_t last_flush = cache.namespaces[index].last_flush;
+	bool due = dirty && (
+		flush_pending[index] ||
+		now < last_flush ||
+		now - last_flush >= CONFIG_WMESH_STORAGE_FLUSH_INTERVAL_S
+	);
+
+	xSemaphoreGive(cache_lock);
+	return due;
+}
+
+
+wmesh_storage_result_t wmesh_storage_cache_flush(
+	uint8_t index,
+	wmesh_storage_backend_t *backend
+) {
+	xSemaphoreTake(cache_lock, portMAX_DELAY);
+
+	wmesh_storage_result_t result = WMESH_STORAGE_OK;
+	for(size_t offset = 0; offset < cache.used; offset += entry_size(entry_at(offset))) {
+		cache_entry_t *entry = entry_at(offset);
+		if(entry->ns != index || !(entry->flags & ENTRY_DIRTY)) {
+			continue;
+		}
+
+		wmesh_storage_result_t entry_result = wmesh_storage_backend_write(
+			backend, entry->key, entry->type, entry + 1, entry->length
+		);
+		if(entry_result == WMESH_STORAGE_OK) {
+			entry->flags &= ~ENTRY_DIRTY;
+		} else {
+			result = entry_result;
+		}
+	}
+
+	cache.namespaces[index].last_flush = time(NULL);
+	flush_pending[index] = false;
+	cache_seal();
+
+	xSemaphoreGive(cache_lock);
+	return result;
+}
+
+
+#if CONFIG_IDF_TARGET_LINUX
+	void wmesh_storage_cache_simulate_reset(esp_reset_reason_t reason) {
+		if(cache_lock) {
+			xSemaphoreTake(cache_lock, portMAX_DELAY);
+		}
+
+		if(reason == ESP_RST_POWERON) {
+			memset(&cache, 0, sizeof(cache));
+		}
+		simulated_reset_reason = reason;
+		cache_checked = false;
+		for(size_t i = 0; i < WMESH_STORAGE_CACHE_NAMESPACES; i++) {
+			flush_pending[i] = false;
+		}
+
+		if(cache_lock) {
+			xSemaphoreGive(cache_lock);
+		}
+	}
+#endif
+
+#endif
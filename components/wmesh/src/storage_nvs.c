@@ -0,0 +1,119 @@
+#include "wmesh/storage_backend.h"
+
+#ifdef CONFIG_WMESH_PERSISTENCE_NVS
+
+#include <string.h>
+#include "wmesh/encryption.h"
+
+
+/// @brief Maps an NVS error to a storage result.
+static wmesh_storage_result_t to_result(esp_err_t err) {
+	switch(err) {
+		case ESP_OK:
+			return WMESH_STORAGE_OK;
+
+		case ESP_ERR_NVS_NOT_FOUND:
+			return WMESH_STORAGE_NOT_FOUND;
+
+		default:
+			return WMESH_STORAGE_ERROR;
+	}
+}
+
+
+esp_err_t wmesh_storage_backend_open(
+	wmesh_storage_backend_t *backend,
+	const char *name
+) {
+	return nvs_open(name, NVS_READWRITE, &backend->nvs_handle);
+}
+
+
+void wmesh_storage_backend_close(wmesh_storage_backend_t *backend) {
+	nvs_commit(backend->nvs_handle);
+	nvs_close(backend->nvs_handle);
+}
+
+
+esp_err_t wmesh_storage_backend_commit(wmesh_storage_backend_t *backend) {
+	return nvs_commit(backend->nvs_handle);
+}
+
+
+wmesh_storage_result_t wmesh_storage_backend_read(
+	wmesh_storage_backend_t *backend,
+	const char *key,
+	wmesh_storage_type_t type,
+	void *data,
+	size_t *length
+) {
+	if(type == WMESH_STORAGE_TYPE_BLOB) {
+		return to_result(nvs_get_blob(backend->nvs_handle, key, data, length));
+	}
+
+	// Counters are stored as integers, to stay readable by older versions.
+	wmesh_encryption_ctr_t ctr;
+	esp_err_t err;
+	#if CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH > 4
+		err = nvs_get_u64(backend->nvs_handle, key, &ctr);
+	#elif CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH > 2
+		err = nvs_get_u32(backend->nvs_handle, key, &ctr);
+	#elif CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH > 1
+		err = nvs_get_u16(backend->nvs_handle, key, &ctr);
+	#else
+		err = nvs_get_u8(backend->nvs_handle, key, &ctr);
+	#endif
+
+	if(err == ESP_OK && data) {
+		if(*length < sizeof(ctr)) {
+			return WMESH_STORAGE_ERROR;
+		}
+
+		memcpy(data, &ctr, sizeof(ctr));
+	}
+	*length = sizeof(ctr);
+
+	return to_result(err);
+}
+
+
+wmesh_storage_result_t wmesh_storage_backend_write(
+	wmesh_storage_backend_t *backend,
+	const char *key,
+	wmesh_storage_type_t type,
+	const void *data,
+	size_t length
+) {
+	if(type == WMESH_STORAGE_TYPE_BLOB) {
+		return to_result(nvs_set_blob(backend->nvs_handle, key, data, length));
+	}
+
+	wmesh_encryption_ctr_t ctr;
+	if(length != sizeof(ctr)) {
+		return WMESH_STORAGE_ERROR;
+	}
+	memcpy(&ctr, data, sizeof(ctr));
+
+	esp_err_t err;
+	#if CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH > 4
+		err = nvs_set_u64(backend->nvs_handle, key, ctr);
+	#elif CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH > 2
+		err = nvs_set_u32(backend->nvs_handle, key, ctr);
+	#elif CONFIG_WMESH_ENCRYPTION_NONCE_LENGTH > 1
+		err = nvs_set_u16(backend->nvs_handle, key, ctr);
+	#else
+		err = nvs_set_u8(backend->nvs_handle, key, ctr);
+	#endif
+
+	return to_result(err);
+}
+
+
+wmesh_storage_result_t wmesh_storage_backend_erase(
+	wmesh_storage_backend_t *backend,
+	const char *key
+) {
+	return to_result(nvs_erase_key(backend->nvs_handle, key));
+}
+
+#endif
@@ -0,0 +1,252 @@
+#include "wmesh/transport.h"
+
+#include <inttypes.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_wifi.h"
+
+static const char *TAG = "Mesh";
+static wmesh_transport_recv_cb_t recv_callback = NULL;
+static wmesh_transport_send_cb_t send_callback = NULL;
+
+
+static esp_err_t ensure_ap_mode();
+
+
+/// @brief ESP-NOW receive callback. Runs in the Wi-Fi task.
+static void recv_cb(const esp_now_recv_info_t *esp_now_info, const uint8_t *data, int data_len) {
+	if(data_len < 0) {
+		return;
+	}
+
+	recv_callback(esp_now_info->src_addr, data, data_len, esp_now_info->rx_ctrl->rssi);
+}
+
+
+/// @brief ESP-NOW send callback. Runs in the Wi-Fi task.
+static void send_cb(const esp_now_send_info_t *tx_info, esp_now_send_status_t status) {
+	send_callback(tx_info->des_addr, status == ESP_NOW_SEND_SUCCESS);
+}
+
+
+esp_err_t wmesh_transport_init(const wmesh_transport_config_t *config) {
+	esp_err_t err;
+
+	if((err = ensure_ap_mode()) != ESP_OK) {
+		return err;
+	}
+
+	// Wi-Fi is now initialized and set to either AP or AP+STA.
+	if((err = esp_now_init()) != ESP_OK) {
+		ESP_LOGE(TAG, "Error initializing ESP-NOW: %s", esp_err_to_name(err));
+		return err;
+	}
+
+	uint32_t esp_now_version;
+	if(esp_now_get_version(&esp_now_version) == ESP_OK) {
+		switch(esp_now_version) {
+			case 1:
+				ESP_LOGE(TAG, "ESP-NOW version 1.0 is not supported");
+				ESP_LOGE(TAG, "Please use ESP-NOW version 2.0");
+				esp_now_deinit();
+				return ESP_ERR_INVALID_VERSION;
+				break;
+
+			case 2:
+				ESP_LOGI(TAG, "Using ESP-NOW version 2.0");
+				break;
+
+			default:
+				ESP_LOGW(TAG,
+					"Using unknown ESP-NOW version %" PRIu32,
+					esp_now_version
+				);
+				break;
+		}
+	} else {
+		ESP_LOGE(TAG, "Unable to get ESP-NOW version");
+	}
+
+	recv_callback = config->recv_cb;
+	if((err = esp_now_register_recv_cb(recv_cb)) != ESP_OK) {
+		ESP_LOGE(TAG, "Error registering ESP-NOW callback");
+		esp_now_deinit();
+		return err;
+	}
+
+	send_callback = config->send_cb;
+	if(send_callback && (err = esp_now_register_send_cb(send_cb)) != ESP_OK) {
+		ESP_LOGE(TAG, "Error registering ESP-NOW send callback");
+		esp_now_deinit();
+		return err;
+	}
+
+	if((err = esp_now_set_pmk(config->network_key)) != ESP_OK) {
+		ESP_LOGE(TAG, "Error registering Primary Master key");
+		esp_now_deinit();
+		return err;
+	}
+
+	ESP_LOGI(TAG, "ESP-NOW initialized");
+	return ESP_OK;
+}
+
+
+void wmesh_transport_detach(void) {
+	esp_now_unregister_recv_cb();
+	if(send_callback) {
+		esp_now_unregister_send_cb();
+	}
+}
+
+
+void wmesh_transport_deinit(void) {
+	esp_now_deinit();
+}
+
+
+void wmesh_transport_get_address(wmesh_address_t address) {
+	esp_read_mac(address, ESP_MAC_WIFI_SOFTAP);
+}
+
+
+esp_err_t wmesh_transport_send(
+	const wmesh_address_t dest,
+	const uint8_t *data,
+	size_t length
+) {
+	esp_err_t err = esp_now_send(dest, data, length);
+	if(err != ESP_OK) {
+		ESP_LOGE(TAG, "Error sending message using ESP-NOW: %s", esp_err_to_name(err));
+	}
+
+	return err;
+}
+
+
+esp_err_t wmesh_transport_add_peer(const wmesh_address_t address) {
+	esp_now_peer_info_t peer = {
+		.ifidx = WIFI_IF_AP,
+		.channel = 0,
+	};
+	memcpy(peer.peer_addr, address, sizeof(wmesh_address_t));
+
+	esp_err_t err = esp_now_add_peer(&peer);
+	if(err != ESP_OK && err != ESP_ERR_ESPNOW_EXIST) {
+		ESP_LOGE(TAG, "Error registering ESP-NOW peer: %s", esp_err_to_name(err));
+		return err;
+	}
+
+	return ESP_OK;
+}
+
+
+void wmesh_transport_del_peer(const wmesh_address_t address) {
+	esp_now_del_peer(address);
+}
+
+
+#if CONFIG_WMESH_RATE_CONTROL
+	/// @brief ESP-NOW configuration of every rate.
+	static const esp_now_rate_config_t rate_configs[WMESH_RATE_COUNT] = {
+		[WMESH_RATE_LORA_250K] = {.phymode = WIFI_PHY_MODE_LR, .rate = WIFI_PHY_RATE_LORA_250K},
+		[WMESH_RATE_LORA_500K] = {.phymode = WIFI_PHY_MODE_LR, .rate = WIFI_PHY_RATE_LORA_500K},
+		[WMESH_RATE_1M] = {.phymode = WIFI_PHY_MODE_11B, .rate = WIFI_PHY_RATE_1M_L},
+		[WMESH_RATE_2M] = {.phymode = WIFI_PHY_MODE_11B, .rate = WIFI_PHY_RATE_2M_S},
+		[WMESH_RATE_5M5] = {.phymode = WIFI_PHY_MODE_11B, .rate = WIFI_PHY_RATE_5M_S},
+		[WMESH_RATE_6M] = {.phymode = WIFI_PHY_MODE_11G, .rate = WIFI_PHY_RATE_6M},
+		[WMESH_RATE_9M] = {.phymode = WIFI_PHY_MODE_11G, .rate = WIFI_PHY_RATE_9M},
+		[WMESH_RATE_11M] = {.phymode = WIFI_PHY_MODE_11B, .rate = WIFI_PHY_RATE_11M_S},
+		[WMESH_RATE_12M] = {.phymode = WIFI_PHY_MODE_11G, .rate = WIFI_PHY_RATE_12M},
+		[WMESH_RATE_18M] = {.phymode = WIFI_PHY_MODE_11G, .rate = WIFI_PHY_RATE_18M},
+		[WMESH_RATE_24M] = {.phymode = WIFI_PHY_MODE_11G, .rate = WIFI_PHY_RATE_24M},
+		[WMESH_RATE_36M] = {.phymode = WIFI_PHY_MODE_11G, .rate = WIFI_PHY_RATE_36M},
+		[WMESH_RATE_48M] = {.phymode = WIFI_PHY_MODE_11G, .rate = WIFI_PHY_RATE_48M},
+		[WMESH_RATE_54M] = {.phymode = WIFI_PHY_MODE_11G, .rate = WIFI_PHY_RATE_54M},
+	};
+
+
+	esp_err_t wmesh_transport_set_peer_rate(
+		const wmesh_address_t address,
+		wmesh_rate_t rate
+	) {
+		esp_now_rate_config_t config = rate_configs[rate];
+		esp_err_t err = esp_now_set_peer_rate_config(address, &config);
+		return err == ESP_ERR_ESPNOW_NOT_FOUND ? ESP_ERR_NOT_FOUND : err;
+	}
+#endif
+
+
+/// @brief Checks whether the Wi-Fi modem is initialized and configured as AP
+/// or AP+STA, if not, tries to set it to a compatible mode.
+///
+/// @return `ESP_OK` or error.
+static esp_err_t ensure_ap_mode() {
+	esp_err_t err;
+
+	wifi_mode_t wifi_mode;
+	err = esp_wifi_get_mode(&wifi_mode);
+	switch(err) {
+		case ESP_OK:
+			break;
+
+		case ESP_ERR_WIFI_NOT_INIT:
+			ESP_LOGE(TAG, "Wi-Fi modem not initialized");
+			return err;
+
+		case ESP_ERR_INVALID_ARG:
+			ESP_LOGE(TAG, "Internal error: %s", esp_err_to_name(err));
+			return err;
+
+		default:
+			ESP_LOGE(TAG, "Unexpected error: %s", esp_err_to_name(err));
+			return err;
+	}
+
+	// Check whether Wi-Fi modem is configured as AP; and, if not, whether it
+	// can be reconfigured.
+	switch(wifi_mode) {
+		case WIFI_MODE_AP:
+		case WIFI_MODE_APSTA:
+			break;
+
+		case WIFI_MODE_STA:
+			ESP_LOGW(TAG, "Wi-Fi modem configured as STA. Setting to SoftAP + STA...");
+
+			if((err = esp_wifi_set_mode(WIFI_MODE_APSTA)) != ESP_OK) {
+				ESP_LOGE(TAG,
+					"Error reconfiguring Wi-Fi modem as SoftAP + STA: %s",
+					esp_err_to_name(err)
+				);
+
+				return err;
+			}
+
+			ESP_LOGW(TAG, "Wi-Fi mode set to SoftAP + STA");
+
+			break;
+
+		default:
+			const char *wifi_mode_names[] = {
+				[WIFI_MODE_NULL] = "WIFI_MODE_NULL",
+				[WIFI_MODE_STA] = "WIFI_MODE_STA",
+				[WIFI_MODE_AP] = "WIFI_MODE_AP",
+				[WIFI_MODE_APSTA] = "WIFI_MODE_APSTA",
+				[WIFI_MODE_NAN] = "WIFI_MODE_NAN",
+				[WIFI_MODE_MAX] = "WIFI_MODE_MAX",
+			};
+			ESP_LOGE(TAG,
+				"Incompatible Wi-Fi mode for mesh operation: %s",
+				wifi_mode_names[wifi_mode]
+			);
+
+			ESP_LOGE(TAG, "Compatible modes are:");
+			ESP_LOGE(TAG, "	- WIFI_MODE_AP");
+			ESP_LOGE(TAG, "	- WIFI_MODE_APSTA");
+
+			return ESP_ERR_WIFI_MODE;
+	}
+
+	return ESP_OK;
+}
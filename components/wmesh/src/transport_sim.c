@@ -0,0 +1,618 @@
+#include "wmesh/transport.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#if CONFIG_WMESH_TRANSPORT_UDP
+	#include <arpa/inet.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <netinet/in.h>
+	#include <sys/socket.h>
+#endif
+
+static const char *TAG = "Mesh";
+
+
+/// @brief Default signal strength of the link. Strong enough for every rate.
+#define SIM_RSSI -40
+
+/// @brief Margin over a rate's sensitivity within which the link model loses
+/// part of the frames sent at it. Half of them at the sensitivity itself,
+/// none this far above, and all this far below.
+#define LINK_MODEL_SPAN_DB 3
+
+
+/// @brief Frame waiting for its simulated delay.
+typedef struct {
+
+	/// @brief When the frame is sent, in microseconds since boot.
+	int64_t deliver_us;
+
+	/// @brief Destination address.
+	wmesh_address_t dest;
+
+	/// @brief Size in bytes of `data`.
+	size_t length;
+
+	/// @brief Frame contents.
+	uint8_t data[CONFIG_WMESH_FRAME_SIZE];
+
+} pending_frame_t;
+
+
+#if CONFIG_WMESH_TRANSPORT_UDP
+	/// @brief Datagram sent to the multicast group.
+	///
+	/// Layout is:
+	/// |  Destination  |  Source  |  Frame  |
+	typedef struct __attribute__((packed)) {
+		wmesh_address_t dest;
+		wmesh_address_t src;
+		uint8_t frame[CONFIG_WMESH_FRAME_SIZE];
+	} datagram_t;
+#endif
+
+
+/// @brief Simulated link state. Only one transport may run at a time.
+static struct {
+
+	/// @brief This node's address.
+	wmesh_address_t address;
+	bool address_set;
+
+	wmesh_transport_recv_cb_t recv_cb;
+	wmesh_transport_send_cb_t send_cb;
+
+	/// @brief Protects every field below, and the callbacks.
+	SemaphoreHandle_t lock;
+
+	wmesh_transport_impairment_t impairment;
+
+	/// @brief Frames waiting for their delay, unordered.
+	pending_frame_t pending[CONFIG_WMESH_TRANSPORT_SIM_QUEUE_LENGTH];
+	size_t pending_count;
+
+	/// @brief Number of frames sent.
+	uint32_t sent;
+
+	/// @brief Number of frames dropped by simulated loss.
+	uint32_t lost;
+
+	/// @brief Number of frames held back to reorder them.
+	uint32_t reordered;
+
+	/// @brief Number of frames dropped because `pending` was full.
+	uint32_t overflows;
+
+	#if CONFIG_WMESH_RATE_CONTROL
+		/// @brief Registered peers, with the rate frames are sent to them at.
+		struct {
+			wmesh_address_t address;
+			wmesh_rate_t rate;
+			bool in_use;
+		} peers[CONFIG_WMESH_REGISTERED_PEER_COUNT];
+	#endif
+
+	/// @brief Task sending delayed frames.
+	TaskHandle_t task;
+	_Atomic bool running;
+	SemaphoreHandle_t task_done;
+
+	#if CONFIG_WMESH_TRANSPORT_UDP
+		int socket;
+		struct sockaddr_in group;
+	#endif
+
+} sim = {
+	#if CONFIG_WMESH_TRANSPORT_UDP
+		.socket = -1,
+	#endif
+};
+
+
+#if CONFIG_WMESH_TRANSPORT_UDP
+	/// @brief Opens the multicast socket.
+	///
+	/// @return `ESP_OK` or error.
+	static esp_err_t open_socket(void) {
+		sim.socket = socket(AF_INET, SOCK_DGRAM, 0);
+		if(sim.socket < 0) {
+			ESP_LOGE(TAG, "Error creating UDP socket: %s", strerror(errno));
+			return ESP_FAIL;
+		}
+
+		// Every process on the host binds the same port.
+		int enable = 1;
+		setsockopt(sim.socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+		#ifdef SO_REUSEPORT
+			setsockopt(sim.socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+		#endif
+
+		sim.group = (struct sockaddr_in) {
+			.sin_family = AF_INET,
+			.sin_port = htons(CONFIG_WMESH_TRANSPORT_UDP_PORT),
+		};
+		if(inet_pton(AF_INET, CONFIG_WMESH_TRANSPORT_UDP_GROUP, &sim.group.sin_addr) != 1) {
+			ESP_LOGE(TAG, "Invalid multicast group: %s", CONFIG_WMESH_TRANSPORT_UDP_GROUP);
+			close(sim.socket);
+			return ESP_ERR_INVALID_ARG;
+		}
+
+		struct sockaddr_in local = {
+			.sin_family = AF_INET,
+			.sin_port = htons(CONFIG_WMESH_TRANSPORT_UDP_PORT),
+			.sin_addr.s_addr = htonl(INADDR_ANY),
+		};
+		struct ip_mreq membership = {
+			.imr_multiaddr = sim.group.sin_addr,
+			.imr_interface.s_addr = htonl(INADDR_ANY),
+		};
+		if(
+			bind(sim.socket, (struct sockaddr *) &local, sizeof(local)) != 0 ||
+			setsockopt(sim.socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0 ||
+			setsockopt(sim.socket, IPPROTO_IP, IP_MULTICAST_LOOP, &enable, sizeof(enable)) != 0 ||
+			fcntl(sim.socket, F_SETFL, fcntl(sim.socket, F_GETFL) | O_NONBLOCK) != 0
+		) {
+			ESP_LOGE(TAG, "Error joining multicast group: %s", strerror(errno));
+			close(sim.socket);
+			return ESP_FAIL;
+		}
+
+		return ESP_OK;
+	}
+
+
+	/// @brief Receives every datagram waiting in the socket.
+	///
+	/// Polled by `sim_task`, since blocking calls stall the FreeRTOS
+	/// simulator.
+	static void poll_socket(void) {
+		static datagram_t datagram;
+
+		ssize_t received;
+		while((received = recv(sim.socket, &datagram, sizeof(datagram), 0)) >= 0) {
+			if((size_t) received <= offsetof(datagram_t, frame)) {
+				continue;
+			}
+
+			// Every datagram, including our own, reaches every member.
+			if(
+				memcmp(datagram.src, sim.address, sizeof(wmesh_address_t)) == 0 || (
+					memcmp(datagram.dest, sim.address, sizeof(wmesh_address_t)) != 0 &&
+					memcmp(datagram.dest, wmesh_broadcast_address, sizeof(wmesh_address_t)) != 0
+				)
+			) {
+				continue;
+			}
+
+			xSemaphoreTake(sim.lock, portMAX_DELAY);
+			wmesh_transport_recv_cb_t recv_cb = sim.recv_cb;
+			int8_t rssi = sim.impairment.rssi;
+			xSemaphoreGive(sim.lock);
+
+			if(recv_cb) {
+				recv_cb(datagram.src, datagram.frame, received - offsetof(datagram_t, frame), rssi);
+			}
+		}
+	}
+#endif
+
+
+#if CONFIG_WMESH_RATE_CONTROL
+	/// @brief Finds a registered peer. Must be called with `sim.lock` taken.
+	///
+	/// @return Position in `sim.peers`, or -1 if not registered.
+	static int find_peer(const wmesh_address_t address) {
+		for(size_t i = 0; i < CONFIG_WMESH_REGISTERED_PEER_COUNT; i++) {
+			if(sim.peers[i].in_use && memcmp(sim.peers[i].address, address, sizeof(wmesh_address_t)) == 0) {
+				return i;
+			}
+		}
+
+		return -1;
+	}
+
+
+	/// @brief Link model. Gets the share of frames sent at a rate which
+	/// arrive, from the margin between the link's signal strength and the
+	/// rate's sensitivity. Must be called with `sim.lock` taken.
+	///
+	/// @return Delivered frames, in percent.
+	static uint8_t link_delivery(wmesh_rate_t rate) {
+		int margin = sim.impairment.rssi - wmesh_rate_sensitivity(rate);
+
+		if(margin >= LINK_MODEL_SPAN_DB) {
+			return 100;
+		}
+		if(margin <= -LINK_MODEL_SPAN_DB) {
+			return 0;
+		}
+		return 50 + 50 * margin / LINK_MODEL_SPAN_DB;
+	}
+#endif
+
+
+/// @brief Sends a frame whose delay has passed.
+///
+/// @return Whether the frame was sent.
+static bool deliver(const wmesh_address_t dest, const uint8_t *data, size_t length) {
+	#if CONFIG_WMESH_TRANSPORT_UDP
+		static datagram_t datagram;
+
+		memcpy(datagram.dest, dest, sizeof(wmesh_address_t));
+		memcpy(datagram.src, sim.address, sizeof(wmesh_address_t));
+		memcpy(datagram.frame, data, length);
+
+		size_t datagram_length = offsetof(datagram_t, frame) + length;
+		ssize_t sent = sendto(
+			sim.socket, &datagram, datagram_length, 0,
+			(struct sockaddr *) &sim.group, sizeof(sim.group)
+		);
+		return sent == (ssize_t) datagram_length;
+	#else
+		xSemaphoreTake(sim.lock, portMAX_DELAY);
+		wmesh_transport_recv_cb_t recv_cb = sim.recv_cb;
+		int8_t rssi = sim.impairment.rssi;
+		xSemaphoreGive(sim.lock);
+
+		if(recv_cb) {
+			recv_cb(sim.address, data, length, rssi);
+		}
+		return true;
+	#endif
+}
+
+
+/// @brief Sends delayed frames once their delay passes, in delivery order.
+/// For UDP, also polls for received frames.
+///
+/// @param arg Unused.
+static void sim_task(void *arg) {
+	static pending_frame_t frame;
+
+	while(atomic_load(&sim.running)) {
+		int64_t next_us = INT64_MAX;
+
+		while(true) {
+			int64_t now_us = esp_timer_get_time();
+
+			xSemaphoreTake(sim.lock, portMAX_DELAY);
+			pending_frame_t *earliest = NULL;
+			for(size_t i = 0; i < sim.pending_count; i++) {
+				if(!earliest || sim.pending[i].deliver_us < earliest->deliver_us) {
+					earliest = &sim.pending[i];
+				}
+			}
+
+			if(!earliest || earliest->deliver_us > now_us) {
+				next_us = earliest ? earliest->deliver_us : INT64_MAX;
+				xSemaphoreGive(sim.lock);
+				break;
+			}
+
+			// Copied out, so callbacks run without the lock.
+			memcpy(&frame, earliest, offsetof(pending_frame_t, data) + earliest->length);
+			*earliest = sim.pending[--sim.pending_count];
+			wmesh_transport_send_cb_t send_cb = sim.send_cb;
+			xSemaphoreGive(sim.lock);
+
+			bool sent = deliver(frame.dest, frame.data, frame.length);
+			if(send_cb) {
+				send_cb(frame.dest, sent);
+			}
+		}
+
+		#if CONFIG_WMESH_TRANSPORT_UDP
+			poll_socket();
+			TickType_t timeout = 1;
+		#else
+			TickType_t timeout = portMAX_DELAY;
+		#endif
+
+		if(next_us != INT64_MAX) {
+			int64_t remaining_us = next_us - esp_timer_get_time();
+			TickType_t ticks = remaining_us <= 0 ? 0 : pdMS_TO_TICKS((remaining_us + 999) / 1000);
+			timeout = ticks < timeout ? ticks : timeout;
+		}
+
+		ulTaskNotifyTake(pdTRUE, timeout);
+	}
+
+	xSemaphoreGive(sim.task_done);
+	vTaskDelete(NULL);
+}
+
+
+esp_err_t wmesh_transport_init(const wmesh_transport_config_t *config) {
+	wmesh_address_t address;
+	wmesh_transport_get_address(address);
+
+	sim.lock = xSemaphoreCreateMutex();
+	if(!sim.lock) {
+		return ESP_ERR_NO_MEM;
+	}
+
+	sim.task_done = xSemaphoreCreateBinary();
+	if(!sim.task_done) {
+		vSemaphoreDelete(sim.lock);
+		return ESP_ERR_NO_MEM;
+	}
+
+	#if CONFIG_WMESH_TRANSPORT_UDP
+		esp_err_t err = open_socket();
+		if(err != ESP_OK) {
+			vSemaphoreDelete(sim.task_done);
+			vSemaphoreDelete(sim.lock);
+			return err;
+		}
+	#endif
+
+	sim.recv_cb = config->recv_cb;
+	sim.send_cb = config->send_cb;
+	sim.impairment = (wmesh_transport_impairment_t) {
+		.loss_percent = CONFIG_WMESH_TRANSPORT_SIM_LOSS_PERCENT,
+		.latency_ms = CONFIG_WMESH_TRANSPORT_SIM_LATENCY_MS,
+		.jitter_ms = CONFIG_WMESH_TRANSPORT_SIM_JITTER_MS,
+		.reorder_percent = CONFIG_WMESH_TRANSPORT_SIM_REORDER_PERCENT,
+		.reorder_delay_ms = CONFIG_WMESH_TRANSPORT_SIM_REORDER_DELAY_MS,
+		.rssi = SIM_RSSI,
+	};
+	sim.pending_count = 0;
+	sim.sent = 0;
+	sim.lost = 0;
+	sim.reordered = 0;
+	sim.overflows = 0;
+	#if CONFIG_WMESH_RATE_CONTROL
+		for(size_t i = 0; i < CONFIG_WMESH_REGISTERED_PEER_COUNT; i++) {
+			sim.peers[i].in_use = false;
+		}
+	#endif
+
+	// Sends frames above the receive task, like the Wi-Fi task.
+	atomic_init(&sim.running, true);
+	if(xTaskCreate(
+		sim_task, "wmesh_sim",
+		CONFIG_WMESH_RX_TASK_STACK_SIZE, NULL,
+		CONFIG_WMESH_RX_TASK_PRIORITY + 1, &sim.task
+	) != pdPASS) {
+		#if CONFIG_WMESH_TRANSPORT_UDP
+			close(sim.socket);
+		#endif
+		vSemaphoreDelete(sim.task_done);
+		vSemaphoreDelete(sim.lock);
+		return ESP_ERR_NO_MEM;
+	}
+
+	ESP_LOGI(TAG,
+		"Simulated %s transport initialized, address %02X:%02X:%02X:%02X:%02X:%02X",
+		#if CONFIG_WMESH_TRANSPORT_UDP
+			"UDP",
+		#else
+			"loopback",
+		#endif
+		address[0], address[1], address[2], address[3], address[4], address[5]
+	);
+	return ESP_OK;
+}
+
+
+void wmesh_transport_detach(void) {
+	xSemaphoreTake(sim.lock, portMAX_DELAY);
+	sim.recv_cb = NULL;
+	sim.send_cb = NULL;
+	xSemaphoreGive(sim.lock);
+}
+
+
+void wmesh_transport_deinit(void) {
+	atomic_store(&sim.running, false);
+	xTaskNotifyGive(sim.task);
+	xSemaphoreTake(sim.task_done, portMAX_DELAY);
+
+	ESP_LOGI(TAG,
+		"Simulated link: %"PRIu32" sent, %"PRIu32" lost, %"PRIu32" reordered, %"PRIu32" overflows, %zu still delayed",
+		sim.sent, sim.lost, sim.reordered, sim.overflows, sim.pending_count
+	);
+
+	#if CONFIG_WMESH_TRANSPORT_UDP
+		close(sim.socket);
+		sim.socket = -1;
+	#endif
+	vSemaphoreDelete(sim.task_done);
+	vSemaphoreDelete(sim.lock);
+}
+
+
+void wmesh_transport_get_address(wmesh_address_t address) {
+	if(!sim.address_set) {
+		unsigned int bytes[6];
+		const char *configured = getenv("WMESH_ADDRESS");
+
+		if(
+			configured && sscanf(
+				configured, "%x:%x:%x:%x:%x:%x",
+				&bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4], &bytes[5]
+			) == 6
+		) {
+			for(size_t i = 0; i < 6; i++) {
+				sim.address[i] = bytes[i];
+			}
+		} else {
+			// Locally administered, unique per process.
+			uint32_t pid = getpid();
+			const wmesh_address_t generated = {
+				0x02, 0x00, pid >> 24, pid >> 16, pid >> 8, pid
+			};
+			memcpy(sim.address, generated, sizeof(wmesh_address_t));
+		}
+
+		sim.address_set = true;
+	}
+
+	memcpy(address, sim.address, sizeof(wmesh_address_t));
+}
+
+
+esp_err_t wmesh_transport_send(
+	const wmesh_address_t dest,
+	const uint8_t *data,
+	size_t length
+) {
+	if(length > CONFIG_WMESH_FRAME_SIZE) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	xSemaphoreTake(sim.lock, portMAX_DELAY);
+	const wmesh_transport_impairment_t *impairment = &sim.impairment;
+	sim.sent++;
+
+	bool lost = esp_random() % 100 < impairment->loss_percent;
+	#if CONFIG_WMESH_RATE_CONTROL
+		// Broadcasts, and peers without a rate, go out at the default rate.
+		int peer = find_peer(dest);
+		wmesh_rate_t rate = peer >= 0 ? sim.peers[peer].rate : WMESH_RATE_DEFAULT;
+		lost = lost || esp_random() % 100 >= link_delivery(rate);
+	#endif
+
+	if(lost) {
+		sim.lost++;
+		wmesh_transport_send_cb_t send_cb = sim.send_cb;
+		xSemaphoreGive(sim.lock);
+
+		if(send_cb) {
+			send_cb(dest, false);
+		}
+		return ESP_OK;
+	}
+
+	if(sim.pending_count == CONFIG_WMESH_TRANSPORT_SIM_QUEUE_LENGTH) {
+		sim.overflows++;
+		xSemaphoreGive(sim.lock);
+		return ESP_ERR_NO_MEM;
+	}
+
+	int64_t delay_ms = impairment->latency_ms;
+	if(impairment->jitter_ms > 0) {
+		delay_ms += esp_random() % (impairment->jitter_ms + 1);
+	}
+	if(esp_random() % 100 < impairment->reorder_percent) {
+		delay_ms += impairment->reorder_delay_ms;
+		sim.reordered++;
+	}
+
+	pending_frame_t *frame = &sim.pending[sim.pending_count++];
+	frame->deliver_us = esp_timer_get_time() + delay_ms * 1000;
+	memcpy(frame->dest, dest, sizeof(wmesh_address_t));
+	memcpy(frame->data, data, length);
+	frame->length = length;
+	xSemaphoreGive(sim.lock);
+
+	xTaskNotifyGive(sim.task);
+	return ESP_OK;
+}
+
+
+#if CONFIG_WMESH_RATE_CONTROL
+	esp_err_t wmesh_transport_add_peer(const wmesh_address_t address) {
+		xSemaphoreTake(sim.lock, portMAX_DELAY);
+		if(find_peer(address) >= 0) {
+			xSemaphoreGive(sim.lock);
+			return ESP_OK;
+		}
+
+		for(size_t i = 0; i < CONFIG_WMESH_REGISTERED_PEER_COUNT; i++) {
+			if(!sim.peers[i].in_use) {
+				memcpy(sim.peers[i].address, address, sizeof(wmesh_address_t));
+				sim.peers[i].rate = WMESH_RATE_DEFAULT;
+				sim.peers[i].in_use = true;
+				xSemaphoreGive(sim.lock);
+				return ESP_OK;
+			}
+		}
+
+		xSemaphoreGive(sim.lock);
+		return ESP_ERR_NO_MEM;
+	}
+
+
+	void wmesh_transport_del_peer(const wmesh_address_t address) {
+		xSemaphoreTake(sim.lock, portMAX_DELAY);
+		int peer = find_peer(address);
+		if(peer >= 0) {
+			sim.peers[peer].in_use = false;
+		}
+		xSemaphoreGive(sim.lock);
+	}
+
+
+	esp_err_t wmesh_transport_set_peer_rate(
+		const wmesh_address_t address,
+		wmesh_rate_t rate
+	) {
+		xSemaphoreTake(sim.lock, portMAX_DELAY);
+		int peer = find_peer(address);
+		if(peer >= 0) {
+			sim.peers[peer].rate = rate;
+		}
+		xSemaphoreGive(sim.lock);
+
+		return peer >= 0 ? ESP_OK : ESP_ERR_NOT_FOUND;
+	}
+
+
+	esp_err_t wmesh_transport_get_peer_rate(
+		const wmesh_address_t address,
+		wmesh_rate_t *rate
+	) {
+		xSemaphoreTake(sim.lock, portMAX_DELAY);
+		int peer = find_peer(address);
+		if(peer >= 0) {
+			*rate = sim.peers[peer].rate;
+		}
+		xSemaphoreGive(sim.lock);
+
+		return peer >= 0 ? ESP_OK : ESP_ERR_NOT_FOUND;
+	}
+
+
+	uint8_t wmesh_transport_link_delivery(wmesh_rate_t rate) {
+		xSemaphoreTake(sim.lock, portMAX_DELAY);
+		uint8_t delivery = link_delivery(rate);
+		xSemaphoreGive(sim.lock);
+
+		return delivery;
+	}
+#else
+	esp_err_t wmesh_transport_add_peer(const wmesh_address_t address) {
+		return ESP_OK;
+	}
+
+
+	void wmesh_transport_del_peer(const wmesh_address_t address) {
+	}
+#endif
+
+
+void wmesh_transport_set_impairment(const wmesh_transport_impairment_t *impairment) {
+	xSemaphoreTake(sim.lock, portMAX_DELAY);
+	sim.impairment = *impairment;
+	xSemaphoreGive(sim.lock);
+}
+
+
+void wmesh_transport_get_impairment(wmesh_transport_impairment_t *impairment) {
+	xSemaphoreTake(sim.lock, portMAX_DELAY);
+	*impairment = sim.impairment;
+	xSemaphoreGive(sim.lock);
+}
@@ -1,19 +1,90 @@
 #include "wmesh/wmesh.h"
 
 #include "esp_log.h"
-#include "esp_now.h"
 #include "esp_mac.h"
-#include "esp_wifi.h"
-#include "mbedtls/gcm.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "wmesh/transport.h"
 
 static const char *TAG = "Mesh";
 wmesh_handle_t *wmesh_global_handle = NULL;
 
 
-static esp_err_t ensure_ap_mode();
-static esp_err_t initialize_esp_now(const wmesh_config_t *config);
+static esp_err_t start_rx_task(wmesh_handle_t *handle);
+#if CONFIG_WMESH_PEER_FLUSH_INTERVAL_MS > 0
+	static esp_err_t start_flush_task(wmesh_handle_t *handle);
+	static void stop_flush_task(wmesh_handle_t *handle);
+	static void queue_peer_flush(wmesh_handle_t *handle);
+#endif
+static void set_service_handle(
+	wmesh_handle_t *handle, wmesh_service_id_t id,
+	wmesh_service_recv_cb_t receive_callback, void *ctx
+);
+static esp_err_t fragment_cb(
+	wmesh_handle_t *handle, wmesh_address_t src,
+	uint8_t *data, size_t data_size, void *user_ctx
+);
+static esp_err_t reliable_data_cb(
+	wmesh_handle_t *handle, wmesh_address_t src,
+	uint8_t *data, size_t data_size, void *user_ctx
+);
+static esp_err_t reliable_ack_cb(
+	wmesh_handle_t *handle, wmesh_address_t src,
+	uint8_t *data, size_t data_size, void *user_ctx
+);
+static esp_err_t bundle_cb(
+	wmesh_handle_t *handle, wmesh_address_t src,
+	uint8_t *data, size_t data_size, void *user_ctx
+);
+static esp_err_t renew_sequence_lease(wmesh_handle_t *handle);
+static esp_err_t init_reliable(wmesh_handle_t *handle);
+static void free_reliable(wmesh_handle_t *handle);
+static esp_err_t init_routing(wmesh_handle_t *handle);
+static void free_routing(wmesh_handle_t *handle);
+static esp_err_t send_fragmented(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	const wmesh_iovec_t *iov, size_t iov_count,
+	size_t data_length, size_t max_payload
+);
+static esp_err_t send_frame(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_frame_t *frame, size_t plaintext_length
+);
+static esp_err_t send_service_frame(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	wmesh_frame_t *frame, size_t payload_length
+);
+static void count_sent(
+	wmesh_handle_t *handle, wmesh_service_id_t service,
+	size_t length, esp_err_t err
+);
+static void gather_payload(
+	wmesh_handle_t *handle, uint8_t *payload,
+	const wmesh_iovec_t *iov, size_t iov_count,
+	size_t offset, size_t length
+);
+static void recv_cb(
+	const wmesh_address_t src, const uint8_t *data, size_t data_len, int8_t rssi
+);
+static void send_cb(const wmesh_address_t dest, bool success);
+#if CONFIG_WMESH_RATE_CONTROL
+	static void apply_rate(const wmesh_peer_t *peer);
+#endif
+#if CONFIG_WMESH_ROUTING
+	static esp_err_t route_beacon_cb(
+		wmesh_handle_t *handle, wmesh_address_t src,
+		uint8_t *data, size_t data_size, void *user_ctx
+	);
+	static esp_err_t routed_cb(
+		wmesh_handle_t *handle, wmesh_address_t src,
+		uint8_t *data, size_t data_size, void *user_ctx
+	);
+#endif
 
 wmesh_handle_t *wmesh_init(const wmesh_config_t *config) {
+	int64_t init_start_us = esp_timer_get_time();
 	esp_err_t err;
 
 	if(wmesh_global_handle != NULL) {
@@ -22,12 +93,12 @@ wmesh_handle_t *wmesh_init(const wmesh_config_t *config) {
 		return NULL;
 	}
 
-	if((err = ensure_ap_mode()) != ESP_OK) {
-		return NULL;
-	}
-
-	// Wi-Fi is now initialized and set to either AP or AP+STA.
-	if((err = initialize_esp_now(config)) != ESP_OK) {
+	const wmesh_transport_config_t transport_config = {
+		.network_key = config->network_key,
+		.recv_cb = recv_cb,
+		.send_cb = send_cb,
+	};
+	if((err = wmesh_transport_init(&transport_config)) != ESP_OK) {
 		return NULL;
 	}
 
@@ -37,10 +108,12 @@ wmesh_handle_t *wmesh_init(const wmesh_config_t *config) {
 		return NULL;
 	}
 
+	wmesh_frame_pool_init(&handle->frame_pool);
+
 	handle->peers = calloc(1, sizeof(*handle->peers));
 	if(!handle->peers) {
 		ESP_LOGE(TAG, "Error allocating peer list");
-		esp_now_deinit();
+		wmesh_transport_deinit();
 		free(handle);
 		return NULL;
 	}
@@ -49,23 +122,51 @@ wmesh_handle_t *wmesh_init(const wmesh_config_t *config) {
 	if(!handle->encryption_ctx) {
 		ESP_LOGE(TAG, "Error allocating encryption context");
 		free(handle->peers);
-		esp_now_deinit();
+		wmesh_transport_deinit();
+		free(handle);
+		return NULL;
+	}
+
+	handle->tx_lock = xSemaphoreCreateMutex();
+	if(!handle->tx_lock) {
+		ESP_LOGE(TAG, "Error allocating transmit lock");
+		free(handle->peers);
+		free(handle->encryption_ctx);
+		wmesh_transport_deinit();
+		free(handle);
+		return NULL;
+	}
+
+	handle->coalesce_lock = xSemaphoreCreateMutex();
+	if(!handle->coalesce_lock) {
+		ESP_LOGE(TAG, "Error allocating coalescing lock");
+		vSemaphoreDelete(handle->tx_lock);
+		free(handle->peers);
+		free(handle->encryption_ctx);
+		wmesh_transport_deinit();
 		free(handle);
 		return NULL;
 	}
+	wmesh_coalescer_init(&handle->coalescer);
 
+	// Replay windows are written through, as one restored from an older
+	// flush after power loss would accept frames already received.
 	const wmesh_storage_config_t peer_storage_config = {
-		.name = "wmesh_peer"
+		.name = "wmesh_peer",
+		.write_through = true,
 	};
 	err = wmesh_storage_open(&handle->peer_storage, &peer_storage_config);
 	if(err != ESP_OK) {
 		ESP_LOGE(TAG, "Error opening Mesh Peer storage");
+		vSemaphoreDelete(handle->coalesce_lock);
+		vSemaphoreDelete(handle->tx_lock);
 		free(handle->peers);
 		free(handle->encryption_ctx);
-		esp_now_deinit();
+		wmesh_transport_deinit();
 		free(handle);
 		return NULL;
 	}
+	wmesh_peer_table_init(&handle->peer_table, &handle->peer_storage);
 
 	const wmesh_storage_config_t self_storage_config = {
 		.name = "wmesh_self"
@@ -73,15 +174,27 @@ wmesh_handle_t *wmesh_init(const wmesh_config_t *config) {
 	err = wmesh_storage_open(&handle->self_storage, &self_storage_config);
 	if(err != ESP_OK) {
 		ESP_LOGE(TAG, "Error opening Mesh Peer storage");
+		wmesh_peer_table_free(&handle->peer_table);
 		wmesh_storage_close(&handle->peer_storage);
+		vSemaphoreDelete(handle->coalesce_lock);
+		vSemaphoreDelete(handle->tx_lock);
 		free(handle->peers);
 		free(handle->encryption_ctx);
-		esp_now_deinit();
+		wmesh_transport_deinit();
 		free(handle);
 		return NULL;
 	}
 
 
+	int64_t preload_start_us = esp_timer_get_time();
+	if(wmesh_peer_list_preload(handle->peers, &handle->peer_table) != WMESH_STORAGE_OK) {
+		ESP_LOGW(TAG, "Error preloading peers");
+	}
+	ESP_LOGI(TAG,
+		"Preloaded %zu peers in %"PRIi64" us",
+		handle->peers->peer_count, esp_timer_get_time() - preload_start_us
+	);
+
 	wmesh_encryption_config_t enc_cfg = {
 		.key = handle->network_key
 	};
@@ -95,28 +208,253 @@ wmesh_handle_t *wmesh_init(const wmesh_config_t *config) {
 		ESP_LOGI(TAG, "Current sequence number: %"PRIu64, (uint64_t) handle->sequence_number);
 	}
 
-	handle->service_handlers = NULL;
+	// The lease is always flushed, so it is never older than a sequence
+	// number which may have been used.
+	if(wmesh_storage_read_ctr(&handle->self_storage, "lease", &handle->sequence_lease) != WMESH_STORAGE_OK) {
+		handle->sequence_lease = 0;
+	}
+	if(wmesh_storage_writes_lost(&handle->self_storage) && handle->sequence_lease > handle->sequence_number) {
+		ESP_LOGW(TAG, "Stored sequence number may be outdated, resuming from %"PRIu64, (uint64_t) handle->sequence_lease);
+		handle->sequence_number = handle->sequence_lease;
+	}
+
+	if(handle->sequence_number >= handle->sequence_lease) {
+		err = renew_sequence_lease(handle);
+	} else {
+		// The rest of the lease is still reserved. Until `wmesh_stop` stores
+		// the exact sequence number, only the end of the lease is safe to
+		// resume from.
+		err = ESP_OK;
+		if(
+			wmesh_storage_write_ctr(&handle->self_storage, "ctr", &handle->sequence_lease) != WMESH_STORAGE_OK ||
+			wmesh_storage_commit(&handle->self_storage) != ESP_OK
+		) {
+			ESP_LOGE(TAG, "Error reserving sequence numbers");
+			err = ESP_FAIL;
+		}
+	}
+
+	if(err != ESP_OK) {
+		wmesh_encryption_ctx_free(handle->encryption_ctx);
+		wmesh_storage_close(&handle->self_storage);
+		wmesh_peer_table_free(&handle->peer_table);
+		wmesh_storage_close(&handle->peer_storage);
+		vSemaphoreDelete(handle->coalesce_lock);
+		vSemaphoreDelete(handle->tx_lock);
+		free(handle->peers);
+		free(handle->encryption_ctx);
+		wmesh_transport_deinit();
+		free(handle);
+		return NULL;
+	}
+
+	if((err = init_reliable(handle)) != ESP_OK) {
+		ESP_LOGE(TAG, "Error allocating reliable delivery state");
+		wmesh_encryption_ctx_free(handle->encryption_ctx);
+		wmesh_storage_close(&handle->self_storage);
+		wmesh_peer_table_free(&handle->peer_table);
+		wmesh_storage_close(&handle->peer_storage);
+		vSemaphoreDelete(handle->coalesce_lock);
+		vSemaphoreDelete(handle->tx_lock);
+		free(handle->peers);
+		free(handle->encryption_ctx);
+		wmesh_transport_deinit();
+		free(handle);
+		return NULL;
+	}
+
+	if((err = init_routing(handle)) != ESP_OK) {
+		ESP_LOGE(TAG, "Error allocating routing state");
+		free_reliable(handle);
+		wmesh_encryption_ctx_free(handle->encryption_ctx);
+		wmesh_storage_close(&handle->self_storage);
+		wmesh_peer_table_free(&handle->peer_table);
+		wmesh_storage_close(&handle->peer_storage);
+		vSemaphoreDelete(handle->coalesce_lock);
+		vSemaphoreDelete(handle->tx_lock);
+		free(handle->peers);
+		free(handle->encryption_ctx);
+		wmesh_transport_deinit();
+		free(handle);
+		return NULL;
+	}
+
+	if((err = start_rx_task(handle)) != ESP_OK) {
+		ESP_LOGE(TAG, "Error starting receive task");
+		free_routing(handle);
+		free_reliable(handle);
+		wmesh_encryption_ctx_free(handle->encryption_ctx);
+		wmesh_storage_close(&handle->self_storage);
+		wmesh_peer_table_free(&handle->peer_table);
+		wmesh_storage_close(&handle->peer_storage);
+		vSemaphoreDelete(handle->coalesce_lock);
+		vSemaphoreDelete(handle->tx_lock);
+		free(handle->peers);
+		free(handle->encryption_ctx);
+		wmesh_transport_deinit();
+		free(handle);
+		return NULL;
+	}
+
+	memset(handle->services, 0, sizeof(handle->services));
+	for(size_t i = 0; i < WMESH_SERVICE_COUNT; i++) {
+		wmesh_counters_init(&handle->services[i].counters);
+	}
+	wmesh_counters_init(&handle->counters);
+	portMUX_INITIALIZE(&handle->services_lock);
+	set_service_handle(handle, WMESH_SERVICE_FRAGMENT, fragment_cb, NULL);
+	set_service_handle(handle, WMESH_SERVICE_RELIABLE_DATA, reliable_data_cb, NULL);
+	set_service_handle(handle, WMESH_SERVICE_RELIABLE_ACK, reliable_ack_cb, NULL);
+	set_service_handle(handle, WMESH_SERVICE_BUNDLE, bundle_cb, NULL);
+	#if CONFIG_WMESH_ROUTING
+		set_service_handle(handle, WMESH_SERVICE_ROUTE_BEACON, route_beacon_cb, NULL);
+		set_service_handle(handle, WMESH_SERVICE_ROUTED, routed_cb, NULL);
+	#endif
+	atomic_init(&handle->next_message_id, 0);
 	for(size_t i = 0; config->service_config && config->service_config[i].receive_callback; i++) {
 		wmesh_register_service(handle, &config->service_config[i]);
 	}
 
+	#if CONFIG_WMESH_STORAGE_RTC_CACHE
+		ESP_LOGI(TAG,
+			"Started in %"PRIi64" us, storage %s",
+			esp_timer_get_time() - init_start_us,
+			wmesh_storage_writes_lost(&handle->self_storage) ? "loaded from flash" : "restored from RTC memory"
+		);
+	#else
+		ESP_LOGI(TAG, "Started in %"PRIi64" us", esp_timer_get_time() - init_start_us);
+	#endif
+
 	wmesh_global_handle = handle;
 	return handle;
 }
 
 
 esp_err_t wmesh_stop(wmesh_handle_t *handle) {
+	wmesh_transport_detach();
 	wmesh_global_handle = NULL;
-	wmesh_peer_list_store(handle->peers, &handle->peer_storage);
+
+	atomic_store(&handle->rx_running, false);
+	xTaskNotifyGive(handle->rx_task);
+	xSemaphoreTake(handle->rx_task_done, portMAX_DELAY);
+	vSemaphoreDelete(handle->rx_task_done);
+	vQueueDelete(handle->send_results);
+	#if CONFIG_WMESH_PEER_FLUSH_INTERVAL_MS > 0
+		stop_flush_task(handle);
+	#endif
+	vSemaphoreDelete(handle->peer_storage_lock);
+
+	// Acknowledgements queued by the receive task may still be waiting.
+	wmesh_flush(handle);
+
+	int64_t store_start_us = esp_timer_get_time();
+	#if CONFIG_WMESH_PEER_FLUSH_INTERVAL_MS > 0
+		// Records the flush task failed to write get one more try.
+		size_t flush_count = wmesh_peer_list_collect(handle->peers, handle->flush_records, handle->flush_count);
+		wmesh_peer_records_store(&handle->peer_table, handle->flush_records, flush_count);
+		free(handle->flush_records);
+	#else
+		wmesh_peer_list_store(handle->peers, &handle->peer_table);
+	#endif
+	ESP_LOGI(TAG,
+		"Stored peer table (%zu peers) in %"PRIi64" us",
+		handle->peers->peer_count, esp_timer_get_time() - store_start_us
+	);
+
+	// On a clean stop the exact sequence number is stored, so the rest of the
+	// current lease is not skipped.
 	wmesh_storage_write_ctr(&handle->self_storage, "ctr", &handle->sequence_number);
 
+	#if CONFIG_WMESH_ENCRYPTION_PROFILE
+		wmesh_encryption_profile_t *profile = &handle->encryption_ctx->profile;
+		uint32_t frames = profile->frames > 0 ? profile->frames : 1;
+		uint32_t copies = profile->copies > 0 ? profile->copies : 1;
+		ESP_LOGI(TAG,
+			"Encryption: %"PRIu32" frames, %"PRIu64" nonce + %"PRIu64" cipher %s/frame",
+			profile->frames,
+			profile->nonce_time / frames, profile->aead_time / frames,
+			WMESH_PROFILE_TIME_UNIT
+		);
+		ESP_LOGI(TAG,
+			"Encryption: %"PRIu32" payloads copied, %"PRIu64" bytes, %"PRIu64" %s/copy",
+			profile->copies, profile->copied_bytes, profile->copy_time / copies,
+			WMESH_PROFILE_TIME_UNIT
+		);
+	#endif
+
 	wmesh_encryption_ctx_free(handle->encryption_ctx);
 	free(handle->encryption_ctx);
 
+	wmesh_peer_table_free(&handle->peer_table);
 	wmesh_storage_close(&handle->peer_storage);
 	wmesh_storage_close(&handle->self_storage);
 
-	esp_now_deinit();
+	wmesh_peer_registry_t *registry = &handle->peers->registry;
+	ESP_LOGI(TAG,
+		"Registered peers: %"PRIu32" hits, %"PRIu32" misses, %"PRIu32" evictions",
+		registry->hits, registry->misses, registry->evictions
+	);
+	ESP_LOGI(TAG,
+		"Peer list: %"PRIu32" evictions, %"PRIu32" reloads, %"PRIu32" unparked, %"PRIu32" dropped, %"PRIu32" loads limited",
+		handle->peers->evictions, handle->peers->reloads,
+		handle->peers->unparked, handle->peers->dropped,
+		handle->peer_loads_limited
+	);
+	ESP_LOGI(TAG,
+		"Peer table: %"PRIu32" shard hits, %"PRIu32" shard misses",
+		handle->peer_table.hits, handle->peer_table.misses
+	);
+
+	wmesh_counters_snapshot_t total;
+	wmesh_counters_read(&handle->counters, &total);
+	ESP_LOGI(TAG,
+		"Received: %"PRIu32" frames, %"PRIu32" stale, %"PRIu32" tag errors, %"PRIu32" decryption errors, %"PRIu32" without handler",
+		total.rx_ok, total.rx_stale, total.rx_auth_errors, total.rx_decrypt_errors, total.rx_no_handler
+	);
+	ESP_LOGI(TAG,
+		"Sent: %"PRIu32" frames delivered, %"PRIu32" failed, %"PRIu32" bytes",
+		total.tx_ok, total.tx_failed, total.bytes_out
+	);
+
+	wmesh_rx_stats_t *rx_stats = &handle->rx_ring->stats;
+	ESP_LOGI(TAG,
+		"Receive queue: %"PRIu32" queued, %"PRIu32" overflows, callback max %"PRIu32" us",
+		rx_stats->queued, rx_stats->overflows, rx_stats->callback_max_us
+	);
+
+	wmesh_reassembly_t *reassembly = handle->reassembly;
+	ESP_LOGI(TAG,
+		"Reassembly: %"PRIu32" completed, %"PRIu32" timeouts, %"PRIu32" evicted, %"PRIu32" dropped",
+		reassembly->completed, reassembly->timeouts, reassembly->evicted, reassembly->dropped
+	);
+
+	wmesh_reliable_tx_t *reliable = handle->reliable;
+	ESP_LOGI(TAG,
+		"Reliable delivery: %"PRIu32" sent, %"PRIu32" retransmissions, %"PRIu32" acked, %"PRIu32" failed",
+		reliable->sent, reliable->retransmissions, reliable->acked, reliable->failed
+	);
+
+	ESP_LOGI(TAG,
+		"Coalescing: %"PRIu32" messages sent in %"PRIu32" frames",
+		handle->coalescer.messages, handle->coalescer.frames
+	);
+
+	#if CONFIG_WMESH_ROUTING
+		wmesh_router_t *router = handle->router;
+		ESP_LOGI(TAG,
+			"Routing: %"PRIu32" forwarded, %"PRIu32" dropped, %"PRIu32" parent changes",
+			router->forwarded, router->dropped, router->parent_changes
+		);
+	#endif
+
+	wmesh_transport_deinit();
+	vSemaphoreDelete(handle->coalesce_lock);
+	vSemaphoreDelete(handle->tx_lock);
+	free(handle->rx_ring);
+	free(handle->reassembly);
+	free_routing(handle);
+	free_reliable(handle);
+	free(handle->peers);
 	free(handle);
 
 	return ESP_OK;
@@ -127,43 +465,45 @@ esp_err_t wmesh_ll_send(
 	wmesh_handle_t *handle, const wmesh_address_t dest,
 	const uint8_t *data, size_t data_length
 ) {
-	size_t buffer_size = WMESH_CIPHERTEXT_LENGTH(data_length);
-	uint8_t *send_buffer = malloc(buffer_size);
-	if(!send_buffer) {
-		ESP_LOGE(TAG, "Error allocating %zu bytes", buffer_size);
+	if(WMESH_CIPHERTEXT_LENGTH(data_length) > CONFIG_WMESH_FRAME_SIZE) {
+		ESP_LOGE(TAG, "Message too long: %zu bytes", data_length);
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	wmesh_frame_t *frame = wmesh_frame_alloc(handle);
+	if(!frame) {
 		return ESP_ERR_NO_MEM;
 	}
 
-	esp_err_t err = wmesh_encrypt(
-		handle->encryption_ctx,
-		&handle->sequence_number,
-		data, data_length,
+	const wmesh_iovec_t iov = { data, data_length };
+	gather_payload(handle, frame->data + WMESH_CIPHERTEXT_HEADER_LENGTH, &iov, 1, 0, data_length);
+	esp_err_t err = send_frame(handle, dest, frame, data_length);
+	wmesh_frame_free(handle, frame);
 
-		send_buffer
-	);
-	if(err != ESP_OK) {
-		ESP_LOGE(TAG, "Error encrypting message: %s", esp_err_to_name(err));
-		free(send_buffer);
-		return err;
-	}
+	return err;
+}
 
-	esp_now_peer_info_t peer = {
-		.ifidx = WIFI_IF_AP,
-		.channel = 0,
-	};
 
-	memcpy(&peer.peer_addr, dest, sizeof(wmesh_address_t));
-	esp_now_add_peer(&peer);
-	err = esp_now_send(dest, send_buffer, buffer_size);
-	esp_now_del_peer(dest);
-	free(send_buffer);
+esp_err_t wmesh_set_large_frames(
+	wmesh_handle_t *handle, const wmesh_address_t address,
+	bool enabled
+) {
+	xSemaphoreTake(handle->tx_lock, portMAX_DELAY);
+	esp_err_t err = wmesh_peer_list_set_large_frames(handle->peers, address, enabled);
+	xSemaphoreGive(handle->tx_lock);
 
-	if(err != ESP_OK) {
-		ESP_LOGE(TAG, "Error sending message using ESP-NOW: %s", esp_err_to_name(err));
-		return err;
-	}
+	return err;
+}
 
-	return ESP_OK;
+
+size_t wmesh_get_max_payload(
+	wmesh_handle_t *handle, const wmesh_address_t address
+) {
+	xSemaphoreTake(handle->tx_lock, portMAX_DELAY);
+	size_t max_payload = wmesh_peer_list_max_payload(handle->peers, address);
+	xSemaphoreGive(handle->tx_lock);
+
+	return max_payload;
 }
 
 
@@ -172,301 +512,1719 @@ esp_err_t wmesh_send(
 	wmesh_service_id_t service,
 	const uint8_t *data, size_t data_length
 ) {
-	size_t buffer_size = data_length + 1;
-	uint8_t *send_buffer = malloc(buffer_size);
-	send_buffer[0] = service;
-	memcpy(send_buffer + 1, data, data_length);
-	esp_err_t err = wmesh_ll_send(handle, dest, send_buffer, buffer_size);
-
-	free(send_buffer);
-	return err;
+	const wmesh_iovec_t iov = { data, data_length };
+	return wmesh_sendv(handle, dest, service, &iov, 1);
 }
 
 
-/// @brief Checks whether the Wi-Fi modem is initialized and configured as AP
-/// or AP+STA, if not, tries to set it to a compatible mode.
-///
-/// @return `ESP_OK` or error.
-static esp_err_t ensure_ap_mode() {
-	esp_err_t err;
+esp_err_t wmesh_sendv(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	const wmesh_iovec_t *iov, size_t iov_count
+) {
+	size_t data_length = wmesh_iovec_length(iov, iov_count);
+	size_t max_payload = wmesh_get_max_payload(handle, dest);
 
-	wifi_mode_t wifi_mode;
-	err = esp_wifi_get_mode(&wifi_mode);
-	switch(err) {
-		case ESP_OK:
-			break;
+	esp_err_t err;
+	wmesh_frame_t *frame;
+	if(data_length > max_payload) {
+		err = send_fragmented(handle, dest, service, iov, iov_count, data_length, max_payload);
+	} else if((frame = wmesh_frame_alloc(handle)) == NULL) {
+		err = ESP_ERR_NO_MEM;
+	} else {
+		gather_payload(handle, wmesh_frame_payload(frame), iov, iov_count, 0, data_length);
+		err = send_service_frame(handle, dest, service, frame, data_length);
+	}
 
-		case ESP_ERR_WIFI_NOT_INIT:
-			ESP_LOGE(TAG, "Wi-Fi modem not initialized");
-			return err;
+	count_sent(handle, service, data_length, err);
+	return err;
+}
 
-		case ESP_ERR_INVALID_ARG:
-			ESP_LOGE(TAG, "Internal error: %s", esp_err_to_name(err));
-			return err;
 
-		default:
-			ESP_LOGE(TAG, "Unexpected error: %s", esp_err_to_name(err));
-			return err;
-	}
+esp_err_t wmesh_send_reliable(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	const uint8_t *data, size_t data_length,
+	TickType_t timeout
+) {
+	const wmesh_iovec_t iov = { data, data_length };
+	return wmesh_send_reliablev(handle, dest, service, &iov, 1, timeout);
+}
 
-	// Check whether Wi-Fi modem is configured as AP; and, if not, whether it
-	// can be reconfigured.
-	switch(wifi_mode) {
-		case WIFI_MODE_AP:
-		case WIFI_MODE_APSTA:
-			break;
 
-		case WIFI_MODE_STA:
-			ESP_LOGW(TAG, "Wi-Fi modem configured as STA. Setting to SoftAP + STA...");
+esp_err_t wmesh_send_reliablev(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	const wmesh_iovec_t *iov, size_t iov_count,
+	TickType_t timeout
+) {
+	size_t data_length = wmesh_iovec_length(iov, iov_count);
+	if(data_length > wmesh_get_max_payload(handle, dest) - sizeof(wmesh_reliable_header_t)) {
+		ESP_LOGE(TAG, "Message too long: %zu bytes", data_length);
+		count_sent(handle, service, data_length, ESP_ERR_INVALID_SIZE);
+		return ESP_ERR_INVALID_SIZE;
+	}
 
-			if((err = esp_wifi_set_mode(WIFI_MODE_APSTA)) != ESP_OK) {
-				ESP_LOGE(TAG,
-					"Error reconfiguring Wi-Fi modem as SoftAP + STA: %s",
-					esp_err_to_name(err)
-				);
+	if(service >= WMESH_SERVICE_RESERVED_FIRST || memcmp(dest, wmesh_broadcast_address, sizeof(wmesh_address_t)) == 0) {
+		return ESP_ERR_INVALID_ARG;
+	}
 
-				return err;
-			}
+	TickType_t start = xTaskGetTickCount();
+	wmesh_frame_t *frame = NULL;
+	size_t frame_length = 0;
+
+	while(true) {
+		xSemaphoreTake(handle->reliable_lock, portMAX_DELAY);
+
+		wmesh_reliable_channel_t *channel = wmesh_reliable_tx_channel(handle->reliable, dest, true);
+		wmesh_reliable_entry_t *entry = channel ? wmesh_reliable_channel_push(
+			handle->reliable, channel,
+			service, iov, iov_count,
+			esp_timer_get_time()
+		) : NULL;
+
+		// If no frame is available, the first transmission is left to the
+		// retransmission timer.
+		if(entry && (frame = wmesh_frame_pool_get(&handle->frame_pool)) != NULL) {
+			const wmesh_iovec_t entry_iov = { entry->data, entry->length };
+			gather_payload(handle, wmesh_frame_payload(frame), &entry_iov, 1, 0, entry->length);
+			frame_length = entry->length;
+		}
 
-			ESP_LOGW(TAG, "Wi-Fi mode set to SoftAP + STA");
+		xSemaphoreGive(handle->reliable_lock);
 
+		if(entry) {
 			break;
+		}
 
-		default:
-			const char *wifi_mode_names[] = {
-				[WIFI_MODE_NULL] = "WIFI_MODE_NULL",
-				[WIFI_MODE_STA] = "WIFI_MODE_STA",
-				[WIFI_MODE_AP] = "WIFI_MODE_AP",
-				[WIFI_MODE_APSTA] = "WIFI_MODE_APSTA",
-				[WIFI_MODE_NAN] = "WIFI_MODE_NAN",
-				[WIFI_MODE_MAX] = "WIFI_MODE_MAX",
-			};
-			ESP_LOGE(TAG,
-				"Incompatible Wi-Fi mode for mesh operation: %s",
-				wifi_mode_names[wifi_mode]
-			);
+		TickType_t elapsed = xTaskGetTickCount() - start;
+		if(elapsed >= timeout || xSemaphoreTake(handle->reliable_progress, timeout - elapsed) != pdTRUE) {
+			count_sent(handle, service, data_length, ESP_ERR_TIMEOUT);
+			return ESP_ERR_TIMEOUT;
+		}
+	}
 
-			ESP_LOGE(TAG, "Compatible modes are:");
-			ESP_LOGE(TAG, "	- WIFI_MODE_AP");
-			ESP_LOGE(TAG, "	- WIFI_MODE_APSTA");
+	// Let the receive task rearm its retransmission timer.
+	xTaskNotifyGive(handle->rx_task);
 
-			return ESP_ERR_WIFI_MODE;
+	if(frame) {
+		esp_err_t err = send_service_frame(
+			handle, dest,
+			WMESH_SERVICE_RELIABLE_DATA,
+			frame, frame_length
+		);
+		if(err != ESP_OK) {
+			ESP_LOGW(TAG, "Reliable frame will be retransmitted");
+		}
 	}
 
+	count_sent(handle, service, data_length, ESP_OK);
 	return ESP_OK;
 }
 
 
-esp_err_t wmesh_register_service(
-	wmesh_handle_t *handle, const wmesh_service_config_t *config
+esp_err_t wmesh_reliable_flush(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	TickType_t timeout
 ) {
-	wmesh_service_handle_t *service_handle = handle->service_handlers;
-
-	if(!service_handle) {
-		handle->service_handlers = calloc(1, sizeof(*handle->service_handlers));
-		if(!handle->service_handlers) {
-			ESP_LOGE(TAG, "Error allocating memory for service handle");
-			return ESP_ERR_NO_MEM;
+	TickType_t start = xTaskGetTickCount();
+
+	while(true) {
+		xSemaphoreTake(handle->reliable_lock, portMAX_DELAY);
+
+		esp_err_t err = ESP_ERR_TIMEOUT;
+		wmesh_reliable_channel_t *channel = wmesh_reliable_tx_channel(handle->reliable, dest, false);
+		if(!channel) {
+			err = ESP_OK;
+		} else if(wmesh_reliable_channel_idle(channel)) {
+			err = channel->lost ? ESP_FAIL : ESP_OK;
+			channel->lost = false;
 		}
-		service_handle = handle->service_handlers;
-	} else {
-		service_handle = handle->service_handlers;
-		while(service_handle->next) {
-			service_handle = service_handle->next;
+
+		xSemaphoreGive(handle->reliable_lock);
+
+		if(err != ESP_ERR_TIMEOUT) {
+			return err;
 		}
 
-		service_handle = service_handle->next = malloc(sizeof(*handle->service_handlers));
-		if(!service_handle) {
-			ESP_LOGE(TAG, "Error allocating memory for service handle");
-			return ESP_ERR_NO_MEM;
+		TickType_t elapsed = xTaskGetTickCount() - start;
+		if(elapsed >= timeout || xSemaphoreTake(handle->reliable_progress, timeout - elapsed) != pdTRUE) {
+			return ESP_ERR_TIMEOUT;
 		}
 	}
+}
 
-	service_handle->id = config->id;
-	service_handle->ctx = config->ctx;
-	service_handle->receive_callback = config->receive_callback;
-	service_handle->next = NULL;
 
-	ESP_LOGI(TAG, "Added handler for service %"PRIu8, config->id);
-	return ESP_OK;
+/// @brief Sends an open bundle, and closes it. Must be called with
+/// `coalesce_lock` taken.
+///
+/// @param handle Mesh handle.
+/// @param bundle Open bundle.
+static void send_bundle(wmesh_handle_t *handle, wmesh_bundle_t *bundle) {
+	wmesh_frame_t *frame = bundle->frame;
+	uint8_t *payload = wmesh_frame_payload(frame);
+	bundle->frame = NULL;
+	handle->coalescer.frames++;
+
+	// A lone message is sent as is, which saves the record header.
+	if(bundle->count == 1) {
+		wmesh_bundle_record_t record;
+		memcpy(&record, payload, sizeof(record));
+		memmove(payload, payload + sizeof(record), record.length);
+
+		send_service_frame(handle, bundle->dest, record.service, frame, record.length);
+		return;
+	}
+
+	send_service_frame(handle, bundle->dest, WMESH_SERVICE_BUNDLE, frame, bundle->length);
 }
 
 
-esp_err_t wmesh_unregister_service(
-	wmesh_handle_t *handle, wmesh_service_id_t id
+esp_err_t wmesh_send_coalesced(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	const uint8_t *data, size_t data_length
 ) {
-	if(!handle->service_handlers) {
-		return ESP_FAIL;
-	}
+	const wmesh_iovec_t iov = { data, data_length };
+	return wmesh_send_coalescedv(handle, dest, service, &iov, 1);
+}
 
-	// Special case for first node.
-	wmesh_service_handle_t *service_handle = handle->service_handlers;
-	if(service_handle->id == id) {
-		handle->service_handlers = service_handle;
-		free(service_handle);
-		return ESP_OK;
-	}
 
-	while(service_handle->next && service_handle->next->id != id) {
-		service_handle = service_handle->next;
+esp_err_t wmesh_send_coalescedv(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	const wmesh_iovec_t *iov, size_t iov_count
+) {
+	if(service == WMESH_SERVICE_BUNDLE) {
+		return ESP_ERR_INVALID_ARG;
 	}
 
-	if(service_handle->next == NULL) {
-		return ESP_FAIL;
+	size_t data_length = wmesh_iovec_length(iov, iov_count);
+	size_t max_payload = wmesh_get_max_payload(handle, dest);
+	if(sizeof(wmesh_bundle_record_t) + data_length > max_payload) {
+		return wmesh_sendv(handle, dest, service, iov, iov_count);
 	}
 
-	wmesh_service_handle_t *free_handle = service_handle->next;
-	service_handle->next = free_handle->next;
-	free(free_handle);
+	xSemaphoreTake(handle->coalesce_lock, portMAX_DELAY);
 
-	return ESP_OK;
-}
+	wmesh_bundle_t *bundle = wmesh_coalescer_find(&handle->coalescer, dest);
+	if(bundle && !wmesh_bundle_fits(bundle, data_length)) {
+		send_bundle(handle, bundle);
+		bundle = NULL;
+	}
 
+	bool opened = false;
+	if(!bundle) {
+		bundle = wmesh_coalescer_victim(&handle->coalescer);
+		if(bundle->frame) {
+			send_bundle(handle, bundle);
+		}
 
-static wmesh_service_handle_t* find_service_handle(wmesh_handle_t *handle, wmesh_service_id_t service_id) {
-	if(!handle->service_handlers) {
-		return NULL;
+		bundle->frame = wmesh_frame_pool_get(&handle->frame_pool);
+		if(!bundle->frame) {
+			xSemaphoreGive(handle->coalesce_lock);
+			return wmesh_sendv(handle, dest, service, iov, iov_count);
+		}
+
+		memcpy(bundle->dest, dest, sizeof(wmesh_address_t));
+		bundle->length = 0;
+		bundle->capacity = max_payload;
+		bundle->count = 0;
+		bundle->deadline_us = esp_timer_get_time() + CONFIG_WMESH_COALESCE_WINDOW_MS * 1000LL;
+		opened = true;
 	}
 
-	ESP_LOGD(TAG, "Searching service handler for id %"PRIu8, service_id);
+	wmesh_bundle_append(bundle, service, iov, iov_count);
+	handle->coalescer.messages++;
 
-	wmesh_service_handle_t *service_handle = handle->service_handlers;
-	while(service_handle && service_handle->id != service_id) {
-		ESP_LOGD(TAG,
-			"Trying %p, id %"PRIu8", callback %p",
-			service_handle, service_handle->id, service_handle->receive_callback
-		);
-		service_handle = service_handle->next;
-	}
+	xSemaphoreGive(handle->coalesce_lock);
+	count_sent(handle, service, data_length, ESP_OK);
 
-	if(!service_handle) {
-		ESP_LOGD(TAG, "Not found");
-	} else {
-		ESP_LOGD(TAG,
-			"Found %p, id %"PRIu8", callback %p",
-			service_handle, service_handle->id, service_handle->receive_callback
-		);
+	// Let the receive task arm the timer for the new bundle.
+	if(opened) {
+		xTaskNotifyGive(handle->rx_task);
 	}
 
-	return service_handle;
+	return ESP_OK;
 }
 
 
-static void recv_cb(const esp_now_recv_info_t *esp_now_info, const uint8_t *data, int data_len) {
-	if(data_len < WMESH_CIPHERTEXT_BASE_LENGTH || data_len < 0) {
-		return;
-	}
+void wmesh_flush(wmesh_handle_t *handle) {
+	xSemaphoreTake(handle->coalesce_lock, portMAX_DELAY);
 
-	size_t plaintext_length = WMESH_PLAINTEXT_LENGTH((size_t) data_len);
-	uint8_t *plaintext = malloc(plaintext_length);
-	if(!plaintext) {
-		ESP_LOGE(TAG, "Error allocating %zu bytes", plaintext_length);
-		return;
+	for(size_t i = 0; i < CONFIG_WMESH_COALESCE_BUNDLES; i++) {
+		wmesh_bundle_t *bundle = &handle->coalescer.bundles[i];
+		if(bundle->frame) {
+			send_bundle(handle, bundle);
+		}
 	}
 
-	wmesh_peer_list_t *peer_list = wmesh_global_handle->peers;
-	wmesh_peer_t *peer = wmesh_peer_list_get_or_create(
-		peer_list,
-		esp_now_info->src_addr,
-		&wmesh_global_handle->peer_storage
-	);
+	xSemaphoreGive(handle->coalesce_lock);
+}
 
-	wmesh_decrypt_status_t err = wmesh_peer_decrypt(
-		peer, wmesh_global_handle->encryption_ctx,
-		data, data_len,
-		plaintext
-	);
 
-	switch(err) {
-		case WMESH_DECRYPT_OK:
-			wmesh_service_id_t service_id = plaintext[0];
-			wmesh_service_handle_t *service_handle = find_service_handle(wmesh_global_handle, service_id);
-			if(service_handle) {
-
-				ESP_LOGD(TAG, "Received message with id %"PRIu8, service_id);
-				service_handle->receive_callback(
-					wmesh_global_handle,
-					esp_now_info->src_addr,
-					plaintext + 1,
-					plaintext_length - 1,
-					service_handle->ctx
-				);
-			} else {
-				ESP_LOGD(TAG,
-					"Received message with id %"PRIu8", but no handler is configured",
-					service_id
-				);
-			}
-			break;
+#if CONFIG_WMESH_ROUTING
+	void wmesh_route_set_root(wmesh_handle_t *handle, bool is_root) {
+		xSemaphoreTake(handle->route_lock, portMAX_DELAY);
+		wmesh_router_set_root(handle->router, is_root);
+		xSemaphoreGive(handle->route_lock);
+	}
 
-		case WMESH_DECRYPT_STALE:
-			ESP_LOGW(TAG,
-				"Received stale data. Expected sequence %"PRIu64,
-				(uint64_t) peer->sequence
-			);
-			break;
 
-		case WMESH_DECRYPT_AUTH_ERROR:
-			ESP_LOGE(TAG, "Tag error");
-			break;
+	bool wmesh_route_get_root(
+		wmesh_handle_t *handle,
+		wmesh_address_t root, uint8_t *hops
+	) {
+		xSemaphoreTake(handle->route_lock, portMAX_DELAY);
+		wmesh_router_t *router = handle->router;
+		bool found = router->parent != NULL;
+		if(found) {
+			memcpy(root, router->parent->root, sizeof(wmesh_address_t));
+			if(hops) {
+				*hops = router->parent->hops + 1;
+			}
+		}
+		xSemaphoreGive(handle->route_lock);
 
-		case WMESH_DECRYPT_ERROR:
-			ESP_LOGE(TAG, "Decryption error");
-			break;
+		return found;
 	}
 
-	free(plaintext);
-}
 
+	bool wmesh_route_is_relaying(wmesh_handle_t *handle) {
+		if(esp_timer_get_time() < atomic_load(&handle->relay_until_us)) {
+			return true;
+		}
 
-/// @brief Initializes ESP-NOW.
-///
-/// @return `ESP_OK` or error.
-static esp_err_t initialize_esp_now(const wmesh_config_t *config) {
-	esp_err_t err;
+		xSemaphoreTake(handle->route_lock, portMAX_DELAY);
+		bool relaying = wmesh_router_has_children(handle->router);
+		xSemaphoreGive(handle->route_lock);
 
-	if((err = esp_now_init()) != ESP_OK) {
-		ESP_LOGE(TAG, "Error initializing ESP-NOW: %s", esp_err_to_name(err));
-		return err;
+		return relaying;
 	}
 
-	uint32_t esp_now_version;
-	if(esp_now_get_version(&esp_now_version) == ESP_OK) {
-		switch(esp_now_version) {
-			case 1:
-				ESP_LOGE(TAG, "ESP-NOW version 1.0 is not supported");
-				ESP_LOGE(TAG, "Please use ESP-NOW version 2.0");
-				esp_now_deinit();
-				return ESP_ERR_INVALID_VERSION;
-				break;
-
-			case 2:
-				ESP_LOGI(TAG, "Using ESP-NOW version 2.0");
-				break;
-
-			default:
-				ESP_LOGW(TAG,
-					"Using unknown ESP-NOW version %" PRIu32,
-					esp_now_version
-				);
-				break;
+
+	/// @brief Sends a routed frame to the next hop. Encrypted for that hop
+	/// only.
+	///
+	/// @return `ESP_OK` or error.
+	static esp_err_t send_routed_frame(
+		wmesh_handle_t *handle, const wmesh_address_t next_hop,
+		const wmesh_route_header_t *header,
+		const uint8_t *data, size_t data_length
+	) {
+		if(sizeof(*header) + data_length > wmesh_get_max_payload(handle, next_hop)) {
+			return ESP_ERR_INVALID_SIZE;
 		}
-	} else {
-		ESP_LOGE(TAG, "Unable to get ESP-NOW version");
+
+		wmesh_frame_t *frame = wmesh_frame_alloc(handle);
+		if(!frame) {
+			return ESP_ERR_NO_MEM;
+		}
+
+		uint8_t *payload = wmesh_frame_payload(frame);
+		memcpy(payload, header, sizeof(*header));
+		memcpy(payload + sizeof(*header), data, data_length);
+
+		return send_service_frame(
+			handle, next_hop,
+			WMESH_SERVICE_ROUTED,
+			frame, sizeof(*header) + data_length
+		);
 	}
 
-	if((err = esp_now_register_recv_cb(recv_cb)) != ESP_OK) {
-		ESP_LOGE(TAG, "Error registering ESP-NOW callback");
-		esp_now_deinit();
+
+	esp_err_t wmesh_send_routed(
+		wmesh_handle_t *handle, const wmesh_address_t dest,
+		wmesh_service_id_t service,
+		const uint8_t *data, size_t data_length
+	) {
+		if(service >= WMESH_SERVICE_RESERVED_FIRST) {
+			return ESP_ERR_INVALID_ARG;
+		}
+
+		wmesh_route_header_t header = {
+			.ttl = CONFIG_WMESH_ROUTE_MAX_HOPS,
+			.service = service,
+		};
+		memcpy(header.origin, handle->router->self, sizeof(wmesh_address_t));
+		memcpy(header.dest, dest, sizeof(wmesh_address_t));
+
+		wmesh_address_t next_hop;
+		xSemaphoreTake(handle->route_lock, portMAX_DELAY);
+		bool found = wmesh_router_next_hop(handle->router, dest, next_hop);
+		xSemaphoreGive(handle->route_lock);
+
+		esp_err_t err = found ?
+			send_routed_frame(handle, next_hop, &header, data, data_length) :
+			ESP_ERR_NOT_FOUND;
+
+		count_sent(handle, service, data_length, err);
 		return err;
 	}
+#endif
 
-	if((err = esp_now_set_pmk(config->network_key)) != ESP_OK) {
-		ESP_LOGE(TAG, "Error registering Primary Master key");
-		esp_now_deinit();
-		return err;
+
+wmesh_frame_t *wmesh_frame_alloc(wmesh_handle_t *handle) {
+	wmesh_frame_t *frame = wmesh_frame_pool_get(&handle->frame_pool);
+	if(!frame) {
+		ESP_LOGE(TAG, "No free frames available");
 	}
 
-	ESP_LOGI(TAG, "ESP-NOW initialized");
-	return ESP_OK;
+	return frame;
+}
+
+
+void wmesh_frame_free(wmesh_handle_t *handle, wmesh_frame_t *frame) {
+	wmesh_frame_pool_put(&handle->frame_pool, frame);
+}
+
+
+esp_err_t wmesh_send_frame(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	wmesh_frame_t *frame, size_t payload_length
+) {
+	esp_err_t err = send_service_frame(handle, dest, service, frame, payload_length);
+	count_sent(handle, service, payload_length, err);
+
+	return err;
 }
+
+
+/// @brief Same as `wmesh_send_frame`, without counting the frame as sent by
+/// `service`. Used for frames carrying messages already counted, or none.
+static esp_err_t send_service_frame(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	wmesh_frame_t *frame, size_t payload_length
+) {
+	if(payload_length > WMESH_FRAME_MAX_PAYLOAD) {
+		ESP_LOGE(TAG, "Message too long: %zu bytes", payload_length);
+		wmesh_frame_free(handle, frame);
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	frame->data[WMESH_CIPHERTEXT_HEADER_LENGTH] = service;
+	esp_err_t err = send_frame(
+		handle, dest,
+		frame, sizeof(wmesh_service_id_t) + payload_length
+	);
+	wmesh_frame_free(handle, frame);
+
+	return err;
+}
+
+
+/// @brief Splits a message into fragments, and sends each one in its own
+/// frame.
+///
+/// @param max_payload Maximum payload of a frame sent to `dest`.
+///
+/// @return `ESP_OK` or error.
+static esp_err_t send_fragmented(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_service_id_t service,
+	const wmesh_iovec_t *iov, size_t iov_count,
+	size_t data_length, size_t max_payload
+) {
+	const size_t fragment_size = max_payload - sizeof(wmesh_fragment_header_t);
+	size_t fragment_count = (data_length + fragment_size - 1) / fragment_size;
+
+	if(data_length > CONFIG_WMESH_MAX_MESSAGE_SIZE || fragment_count > WMESH_FRAGMENT_MAX_COUNT) {
+		ESP_LOGE(TAG, "Message too long: %zu bytes", data_length);
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	wmesh_fragment_header_t header = {
+		.message_id = atomic_fetch_add(&handle->next_message_id, 1),
+		.total_length = data_length,
+		.count = fragment_count,
+		.service = service,
+	};
+
+	for(size_t i = 0; i < fragment_count; i++) {
+		size_t offset = i * fragment_size;
+		size_t length = data_length - offset < fragment_size ?
+			data_length - offset : fragment_size;
+
+		wmesh_frame_t *frame = wmesh_frame_alloc(handle);
+		if(!frame) {
+			return ESP_ERR_NO_MEM;
+		}
+
+		header.index = i;
+		header.offset = offset;
+
+		uint8_t *payload = wmesh_frame_payload(frame);
+		memcpy(payload, &header, sizeof(header));
+		gather_payload(handle, payload + sizeof(header), iov, iov_count, offset, length);
+
+		esp_err_t err = send_service_frame(
+			handle, dest,
+			WMESH_SERVICE_FRAGMENT,
+			frame, sizeof(header) + length
+		);
+		if(err != ESP_OK) {
+			return err;
+		}
+	}
+
+	return ESP_OK;
+}
+
+
+/// @brief Counts a frame handed to the transport.
+///
+/// @param counters Peer or mesh counters.
+/// @param length Frame size in bytes.
+/// @param err Result of `wmesh_transport_send`.
+static void count_transmitted(wmesh_counters_t *counters, size_t length, esp_err_t err) {
+	if(err == ESP_OK) {
+		wmesh_counter_add(&counters->bytes_out, length);
+	} else {
+		wmesh_counter_add(&counters->tx_failed, 1);
+	}
+}
+
+
+/// @brief Counts a message sent by a service.
+///
+/// @param handle Mesh handle.
+/// @param service Sending service.
+/// @param length Message size in bytes.
+/// @param err Result of the send.
+static void count_sent(
+	wmesh_handle_t *handle, wmesh_service_id_t service,
+	size_t length, esp_err_t err
+) {
+	wmesh_counters_t *counters = &handle->services[service].counters;
+
+	if(err == ESP_OK) {
+		wmesh_counter_add(&counters->tx_ok, 1);
+		wmesh_counter_add(&counters->bytes_out, length);
+	} else {
+		wmesh_counter_add(&counters->tx_failed, 1);
+	}
+}
+
+
+/// @brief Copies a payload into a frame. With
+/// `CONFIG_WMESH_ENCRYPTION_PROFILE`, the copy is timed.
+///
+/// @param handle Mesh handle.
+/// @param payload Start of the payload inside the frame.
+/// @param iov Segments to copy.
+/// @param iov_count Number of segments.
+/// @param offset Offset of the first byte to copy, across every segment.
+/// @param length Number of bytes to copy.
+static void gather_payload(
+	wmesh_handle_t *handle, uint8_t *payload,
+	const wmesh_iovec_t *iov, size_t iov_count,
+	size_t offset, size_t length
+) {
+	#if CONFIG_WMESH_ENCRYPTION_PROFILE
+		uint32_t start_time = wmesh_profile_now();
+	#endif
+
+	wmesh_iovec_gather(payload, iov, iov_count, offset, length);
+
+	#if CONFIG_WMESH_ENCRYPTION_PROFILE
+		uint32_t end_time = wmesh_profile_now();
+
+		// Payloads are copied outside `tx_lock`, which also guards the
+		// rest of the profile.
+		xSemaphoreTake(handle->tx_lock, portMAX_DELAY);
+		wmesh_encryption_profile_t *profile = &handle->encryption_ctx->profile;
+		profile->copies++;
+		profile->copied_bytes += length;
+		profile->copy_time += (uint32_t) (end_time - start_time);
+		xSemaphoreGive(handle->tx_lock);
+	#endif
+}
+
+
+/// @brief Encrypts a frame in place and sends it.
+///
+/// @param handle Mesh handle.
+/// @param dest Destination node address.
+/// @param frame Frame. Plaintext must start right after the encryption header.
+/// @param plaintext_length Number of plaintext bytes in the frame.
+///
+/// @return `ESP_OK` or error.
+static esp_err_t send_frame(
+	wmesh_handle_t *handle, const wmesh_address_t dest,
+	wmesh_frame_t *frame, size_t plaintext_length
+) {
+	xSemaphoreTake(handle->tx_lock, portMAX_DELAY);
+
+	esp_err_t err;
+	if(handle->sequence_number >= handle->sequence_lease && (err = renew_sequence_lease(handle)) != ESP_OK) {
+		xSemaphoreGive(handle->tx_lock);
+		return err;
+	}
+
+	size_t ciphertext_length;
+	err = wmesh_encrypt_inplace(
+		handle->encryption_ctx,
+		&handle->sequence_number,
+		frame->data, plaintext_length,
+		&ciphertext_length
+	);
+	if(err != ESP_OK) {
+		xSemaphoreGive(handle->tx_lock);
+		ESP_LOGE(TAG, "Error encrypting message: %s", esp_err_to_name(err));
+		return err;
+	}
+
+	err = wmesh_peer_list_register(handle->peers, dest);
+	if(err != ESP_OK) {
+		xSemaphoreGive(handle->tx_lock);
+		return err;
+	}
+
+	err = wmesh_transport_send(dest, frame->data, ciphertext_length);
+
+	// Delivered frames are counted by `send_cb`.
+	wmesh_peer_t *peer = wmesh_peer_list_get(handle->peers, dest);
+	count_transmitted(&handle->counters, ciphertext_length, err);
+	if(peer) {
+		count_transmitted(&peer->counters, ciphertext_length, err);
+	}
+	xSemaphoreGive(handle->tx_lock);
+
+	return err;
+}
+
+
+/// @brief Reserves the next block of sequence numbers in storage. Must be
+/// called with `tx_lock` taken, or before the mesh is started.
+///
+/// Only the end of the block is stored. After a crash, sending resumes from
+/// it, so a sequence number which may have been used is never reused. The
+/// lease is flushed past the RTC memory cache, so this also holds after power
+/// loss.
+///
+/// @return `ESP_OK` or error.
+static esp_err_t renew_sequence_lease(wmesh_handle_t *handle) {
+	wmesh_encryption_ctr_t lease = handle->sequence_number + CONFIG_WMESH_SEQUENCE_LEASE_SIZE;
+
+	if(
+		wmesh_storage_write_ctr(&handle->self_storage, "lease", &lease) != WMESH_STORAGE_OK ||
+		wmesh_storage_write_ctr(&handle->self_storage, "ctr", &lease) != WMESH_STORAGE_OK ||
+		wmesh_storage_flush(&handle->self_storage) != ESP_OK
+	) {
+		ESP_LOGE(TAG, "Error reserving sequence numbers");
+		return ESP_FAIL;
+	}
+
+	handle->sequence_lease = lease;
+	return ESP_OK;
+}
+
+
+void wmesh_get_rx_stats(wmesh_handle_t *handle, wmesh_rx_stats_t *stats) {
+	memcpy(stats, &handle->rx_ring->stats, sizeof(*stats));
+}
+
+
+/// @brief Replaces a service dispatch table entry.
+static void set_service_handle(
+	wmesh_handle_t *handle, wmesh_service_id_t id,
+	wmesh_service_recv_cb_t receive_callback, void *ctx
+) {
+	wmesh_service_handle_t *service_handle = &handle->services[id];
+
+	portENTER_CRITICAL(&handle->services_lock);
+	atomic_fetch_add_explicit(&service_handle->version, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	service_handle->receive_callback = receive_callback;
+	service_handle->ctx = ctx;
+
+	atomic_fetch_add_explicit(&service_handle->version, 1, memory_order_release);
+	portEXIT_CRITICAL(&handle->services_lock);
+}
+
+
+esp_err_t wmesh_register_service(
+	wmesh_handle_t *handle, const wmesh_service_config_t *config
+) {
+	if(!config->receive_callback) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	if(config->id >= WMESH_SERVICE_RESERVED_FIRST) {
+		ESP_LOGE(TAG, "Service ID %"PRIu8" is reserved", config->id);
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	set_service_handle(handle, config->id, config->receive_callback, config->ctx);
+
+	ESP_LOGI(TAG, "Added handler for service %"PRIu8, config->id);
+	return ESP_OK;
+}
+
+
+esp_err_t wmesh_unregister_service(
+	wmesh_handle_t *handle, wmesh_service_id_t id
+) {
+	if(id >= WMESH_SERVICE_RESERVED_FIRST || !handle->services[id].receive_callback) {
+		return ESP_FAIL;
+	}
+
+	set_service_handle(handle, id, NULL, NULL);
+	return ESP_OK;
+}
+
+
+/// @brief Reads a service dispatch table entry without locking.
+///
+/// @param handle Mesh handle.
+/// @param service_id Service to look up.
+/// @param[out] service_handle Consistent copy of the entry.
+///
+/// @return `true` if the service has a handler.
+static bool find_service_handle(
+	wmesh_handle_t *handle, wmesh_service_id_t service_id,
+	wmesh_service_handle_t *service_handle
+) {
+	wmesh_service_handle_t *entry = &handle->services[service_id];
+	uint32_t version;
+
+	do {
+		version = atomic_load_explicit(&entry->version, memory_order_acquire);
+		service_handle->receive_callback = entry->receive_callback;
+		service_handle->ctx = entry->ctx;
+		atomic_thread_fence(memory_order_acquire);
+	} while((version & 1) || version != atomic_load_explicit(&entry->version, memory_order_relaxed));
+
+	return service_handle->receive_callback != NULL;
+}
+
+
+/// @brief Passes a received message to its service.
+///
+/// @param handle Mesh handle.
+/// @param src Sender address.
+/// @param service_id Destination service.
+/// @param data Message data.
+/// @param data_length Size in bytes of `data`.
+static void dispatch(
+	wmesh_handle_t *handle, wmesh_address_t src,
+	wmesh_service_id_t service_id,
+	uint8_t *data, size_t data_length
+) {
+	wmesh_counters_t *counters = &handle->services[service_id].counters;
+
+	wmesh_service_handle_t service_handle;
+	if(!find_service_handle(handle, service_id, &service_handle)) {
+		ESP_LOGD(TAG,
+			"Received message with id %"PRIu8", but no handler is configured",
+			service_id
+		);
+
+		wmesh_counter_add(&counters->rx_no_handler, 1);
+		wmesh_counter_add(&handle->counters.rx_no_handler, 1);
+		wmesh_peer_t *peer = wmesh_peer_list_get(handle->peers, src);
+		if(peer) {
+			wmesh_counter_add(&peer->counters.rx_no_handler, 1);
+		}
+		return;
+	}
+
+	ESP_LOGD(TAG, "Received message with id %"PRIu8, service_id);
+	wmesh_counter_add(&counters->rx_ok, 1);
+	wmesh_counter_add(&counters->bytes_in, data_length);
+	service_handle.receive_callback(
+		handle,
+		src,
+		data,
+		data_length,
+		service_handle.ctx
+	);
+}
+
+
+void wmesh_get_stats(
+	wmesh_handle_t *handle,
+	wmesh_counters_snapshot_t *total,
+	wmesh_peer_stats_t *peers, size_t *peer_count,
+	wmesh_service_stats_t *services, size_t *service_count
+) {
+	if(total) {
+		wmesh_counters_read(&handle->counters, total);
+	}
+
+	if(peers) {
+		wmesh_peer_list_t *list = handle->peers;
+		size_t count = 0;
+
+		xSemaphoreTake(handle->tx_lock, portMAX_DELAY);
+		for(size_t i = 0; i < list->peer_count + list->parked_count && count < *peer_count; i++) {
+			const wmesh_peer_t *peer = i < list->peer_count ?
+				&list->peers[i] :
+				&list->parked[i - list->peer_count].peer;
+			wmesh_peer_stats_t *stats = &peers[count];
+			memcpy(stats->address, peer->address, sizeof(wmesh_address_t));
+			wmesh_counters_read(&peer->counters, &stats->counters);
+
+			// Peers preloaded from storage, but not heard from, are skipped.
+			if(wmesh_counters_any(&stats->counters)) {
+				count++;
+			}
+		}
+		xSemaphoreGive(handle->tx_lock);
+
+		*peer_count = count;
+	}
+
+	if(services) {
+		size_t count = 0;
+
+		for(size_t id = 0; id < WMESH_SERVICE_COUNT && count < *service_count; id++) {
+			wmesh_service_handle_t service_handle;
+			wmesh_service_stats_t *stats = &services[count];
+			stats->id = id;
+			stats->registered = find_service_handle(handle, id, &service_handle);
+			wmesh_counters_read(&handle->services[id].counters, &stats->counters);
+
+			if(stats->registered || wmesh_counters_any(&stats->counters)) {
+				count++;
+			}
+		}
+
+		*service_count = count;
+	}
+}
+
+
+/// @brief Internal service. Reassembles fragmented messages and dispatches
+/// them once complete.
+static esp_err_t fragment_cb(
+	wmesh_handle_t *handle, wmesh_address_t src,
+	uint8_t *data, size_t data_size, void *user_ctx
+) {
+	wmesh_fragment_header_t header;
+	if(data_size < sizeof(header)) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+	memcpy(&header, data, sizeof(header));
+
+	if(header.service >= WMESH_SERVICE_RESERVED_FIRST) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	wmesh_reassembly_slot_t *message = wmesh_reassembly_add(
+		handle->reassembly, src, &header,
+		data + sizeof(header), data_size - sizeof(header),
+		esp_timer_get_time()
+	);
+	if(!message) {
+		return ESP_OK;
+	}
+
+	dispatch(handle, message->src, message->service, message->data, message->length);
+	wmesh_reassembly_release(message);
+	return ESP_OK;
+}
+
+
+/// @brief Internal service. Acknowledges reliable frames, and dispatches them
+/// unless they are duplicates.
+static esp_err_t reliable_data_cb(
+	wmesh_handle_t *handle, wmesh_address_t src,
+	uint8_t *data, size_t data_size, void *user_ctx
+) {
+	wmesh_reliable_header_t header;
+	if(data_size < sizeof(header)) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+	memcpy(&header, data, sizeof(header));
+
+	if(header.service >= WMESH_SERVICE_RESERVED_FIRST) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	// Added by `process_frame` before dispatching.
+	wmesh_peer_t *peer = wmesh_peer_list_get(handle->peers, src);
+	if(!peer) {
+		return ESP_ERR_NOT_FOUND;
+	}
+
+	wmesh_reliable_ack_t ack;
+	bool fresh = wmesh_reliable_rx_accept(&peer->reliable, &header, &ack);
+
+	esp_err_t err = wmesh_send_coalesced(
+		handle, src,
+		WMESH_SERVICE_RELIABLE_ACK,
+		(uint8_t *) &ack, sizeof(ack)
+	);
+	if(err != ESP_OK) {
+		ESP_LOGW(TAG, "Error sending acknowledgement: %s", esp_err_to_name(err));
+	}
+
+	if(fresh) {
+		dispatch(handle, src, header.service, data + sizeof(header), data_size - sizeof(header));
+	}
+
+	return ESP_OK;
+}
+
+
+/// @brief Internal service. Removes acknowledged frames from the send window.
+static esp_err_t reliable_ack_cb(
+	wmesh_handle_t *handle, wmesh_address_t src,
+	uint8_t *data, size_t data_size, void *user_ctx
+) {
+	wmesh_reliable_ack_t ack;
+	if(data_size != sizeof(ack)) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+	memcpy(&ack, data, sizeof(ack));
+
+	size_t acked = 0;
+	xSemaphoreTake(handle->reliable_lock, portMAX_DELAY);
+	wmesh_reliable_channel_t *channel = wmesh_reliable_tx_channel(handle->reliable, src, false);
+	if(channel) {
+		acked = wmesh_reliable_channel_ack(handle->reliable, channel, &ack, esp_timer_get_time());
+	}
+	xSemaphoreGive(handle->reliable_lock);
+
+	if(acked) {
+		xSemaphoreGive(handle->reliable_progress);
+	}
+
+	return ESP_OK;
+}
+
+
+/// @brief Retransmits every reliable frame whose timer has expired.
+///
+/// @param handle Mesh handle.
+///
+/// @return Time the next retransmission is due, in microseconds, or
+/// `INT64_MAX` if none.
+static int64_t process_retransmissions(wmesh_handle_t *handle) {
+	wmesh_reliable_tx_t *reliable = handle->reliable;
+
+	xSemaphoreTake(handle->reliable_lock, portMAX_DELAY);
+	int64_t now_us = esp_timer_get_time();
+	uint32_t failed = reliable->failed;
+
+	for(size_t i = 0; i < CONFIG_WMESH_RELIABLE_CHANNELS; i++) {
+		wmesh_reliable_channel_t *channel = &reliable->channels[i];
+		if(!channel->in_use) {
+			continue;
+		}
+
+		wmesh_reliable_entry_t *entry;
+		while((entry = wmesh_reliable_channel_expired(reliable, channel, now_us)) != NULL) {
+			esp_err_t err = ESP_ERR_NO_MEM;
+			wmesh_frame_t *frame = wmesh_frame_pool_get(&handle->frame_pool);
+			if(frame) {
+				const wmesh_iovec_t entry_iov = { entry->data, entry->length };
+				gather_payload(handle, wmesh_frame_payload(frame), &entry_iov, 1, 0, entry->length);
+				err = send_service_frame(
+					handle, channel->dest,
+					WMESH_SERVICE_RELIABLE_DATA,
+					frame, entry->length
+				);
+			}
+
+			wmesh_reliable_entry_rearm(reliable, channel, entry, err == ESP_OK, now_us);
+		}
+	}
+
+	int64_t deadline_us = wmesh_reliable_tx_next_deadline(reliable);
+	bool dropped = reliable->failed != failed;
+	xSemaphoreGive(handle->reliable_lock);
+
+	if(dropped) {
+		xSemaphoreGive(handle->reliable_progress);
+	}
+
+	return deadline_us;
+}
+
+
+/// @brief Sends every bundle whose coalescing window has expired.
+///
+/// @param handle Mesh handle.
+///
+/// @return Time the next bundle is due, in microseconds, or `INT64_MAX` if
+/// none.
+static int64_t process_bundles(wmesh_handle_t *handle) {
+	xSemaphoreTake(handle->coalesce_lock, portMAX_DELAY);
+	int64_t now_us = esp_timer_get_time();
+
+	for(size_t i = 0; i < CONFIG_WMESH_COALESCE_BUNDLES; i++) {
+		wmesh_bundle_t *bundle = &handle->coalescer.bundles[i];
+		if(bundle->frame && bundle->deadline_us <= now_us) {
+			send_bundle(handle, bundle);
+		}
+	}
+
+	int64_t deadline_us = wmesh_coalescer_next_deadline(&handle->coalescer);
+	xSemaphoreGive(handle->coalesce_lock);
+
+	return deadline_us;
+}
+
+
+#if CONFIG_WMESH_ROUTING
+	/// @brief Internal service. Updates the neighbor table from a received
+	/// beacon.
+	static esp_err_t route_beacon_cb(
+		wmesh_handle_t *handle, wmesh_address_t src,
+		uint8_t *data, size_t data_size, void *user_ctx
+	) {
+		wmesh_route_beacon_t beacon;
+		if(data_size != sizeof(beacon)) {
+			return ESP_ERR_INVALID_SIZE;
+		}
+		memcpy(&beacon, data, sizeof(beacon));
+
+		xSemaphoreTake(handle->route_lock, portMAX_DELAY);
+		wmesh_router_t *router = handle->router;
+		uint32_t parent_changes = router->parent_changes;
+		wmesh_router_beacon_received(router, src, &beacon, esp_timer_get_time());
+
+		if(router->parent_changes != parent_changes && router->parent) {
+			ESP_LOGI(TAG,
+				"New parent "MACSTR", %u hops to root "MACSTR,
+				MAC2STR(router->parent->address), (unsigned) router->parent->hops + 1,
+				MAC2STR(router->parent->root)
+			);
+		}
+		xSemaphoreGive(handle->route_lock);
+
+		return ESP_OK;
+	}
+
+
+	/// @brief Internal service. Dispatches routed frames for this node, and
+	/// forwards the rest to their next hop.
+	static esp_err_t routed_cb(
+		wmesh_handle_t *handle, wmesh_address_t src,
+		uint8_t *data, size_t data_size, void *user_ctx
+	) {
+		wmesh_route_header_t header;
+		if(data_size < sizeof(header)) {
+			return ESP_ERR_INVALID_SIZE;
+		}
+		memcpy(&header, data, sizeof(header));
+
+		if(header.service >= WMESH_SERVICE_RESERVED_FIRST) {
+			return ESP_ERR_INVALID_ARG;
+		}
+
+		uint8_t *payload = data + sizeof(header);
+		size_t payload_length = data_size - sizeof(header);
+		int64_t now_us = esp_timer_get_time();
+
+		xSemaphoreTake(handle->route_lock, portMAX_DELAY);
+		wmesh_router_t *router = handle->router;
+		wmesh_router_learn(router, header.origin, src, now_us);
+
+		bool for_self = memcmp(header.dest, router->self, sizeof(wmesh_address_t)) == 0;
+		wmesh_address_t next_hop;
+		bool forward =
+			!for_self && header.ttl > 1 &&
+			wmesh_router_next_hop(router, header.dest, next_hop);
+		if(!for_self && !forward) {
+			router->dropped++;
+		}
+		xSemaphoreGive(handle->route_lock);
+
+		if(for_self) {
+			dispatch(handle, header.origin, header.service, payload, payload_length);
+			return ESP_OK;
+		}
+
+		if(!forward) {
+			ESP_LOGD(TAG, "No route to "MACSTR, MAC2STR(header.dest));
+			return ESP_OK;
+		}
+
+		header.ttl--;
+		atomic_store(&handle->relay_until_us, now_us + CONFIG_WMESH_ROUTE_FORWARD_WINDOW_MS * 1000LL);
+		esp_err_t err = send_routed_frame(handle, next_hop, &header, payload, payload_length);
+
+		xSemaphoreTake(handle->route_lock, portMAX_DELAY);
+		if(err == ESP_OK) {
+			router->forwarded++;
+		} else {
+			router->dropped++;
+		}
+		xSemaphoreGive(handle->route_lock);
+
+		return err;
+	}
+
+
+	/// @brief Forgets silent neighbors, and sends a beacon if one is due.
+	///
+	/// @param handle Mesh handle.
+	///
+	/// @return Time the next beacon is due, in microseconds.
+	static int64_t process_routing(wmesh_handle_t *handle) {
+		int64_t now_us = esp_timer_get_time();
+		if(now_us < handle->beacon_us) {
+			return handle->beacon_us;
+		}
+
+		wmesh_route_beacon_t beacon;
+		xSemaphoreTake(handle->route_lock, portMAX_DELAY);
+		wmesh_router_expire(handle->router, now_us);
+		bool send = wmesh_router_make_beacon(handle->router, &beacon);
+		xSemaphoreGive(handle->route_lock);
+
+		if(send) {
+			esp_err_t err = wmesh_send(
+				handle, wmesh_broadcast_address,
+				WMESH_SERVICE_ROUTE_BEACON,
+				(uint8_t *) &beacon, sizeof(beacon)
+			);
+			if(err != ESP_OK) {
+				ESP_LOGW(TAG, "Error sending beacon: %s", esp_err_to_name(err));
+			}
+		}
+
+		// Jitter of +-1/8 of the interval keeps neighbors from beaconing in
+		// lockstep.
+		const int64_t interval_us = CONFIG_WMESH_ROUTE_BEACON_INTERVAL_MS * 1000LL;
+		handle->beacon_us = now_us + interval_us - interval_us / 8 + esp_random() % (interval_us / 4 + 1);
+		return handle->beacon_us;
+	}
+#endif
+
+
+/// @brief Converts a deadline into a timeout for `ulTaskNotifyTake`.
+///
+/// @param deadline_us Deadline in microseconds, or `INT64_MAX` for none.
+///
+/// @return Ticks until the deadline, rounded up.
+static TickType_t ticks_until(int64_t deadline_us) {
+	if(deadline_us == INT64_MAX) {
+		return portMAX_DELAY;
+	}
+
+	int64_t now_us = esp_timer_get_time();
+	return deadline_us > now_us ? pdMS_TO_TICKS((deadline_us - now_us + 999) / 1000) + 1 : 0;
+}
+
+
+/// @brief Internal service. Splits a bundle, and dispatches every message in
+/// it.
+static esp_err_t bundle_cb(
+	wmesh_handle_t *handle, wmesh_address_t src,
+	uint8_t *data, size_t data_size, void *user_ctx
+) {
+	uint8_t *cursor = data;
+	const uint8_t *end = data + data_size;
+
+	wmesh_service_id_t service;
+	uint8_t *record;
+	size_t record_length;
+	while(wmesh_bundle_next(&cursor, end, &service, &record, &record_length)) {
+		if(service != WMESH_SERVICE_BUNDLE) {
+			dispatch(handle, src, service, record, record_length);
+		}
+	}
+
+	return cursor == end ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+
+/// @brief Counts a received frame.
+///
+/// @param counters Peer or mesh counters.
+/// @param slot Received frame.
+/// @param status Decryption result.
+static void count_received(
+	wmesh_counters_t *counters, const wmesh_rx_slot_t *slot,
+	wmesh_decrypt_status_t status
+) {
+	wmesh_counter_add(&counters->bytes_in, slot->length);
+	atomic_store_explicit(&counters->last_rssi, slot->rssi, memory_order_relaxed);
+
+	switch(status) {
+		case WMESH_DECRYPT_OK:
+			wmesh_counter_add(&counters->rx_ok, 1);
+			break;
+
+		case WMESH_DECRYPT_STALE:
+			wmesh_counter_add(&counters->rx_stale, 1);
+			break;
+
+		case WMESH_DECRYPT_AUTH_ERROR:
+			wmesh_counter_add(&counters->rx_auth_errors, 1);
+			break;
+
+		case WMESH_DECRYPT_ERROR:
+			wmesh_counter_add(&counters->rx_decrypt_errors, 1);
+			break;
+	}
+}
+
+
+/// @brief Takes one of the `CONFIG_WMESH_PEER_LOAD_RATE` peer loads allowed
+/// per second. Unused loads add up to one second's worth.
+///
+/// @param handle Mesh handle.
+///
+/// @return `true` if the peer may be loaded.
+static bool take_peer_load(wmesh_handle_t *handle) {
+	const int64_t interval_us = 1000000 / CONFIG_WMESH_PEER_LOAD_RATE;
+	int64_t now_us = esp_timer_get_time();
+
+	int64_t full_us = handle->peer_load_full_us > now_us ? handle->peer_load_full_us : now_us;
+	if(full_us + interval_us - now_us > interval_us * CONFIG_WMESH_PEER_LOAD_RATE) {
+		return false;
+	}
+
+	handle->peer_load_full_us = full_us + interval_us;
+	return true;
+}
+
+
+/// @brief Decrypts a received frame and passes it to its service. The frame
+/// is decrypted in its slot, and services get a pointer into it.
+///
+/// @param handle Mesh handle.
+/// @param slot Received frame.
+static void process_frame(wmesh_handle_t *handle, wmesh_rx_slot_t *slot) {
+	uint8_t *plaintext;
+	size_t plaintext_length;
+
+	// Unknown peers are decrypted with a copy, and only added to the list
+	// once a frame from them is authenticated, so forged addresses can't
+	// evict known peers.
+	wmesh_peer_list_t *peer_list = handle->peers;
+	wmesh_peer_t *peer = wmesh_peer_list_get(peer_list, slot->src);
+	wmesh_peer_t new_peer;
+	if(!peer) {
+		// Parked peers need no storage. Other lookups may read flash, so
+		// forged addresses could keep the task busy without a limit.
+		const wmesh_peer_t *parked = wmesh_peer_list_get_parked(peer_list, slot->src);
+		if(parked) {
+			memcpy(&new_peer, parked, sizeof(new_peer));
+		} else if(!take_peer_load(handle)) {
+			handle->peer_loads_limited++;
+			return;
+		} else {
+			xSemaphoreTake(handle->peer_storage_lock, portMAX_DELAY);
+			wmesh_storage_result_t fetched = wmesh_peer_list_fetch(peer_list, slot->src, &handle->peer_table, &new_peer);
+			xSemaphoreGive(handle->peer_storage_lock);
+
+			if(fetched == WMESH_STORAGE_ERROR) {
+				return;
+			}
+		}
+		peer = &new_peer;
+	}
+
+	wmesh_decrypt_status_t err = wmesh_peer_decrypt_inplace(
+		peer, handle->encryption_ctx,
+		slot->data, slot->length,
+		&plaintext, &plaintext_length
+	);
+
+	// Every frame carries at least a service ID.
+	if(err == WMESH_DECRYPT_OK && plaintext_length == 0) {
+		err = WMESH_DECRYPT_ERROR;
+	}
+
+	if(err == WMESH_DECRYPT_OK && peer == &new_peer) {
+		// Other tasks look peers up with `tx_lock` taken, so it is only
+		// needed to add one.
+		#if CONFIG_WMESH_PEER_FLUSH_INTERVAL_MS > 0
+			// Evicted peers stay parked until `flush_task` writes them. Once
+			// no parked peer may be dropped, they are flushed right away.
+			xSemaphoreTake(handle->tx_lock, portMAX_DELAY);
+			peer = wmesh_peer_list_insert(peer_list, &new_peer, NULL);
+			bool parked_full = !wmesh_peer_list_can_insert(peer_list);
+			xSemaphoreGive(handle->tx_lock);
+
+			if(parked_full) {
+				queue_peer_flush(handle);
+			}
+		#else
+			xSemaphoreTake(handle->peer_storage_lock, portMAX_DELAY);
+			xSemaphoreTake(handle->tx_lock, portMAX_DELAY);
+			peer = wmesh_peer_list_insert(peer_list, &new_peer, &handle->peer_table);
+			xSemaphoreGive(handle->tx_lock);
+			xSemaphoreGive(handle->peer_storage_lock);
+		#endif
+
+		// Without a place in the list, the frame's sequence number can't be
+		// recorded, so the frame could be replayed.
+		if(!peer) {
+			ESP_LOGW(TAG, "Peer list full, dropping frame");
+			return;
+		}
+	} else if(err == WMESH_DECRYPT_OK) {
+		wmesh_peer_list_touch(peer_list, peer);
+	}
+
+	count_received(&handle->counters, slot, err);
+	count_received(&peer->counters, slot, err);
+
+	switch(err) {
+		case WMESH_DECRYPT_OK:
+			#if CONFIG_WMESH_RATE_CONTROL
+				if(wmesh_rate_rssi(&peer->rate, slot->rssi)) {
+					apply_rate(peer);
+				}
+			#endif
+
+			dispatch(
+				handle, slot->src,
+				plaintext[0],
+				plaintext + 1, plaintext_length - 1
+			);
+			break;
+
+		case WMESH_DECRYPT_STALE:
+			ESP_LOGW(TAG,
+				"Received stale data. Last sequence %"PRIu64,
+				(uint64_t) peer->window.last
+			);
+			break;
+
+		case WMESH_DECRYPT_AUTH_ERROR:
+			ESP_LOGE(TAG, "Tag error");
+			break;
+
+		case WMESH_DECRYPT_ERROR:
+			ESP_LOGE(TAG, "Decryption error");
+			break;
+	}
+}
+
+
+#if CONFIG_WMESH_RATE_CONTROL
+	/// @brief Configures the driver to send frames to a peer at its current
+	/// rate. Fails silently if the peer is not registered, in which case the
+	/// rate is applied when it is.
+	///
+	/// @param peer Peer.
+	static void apply_rate(const wmesh_peer_t *peer) {
+		esp_err_t err = wmesh_transport_set_peer_rate(peer->address, peer->rate.current);
+		if(err != ESP_OK && err != ESP_ERR_NOT_FOUND) {
+			ESP_LOGW(TAG, "Error setting peer rate: %s", esp_err_to_name(err));
+		}
+	}
+#endif
+
+
+/// @brief Result of a unicast send.
+typedef struct {
+	wmesh_address_t dest;
+	bool success;
+} send_result_t;
+
+
+/// @brief Counts every queued send result in its peer, and feeds it to the
+/// peer's rate control.
+///
+/// @param handle Mesh handle.
+static void process_send_results(wmesh_handle_t *handle) {
+	send_result_t result;
+
+	while(xQueueReceive(handle->send_results, &result, 0) == pdTRUE) {
+		wmesh_peer_t *peer = wmesh_peer_list_get(handle->peers, result.dest);
+		if(!peer) {
+			continue;
+		}
+
+		wmesh_counter_add(result.success ? &peer->counters.tx_ok : &peer->counters.tx_failed, 1);
+
+		#if CONFIG_WMESH_RATE_CONTROL
+			wmesh_rate_t previous = peer->rate.current;
+			if(wmesh_rate_feedback(&peer->rate, result.success)) {
+				if(peer->rate.current != previous) {
+					ESP_LOGD(TAG,
+						"%02X:%02X:%02X:%02X:%02X:%02X rate %"PRIu16" -> %"PRIu16" Kbps",
+						peer->address[0], peer->address[1], peer->address[2],
+						peer->address[3], peer->address[4], peer->address[5],
+						wmesh_rate_kbps(previous), wmesh_rate_kbps(peer->rate.current)
+					);
+				}
+
+				apply_rate(peer);
+			}
+		#endif
+	}
+}
+
+
+/// @brief Transport send callback. Runs in the driver task, so it only
+/// counts the result, and queues it for `rx_task`.
+static void send_cb(const wmesh_address_t dest, bool success) {
+	wmesh_handle_t *handle = wmesh_global_handle;
+	if(!handle) {
+		return;
+	}
+
+	wmesh_counter_add(success ? &handle->counters.tx_ok : &handle->counters.tx_failed, 1);
+
+	// Broadcasts are never acknowledged, so they say nothing about the link.
+	if(memcmp(dest, wmesh_broadcast_address, sizeof(wmesh_address_t)) == 0) {
+		return;
+	}
+
+	send_result_t result = {
+		.success = success,
+	};
+	memcpy(result.dest, dest, sizeof(wmesh_address_t));
+
+	if(xQueueSend(handle->send_results, &result, 0) == pdTRUE) {
+		xTaskNotifyGive(handle->rx_task);
+	}
+}
+
+
+#if CONFIG_WMESH_PEER_FLUSH_INTERVAL_MS > 0
+	/// @brief Copies every peer whose replay window changed, and hands the
+	/// copies to `flush_task`. Skipped while the previous copies are being
+	/// written, in which case the peers stay marked as changed.
+	///
+	/// @param handle Mesh handle.
+	static void queue_peer_flush(wmesh_handle_t *handle) {
+		if(atomic_load(&handle->flush_pending)) {
+			return;
+		}
+
+		handle->flush_count = wmesh_peer_list_collect(
+			handle->peers,
+			handle->flush_records, handle->flush_count
+		);
+		if(handle->flush_count > 0) {
+			atomic_store(&handle->flush_pending, true);
+			xTaskNotifyGive(handle->flush_task);
+		}
+	}
+
+
+	/// @brief Peer flush task. Writes the records queued by `rx_task`.
+	///
+	/// @param arg Mesh handle.
+	static void flush_task(void *arg) {
+		wmesh_handle_t *handle = arg;
+
+		while(atomic_load(&handle->flush_running)) {
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			if(!atomic_load(&handle->flush_pending)) {
+				continue;
+			}
+
+			xSemaphoreTake(handle->peer_storage_lock, portMAX_DELAY);
+			size_t remaining = wmesh_peer_records_store(
+				&handle->peer_table,
+				handle->flush_records, handle->flush_count
+			);
+			esp_err_t err = wmesh_storage_commit(&handle->peer_storage);
+			xSemaphoreGive(handle->peer_storage_lock);
+
+			if(remaining > 0 || err != ESP_OK) {
+				ESP_LOGW(TAG, "Error storing peers");
+			}
+
+			handle->flush_count = remaining;
+			atomic_store(&handle->flush_pending, false);
+		}
+
+		xSemaphoreGive(handle->flush_task_done);
+		vTaskDelete(NULL);
+	}
+#endif
+
+
+/// @brief Mesh receive task. Processes frames queued by `recv_cb`.
+///
+/// @param arg Mesh handle.
+static void rx_task(void *arg) {
+	wmesh_handle_t *handle = arg;
+	TickType_t timeout = portMAX_DELAY;
+
+	#if CONFIG_WMESH_PEER_FLUSH_INTERVAL_MS > 0
+		const int64_t flush_interval_us = CONFIG_WMESH_PEER_FLUSH_INTERVAL_MS * 1000LL;
+		int64_t flush_us = esp_timer_get_time() + flush_interval_us;
+	#else
+		int64_t flush_us = INT64_MAX;
+	#endif
+
+	while(atomic_load(&handle->rx_running)) {
+		ulTaskNotifyTake(pdTRUE, timeout);
+
+		wmesh_rx_slot_t *slot;
+		while((slot = wmesh_rx_ring_peek(handle->rx_ring)) != NULL) {
+			process_frame(handle, slot);
+			wmesh_rx_ring_release(handle->rx_ring);
+		}
+
+		process_send_results(handle);
+
+		#if CONFIG_WMESH_PEER_FLUSH_INTERVAL_MS > 0
+			if(esp_timer_get_time() >= flush_us) {
+				queue_peer_flush(handle);
+				flush_us = esp_timer_get_time() + flush_interval_us;
+			}
+		#endif
+
+		int64_t deadline_us = flush_us;
+		int64_t retransmit_us = process_retransmissions(handle);
+		int64_t bundle_us = process_bundles(handle);
+		deadline_us = retransmit_us < deadline_us ? retransmit_us : deadline_us;
+		deadline_us = bundle_us < deadline_us ? bundle_us : deadline_us;
+		#if CONFIG_WMESH_ROUTING
+			int64_t beacon_us = process_routing(handle);
+			deadline_us = beacon_us < deadline_us ? beacon_us : deadline_us;
+		#endif
+		timeout = ticks_until(deadline_us);
+	}
+
+	xSemaphoreGive(handle->rx_task_done);
+	vTaskDelete(NULL);
+}
+
+
+/// @brief Transport receive callback. Runs in the driver task, so it only
+/// queues the frame for `rx_task`.
+static void recv_cb(
+	const wmesh_address_t src, const uint8_t *data, size_t data_len, int8_t rssi
+) {
+	int64_t start_us = esp_timer_get_time();
+
+	wmesh_handle_t *handle = wmesh_global_handle;
+	if(!handle || data_len < WMESH_CIPHERTEXT_MIN_OVERHEAD) {
+		return;
+	}
+
+	wmesh_rx_ring_t *ring = handle->rx_ring;
+	wmesh_rx_stats_t *stats = &ring->stats;
+	wmesh_rx_slot_t *slot;
+
+	if(data_len > CONFIG_WMESH_FRAME_SIZE) {
+		stats->oversized++;
+	} else if((slot = wmesh_rx_ring_reserve(ring)) == NULL) {
+		stats->overflows++;
+	} else {
+		memcpy(slot->src, src, sizeof(wmesh_address_t));
+		memcpy(slot->data, data, data_len);
+		slot->length = data_len;
+		slot->rssi = rssi;
+
+		wmesh_rx_ring_commit(ring);
+		stats->queued++;
+		xTaskNotifyGive(handle->rx_task);
+	}
+
+	uint32_t elapsed_us = esp_timer_get_time() - start_us;
+	stats->callback_total_us += elapsed_us;
+	if(elapsed_us > stats->callback_max_us) {
+		stats->callback_max_us = elapsed_us;
+	}
+}
+
+
+/// @brief Allocates the reliable delivery state.
+///
+/// @return `ESP_OK` or error.
+static esp_err_t init_reliable(wmesh_handle_t *handle) {
+	handle->reliable = malloc(sizeof(*handle->reliable));
+	if(!handle->reliable) {
+		return ESP_ERR_NO_MEM;
+	}
+	wmesh_reliable_tx_init(handle->reliable);
+
+	handle->reliable_lock = xSemaphoreCreateMutex();
+	if(!handle->reliable_lock) {
+		free(handle->reliable);
+		return ESP_ERR_NO_MEM;
+	}
+
+	handle->reliable_progress = xSemaphoreCreateBinary();
+	if(!handle->reliable_progress) {
+		vSemaphoreDelete(handle->reliable_lock);
+		free(handle->reliable);
+		return ESP_ERR_NO_MEM;
+	}
+
+	return ESP_OK;
+}
+
+
+/// @brief Frees the reliable delivery state.
+static void free_reliable(wmesh_handle_t *handle) {
+	vSemaphoreDelete(handle->reliable_progress);
+	vSemaphoreDelete(handle->reliable_lock);
+	free(handle->reliable);
+}
+
+
+static esp_err_t init_routing(wmesh_handle_t *handle) {
+	#if CONFIG_WMESH_ROUTING
+		handle->router = malloc(sizeof(*handle->router));
+		if(!handle->router) {
+			return ESP_ERR_NO_MEM;
+		}
+
+		wmesh_address_t self;
+		wmesh_transport_get_address(self);
+		wmesh_router_init(handle->router, self);
+
+		handle->route_lock = xSemaphoreCreateMutex();
+		if(!handle->route_lock) {
+			free(handle->router);
+			return ESP_ERR_NO_MEM;
+		}
+
+		handle->beacon_us = esp_timer_get_time();
+		atomic_init(&handle->relay_until_us, 0);
+	#endif
+
+	return ESP_OK;
+}
+
+
+static void free_routing(wmesh_handle_t *handle) {
+	#if CONFIG_WMESH_ROUTING
+		vSemaphoreDelete(handle->route_lock);
+		free(handle->router);
+	#endif
+}
+
+
+/// @brief Allocates the receive queue and starts the receive task.
+///
+/// @return `ESP_OK` or error.
+static esp_err_t start_rx_task(wmesh_handle_t *handle) {
+	handle->rx_ring = malloc(sizeof(*handle->rx_ring));
+	if(!handle->rx_ring) {
+		ESP_LOGE(TAG, "Error allocating receive queue");
+		return ESP_ERR_NO_MEM;
+	}
+	wmesh_rx_ring_init(handle->rx_ring);
+	handle->peer_load_full_us = 0;
+	handle->peer_loads_limited = 0;
+
+	handle->reassembly = malloc(sizeof(*handle->reassembly));
+	if(!handle->reassembly) {
+		ESP_LOGE(TAG, "Error allocating reassembly buffers");
+		free(handle->rx_ring);
+		return ESP_ERR_NO_MEM;
+	}
+	wmesh_reassembly_init(handle->reassembly);
+
+	handle->send_results = xQueueCreate(CONFIG_WMESH_RATE_FEEDBACK_QUEUE_LENGTH, sizeof(send_result_t));
+	if(!handle->send_results) {
+		ESP_LOGE(TAG, "Error allocating send result queue");
+		free(handle->reassembly);
+		free(handle->rx_ring);
+		return ESP_ERR_NO_MEM;
+	}
+
+	handle->rx_task_done = xSemaphoreCreateBinary();
+	if(!handle->rx_task_done) {
+		vQueueDelete(handle->send_results);
+		free(handle->reassembly);
+		free(handle->rx_ring);
+		return ESP_ERR_NO_MEM;
+	}
+
+	handle->peer_storage_lock = xSemaphoreCreateMutex();
+	if(!handle->peer_storage_lock) {
+		vSemaphoreDelete(handle->rx_task_done);
+		vQueueDelete(handle->send_results);
+		free(handle->reassembly);
+		free(handle->rx_ring);
+		return ESP_ERR_NO_MEM;
+	}
+
+	#if CONFIG_WMESH_PEER_FLUSH_INTERVAL_MS > 0
+		if(start_flush_task(handle) != ESP_OK) {
+			ESP_LOGE(TAG, "Error starting peer flush task");
+			vSemaphoreDelete(handle->peer_storage_lock);
+			vSemaphoreDelete(handle->rx_task_done);
+			vQueueDelete(handle->send_results);
+			free(handle->reassembly);
+			free(handle->rx_ring);
+			return ESP_ERR_NO_MEM;
+		}
+	#endif
+
+	atomic_init(&handle->rx_running, true);
+	BaseType_t created = xTaskCreatePinnedToCore(
+		rx_task, "wmesh_rx",
+		CONFIG_WMESH_RX_TASK_STACK_SIZE, handle,
+		CONFIG_WMESH_RX_TASK_PRIORITY, &handle->rx_task,
+		#if CONFIG_WMESH_RX_TASK_CORE_ID < 0
+			tskNO_AFFINITY
+		#else
+			CONFIG_WMESH_RX_TASK_CORE_ID
+		#endif
+	);
+
+	if(created != pdPASS) {
+		#if CONFIG_WMESH_PEER_FLUSH_INTERVAL_MS > 0
+			stop_flush_task(handle);
+			free(handle->flush_records);
+		#endif
+		vSemaphoreDelete(handle->peer_storage_lock);
+		vSemaphoreDelete(handle->rx_task_done);
+		vQueueDelete(handle->send_results);
+		free(handle->reassembly);
+		free(handle->rx_ring);
+		return ESP_ERR_NO_MEM;
+	}
+
+	return ESP_OK;
+}
+
+
+#if CONFIG_WMESH_PEER_FLUSH_INTERVAL_MS > 0
+	/// @brief Allocates the peer flush buffer and starts the peer flush task.
+	///
+	/// @return `ESP_OK` or error.
+	static esp_err_t start_flush_task(wmesh_handle_t *handle) {
+		handle->flush_records = malloc(WMESH_PEER_RECORD_COUNT * sizeof(*handle->flush_records));
+		if(!handle->flush_records) {
+			return ESP_ERR_NO_MEM;
+		}
+		handle->flush_count = 0;
+		atomic_init(&handle->flush_pending, false);
+
+		handle->flush_task_done = xSemaphoreCreateBinary();
+		if(!handle->flush_task_done) {
+			free(handle->flush_records);
+			return ESP_ERR_NO_MEM;
+		}
+
+		atomic_init(&handle->flush_running, true);
+		BaseType_t created = xTaskCreate(
+			flush_task, "wmesh_flush",
+			CONFIG_WMESH_FLUSH_TASK_STACK_SIZE, handle,
+			CONFIG_WMESH_FLUSH_TASK_PRIORITY, &handle->flush_task
+		);
+
+		if(created != pdPASS) {
+			vSemaphoreDelete(handle->flush_task_done);
+			free(handle->flush_records);
+			return ESP_ERR_NO_MEM;
+		}
+
+		return ESP_OK;
+	}
+
+
+	/// @brief Stops the peer flush task, once the records it was handed are
+	/// written. `flush_records` is kept.
+	static void stop_flush_task(wmesh_handle_t *handle) {
+		atomic_store(&handle->flush_running, false);
+		xTaskNotifyGive(handle->flush_task);
+		xSemaphoreTake(handle->flush_task_done, portMAX_DELAY);
+		vSemaphoreDelete(handle->flush_task_done);
+	}
+#endif
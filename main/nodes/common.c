@@ -1,5 +1,7 @@
 #include "nodes/common.h"
 
+#include <stdio.h>
+
 
 cJSON *spv_telemetry_msg_to_json(spv_telemetry_msg *msg) {
 	cJSON *array = cJSON_CreateArray();
@@ -63,3 +65,72 @@ cJSON* spv_telemetry_reading_to_json(
 
 	return json;
 }
+
+
+/// @brief Adds every counter to a JSON object, with the given key prefix.
+static void add_counters(
+	cJSON *json,
+	const char *prefix,
+	const wmesh_counters_snapshot_t *counters,
+	bool rssi
+) {
+	const struct {
+		const char *name;
+		double value;
+	} fields[] = {
+		{ "rx_ok", counters->rx_ok },
+		{ "rx_stale", counters->rx_stale },
+		{ "rx_auth_errors", counters->rx_auth_errors },
+		{ "rx_decrypt_errors", counters->rx_decrypt_errors },
+		{ "rx_no_handler", counters->rx_no_handler },
+		{ "tx_ok", counters->tx_ok },
+		{ "tx_failed", counters->tx_failed },
+		{ "bytes_in", counters->bytes_in },
+		{ "bytes_out", counters->bytes_out },
+		{ "rssi", counters->last_rssi },
+	};
+
+	size_t count = sizeof(fields) / sizeof(*fields) - (rssi ? 0 : 1);
+	for(size_t i = 0; i < count; i++) {
+		char key[64];
+		snprintf(key, sizeof(key), "%s_%s", prefix, fields[i].name);
+		cJSON_AddNumberToObject(json, key, fields[i].value);
+	}
+}
+
+
+cJSON* spv_mesh_stats_to_json(
+	const wmesh_counters_snapshot_t *total,
+	const wmesh_peer_stats_t *peers,
+	size_t peer_count,
+	const wmesh_service_stats_t *services,
+	size_t service_count
+) {
+	cJSON *json = cJSON_CreateObject();
+	if(!json) {
+		return NULL;
+	}
+
+	if(total) {
+		add_counters(json, "mesh", total, true);
+	}
+
+	for(size_t i = 0; i < peer_count; i++) {
+		const uint8_t *address = peers[i].address;
+		char prefix[32];
+		snprintf(
+			prefix, sizeof(prefix), "mesh_%02X%02X%02X%02X%02X%02X",
+			address[0], address[1], address[2],
+			address[3], address[4], address[5]
+		);
+		add_counters(json, prefix, &peers[i].counters, true);
+	}
+
+	for(size_t i = 0; i < service_count; i++) {
+		char prefix[32];
+		snprintf(prefix, sizeof(prefix), "mesh_service_%u", services[i].id);
+		add_counters(json, prefix, &services[i].counters, false);
+	}
+
+	return json;
+}
@@ -4,6 +4,7 @@
 #include "cJSON.h"
 #include "services/telemetry.h"
 #include "time/clock.h"
+#include "wmesh/stats.h"
 
 /// @brief Converts a mesh telemetry message into Thingsboard JSON.
 ///
@@ -27,6 +28,28 @@ cJSON* spv_telemetry_reading_to_json(
 );
 
 
+/// @brief Converts mesh traffic counters into Thingsboard JSON. Every counter
+/// is a key of a single object: `mesh_<counter>` for the whole mesh,
+/// `mesh_<address>_<counter>` for peers and `mesh_service_<id>_<counter>` for
+/// services.
+///
+/// @param[in] total Counters of the whole mesh. May be `NULL`, when the
+/// counters are split across several messages.
+/// @param[in] peers Counters of every peer.
+/// @param[in] peer_count Number of entries in `peers`.
+/// @param[in] services Counters of every service.
+/// @param[in] service_count Number of entries in `services`.
+///
+/// @return JSON object or `NULL`.
+cJSON* spv_mesh_stats_to_json(
+	const wmesh_counters_snapshot_t *total,
+	const wmesh_peer_stats_t *peers,
+	size_t peer_count,
+	const wmesh_service_stats_t *services,
+	size_t service_count
+);
+
+
 
 
 #endif
@@ -1,5 +1,6 @@
 #include "nodes/gateway.h"
 
+#include "esp_attr.h"
 #include "esp_log.h"
 #include "esp_sleep.h"
 #include "esp_netif_sntp.h"
@@ -28,16 +29,20 @@ typedef struct {
 	spv_timestamp_t last_telemetry;
 
 	bool ota_requested;
+	bool ota_large_frames;
 	size_t next_chunk;
 	bool retry_requested;
 	size_t chunks_since_retry;
 } gateway_status_t;
 static gateway_status_t gateway_status = {
 	.ota_requested = false,
+	.ota_large_frames = true,
 	0
 };
 
+static void gateway_announce_channel(wmesh_handle_t *handle, uint8_t channel);
 static void gateway_perform_ota(wmesh_handle_t *handle, gateway_status_t *gateway_status);
+static void gateway_publish_mesh_stats(wmesh_handle_t *handle, thingsboard_handle_t *thingsboard_handle);
 
 static wmesh_service_config_t telemetry_service_config = {
 	.id = CONFIG_SPV_TELEMETRY_SERVICE_ID,
@@ -54,6 +59,10 @@ static wmesh_service_config_t ota_service_config = {
 
 RTC_DATA_ATTR uint8_t boots_since_ntp_sync;
 
+/// @brief Channel announced on the last wake, or 0 if none. Nodes rejoining
+/// after deep sleep wait on it.
+static RTC_DATA_ATTR uint8_t last_channel;
+
 
 void spv_start_gateway(
 	const spv_config_t *config
@@ -80,6 +89,9 @@ void spv_start_gateway(
 		ESP_LOGE(TAG, "Error initializing mesh");
 		abort();
 	}
+	#if CONFIG_WMESH_ROUTING
+		wmesh_route_set_root(handle, true);
+	#endif
 
 	spv_wifi_scan_results_t scan = { 0 };
 	ESP_ERROR_CHECK(spv_wifi_scan(
@@ -95,24 +107,14 @@ void spv_start_gateway(
 	bool connectivity = true;
 	if(scan.network_count == 0) {
 		ESP_LOGE(TAG, "No Wi-Fi networks found");
-		spv_gateway_send_channel(
-			handle,
-			&(spv_gateway_channel_advertisement_t){
-				.channel = 1
-			}
-		);
+		gateway_announce_channel(handle, 1);
 
 		connectivity = false;
 
 	} else {
 
 		ESP_LOGI(TAG, "Advertising on channel %"PRIu8, scan.networks[0].channel);
-		spv_gateway_send_channel(
-			handle,
-			&(spv_gateway_channel_advertisement_t){
-				.channel = scan.networks[0].channel
-			}
-		);
+		gateway_announce_channel(handle, scan.networks[0].channel);
 
 		esp_err_t err = spv_wifi_start_sta_connect(
 			&(spv_wifi_sta_options_t) {
@@ -224,6 +226,7 @@ void spv_start_gateway(
 			.firmware_version = spv_ota_get_current_version(),
 			.flags = {
 				.has_connectivity = connectivity,
+				.large_frames = true,
 			}
 		};
 		spv_gateway_send_advertisement(handle, &advertisement);
@@ -249,6 +252,10 @@ void spv_start_gateway(
 	};
 	spv_gateway_send_sleep(handle, &sleep);
 
+	if(connectivity) {
+		gateway_publish_mesh_stats(handle, &thingsboard_handle);
+	}
+
 	wmesh_stop(handle);
 	nvs_flash_deinit();
 	spv_ulp_start();
@@ -327,6 +334,14 @@ static esp_err_t ota_cb(wmesh_handle_t *handle, wmesh_address_t src, uint8_t *da
 			);
 			gateway_status->ota_requested = true;
 
+			// Chunks are broadcast, so a single node without large frame
+			// support limits every node to small frames.
+			wmesh_set_large_frames(handle, src, msg.request->flags.large_frames);
+			if(!msg.request->flags.large_frames) {
+				ESP_LOGI(TAG, "Node does not support large frames");
+				gateway_status->ota_large_frames = false;
+			}
+
 			return ESP_OK;
 
 
@@ -351,6 +366,35 @@ static esp_err_t ota_cb(wmesh_handle_t *handle, wmesh_address_t src, uint8_t *da
 }
 
 
+/// @brief Repeats the channel announcement for
+/// `CONFIG_SPV_GATEWAY_SERVICE_CHANNEL_ANNOUNCE_MS` on channel 1, and on the
+/// previous channel if it changed, where nodes rejoining after deep sleep
+/// wait. Must be called before connecting to Wi-Fi, which fixes the channel.
+static void gateway_announce_channel(wmesh_handle_t *handle, uint8_t channel) {
+	const spv_gateway_channel_advertisement_t announcement = {
+		.channel = channel
+	};
+	bool moved = last_channel != 0 && last_channel != 1 && last_channel != channel;
+	if(moved) {
+		ESP_LOGI(TAG, "Channel changed from %"PRIu8", announcing there too", last_channel);
+	}
+
+	for(int elapsed_ms = 0; elapsed_ms < CONFIG_SPV_GATEWAY_SERVICE_CHANNEL_ANNOUNCE_MS; elapsed_ms += 100) {
+		spv_gateway_send_channel(handle, &announcement);
+		if(moved) {
+			vTaskDelay(pdMS_TO_TICKS(10));
+			spv_wifi_set_channel(last_channel);
+			spv_gateway_send_channel(handle, &announcement);
+			vTaskDelay(pdMS_TO_TICKS(10));
+			spv_wifi_set_channel(1);
+		}
+		vTaskDelay(pdMS_TO_TICKS(100));
+	}
+
+	last_channel = channel;
+}
+
+
 static void gateway_perform_ota(wmesh_handle_t *handle, gateway_status_t *gateway_status) {
 	esp_image_metadata_t metadata;
 	const esp_partition_t *partition = esp_ota_get_running_partition();
@@ -363,15 +407,21 @@ static void gateway_perform_ota(wmesh_handle_t *handle, gateway_status_t *gatewa
 		},
 		&metadata
 	);
+
+	wmesh_set_large_frames(handle, wmesh_broadcast_address, gateway_status->ota_large_frames);
+	size_t chunk_size = gateway_status->ota_large_frames ?
+		SPV_OTA_MAX_CHUNK_SIZE(wmesh_get_max_payload(handle, wmesh_broadcast_address)) :
+		CONFIG_SPV_OTA_SERVICE_CHUNK_SIZE;
+
 	spv_ota_send_begin(
 		handle,
 		&(spv_ota_begin_t) {
 			.size = metadata.image_len,
-			.version = spv_ota_get_current_version()
+			.version = spv_ota_get_current_version(),
+			.chunk_size = chunk_size,
 		}
 	);
 
-	size_t chunk_size = CONFIG_SPV_OTA_SERVICE_CHUNK_SIZE;
 	size_t chunk_count = (metadata.image_len + chunk_size - 1) / chunk_size;
 	gateway_status->next_chunk = 0;
 
@@ -379,9 +429,9 @@ static void gateway_perform_ota(wmesh_handle_t *handle, gateway_status_t *gatewa
 	ESP_LOGI(TAG, "	Version:	%"PRIu64, spv_ota_get_current_version());
 	ESP_LOGI(TAG, "	Size:		%zu Bytes", metadata.image_len);
 	ESP_LOGI(TAG, "	Chunks:		%zu", chunk_count);
+	ESP_LOGI(TAG, "	Chunk size:	%zu Bytes", chunk_size);
 
 	vTaskDelay(pdMS_TO_TICKS(2000));
-	spv_ota_data_t data_msg = { 0 };
 	uint32_t wait_ms = 15;
 	size_t last_chunk_sent = 0;
 	for(
@@ -411,13 +461,6 @@ static void gateway_perform_ota(wmesh_handle_t *handle, gateway_status_t *gatewa
 		}
 
 		size_t send_chunk = gateway_status->next_chunk;
-		data_msg.chunk = send_chunk;
-		size_t send_byte_offset = send_chunk * chunk_size;
-		size_t send_bytes = send_chunk == chunk_count - 1 ?
-			metadata.image_len - send_byte_offset :
-			chunk_size;
-
-		esp_partition_read(partition, send_byte_offset, data_msg.data, send_bytes);
 
 		if(send_chunk % 10 == 0 || send_chunk == chunk_count - 1) {
 			ESP_LOGI(TAG, "Sending OTA update chunk [%zu/%zu]", send_chunk, chunk_count - 1);
@@ -432,10 +475,58 @@ static void gateway_perform_ota(wmesh_handle_t *handle, gateway_status_t *gatewa
 
 		gateway_status->chunks_since_retry++;
 
-		spv_ota_send_data(handle, &data_msg);
+		spv_ota_send_data(handle, partition, metadata.image_len, send_chunk, chunk_size);
 	}
 
 	vTaskDelay(pdMS_TO_TICKS(2000));
 	spv_ota_send_end(handle);
 	vTaskDelay(pdMS_TO_TICKS(10000));
+	wmesh_set_large_frames(handle, wmesh_broadcast_address, false);
+}
+
+
+/// @brief Publishes the mesh traffic counters as gateway telemetry, so
+/// degrading links show up before messages are lost. Only peers heard from
+/// are published, split across messages of
+/// `CONFIG_SPV_GATEWAY_SERVICE_MESH_STATS_PEERS` peers.
+static void gateway_publish_mesh_stats(wmesh_handle_t *handle, thingsboard_handle_t *thingsboard_handle) {
+	size_t peer_count = CONFIG_WMESH_PEER_LIST_SIZE + CONFIG_WMESH_PEER_PARKED_COUNT;
+	size_t service_count = WMESH_SERVICE_COUNT;
+	wmesh_peer_stats_t *peers = malloc(peer_count * sizeof(*peers));
+	wmesh_service_stats_t *services = malloc(service_count * sizeof(*services));
+	if(!peers || !services) {
+		ESP_LOGE(TAG, "Error allocating mesh statistics");
+		free(services);
+		free(peers);
+		return;
+	}
+
+	wmesh_counters_snapshot_t total;
+	wmesh_get_stats(handle, &total, peers, &peer_count, services, &service_count);
+	ESP_LOGI(TAG,
+		"Mesh: %"PRIu32" frames received, %"PRIu32" delivered, %"PRIu32" failed",
+		total.rx_ok, total.tx_ok, total.tx_failed
+	);
+
+	// The first message also holds the mesh and service counters.
+	size_t sent = 0;
+	do {
+		size_t count = peer_count - sent;
+		if(count > CONFIG_SPV_GATEWAY_SERVICE_MESH_STATS_PEERS) {
+			count = CONFIG_SPV_GATEWAY_SERVICE_MESH_STATS_PEERS;
+		}
+
+		cJSON *json = sent == 0 ?
+			spv_mesh_stats_to_json(&total, peers, count, services, service_count) :
+			spv_mesh_stats_to_json(NULL, peers + sent, count, NULL, 0);
+		if(json) {
+			thingsboard_gateway_send_telemetry(thingsboard_handle, json);
+			cJSON_Delete(json);
+		}
+
+		sent += count;
+	} while(sent < peer_count);
+
+	free(services);
+	free(peers);
 }
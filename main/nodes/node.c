@@ -1,7 +1,10 @@
 #include "nodes/node.h"
 
+#include <stdatomic.h>
+#include "esp_attr.h"
 #include "esp_log.h"
 #include "esp_sleep.h"
+#include "esp_timer.h"
 #include "sdkconfig.h"
 #include "ulp_common.h"
 
@@ -22,7 +25,9 @@ static esp_err_t ota_cb(wmesh_handle_t *handle, wmesh_address_t src, uint8_t *da
 
 typedef enum {
 	NODE_STATE_WAIT_CHANNEL,
+	NODE_STATE_REJOIN,
 	NODE_STATE_WAIT_GATEWAY,
+	NODE_STATE_JOINING,
 	NODE_STATE_SEND_TELEMETRY,
 	NODE_STATE_WAIT_OTA_OR_SLEEP,
 	NODE_STATE_OTA,
@@ -30,14 +35,23 @@ typedef enum {
 	NODE_STATE_SLEEP
 } node_state_t;
 
+/// @brief Node state. `state` is changed by both the main task and the mesh
+/// receive task. Moves out of `NODE_STATE_WAIT_CHANNEL`, `NODE_STATE_REJOIN`
+/// and `NODE_STATE_WAIT_GATEWAY` go through `NODE_STATE_JOINING`, taken with a
+/// compare-exchange, so only one task changes the channel at a time.
 typedef struct {
-	node_state_t state;
+	_Atomic node_state_t state;
 	wmesh_address_t gateway_address;
 	spv_timestamp_t sleep_until;
 
+	uint8_t channel;
+	bool rejoined;
+	int64_t joined_us;
+
 	bool ota_requested;
 	esp_ota_handle_t ota_handle;
 	size_t ota_bytes;
+	size_t ota_chunk_size;
 	size_t ota_chunks;
 	size_t ota_next_chunk;
 } node_status_t;
@@ -45,6 +59,25 @@ static node_status_t node_status = {
 	.state = NODE_STATE_WAIT_CHANNEL
 };
 
+/// @brief Gateway found on the last wake. Kept across deep sleep, so the node
+/// can tune straight to the gateway's channel instead of waiting for its
+/// channel announcement.
+typedef struct {
+	bool valid;
+	wmesh_address_t address;
+	uint8_t channel;
+	uint64_t firmware_version;
+} node_gateway_cache_t;
+static RTC_DATA_ATTR node_gateway_cache_t gateway_cache;
+
+/// @brief Radio-on time of deep sleep wakes since power-on, by how the gateway
+/// was found. Index 1 is for the cached channel, 0 for channel discovery.
+typedef struct {
+	uint32_t wakes;
+	uint64_t radio_on_us;
+} node_radio_stats_t;
+static RTC_DATA_ATTR node_radio_stats_t radio_stats[2];
+
 static wmesh_service_config_t gateway_service_config = {
 	.id = CONFIG_SPV_GATEWAY_SERVICE_ID,
 	.receive_callback = gateway_cb,
@@ -70,9 +103,19 @@ void spv_start_node(
 
 	ulp_timer_stop();
 	spv_sensors_init();
+	int64_t radio_on_us = esp_timer_get_time();
 	ESP_ERROR_CHECK(spv_wifi_set_mode(WIFI_MODE_AP));
 	ESP_ERROR_CHECK(spv_wifi_start());
-	spv_wifi_set_channel(1);
+
+	bool rejoining = esp_reset_reason() == ESP_RST_DEEPSLEEP && gateway_cache.valid;
+	if(rejoining) {
+		ESP_LOGI(TAG, "Rejoining gateway on channel %"PRIu8, gateway_cache.channel);
+		node_status.channel = gateway_cache.channel;
+		atomic_store(&node_status.state, NODE_STATE_REJOIN);
+	} else {
+		node_status.channel = 1;
+	}
+	spv_wifi_set_channel(node_status.channel);
 
 
 	wmesh_config_t mesh_config = { 0 };
@@ -93,8 +136,25 @@ void spv_start_node(
 	));
 
 
-	while(node_status.state < NODE_STATE_SEND_TELEMETRY) {
+	// Until the gateway is heard, a rejoining node switches between the
+	// cached channel, where the gateway advertises unless it moved, and
+	// channel 1, where the gateway announces its channel when it wakes. A
+	// gateway which moved also announces its channel on the cached one.
+	int64_t switch_us = esp_timer_get_time() + CONFIG_SPV_GATEWAY_SERVICE_REJOIN_SLOT_MS * 1000LL;
+	while(atomic_load(&node_status.state) < NODE_STATE_SEND_TELEMETRY) {
 		vTaskDelay(pdMS_TO_TICKS(100));
+
+		node_state_t state = NODE_STATE_REJOIN;
+		if(
+			gateway_cache.channel != 1 &&
+			esp_timer_get_time() >= switch_us &&
+			atomic_compare_exchange_strong(&node_status.state, &state, NODE_STATE_JOINING)
+		) {
+			node_status.channel = node_status.channel == 1 ? gateway_cache.channel : 1;
+			spv_wifi_set_channel(node_status.channel);
+			atomic_store(&node_status.state, NODE_STATE_REJOIN);
+			switch_us = esp_timer_get_time() + CONFIG_SPV_GATEWAY_SERVICE_REJOIN_SLOT_MS * 1000LL;
+		}
 	}
 
 	if(esp_reset_reason() != ESP_RST_DEEPSLEEP) {
@@ -103,8 +163,9 @@ void spv_start_node(
 
 	} else if(node_status.state == NODE_STATE_SEND_TELEMETRY) {
 		ESP_LOGI(TAG, "Sending telemetry");
+		size_t chunk_size = spv_telemetry_max_readings(handle, node_status.gateway_address);
 		spv_telemetry_msg *msg = alloca(
-			sizeof(*msg) + sizeof(*msg->datos) * CONFIG_SPV_TELEMETRY_CHUNK_SIZE
+			sizeof(*msg) + sizeof(*msg->datos) * chunk_size
 		);
 		memcpy(msg->node_name, config->name, sizeof(msg->node_name));
 		spv_timestamp_t reading_start_time = spv_ulp_start_time_get();
@@ -115,12 +176,12 @@ void spv_start_node(
 		);
 
 		size_t reading_count = spv_ulp_get_reading_count(SPV_ULP_NOISE_READING);
-		for(size_t reading = 0; reading < reading_count; reading += CONFIG_SPV_TELEMETRY_CHUNK_SIZE) {
+		for(size_t reading = 0; reading < reading_count; reading += chunk_size) {
 			ESP_LOGI(TAG, "Next chunk");
 			msg->fecha = reading_start_time + reading * CONFIG_SPV_SENSOR_READ_FREQUENCY_SECONDS;
 
 			size_t i = 0;
-			for(; i + reading < reading_count && i < CONFIG_SPV_TELEMETRY_CHUNK_SIZE; i++) {
+			for(; i + reading < reading_count && i < chunk_size; i++) {
 				ESP_LOGI(TAG, "Reading data %zu", i + reading);
 				msg->datos[i].noise = spv_ulp_get_reading_cvt(reading + i, SPV_ULP_NOISE_READING);
 				msg->datos[i].luminosity = spv_ulp_get_reading_cvt(reading + i, SPV_ULP_LUMINOSITY_READING);
@@ -134,6 +195,11 @@ void spv_start_node(
 			spv_telemetry_send_msg(handle, msg, node_status.gateway_address);
 		}
 
+		esp_err_t err = wmesh_reliable_flush(handle, node_status.gateway_address, portMAX_DELAY);
+		if(err != ESP_OK) {
+			ESP_LOGW(TAG, "Some telemetry was not acknowledged by the gateway");
+		}
+
 		node_status.state = node_status.ota_requested ?
 			NODE_STATE_WAIT_OTA_OR_SLEEP : NODE_STATE_WAIT_SLEEP;
 	}
@@ -143,8 +209,38 @@ void spv_start_node(
 		vTaskDelay(pdMS_TO_TICKS(100));
 	}
 
+	#if CONFIG_WMESH_ROUTING
+		// Nodes further from the gateway may still be sending through this
+		// one.
+		while(wmesh_route_is_relaying(handle) && time_get() < node_status.sleep_until) {
+			vTaskDelay(pdMS_TO_TICKS(100));
+		}
+	#endif
+
 	wmesh_stop(handle);
 	nvs_flash_deinit();
+	esp_wifi_stop();
+	int64_t radio_off_us = esp_timer_get_time();
+
+	ESP_LOGI(TAG,
+		"Radio on for %"PRIi64" ms, gateway found after %"PRIi64" ms (%s)",
+		(radio_off_us - radio_on_us) / 1000,
+		(node_status.joined_us - radio_on_us) / 1000,
+		node_status.rejoined ? "cached channel" : "channel discovery"
+	);
+	if(esp_reset_reason() == ESP_RST_DEEPSLEEP) {
+		node_radio_stats_t *stats = &radio_stats[node_status.rejoined];
+		stats->wakes++;
+		stats->radio_on_us += radio_off_us - radio_on_us;
+	}
+	if(radio_stats[0].wakes > 0 && radio_stats[1].wakes > 0) {
+		int64_t discovery_ms = radio_stats[0].radio_on_us / radio_stats[0].wakes / 1000;
+		int64_t cached_ms = radio_stats[1].radio_on_us / radio_stats[1].wakes / 1000;
+		ESP_LOGI(TAG,
+			"Average radio on time: %"PRIi64" ms over %"PRIu32" cached channel wakes, %"PRIi64" ms over %"PRIu32" discovery wakes, %"PRIi64" ms saved per wake",
+			cached_ms, radio_stats[1].wakes, discovery_ms, radio_stats[0].wakes, discovery_ms - cached_ms
+		);
+	}
 
 	spv_ulp_start();
 	spv_timestamp_t sleep_seconds = node_status.sleep_until - time_get();
@@ -158,10 +254,16 @@ void spv_start_node(
 static esp_err_t gateway_cb(wmesh_handle_t *handle, wmesh_address_t src, uint8_t *data, size_t data_size, void *user_ctx) {
 	spv_gateway_received_message_t message = spv_gateway_decode_message(data, data_size);
 	node_status_t *node_status = user_ctx;
+	node_state_t state = atomic_load(&node_status->state);
 
 	switch(message.type) {
 		case GATEWAY_TYPE_CHANNEL:
-			if(node_status->state != NODE_STATE_WAIT_CHANNEL) {
+			// While rejoining, the announcement is heard either on channel 1,
+			// or on the cached channel if the gateway moved.
+			if(
+				(state != NODE_STATE_WAIT_CHANNEL && state != NODE_STATE_REJOIN) ||
+				!atomic_compare_exchange_strong(&node_status->state, &state, NODE_STATE_JOINING)
+			) {
 				ESP_LOGW(TAG, "Received channel announcement. Ignoring");
 				return ESP_OK;
 			}
@@ -171,15 +273,20 @@ static esp_err_t gateway_cb(wmesh_handle_t *handle, wmesh_address_t src, uint8_t
 				message.channel->channel
 			);
 			spv_wifi_set_channel(message.channel->channel);
-			node_status->state = NODE_STATE_WAIT_GATEWAY;
+			node_status->channel = message.channel->channel;
+			atomic_store(&node_status->state, NODE_STATE_WAIT_GATEWAY);
 			return ESP_OK;
 
 
 		case GATEWAY_TYPE_ADVERTISEMENT:
-			if(node_status->state != NODE_STATE_WAIT_GATEWAY) {
+			if(
+				(state != NODE_STATE_WAIT_GATEWAY && state != NODE_STATE_REJOIN) ||
+				!atomic_compare_exchange_strong(&node_status->state, &state, NODE_STATE_JOINING)
+			) {
 				ESP_LOGI(TAG, "Received reduntant gateway advertisement. Ignoring");
 				return ESP_OK;
 			}
+			node_status->rejoined = state == NODE_STATE_REJOIN;
 
 			time_set(message.advertisement->current_time);
 			ESP_LOGI(TAG,
@@ -190,20 +297,43 @@ static esp_err_t gateway_cb(wmesh_handle_t *handle, wmesh_address_t src, uint8_t
 			ESP_LOGI(TAG, "	Current time:		%"PRIu64, message.advertisement->current_time);
 			ESP_LOGI(TAG, "	Firmware version:	%"PRIu64, message.advertisement->firmware_version);
 			ESP_LOGI(TAG, "	Connectivity:		%s", message.advertisement->flags.has_connectivity ? "yes" : "no");
+			ESP_LOGI(TAG, "	Large frames:		%s", message.advertisement->flags.large_frames ? "yes" : "no");
 			memcpy(node_status->gateway_address, src, sizeof(node_status->gateway_address));
+			node_status->joined_us = esp_timer_get_time();
+
+			if(gateway_cache.valid && memcmp(gateway_cache.address, src, sizeof(gateway_cache.address)) != 0) {
+				ESP_LOGI(TAG, "Gateway changed since last wake");
+			} else if(gateway_cache.valid && gateway_cache.firmware_version != message.advertisement->firmware_version) {
+				ESP_LOGI(TAG, "Gateway firmware changed since last wake");
+			}
+			memcpy(gateway_cache.address, src, sizeof(gateway_cache.address));
+			gateway_cache.channel = node_status->channel;
+			gateway_cache.firmware_version = message.advertisement->firmware_version;
+			gateway_cache.valid = true;
+
+			if(message.advertisement->flags.large_frames) {
+				wmesh_set_large_frames(handle, src, true);
+			}
 
 			if(message.advertisement->firmware_version > spv_ota_get_current_version()) {
 				ESP_LOGI(TAG, "Gateway has a newer firmware, requesting OTA");
-				spv_ota_send_request(handle, node_status->gateway_address);
+				spv_ota_send_request(
+					handle, node_status->gateway_address,
+					&(spv_ota_request_t) {
+						.flags = {
+							.large_frames = true,
+						}
+					}
+				);
 				node_status->ota_requested = true;
 			}
 
 			if(!message.advertisement->flags.has_connectivity) {
 				ESP_LOGW(TAG, "Gateway has no connectivity, waiting for sleep");
-				node_status->state = node_status->ota_requested ?
-					NODE_STATE_WAIT_OTA_OR_SLEEP : NODE_STATE_WAIT_SLEEP;
+				atomic_store(&node_status->state, node_status->ota_requested ?
+					NODE_STATE_WAIT_OTA_OR_SLEEP : NODE_STATE_WAIT_SLEEP);
 			} else {
-				node_status->state = NODE_STATE_SEND_TELEMETRY;
+				atomic_store(&node_status->state, NODE_STATE_SEND_TELEMETRY);
 			}
 
 			return ESP_OK;
@@ -232,7 +362,7 @@ static esp_err_t ota_cb(wmesh_handle_t *handle, wmesh_address_t src, uint8_t *da
 	esp_err_t err;
 
 
-	size_t chunk_size = CONFIG_SPV_OTA_SERVICE_CHUNK_SIZE;
+	size_t chunk_size = node_status->ota_chunk_size;
 	switch (msg.type) {
 		case OTA_TYPE_BEGIN:
 			if(!node_status->ota_requested) {
@@ -249,12 +379,14 @@ static esp_err_t ota_cb(wmesh_handle_t *handle, wmesh_address_t src, uint8_t *da
 			}
 
 			size_t ota_bytes = msg.begin->size;
+			chunk_size = msg.chunk_size;
 			size_t chunk_count = (msg.begin->size + chunk_size - 1) / chunk_size;
 
 			ESP_LOGI(TAG, "Starting OTA:");
 			ESP_LOGI(TAG, "	Version:	%"PRIu64, msg.begin->version);
 			ESP_LOGI(TAG, "	Size:		%zu Bytes", msg.begin->size);
 			ESP_LOGI(TAG, "	Chunks:		%zu" , chunk_count);
+			ESP_LOGI(TAG, "	Chunk size:	%zu Bytes", chunk_size);
 
 
 			if((err = spv_ota_begin(ota_bytes, &node_status->ota_handle)) != ESP_OK) {
@@ -262,6 +394,7 @@ static esp_err_t ota_cb(wmesh_handle_t *handle, wmesh_address_t src, uint8_t *da
 				node_status->state = NODE_STATE_WAIT_SLEEP;
 			}
 			node_status->ota_chunks = chunk_count;
+			node_status->ota_chunk_size = chunk_size;
 			node_status->ota_bytes = ota_bytes;
 			node_status->state = NODE_STATE_OTA;
 			return ESP_OK;
@@ -303,7 +436,12 @@ static esp_err_t ota_cb(wmesh_handle_t *handle, wmesh_address_t src, uint8_t *da
 			size_t recv_byte_offset = received_chunk * chunk_size;
 			size_t data_size = received_chunk == node_status->ota_chunks - 1 ?
 				node_status->ota_bytes - recv_byte_offset :
-				CONFIG_SPV_OTA_SERVICE_CHUNK_SIZE;
+				chunk_size;
+
+			if(msg.chunk_size < data_size) {
+				ESP_LOGW(TAG, "OTA chunk [%zu] is too short, ignoring", received_chunk);
+				return ESP_OK;
+			}
 
 			err = esp_ota_write(node_status->ota_handle, msg.data->data, data_size);
 
@@ -6,37 +6,51 @@
 static const char *TAG = "SPV Mesh Gateway";
 
 
-esp_err_t spv_gateway_send_channel(
+/// @brief Broadcasts a gateway message, prefixed by its type.
+///
+/// @param coalesce Whether the message may wait for others. Messages which
+/// are followed by a channel change or sleep must go out immediately.
+static esp_err_t send_message(
 	wmesh_handle_t *handle,
-	const spv_gateway_channel_advertisement_t *advertisement
+	uint8_t message_type,
+	const void *data,
+	size_t data_size,
+	bool coalesce
 ) {
-	uint8_t buffer[sizeof(uint8_t) + sizeof(*advertisement)];
+	const wmesh_iovec_t iov[] = {
+		{ &message_type, sizeof(message_type) },
+		{ data, data_size },
+	};
 
-	buffer[0] = GATEWAY_TYPE_CHANNEL;
-	memcpy(buffer + 1, advertisement, sizeof(*advertisement));
+	if(!coalesce) {
+		return wmesh_sendv(
+			handle, wmesh_broadcast_address,
+			CONFIG_SPV_GATEWAY_SERVICE_ID,
+			iov, 2
+		);
+	}
 
-	return wmesh_send(
+	return wmesh_send_coalescedv(
 		handle, wmesh_broadcast_address,
 		CONFIG_SPV_GATEWAY_SERVICE_ID,
-		buffer, sizeof(buffer)
+		iov, 2
 	);
 }
 
 
-esp_err_t spv_gateway_send_advertisement(
+esp_err_t spv_gateway_send_channel(
 	wmesh_handle_t *handle,
-	const spv_gateway_advertisement_t *advertisement
+	const spv_gateway_channel_advertisement_t *advertisement
 ) {
-	uint8_t buffer[sizeof(uint8_t) + sizeof(*advertisement)];
+	return send_message(handle, GATEWAY_TYPE_CHANNEL, advertisement, sizeof(*advertisement), false);
+}
 
-	buffer[0] = GATEWAY_TYPE_ADVERTISEMENT;
-	memcpy(buffer + 1, advertisement, sizeof(*advertisement));
 
-	return wmesh_send(
-		handle, wmesh_broadcast_address,
-		CONFIG_SPV_GATEWAY_SERVICE_ID,
-		buffer, sizeof(buffer)
-	);
+esp_err_t spv_gateway_send_advertisement(
+	wmesh_handle_t *handle,
+	const spv_gateway_advertisement_t *advertisement
+) {
+	return send_message(handle, GATEWAY_TYPE_ADVERTISEMENT, advertisement, sizeof(*advertisement), true);
 }
 
 
@@ -44,16 +58,7 @@ esp_err_t spv_gateway_send_sleep(
 	wmesh_handle_t *handle,
 	const spv_gateway_sleep_command_t *sleep_command
 ) {
-	uint8_t buffer[sizeof(uint8_t) + sizeof(*sleep_command)];
-
-	buffer[0] = GATEWAY_TYPE_SLEEP;
-	memcpy(buffer + 1, sleep_command, sizeof(*sleep_command));
-
-	return wmesh_send(
-		handle, wmesh_broadcast_address,
-		CONFIG_SPV_GATEWAY_SERVICE_ID,
-		buffer, sizeof(buffer)
-	);
+	return send_message(handle, GATEWAY_TYPE_SLEEP, sleep_command, sizeof(*sleep_command), false);
 }
 
 
@@ -32,6 +32,10 @@ typedef struct __attribute__((packed)) {
 		/// @brief True if the gateway has internet connectivity. False otherwise.
 		bool has_connectivity:1;
 
+		/// @brief True if the gateway accepts frames larger than an ESP-NOW
+		/// v1 frame. Never set by older gateways.
+		bool large_frames:1;
+
 	} flags;
 
 } spv_gateway_advertisement_t;
@@ -47,7 +51,8 @@ typedef struct __attribute__((packed)) {
 
 
 
-/// @brief Send a channel advertisement.
+/// @brief Send a channel advertisement. Sent immediately, so the radio may
+/// change channel right after.
 ///
 /// @param[in] handle Mesh handle.
 /// @param[in] advertisement Advertisement data.
@@ -71,7 +76,8 @@ esp_err_t spv_gateway_send_advertisement(
 );
 
 
-/// @brief Sends a sleep message to the network.
+/// @brief Sends a sleep message to the network. Sent immediately, so the
+/// radio may be turned off right after.
 ///
 /// @param[in] handle Mesh handle.
 /// @param[in] sleep_command Sleep command.
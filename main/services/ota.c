@@ -1,5 +1,7 @@
 #include "services/ota.h"
 
+#include <inttypes.h>
+#include <stddef.h>
 #include <string.h>
 #include "esp_log.h"
 
@@ -13,18 +15,26 @@ static esp_err_t send_mesh(
 	const uint8_t *data,
 	size_t data_size
 );
+static esp_err_t send_request(
+	wmesh_handle_t *handle,
+	const wmesh_address_t dst,
+	spv_ota_message_type_t message_type,
+	const uint8_t *data,
+	size_t data_size
+);
 
 
 esp_err_t spv_ota_send_request(
 	wmesh_handle_t *handle,
-	const wmesh_address_t gateway_address
+	const wmesh_address_t gateway_address,
+	const spv_ota_request_t *message
 ) {
-	return send_mesh(
+	return send_request(
 		handle,
 		gateway_address,
 		OTA_TYPE_REQUEST,
-		(uint8_t*) &(spv_ota_request_t) {0},
-		sizeof(spv_ota_request_t)
+		(uint8_t*) message,
+		sizeof(*message)
 	);
 }
 
@@ -38,21 +48,58 @@ esp_err_t spv_ota_send_begin(
 		wmesh_broadcast_address,
 		OTA_TYPE_BEGIN,
 		(uint8_t*) message,
-		sizeof(*message)
+		message->chunk_size == CONFIG_SPV_OTA_SERVICE_CHUNK_SIZE ?
+			offsetof(spv_ota_begin_t, chunk_size) : sizeof(*message)
 	);
 }
 
 
 esp_err_t spv_ota_send_data(
 	wmesh_handle_t *handle,
-	const spv_ota_data_t *data
+	const esp_partition_t *partition,
+	size_t image_size,
+	uint64_t chunk,
+	size_t chunk_size
 ) {
-	return send_mesh(
+	spv_ota_data_t header = { .chunk = chunk };
+	size_t length = sizeof(uint8_t) + sizeof(header) + chunk_size;
+	if(length > WMESH_FRAME_MAX_PAYLOAD) {
+		ESP_LOGE(TAG, "OTA chunk too long: %zu bytes", chunk_size);
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	size_t offset = chunk * chunk_size;
+	if(offset >= image_size) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	wmesh_frame_t *frame = wmesh_frame_alloc(handle);
+	if(!frame) {
+		return ESP_ERR_NO_MEM;
+	}
+
+	uint8_t *buffer = wmesh_frame_payload(frame);
+	buffer[0] = OTA_TYPE_DATA;
+	memcpy(&buffer[1], &header, sizeof(header));
+
+	// Flash is read straight into the frame, which is then encrypted in place.
+	// Chunks are always sent whole, as older nodes expect.
+	uint8_t *data = &buffer[1 + sizeof(header)];
+	size_t read_size = image_size - offset < chunk_size ? image_size - offset : chunk_size;
+	esp_err_t err = esp_partition_read(partition, offset, data, read_size);
+	if(err != ESP_OK) {
+		ESP_LOGE(TAG, "Error reading OTA chunk %"PRIu64": %s", chunk, esp_err_to_name(err));
+		wmesh_frame_free(handle, frame);
+		return err;
+	}
+	memset(data + read_size, 0, chunk_size - read_size);
+
+	return wmesh_send_frame(
 		handle,
 		wmesh_broadcast_address,
-		OTA_TYPE_DATA,
-		(uint8_t*) data,
-		sizeof(*data)
+		CONFIG_SPV_OTA_SERVICE_ID,
+		frame,
+		length
 	);
 }
 
@@ -62,7 +109,7 @@ esp_err_t spv_ota_send_retry_request(
 	const wmesh_address_t gateway_address,
 	const spv_ota_retry_request_t *data
 ) {
-	return send_mesh(
+	return send_request(
 		handle,
 		wmesh_broadcast_address,
 		OTA_TYPE_RETRY,
@@ -117,7 +164,15 @@ spv_ota_received_message_t spv_ota_decode_message(
 			return msg;
 
 		case OTA_TYPE_BEGIN:
-			if(payload_size != sizeof(*msg.begin)) {
+			// Older gateways do not send the chunk size.
+			if(payload_size == offsetof(spv_ota_begin_t, chunk_size)) {
+				msg.chunk_size = CONFIG_SPV_OTA_SERVICE_CHUNK_SIZE;
+			} else if(payload_size == sizeof(*msg.begin)) {
+				msg.chunk_size = ((spv_ota_begin_t*) payload)->chunk_size;
+			} else {
+				return msg;
+			}
+			if(msg.chunk_size == 0) {
 				return msg;
 			}
 			msg.type = type;
@@ -125,10 +180,11 @@ spv_ota_received_message_t spv_ota_decode_message(
 			return msg;
 
 		case OTA_TYPE_DATA:
-			if(payload_size != sizeof(*msg.data)) {
+			if(payload_size <= sizeof(*msg.data)) {
 				return msg;
 			}
 			msg.type = type;
+			msg.chunk_size = payload_size - sizeof(*msg.data);
 			msg.data = payload;
 			return msg;
 
@@ -161,22 +217,38 @@ static esp_err_t send_mesh(
 	const uint8_t *data,
 	size_t data_size
 ) {
-	esp_err_t err;
+	if(data_size + 1 > WMESH_FRAME_MAX_PAYLOAD) {
+		ESP_LOGE(TAG, "OTA message too long: %zu bytes", data_size);
+		return ESP_ERR_INVALID_SIZE;
+	}
 
+	uint8_t type = message_type;
+	const wmesh_iovec_t iov[] = {
+		{ &type, sizeof(type) },
+		{ data, data_size },
+	};
 
-	uint8_t *buffer = malloc(data_size + 1);
-	assert(buffer);
-	buffer[0] = message_type;
-	memcpy(&buffer[1], data, data_size);
+	return wmesh_sendv(handle, dst, CONFIG_SPV_OTA_SERVICE_ID, iov, 2);
+}
 
-	err = wmesh_send(
-		handle,
-		dst,
-		CONFIG_SPV_OTA_SERVICE_ID,
-		buffer,
-		data_size + 1
-	);
-	free(buffer);
 
-	return err;
+/// @brief Sends a small request to the gateway. Requests are coalesced with
+/// other traffic to the same destination, since they are not time-critical.
+///
+/// @attention Not suitable for messages which must keep their order relative
+/// to `send_mesh`.
+static esp_err_t send_request(
+	wmesh_handle_t *handle,
+	const wmesh_address_t dst,
+	spv_ota_message_type_t message_type,
+	const uint8_t *data,
+	size_t data_size
+) {
+	uint8_t type = message_type;
+	const wmesh_iovec_t iov[] = {
+		{ &type, sizeof(type) },
+		{ data, data_size },
+	};
+
+	return wmesh_send_coalescedv(handle, dst, CONFIG_SPV_OTA_SERVICE_ID, iov, 2);
 }
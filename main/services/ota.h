@@ -4,13 +4,23 @@
 #include "sdkconfig.h"
 
 #include <stdint.h>
+#include "esp_partition.h"
 #include "time/clock.h"
 #include "wmesh/wmesh.h"
 
 
 /// @brief Sent by a node to request an OTA update.
 typedef struct __attribute__((packed)) {
-	uint8_t _dummy;
+
+	/// @brief Node capability flags. Always zero on older nodes.
+	struct __attribute__((packed)) {
+
+		/// @brief True if the node accepts frames larger than an ESP-NOW v1
+		/// frame.
+		bool large_frames:1;
+
+	} flags;
+
 } spv_ota_request_t;
 
 
@@ -23,6 +33,11 @@ typedef struct __attribute__((packed)) {
 	/// @brief Update size in bytes.
 	size_t size;
 
+	/// @brief Data bytes per chunk. Left out when it is
+	/// `CONFIG_SPV_OTA_SERVICE_CHUNK_SIZE`, so older nodes can still decode
+	/// the message.
+	uint16_t chunk_size;
+
 } spv_ota_begin_t;
 
 
@@ -32,12 +47,19 @@ typedef struct __attribute__((packed)) {
 	/// @brief Chunk sequence identifier.
 	uint64_t chunk;
 
-	/// @brief Chunk data.
-	uint8_t data[CONFIG_SPV_OTA_SERVICE_CHUNK_SIZE];
+	/// @brief Chunk data. Always holds a whole chunk, including the last one.
+	uint8_t data[];
 
 } spv_ota_data_t;
 
 
+/// @brief Largest chunk size which fits in a frame.
+///
+/// @param max_payload Maximum frame payload. See `wmesh_get_max_payload`.
+#define SPV_OTA_MAX_CHUNK_SIZE(max_payload) \
+	((max_payload) - sizeof(uint8_t) - sizeof(spv_ota_data_t))
+
+
 /// @brief Sent by a node to signal a lost packet.
 typedef struct __attribute__((packed)) {
 
@@ -57,12 +79,14 @@ typedef struct __attribute__((packed)) {
 /// @brief Sends an OTA request message.
 ///
 /// @param[in] handle Mesh handle.
+/// @param[in] gateway_address Gateway mesh address.
 /// @param[in] message OTA request message.
 ///
 /// @return `ESP_OK` or error.
 esp_err_t spv_ota_send_request(
 	wmesh_handle_t *handle,
-	const wmesh_address_t gateway_address
+	const wmesh_address_t gateway_address,
+	const spv_ota_request_t *message
 );
 
 
@@ -78,15 +102,22 @@ esp_err_t spv_ota_send_begin(
 );
 
 
-/// @brief Sends an OTA data message.
+/// @brief Sends an OTA data message. The chunk is read from flash straight
+/// into the frame, and padded with zeros if it's the last one.
 ///
 /// @param[in] handle Mesh handle.
-/// @param[in] data OTA data message.
+/// @param[in] partition Partition holding the image.
+/// @param[in] image_size Image size in bytes.
+/// @param[in] chunk Chunk number.
+/// @param[in] chunk_size Chunk size in bytes.
 ///
 /// @return `ESP_OK` or error.
 esp_err_t spv_ota_send_data(
 	wmesh_handle_t *handle,
-	const spv_ota_data_t *data
+	const esp_partition_t *partition,
+	size_t image_size,
+	uint64_t chunk,
+	size_t chunk_size
 );
 
 
@@ -144,6 +175,10 @@ typedef struct {
 	/// @brief Indicates which type of message was received.
 	spv_ota_message_type_t type;
 
+	/// @brief Data bytes per chunk when `type` is `OTA_TYPE_BEGIN`, or data
+	/// bytes in the message when `type` is `OTA_TYPE_DATA`.
+	size_t chunk_size;
+
 	union {
 
 		/// @brief Update request message. Only valid when `type` is
@@ -12,17 +12,36 @@ esp_err_t spv_telemetry_send_msg(
     const wmesh_address_t gateway_address
 ) {
     size_t size = sizeof(uint8_t) + msg->num_datos * sizeof(*msg->datos) + sizeof(*msg) ;
-    uint8_t *buffer = malloc(size);
-    buffer[0] = TELEMETRY_TYPE_MSG;
-    memcpy(&buffer[1], msg, msg->num_datos * sizeof(*msg->datos) + sizeof(*msg));
-    esp_err_t err = wmesh_send(
+    if(size > wmesh_get_max_payload(handle, gateway_address) - sizeof(wmesh_reliable_header_t)){
+        ESP_LOGE(TAG, "Telemetry message too long: %zu bytes", size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // The reliable send window keeps its own copy, so the message is gathered
+    // straight into it.
+    uint8_t type = TELEMETRY_TYPE_MSG;
+    const wmesh_iovec_t iov[] = {
+        { &type, sizeof(type) },
+        { msg, msg->num_datos * sizeof(*msg->datos) + sizeof(*msg) },
+    };
+
+    return wmesh_send_reliablev(
         handle,gateway_address,
         CONFIG_SPV_TELEMETRY_SERVICE_ID,
-        buffer,size
+        iov,2,
+        portMAX_DELAY
     );
-    free(buffer);
+}
+
+
+size_t spv_telemetry_max_readings(
+    wmesh_handle_t *handle,
+    const wmesh_address_t gateway_address
+) {
+    size_t max_payload = wmesh_get_max_payload(handle, gateway_address);
+    size_t header_size = sizeof(wmesh_reliable_header_t) + sizeof(uint8_t) + sizeof(spv_telemetry_msg);
 
-    return err;
+    return (max_payload - header_size) / sizeof(spv_telemetry_reading_t);
 }
 
 
@@ -31,6 +31,17 @@ esp_err_t spv_telemetry_send_msg(
     const wmesh_address_t gateway_address
 );
 
+/// @brief Gets how many readings fit in a single telemetry message.
+///
+/// @param handle Mesh handle.
+/// @param gateway_address Gateway mesh address.
+///
+/// @return Maximum value of `num_datos`.
+size_t spv_telemetry_max_readings(
+    wmesh_handle_t *handle,
+    const wmesh_address_t gateway_address
+);
+
 /// @brief Type of received TELEMETRY message.
 typedef enum {
 